@@ -0,0 +1,43 @@
+#ifndef BOOTLOADER_BLOCKDEV_H
+#define BOOTLOADER_BLOCKDEV_H
+
+#include <stdint.h>
+
+#define BLOCKDEV_ERR_IO            ( -1L )
+#define BLOCKDEV_ERR_RANGE         ( -2L )
+#define BLOCKDEV_ERR_TIMEOUT       ( -3L )
+
+// The largest block size partial block reads are bounced through
+#define BLOCKDEV_MAX_BLOCK_SIZE    ( 0x1000U )
+
+/**
+ * A block device (e.g. a virtio disk), read in whole blocks. Reads go
+ * straight to the caller's buffer, which may be anywhere in memory: the
+ * driver splits them into as many device requests as it has to, and keeps
+ * as many of them in flight as it can.
+ */
+struct blockdev_t {
+    const char *name;
+    uint64_t block_size;
+    uint64_t nr_blocks;
+
+    /**
+     * Reads count blocks, starting at block lba, to buf.
+     *
+     * @return 0 on success, or a negative BLOCKDEV_ERR_* code.
+     */
+    int64_t (*read)(struct blockdev_t *dev, uint64_t lba, void *buf, uint64_t count);
+
+    void *priv;
+};
+
+/**
+ * Reads len bytes from byte offset offset of a device. Whole blocks are
+ * read straight to buf, in one device read; only a partial first and last
+ * block are read through a bounce buffer.
+ *
+ * @return 0 on success, or a negative BLOCKDEV_ERR_* code.
+ */
+int64_t blockdev_read_bytes(struct blockdev_t *dev, uint64_t offset, void *buf, uint64_t len);
+
+#endif
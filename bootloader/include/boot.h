@@ -26,6 +26,7 @@
 
 #include <bftypes.h>
 #include <bferrorcodes.h>
+#include "pmu.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,52 +43,132 @@ typedef boot_ret_t (*boot_fn_t)();
 #define BOOT_ABORT            ( 3L << 1)
 #define BOOT_NOT_FOUND        ( 4L << 1)
 
-#ifndef NR_START_FNS
-#define NR_START_FNS ( 8U )
-#endif
+#define BOOT_STAGE_MAX_DEPS   ( 4U )
 
 /**
- * boot_add_prestart_fn()
- *
- * Register a prestart function. A prestart function is run
- * in EL2 context.
+ * Boot phases. Every stage of a phase completes before the next phase
+ * starts. Prestart stages run in EL2 before Bareflank is started, the single
+ * start stage starts it, and poststart stages run afterwards.
+ */
+#define BOOT_PHASE_PRESTART   ( 0U )
+#define BOOT_PHASE_START      ( 1U )
+#define BOOT_PHASE_POSTSTART  ( 2U )
+#define NR_BOOT_PHASES        ( 3U )
+
+/**
+ * Stage flags
  *
- * @param fn the prestart function to add
- * @return boot_ret_t BOOT_SUCCESS on success
+ * BOOT_STAGE_BOOT_CPU: the stage must run on the boot core (e.g. anything
+ *      that changes exception level, or calls into the VMM)
+ * BOOT_STAGE_ALL_CPUS: the stage runs on the boot core once no other stage
+ *      is running, and has the secondary cores to itself (it may smp_call()
+ *      them, but must wait for every call before returning)
+ */
+#define BOOT_STAGE_BOOT_CPU   ( 1UL << 0 )
+#define BOOT_STAGE_ALL_CPUS   ( 1UL << 1 )
+
+/**
+ * Scheduler state of a boot stage (kept apart from the constant descriptor)
  */
-boot_ret_t boot_add_prestart_fn(boot_fn_t fn);
+struct boot_stage_state_t {
+    uint64_t state;
+    uint64_t cpu;
+    boot_ret_t ret;
+
+    // Generic timer ticks the stage took
+    uint64_t ticks;
+#ifdef BOOTLOADER_PMU
+    struct pmu_totals_t pmu;
+#endif
+};
 
 /**
- * boot_add_start_fn()
+ * A boot stage. Within a phase, stages run as soon as all of the stages they
+ * depend on have completed, concurrently on any available secondary cores
+ * unless they're pinned to the boot core. Otherwise, stages are started in
+ * phase and priority order.
  *
- * Register a start function (i.e a function to start bareflank)
- * The function will return back to the booloader at EL2
+ * A stage returns BOOT_CONTINUE on success. BOOT_INTERRUPT_STAGE skips the
+ * phase's remaining stages (ones already running are allowed to finish) and
+ * moves on to the next phase. Any other value aborts the boot.
  *
- * @param fn the start function to execute during boot_start
- * @return boot_ret_t BOOT_SUCCESS on success
+ * Stages aren't registered at runtime: the BOOT_*_STAGE() macros place their
+ * descriptors in .boot_stages.<phase>.<priority> sections, which
+ * bootloader.lds sorts by name into a single table.
  */
-boot_ret_t boot_set_start_fn(boot_fn_t fn);
+struct boot_stage_t {
+    const char *name;
+    boot_fn_t fn;
+    uint64_t phase;
+    uint64_t flags;
+
+    // Names of stages (in this or an earlier phase) that must complete first
+    const char *deps[BOOT_STAGE_MAX_DEPS];
+
+    struct boot_stage_state_t *state;
+};
 
 /**
- * boot_add_poststart_fn()
+ * Defines a boot stage.
  *
- * Register a poststart function. The poststart functions run
- * after the start_fn returns, and will execute in EL1.
- *
- * @param fn the poststart function to add
- * @return boot_ret_t BOOT_SUCCESS on success
+ * @param stage_phase the stage's phase, as a literal (0, 1 or 2)
+ * @param stage_prio the stage's priority within its phase, as a two digit literal
+ *      (00 runs first, 99 last)
+ * @param stage_name the stage's name, used to refer to it in dependencies
+ * @param stage_fn the function that implements the stage
+ * @param stage_flags BOOT_STAGE_* flags
+ * @param ... names of the stages this stage depends on
  */
-boot_ret_t boot_add_poststart_fn(boot_fn_t fn);
+#define BOOT_STAGE(stage_phase, stage_prio, stage_name, stage_fn, stage_flags, ...)     \
+    _Static_assert(sizeof(#stage_prio) == 3, "boot stage priorities are two digits");   \
+    static struct boot_stage_state_t __boot_stage_state_##stage_fn;                     \
+    static const struct boot_stage_t __boot_stage_##stage_fn                            \
+        __attribute__((used, aligned(8),                                                \
+            section(".boot_stages." #stage_phase "." #stage_prio))) = {                 \
+        .name = stage_name,                                                             \
+        .fn = stage_fn,                                                                 \
+        .phase = stage_phase,                                                           \
+        .flags = stage_flags,                                                           \
+        .deps = { __VA_ARGS__ },                                                        \
+        .state = &__boot_stage_state_##stage_fn,                                        \
+    }
+
+#define BOOT_PRESTART_STAGE(prio, stage_name, stage_fn, stage_flags, ...) \
+    BOOT_STAGE(0, prio, stage_name, stage_fn, stage_flags, ##__VA_ARGS__)
+
+#define BOOT_START_STAGE(stage_name, stage_fn, stage_flags, ...) \
+    BOOT_STAGE(1, 00, stage_name, stage_fn, stage_flags, ##__VA_ARGS__)
+
+#define BOOT_POSTSTART_STAGE(prio, stage_name, stage_fn, stage_flags, ...) \
+    BOOT_STAGE(2, prio, stage_name, stage_fn, stage_flags, ##__VA_ARGS__)
 
 /**
  * boot_start()
  *
- * Run the boot process (call all of the registered boot functions in order)
+ * Run the boot process: each phase's stages are scheduled in dependency
+ * order, across all of the cores brought up by smp_init(). Fails if there
+ * isn't exactly one start stage.
  *
- * @param fn the poststart function to add
  * @return boot_ret_t BOOT_CONTINUE on success
  */
 boot_ret_t boot_start();
 
+/**
+ * boot_report_timing()
+ *
+ * Print how long each boot stage that has run took, as "timing: <stage> <us>
+ * us" lines (collected by scripts/tools/bfqemu.py), followed by the timer's
+ * count when boot_start() was called ("entry") and the time since ("total").
+ */
+void boot_report_timing();
+
+/**
+ * boot_report_pmu()
+ *
+ * Print what the PMU counted for each boot stage that has run, and for each
+ * region marked with PMU_BEGIN/PMU_END (only with ENABLE_PMU_COUNTERS).
+ */
+void boot_report_pmu();
+
 #endif
 
@@ -3,13 +3,60 @@
 
 #include "boot.h"
 
+// The flattened device tree or FIT image passed in by the previous stage
+extern const void *g_boot_image;
+
+// Where the bootloader was loaded, if it moved itself at startup (else 0)
+extern uint64_t g_relocated_from;
+
+uint64_t bootloader_relocation_target(const void *image);
+
+/**
+ * VMM reload mailbox (ENABLE_VMM_RELOAD). After loading the VMM, the
+ * bootloader polls g_vmm_reload: to replace the VMM, write the address (and,
+ * for a plain ELF executable, the size) of the new image, then set request
+ * to VMM_RELOAD_IMAGE; the bootloader resets it to VMM_RELOAD_NONE and sets
+ * status once done. Set request to VMM_RELOAD_CONTINUE to resume booting.
+ * The mailbox is checked about every millisecond, or straight away after a
+ * sev. A reloaded VMM is loaded but not started, like a freshly booted one.
+ */
+#define VMM_RELOAD_NONE       ( 0UL )
+#define VMM_RELOAD_IMAGE      ( 0x44414f4c4552UL )     // "RELOAD"
+#define VMM_RELOAD_CONTINUE   ( 0x45554e49544e4f43UL ) // "CONTINUE"
+
+struct vmm_reload_mailbox_t {
+    volatile uint64_t request;
+    volatile uint64_t image;
+    volatile uint64_t size;
+    volatile int64_t status;
+};
+
+extern struct vmm_reload_mailbox_t g_vmm_reload;
+
+int64_t reload_vmm(const void *image, uint64_t size);
+
+/**
+ * Reports the bootloader heap (platform.c): the whole region it may allocate
+ * from, and the end of the part handed out so far.
+ */
+void platform_heap_region(uint64_t *start, uint64_t *end, uint64_t *used_end);
+
+/**
+ * Moves the bootloader heap to [start, end). Only possible before anything
+ * has been allocated.
+ *
+ * @return 0 on success, or -1 if the heap is already in use.
+ */
+int platform_move_heap(uint64_t start, uint64_t end);
+
 boot_ret_t print_banner();
 boot_ret_t panic();
 boot_ret_t verify_environment();
-boot_ret_t init_el2();
 boot_ret_t switch_to_el1();
 boot_ret_t init_platform_info();
 boot_ret_t init_bootloader();
-boot_ret_t launch_bareflank();
+boot_ret_t select_boot_image();
+boot_ret_t place_vmm();
+boot_ret_t start_vmm();
 
 #endif
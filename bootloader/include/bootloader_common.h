@@ -20,10 +20,12 @@
 #ifndef COMMON_H
 #define COMMON_H
 
-// #include <bftypes.h>
-// #include <bferrorcodes.h>
-// #include <bfelf_loader.h>
-// #include <bfdebugringinterface.h>
+#include <bftypes.h>
+#include <bferrorcodes.h>
+#include <bfelf_loader.h>
+#include <bfdebugringinterface.h>
+
+#include "prelink.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -87,6 +89,25 @@ common_fini(void);
 int64_t
 common_add_module(const char *file, uint64_t fsize);
 
+/**
+ * Add Prelinked Module
+ *
+ * Add's a VMM image that was already relocated for its load address on the
+ * build host (see scripts/tools/bfprelink.py). The image must already be
+ * resident at prelink->base with its BSS cleared, and is executed in place:
+ * common_load_vmm() skips ELF parsing, relocation and symbol lookup for it
+ * entirely. A prelinked image is fully resolved, so it must be the only
+ * module that is added.
+ *
+ * @param exec the prelinked image, resident at its load address
+ * @param exec_size the size of the image in memory (including BSS)
+ * @param prelink the prelink information recorded for the image
+ * @return BF_SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_add_prelinked_module(char *exec, uint64_t exec_size,
+    const struct bfvmm_prelink_t *prelink);
+
 /**
  * Load VMM
  *
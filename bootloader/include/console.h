@@ -0,0 +1,92 @@
+#ifndef BOOTLOADER_CONSOLE_H
+#define BOOTLOADER_CONSOLE_H
+
+#include <stdint.h>
+#include "boot.h"
+
+// The baud rate the previous stage is assumed to have left the console at,
+// for UARTs whose input clock isn't described in the device tree
+#define CONSOLE_DEFAULT_BAUD       ( 115200UL )
+
+#define CONSOLE_ERR_NO_STDOUT      ( -1L )
+#define CONSOLE_ERR_UNSUPPORTED    ( -2L )
+#define CONSOLE_ERR_BAUD           ( -3L )
+
+struct console_driver_t;
+
+/**
+ * A UART bound to a console driver.
+ */
+struct console_t {
+    const struct console_driver_t *driver;
+    volatile uint8_t *base;
+
+    // Registers are (1 << reg_shift) bytes apart, and accessed reg_io_width
+    // bytes at a time (1 or 4)
+    uint64_t reg_shift;
+    uint64_t reg_io_width;
+
+    // The UART's input clock in Hz, or 0 if the device tree doesn't say
+    uint64_t clock;
+    uint64_t baud;
+
+    // Bytes that can be queued at once: 0 until setup has enabled the FIFO
+    // (the early console doesn't assume the previous stage did)
+    uint64_t fifo_size;
+};
+
+/**
+ * A UART driver.
+ *
+ * compatible: the device tree compatible strings it handles (NULL terminated)
+ * setup: enables the UART's FIFOs and, if baud isn't 0, sets its baud rate.
+ *      Returns 0, or CONSOLE_ERR_BAUD if the baud rate can't be set.
+ * write: writes len bytes, filling the transmit FIFO before waiting on it
+ * read: reads up to len bytes that have already been received, without
+ *      waiting, and returns how many it read
+ */
+struct console_driver_t {
+    const char *name;
+    const char *const *compatible;
+    int64_t (*setup)(struct console_t *console, uint64_t baud);
+    void (*write)(struct console_t *console, const char *buf, uint64_t len);
+    uint64_t (*read)(struct console_t *console, char *buf, uint64_t len);
+};
+
+extern const struct console_driver_t g_uart_8250;
+extern const struct console_driver_t g_uart_pl011;
+
+/**
+ * Writes to the console, translating "\n" to "\r\n". Until the "console"
+ * stage has run, this is the early console chosen at build time
+ * (EARLY_CONSOLE), if any.
+ *
+ * @param buf The characters to write.
+ * @param len The number of characters to write.
+ */
+void console_write(const char *buf, uint64_t len);
+
+/**
+ * Reads whatever the console has received, up to len bytes, without waiting
+ * for more.
+ *
+ * @param buf The buffer to read into.
+ * @param len The size of the buffer.
+ * @return The number of bytes read (0 if there's no console).
+ */
+uint64_t console_read(char *buf, uint64_t len);
+
+/**
+ * Binds the console to the UART the device tree's /chosen/stdout-path names,
+ * at the baud rate in its options (e.g. "serial0:921600n8") or, failing
+ * that, in a console= kernel argument (e.g. "console=ttyS0,921600n8").
+ *
+ * @param fdt The platform device tree.
+ * @return 0 on success, or a negative CONSOLE_ERR_* code (in which case the
+ *      early console is kept).
+ */
+int64_t console_init(const void *fdt);
+
+boot_ret_t init_console();
+
+#endif
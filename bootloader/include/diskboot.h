@@ -0,0 +1,25 @@
+#ifndef BOOTLOADER_DISKBOOT_H
+#define BOOTLOADER_DISKBOOT_H
+
+#include <stdint.h>
+
+/**
+ * Boots from a FIT image (bootloader.fit) on the first virtio block device
+ * (ENABLE_DISK_BOOT): the file DISK_BOOT_FILE, if the partition at byte
+ * DISK_BOOT_OFFSET (or the first FAT32 partition of an MBR there) is FAT32,
+ * or else the raw partition itself.
+ *
+ * Only the FIT's tree is read up front. The uncompressed VMM, kernel and
+ * initrd are planned like any other component, then read in large requests
+ * straight to wherever the plan places them; the bootloader component is
+ * never read at all. Anything else (the platform device tree, compressed
+ * components) is read into the tree, so it has to fit in DISK_FIT_SIZE.
+ *
+ * @param image The image the previous stage passed us, whose device tree
+ *      describes the disk.
+ * @return The boot image, or NULL if there's no disk, no FIT on it, or its
+ *      components couldn't be read (nothing is planned then).
+ */
+const void *disk_boot_image(const void *image);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef BOOTLOADER_DOWNLOAD_H
+#define BOOTLOADER_DOWNLOAD_H
+
+#include <stdint.h>
+
+/**
+ * Serial download (ENABLE_SERIAL_DOWNLOAD): receives the boot image over the
+ * console from scripts/tools/bfsend.py.
+ *
+ * The image is sent in fixed size blocks, each optionally LZ4 compressed, as
+ * frames of a 24 byte little-endian header followed by len bytes of payload:
+ *
+ *      0  magic    "BFDL"
+ *      4  type     DOWNLOAD_FRAME_*
+ *      5  flags    DOWNLOAD_FLAG_*
+ *      6  (zero)
+ *      8  seq      block number (DATA), or number of blocks (END)
+ *      12 len      payload bytes
+ *      16 raw_len  bytes the payload decompresses to
+ *      20 crc      CRC-32 of the header's first 20 bytes and the payload
+ *
+ * START's payload is the image size and block size (two 32-bit words). The
+ * bootloader answers on the console with lines starting "bfdl: ":
+ *
+ *      ready <window> <max len>  sent every second until START arrives
+ *      ack <n>                   blocks before n are in place
+ *      nak <n>                   resend from block n (go-back-N)
+ *      done                      END arrived after the last block
+ *      error <reason>            the download was abandoned
+ *
+ * The sender may have up to window blocks unacknowledged. Blocks are only
+ * acknowledged once decompressed, which (on a secondary core, if there is
+ * one) overlaps with receiving the blocks after them.
+ */
+
+#define DOWNLOAD_MAGIC             ( 0x4C444642U )   // "BFDL"
+#define DOWNLOAD_HEADER_SIZE       ( 24U )
+
+#define DOWNLOAD_FRAME_START       ( 1U )
+#define DOWNLOAD_FRAME_DATA        ( 2U )
+#define DOWNLOAD_FRAME_END         ( 3U )
+
+#define DOWNLOAD_FLAG_LZ4          ( 1U << 0 )
+
+// Blocks in flight, and the largest block (raw or compressed)
+#define DOWNLOAD_WINDOW            ( 8U )
+#define DOWNLOAD_MAX_BLOCK         ( 0x10000U )
+
+/**
+ * Waits for bfsend.py (announcing itself on the console until it does, or
+ * until DOWNLOAD_TIMEOUT seconds pass) and receives the boot image to
+ * DOWNLOAD_ADDR.
+ *
+ * @param image The image the previous stage passed us.
+ * @return The downloaded FIT image, or NULL if nothing was sent or the
+ *      download failed.
+ */
+const void *download_boot_image(const void *image);
+
+#endif
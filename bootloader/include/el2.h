@@ -0,0 +1,54 @@
+#ifndef BOOTLOADER_EL2_H
+#define BOOTLOADER_EL2_H
+
+#include <stdint.h>
+#include "boot.h"
+
+/**
+ * An EL2 register setting. Registers whose value depends on the core (e.g.
+ * VMPIDR_EL2) or on the hardware (e.g. the PMU counters handed to EL1 in
+ * MDCR_EL2) compute it at runtime instead of using value.
+ */
+struct el2_reg_t {
+    const char *name;
+    uint64_t value;
+    uint64_t (*compute)(void);
+    uint64_t (*read)(void);
+    void (*write)(uint64_t value);
+};
+
+/**
+ * A named EL2 configuration: the registers it sets, in order.
+ */
+struct el2_profile_t {
+    const char *name;
+    const struct el2_reg_t *regs;
+    uint64_t nr_regs;
+};
+
+/**
+ * @return The EL2 profile selected at build time (EL2_PROFILE).
+ */
+const struct el2_profile_t *el2_profile(void);
+
+/**
+ * Applies the selected EL2 profile to the calling core.
+ *
+ * @param verbose If set, prints each register's old and new values.
+ */
+void el2_apply_profile(int verbose);
+
+/**
+ * Reports an exception the bootloader doesn't handle, and stops the core
+ * (called from vectors.s).
+ *
+ * @param vector The vector taken, 0 to 15.
+ * @param esr ESR_EL2.
+ * @param elr ELR_EL2.
+ * @param far FAR_EL2.
+ */
+void el2_unexpected_exception(uint64_t vector, uint64_t esr, uint64_t elr, uint64_t far);
+
+boot_ret_t init_el2();
+
+#endif
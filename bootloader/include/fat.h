@@ -0,0 +1,80 @@
+#ifndef BOOTLOADER_FAT_H
+#define BOOTLOADER_FAT_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+/**
+ * Read-only FAT32, over a block device (e.g. the boot partition 'make
+ * flash' installs bootloader.bin to).
+ *
+ * Opening a file walks its cluster chain once, merging runs of adjacent
+ * clusters into extents. Reads then cost one device read per extent they
+ * touch, straight into the caller's buffer: a file written to a freshly
+ * formatted partition is usually a single extent.
+ */
+
+#define FAT_ERR_IO                 ( -1L )
+#define FAT_ERR_NOT_FAT            ( -2L )
+#define FAT_ERR_NOT_FOUND          ( -3L )
+#define FAT_ERR_CORRUPT            ( -4L )
+#define FAT_ERR_FRAGMENTED         ( -5L )
+#define FAT_ERR_RANGE              ( -6L )
+
+// The most fragments a file may be in
+#define FAT_MAX_EXTENTS            ( 32U )
+
+struct fat_fs_t {
+    struct blockdev_t *dev;
+
+    // Byte offsets on the device
+    uint64_t fat_start;
+    uint64_t fat_size;
+    uint64_t data_start;
+
+    uint64_t cluster_size;
+    uint64_t nr_clusters;
+    uint32_t root_cluster;
+};
+
+/**
+ * A run of adjacent clusters, as a byte range of the device.
+ */
+struct fat_extent_t {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct fat_file_t {
+    struct fat_fs_t *fs;
+    uint64_t size;
+
+    uint64_t nr_extents;
+    struct fat_extent_t extents[FAT_MAX_EXTENTS];
+};
+
+/**
+ * Reads the boot sector of the FAT32 file system at byte offset of a
+ * device (i.e. a partition's).
+ *
+ * @return 0 on success, or a negative FAT_ERR_* code.
+ */
+int64_t fat_mount(struct fat_fs_t *fs, struct blockdev_t *dev, uint64_t offset);
+
+/**
+ * Opens a file by path (e.g. "/boot/bootloader.fit"), matching long and
+ * short names without regard to case, and resolves where its data is.
+ *
+ * @return 0 on success, or a negative FAT_ERR_* code (FAT_ERR_FRAGMENTED if
+ *      the file is in more than FAT_MAX_EXTENTS pieces).
+ */
+int64_t fat_open(struct fat_fs_t *fs, const char *path, struct fat_file_t *file);
+
+/**
+ * Reads len bytes from byte pos of an open file.
+ *
+ * @return 0 on success, or a negative FAT_ERR_* code.
+ */
+int64_t fat_read(const struct fat_file_t *file, uint64_t pos, void *buf, uint64_t len);
+
+#endif
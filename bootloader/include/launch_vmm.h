@@ -1,9 +1,61 @@
 #ifndef BOOTLOADER_LAUNCH_VMM_H
 #define BOOTLOADER_LAUNCH_VMM_H
 
+#include "prelink.h"
+
 int ensure_image_is_accessible(const void *image);
+const void *find_platform_device_tree(const void *image);
+
+/**
+ * Finds the FIT image to boot from. Previous stages that can only hand Linux
+ * a device tree and an initrd (e.g. QEMU's -kernel and -initrd) pass the FIT
+ * as the initrd, described by /chosen/linux,initrd-start.
+ *
+ * @return The FIT image, or image itself if it's a FIT or doesn't point at
+ *      one.
+ */
+const void *find_boot_image(const void *image);
 void load_device_tree(void *fdt);
+int get_component_data(const void *image, int node,
+    const void **out_data_location, int *out_size);
+int get_subcomponent_information(const void *image, const char *path,
+    void **out_load_location, void const**out_data_location, int *out_size,
+    int * node_offset);
+
+/**
+ * Returns true if a FIT component's data is compressed.
+ */
+int is_compressed(const void *image, int node);
+
+/**
+ * Copies, or decompresses, a component's data to its load location.
+ *
+ * @return The number of bytes placed at the load location, or a negative
+ *      FDT error code.
+ */
+int place_component(const void *image, int node, void *load_location,
+    const void *data_location, int size);
+
+/**
+ * Reads the prelink information that scripts/tools/bfprelink.py recorded in
+ * a VMM image node.
+ *
+ * @return SUCCESS, -FDT_ERR_NOTFOUND if the VMM was not prelinked, or another
+ *      FDT error code if the prelink information is malformed.
+ */
+int get_prelink_information(const void *image, int node,
+    struct bfvmm_prelink_t *prelink);
+
 void * load_image_component_verbosely(const void * image,
     const char * path, const char * description, int * size);
 
+/**
+ * Loads the VMM image at the given FIT path and adds it to the VMM loader.
+ * VMM images that were prelinked at build time are placed at their load
+ * address and executed in place; plain ELF images are relocated at load time.
+ *
+ * @return SUCCESS, or an FDT error code.
+ */
+int load_vmm_component(const void *image, const char *path);
+
 #endif
@@ -0,0 +1,88 @@
+#ifndef BOOTLOADER_LINUX_H
+#define BOOTLOADER_LINUX_H
+
+#include <stdint.h>
+#include "boot.h"
+
+// Linux wants its Image placed at a 2 MiB aligned base, plus text_offset
+#define LINUX_IMAGE_ALIGN        ( 0x200000UL )
+#define LINUX_FLAG_BIG_ENDIAN    ( 1UL << 0 )
+#define LINUX_FLAG_ANY_PLACEMENT ( 1UL << 3 )
+#define LINUX_MAX_RESERVATIONS   ( 16U )
+#define LINUX_MAX_CHOSEN         ( 8U )
+
+#define LINUX_ERR_NO_SPACE       ( -1L )
+
+/**
+ * The arm64 Image header fields we care about (see Linux's
+ * Documentation/arm64/booting.rst).
+ */
+struct linux_image_t {
+    uint64_t text_offset;
+    uint64_t image_size;
+    uint64_t flags;
+};
+
+/**
+ * Marks memory Linux must leave alone (e.g. the VMM), which is added to the
+ * device tree's memory reservation block when handing off to Linux, and left
+ * out of the guest's stage-2 map. The bootloader and its heap are reserved
+ * separately, as they stay mapped.
+ *
+ * @param addr The start of the region.
+ * @param size The size of the region, in bytes.
+ * @return 0 on success, or LINUX_ERR_NO_SPACE if too many regions are
+ *      reserved.
+ */
+int64_t linux_reserve_memory(uint64_t addr, uint64_t size);
+
+/**
+ * Adds a property to /chosen when handing off to Linux (e.g. results for
+ * userspace to collect from /proc/device-tree/chosen). Setting the same
+ * property again replaces it.
+ *
+ * @param name The property's name. Must stay valid until Linux is launched.
+ * @param value The property's value. Must stay valid until Linux is launched.
+ * @param len The length of value, in bytes.
+ * @return 0 on success, or LINUX_ERR_NO_SPACE if too many properties are set.
+ */
+int64_t linux_set_chosen(const char *name, const void *value, int len);
+
+/**
+ * Looks up a region passed to linux_reserve_memory().
+ *
+ * @param index The region's index, in the order they were reserved.
+ * @param addr Out argument. Receives the start of the region.
+ * @param size Out argument. Receives the size of the region, in bytes.
+ * @return 0 on success, or -1 if index is past the last region.
+ */
+int linux_reserved_region(uint64_t index, uint64_t *addr, uint64_t *size);
+
+/**
+ * Parses an arm64 Image header.
+ *
+ * @param image The start of the Image.
+ * @param size The size of the Image file, in bytes.
+ * @param header Out argument. Receives the header, with image_size and
+ *      text_offset defaulted for kernels older than 3.17.
+ * @return 0 on success, or -1 if this isn't a little-endian arm64 Image.
+ */
+int linux_read_image_header(const void *image, uint64_t size,
+    struct linux_image_t *header);
+
+/**
+ * Reads the Image header of a FIT kernel component. Compressed kernels can't
+ * be parsed before they're decompressed, so for those, the copy of the
+ * header recorded by scripts/tools/bfmkfit.py is used instead.
+ *
+ * @return 0 on success, or -1 if the header can't be found.
+ */
+int linux_read_component_header(const void *image, int node,
+    const void *data, uint64_t size, struct linux_image_t *header);
+
+boot_ret_t place_linux();
+boot_ret_t place_initrd();
+boot_ret_t fixup_linux_device_tree();
+boot_ret_t launch_linux();
+
+#endif
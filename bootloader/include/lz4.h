@@ -0,0 +1,46 @@
+#ifndef BOOTLOADER_LZ4_H
+#define BOOTLOADER_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ4_ERR_CORRUPT       ( -1L )
+#define LZ4_ERR_UNSUPPORTED   ( -2L )
+#define LZ4_ERR_NOSPACE       ( -3L )
+#define LZ4_ERR_NOSIZE        ( -4L )
+
+/**
+ * Returns the uncompressed size recorded in an LZ4 frame header.
+ *
+ * @param src The LZ4 frame.
+ * @param src_len The size of the LZ4 frame, in bytes.
+ * @return The content size, or a negative LZ4_ERR_* code if the frame is
+ *      invalid or doesn't record its content size.
+ */
+long lz4_frame_content_size(const void *src, size_t src_len);
+
+/**
+ * Decompresses an LZ4 frame (as produced by the lz4 tool, or by
+ * scripts/tools/bflz4.py). Block and content checksums are skipped, and so
+ * are FIT hash nodes: nothing checks a component's integrity at boot.
+ *
+ * @param src The LZ4 frame.
+ * @param src_len The size of the LZ4 frame, in bytes.
+ * @param dst The buffer to decompress into.
+ * @param dst_len The size of the destination buffer, in bytes.
+ * @return The number of bytes decompressed, or a negative LZ4_ERR_* code.
+ */
+long lz4_decompress_frame(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+/**
+ * Decompresses a single raw LZ4 block.
+ *
+ * @param src The compressed block.
+ * @param src_len The size of the compressed block, in bytes.
+ * @param dst The buffer to decompress into.
+ * @param dst_len The size of the destination buffer, in bytes.
+ * @return The number of bytes decompressed, or a negative LZ4_ERR_* code.
+ */
+long lz4_decompress_block(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+#endif
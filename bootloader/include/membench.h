@@ -0,0 +1,48 @@
+#ifndef BOOTLOADER_MEMBENCH_H
+#define BOOTLOADER_MEMBENCH_H
+
+#include <stdint.h>
+#include "boot.h"
+
+// Bytes in each of the three arrays the benchmark streams through, per bank
+#ifndef MEMBENCH_SIZE
+#define MEMBENCH_SIZE              ( 0x800000UL )
+#endif
+
+// Dependent loads timed by the latency test
+#define MEMBENCH_LOADS             ( 0x10000UL )
+
+#define MEMBENCH_MAX_BANKS         ( 4U )
+#define MEMBENCH_MAX_RESULTS       ( MEMBENCH_MAX_BANKS * 4U )
+
+/**
+ * STREAM style kernels, over uint64_t arrays a, b and c:
+ *
+ * MEMBENCH_COPY: a = b (with memcpy())
+ * MEMBENCH_SCALE: a = 3 * b
+ * MEMBENCH_ADD: a = b + c
+ */
+#define MEMBENCH_COPY              ( 0U )
+#define MEMBENCH_SCALE             ( 1U )
+#define MEMBENCH_ADD               ( 2U )
+#define MEMBENCH_NR_KERNELS        ( 3U )
+
+/**
+ * One row of results: a bank measured with the caches on or off, from one
+ * core or all of them.
+ */
+struct membench_result_t {
+    uint64_t bank;
+    uint64_t cached;
+    uint64_t cpus;
+
+    // Bandwidth of each kernel, in MB/s
+    uint64_t mbps[MEMBENCH_NR_KERNELS];
+
+    // Load to use latency, in ns (measured from one core)
+    uint64_t latency_ns;
+};
+
+boot_ret_t run_membench();
+
+#endif
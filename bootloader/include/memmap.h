@@ -0,0 +1,52 @@
+#ifndef BOOTLOADER_MEMMAP_H
+#define BOOTLOADER_MEMMAP_H
+
+#include <stdint.h>
+
+#define MEMMAP_MAX_RANGES     ( 16U )
+
+/**
+ * A physical memory range, [start, end).
+ */
+struct memmap_range_t {
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * Reads a node's reg property (e.g. a device's register banks), using its
+ * parent's #address-cells and #size-cells.
+ *
+ * @param fdt The device tree.
+ * @param node The node.
+ * @param ranges Out argument. Receives the ranges, in order.
+ * @param max The number of entries ranges can hold.
+ * @return The number of ranges read.
+ */
+int memmap_node_reg(const void *fdt, int node, struct memmap_range_t *ranges, int max);
+
+/**
+ * Reads the DRAM banks described by a device tree's /memory nodes.
+ *
+ * @param fdt The platform device tree.
+ * @param banks Out argument. Receives the banks, in device tree order.
+ * @param max The number of entries banks can hold.
+ * @return The number of banks read.
+ */
+int memmap_banks(const void *fdt, struct memmap_range_t *banks, int max);
+
+/**
+ * Reads the memory a device tree reserves: its memory reservation block and
+ * the children of /reserved-memory with a reg property.
+ *
+ * @param fdt The platform device tree.
+ * @param ranges Out argument. Receives the reserved ranges.
+ * @param max The number of entries ranges can hold.
+ * @param no_map_only If set, only /reserved-memory nodes marked no-map
+ *      (which must not be mapped at all) are read.
+ * @return The number of ranges read.
+ */
+int memmap_reserved(const void *fdt, struct memmap_range_t *ranges, int max,
+    int no_map_only);
+
+#endif
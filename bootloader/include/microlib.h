@@ -65,7 +65,13 @@ int puts(const char * s);
 size_t strnlen(const char *s, size_t max);
 void * memchr(const void *s, int c, size_t n);
 void * memset(void *b, int c, size_t len);
+int memcmp(const void *s1, const void *s2, size_t n);
+int strcmp(const char *s1, const char *s2);
+size_t strlen(const char *s);
+char * strchr(const char *s, int c);
+char * strrchr(const char *s, int c);
 
 int bootloader_printf(const char *fmt, ...);
+int bootloader_sprintf(char *buf, const char *fmt, ...);
 
 #endif
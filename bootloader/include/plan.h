@@ -0,0 +1,126 @@
+#ifndef BOOTLOADER_PLAN_H
+#define BOOTLOADER_PLAN_H
+
+#include <stdint.h>
+#include "boot.h"
+
+#define PLAN_MAX_COMPONENTS   ( 8U )
+#define PLAN_MAX_RANGES       ( 32U )
+
+#define PLAN_ERR_TOO_MANY     ( -1L )
+#define PLAN_ERR_NO_MEMORY    ( -2L )
+#define PLAN_ERR_CYCLE        ( -3L )
+#define PLAN_ERR_NO_MAP       ( -4L )
+#define PLAN_ERR_COPY         ( -5L )
+
+// The component has to be placed at its hint (e.g. a prelinked VMM)
+#define PLAN_FIXED            ( 1UL << 0 )
+// The component may be used right where its data already is
+#define PLAN_IN_PLACE         ( 1UL << 1 )
+// The component is decompressed, so its data can't overlap its destination
+#define PLAN_COMPRESSED       ( 1UL << 2 )
+
+/**
+ * A component of the boot image, and where the planner decided it goes.
+ *
+ * A component's destination is [dst, dst + memsz) with dst % align ==
+ * offset. Its data (size bytes at src, or none if src is 0) is copied there,
+ * or decompressed, unless it was planned to stay in place. Components whose
+ * data isn't in memory (e.g. files on a semihosting host) have a read
+ * function instead, which reads their size bytes of data straight to dst.
+ */
+struct plan_component_t;
+
+/**
+ * Reads a component's data (from c->source) to its destination.
+ *
+ * @return The number of bytes read, or a negative error code.
+ */
+typedef int64_t (*plan_read_t)(const struct plan_component_t *c, void *dst);
+
+struct plan_component_t {
+    const char *name;
+    const void *image;
+    int node;
+
+    uint64_t src;
+    uint64_t size;
+    uint64_t memsz;
+    uint64_t align;
+    uint64_t offset;
+    uint64_t hint;
+    uint64_t flags;
+
+    plan_read_t read;
+    const void *source;
+
+    uint64_t dst;
+    uint64_t placed;
+};
+
+/**
+ * Marks memory that must not be used as a destination, and that is never
+ * overwritten while components are copied.
+ *
+ * @return 0 on success, or PLAN_ERR_TOO_MANY.
+ */
+int64_t plan_reserve(uint64_t addr, uint64_t size);
+
+/**
+ * Adds a component to the plan.
+ *
+ * @return 0 on success, or PLAN_ERR_TOO_MANY.
+ */
+int64_t plan_add(const struct plan_component_t *component);
+
+/**
+ * Places every component within the memory described by the device tree's
+ * /memory nodes, minus its memory reservations and everything passed to
+ * plan_reserve(), so that no two destinations overlap. Components that can
+ * stay in place do, then the rest are placed at their hint if possible,
+ * or first-fit otherwise, preferably where no other component's data is.
+ *
+ * Destinations may still overlap another component's data, so the copies
+ * are ordered such that every component is copied before anything
+ * overwrites its data: no bounce buffer is needed.
+ *
+ * @param fdt The platform device tree.
+ * @return 0 on success, or a negative PLAN_ERR_* code.
+ */
+int64_t plan_compute(const void *fdt);
+
+/**
+ * Copies (decompresses, or reads) every component to its destination, in
+ * the order chosen by plan_compute().
+ *
+ * @return 0 on success, or PLAN_ERR_COPY.
+ */
+int64_t plan_execute(void);
+
+/**
+ * Finds a FIT component placed by the plan.
+ *
+ * @param image The FIT image.
+ * @param node The component's node.
+ * @return The component, or NULL if it wasn't planned.
+ */
+const struct plan_component_t *plan_find(const void *image, int node);
+
+/**
+ * Finds memory the plan left free. Once the plan has been executed and the
+ * components placed, nothing uses it until the next stage (e.g. Linux)
+ * does, so it can be used as scratch memory in the meantime.
+ *
+ * @param start The start of the range to search (e.g. a DRAM bank).
+ * @param end The end of the range to search.
+ * @param size The number of bytes needed.
+ * @param align The alignment needed (a power of two).
+ * @param addr Out argument. Receives the lowest suitable address.
+ * @return 0 on success, or PLAN_ERR_NO_MEMORY.
+ */
+int64_t plan_find_free(uint64_t start, uint64_t end, uint64_t size, uint64_t align,
+    uint64_t *addr);
+
+boot_ret_t plan_boot_image();
+
+#endif
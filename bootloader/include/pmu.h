@@ -0,0 +1,99 @@
+#ifndef BOOTLOADER_PMU_H
+#define BOOTLOADER_PMU_H
+
+#include <stdint.h>
+#include "smp.h"
+
+/**
+ * What each PMU counter counts. PMU_CYCLES is the dedicated cycle counter
+ * (PMCCNTR_EL0); the rest are programmable event counters, in counter
+ * order, and are left at zero on cores with fewer of them.
+ */
+#define PMU_CYCLES            ( 0U )
+#define PMU_INST_RETIRED      ( 1U )
+#define PMU_L1D_REFILL        ( 2U )
+#define PMU_L2D_REFILL        ( 3U )
+#define PMU_TLB_REFILL        ( 4U )
+#define PMU_BUS_ACCESS        ( 5U )
+#define PMU_NR_COUNTERS       ( 6U )
+
+/**
+ * A snapshot of every counter, taken at the start of a measurement.
+ */
+struct pmu_sample_t {
+    uint64_t counts[PMU_NR_COUNTERS];
+};
+
+/**
+ * What's been counted across every measurement of something.
+ */
+struct pmu_totals_t {
+    uint64_t calls;
+    uint64_t counts[PMU_NR_COUNTERS];
+};
+
+/**
+ * A named region of code, measured wherever PMU_BEGIN and PMU_END mark it.
+ * Each core accumulates into its own totals, so regions can be measured
+ * from stages running concurrently.
+ */
+struct pmu_region_t {
+    const char *name;
+    struct pmu_totals_t *totals;
+};
+
+/**
+ * Enables the cycle counter and the event counters on the calling core,
+ * counting at EL1 and EL2. Counters are per core, so every core that's
+ * measured calls this.
+ */
+void pmu_init(void);
+
+/**
+ * Reads every counter on the calling core.
+ */
+void pmu_read(struct pmu_sample_t *sample);
+
+/**
+ * Adds what's been counted since a sample was taken to a set of totals.
+ */
+void pmu_accumulate(struct pmu_totals_t *totals, const struct pmu_sample_t *start);
+
+/**
+ * Prints one line of totals (and the derived instructions per cycle and
+ * misses per thousand instructions).
+ */
+void pmu_print(const char *name, const struct pmu_totals_t *totals);
+
+/**
+ * Prints the totals of every region, summed across cores.
+ */
+void pmu_report_regions(void);
+
+#ifdef BOOTLOADER_PMU
+
+// The region table, collected by bootloader.lds
+#define PMU_REGION(var, region_name)                                    \
+    static struct pmu_totals_t __pmu_totals_##var[SMP_MAX_CPUS];        \
+    static const struct pmu_region_t var                                \
+        __attribute__((used, aligned(8), section(".pmu_regions"))) = {  \
+        .name = region_name,                                            \
+        .totals = __pmu_totals_##var,                                   \
+    }
+
+#define PMU_BEGIN(var)                                                  \
+    struct pmu_sample_t __pmu_start_##var;                              \
+    pmu_read(&__pmu_start_##var)
+
+#define PMU_END(var)                                                    \
+    pmu_accumulate(&(var).totals[smp_this_cpu()], &__pmu_start_##var)
+
+#else
+
+#define PMU_REGION(var, region_name)
+#define PMU_BEGIN(var)
+#define PMU_END(var)
+
+#endif
+
+#endif
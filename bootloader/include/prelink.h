@@ -0,0 +1,52 @@
+#ifndef BOOTLOADER_PRELINK_H
+#define BOOTLOADER_PRELINK_H
+
+#include <stdint.h>
+
+#ifndef BFVMM_PRELINK_MAX_SEGMENTS
+#define BFVMM_PRELINK_MAX_SEGMENTS ( 8U )
+#endif
+
+/* Segment permission flags, as found in the ELF program headers */
+#define BFVMM_PRELINK_PF_X ( 1U << 0 )
+#define BFVMM_PRELINK_PF_W ( 1U << 1 )
+#define BFVMM_PRELINK_PF_R ( 1U << 2 )
+
+/**
+ * A loadable segment of a prelinked VMM image.
+ */
+struct bfvmm_prelink_segment_t {
+    uint64_t offset;    // Offset of the segment from the start of the image
+    uint64_t memsz;     // Size of the segment in memory
+    uint64_t flags;     // BFVMM_PRELINK_PF_* permissions
+};
+
+/**
+ * Everything the bootloader needs to know to run a VMM image that was
+ * relocated on the build host by scripts/tools/bfprelink.py.
+ *
+ * The first fields are stored (in this order) as 64-bit cells in the
+ * "bareflank,prelink" property of the VMM's FIT image node, and the
+ * segments as (offset, memsz, flags) triples in the
+ * "bareflank,prelink-segments" property. All addresses are absolute.
+ */
+struct bfvmm_prelink_t {
+    uint64_t base;
+    uint64_t entry;
+    uint64_t memsz;
+    uint64_t init;
+    uint64_t fini;
+    uint64_t init_array;
+    uint64_t init_array_size;
+    uint64_t fini_array;
+    uint64_t fini_array_size;
+    uint64_t eh_frame;
+    uint64_t eh_frame_size;
+
+    uint64_t num_segments;
+    struct bfvmm_prelink_segment_t segments[BFVMM_PRELINK_MAX_SEGMENTS];
+};
+
+#define BFVMM_PRELINK_NUM_FIELDS ( 11U )
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef BOOTLOADER_PROFILE_H
+#define BOOTLOADER_PROFILE_H
+
+#include <stdint.h>
+#include "boot.h"
+
+#ifndef PROFILE_PERIOD
+#define PROFILE_PERIOD             ( 100000U )
+#endif
+
+#define PROFILE_ERR_NO_GIC         ( -1L )
+#define PROFILE_ERR_NO_PMU         ( -2L )
+#define PROFILE_ERR_NO_COUNTER     ( -3L )
+
+/**
+ * Starts sampling the boot core's PC every PROFILE_PERIOD cycles, using a
+ * PMU event counter's overflow interrupt. Needs a GICv2, and the PMU's
+ * interrupt in the platform device tree. Physical IRQs are routed to EL2
+ * (HCR_EL2.IMO) until profile_stop().
+ *
+ * @param fdt The platform device tree.
+ * @return 0 on success, or a negative PROFILE_ERR_* code.
+ */
+int64_t profile_start(const void *fdt);
+
+/**
+ * Stops sampling, and prints every PC sampled and how often, for
+ * scripts/tools/bfprofile.py to symbolise. Does nothing if sampling
+ * wasn't started.
+ */
+void profile_stop(void);
+
+/**
+ * Handles an IRQ taken at EL2 (called from vectors.s).
+ *
+ * @param pc The interrupted PC.
+ */
+void el2_irq(uint64_t pc);
+
+boot_ret_t init_profile();
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef BOOTLOADER_SEMIHOST_H
+#define BOOTLOADER_SEMIHOST_H
+
+#include <stdint.h>
+#include "plan.h"
+
+/**
+ * ARM semihosting: file I/O serviced by the host through HLT #0xF000, by a
+ * JTAG debugger or by QEMU (-semihosting-config enable=on,target=native).
+ * Without either, the HLT is an undefined instruction, so these are only
+ * used when the build asks for them (ENABLE_SEMIHOSTING).
+ */
+
+#define SEMIHOST_ERR               ( -1L )
+
+/**
+ * Opens a host file for reading.
+ *
+ * @param path The file's path on the host (relative paths are relative to
+ *      the debugger's or QEMU's working directory).
+ * @return A handle, or SEMIHOST_ERR.
+ */
+int64_t semihost_open(const char *path);
+
+/**
+ * @return The length of an open file, or SEMIHOST_ERR.
+ */
+int64_t semihost_length(int64_t handle);
+
+/**
+ * Reads up to len bytes from the file's current position, in as few host
+ * calls as the host allows (normally one).
+ *
+ * @return The number of bytes read (less than len at the end of the file),
+ *      or SEMIHOST_ERR.
+ */
+int64_t semihost_read(int64_t handle, void *buf, uint64_t len);
+
+void semihost_close(int64_t handle);
+
+/**
+ * Reads the host file c->source names to a planned component's destination
+ * (a plan_read_t).
+ *
+ * @return The number of bytes read, or SEMIHOST_ERR.
+ */
+int64_t semihost_read_component(const struct plan_component_t *c, void *dst);
+
+/**
+ * Builds a boot image whose VMM, kernel and initrd are files on the host
+ * (ENABLE_SEMIHOSTING), and whose device tree is the host's copy of the
+ * build's, or else image's. The files are only opened now: the plan reads
+ * them straight to their destinations, so a rebuilt VMM boots without
+ * repacking the FIT.
+ *
+ * @param image The image the previous stage passed us.
+ * @return The new boot image, or NULL if a file couldn't be read.
+ */
+const void *semihost_boot_image(const void *image);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef BOOTLOADER_SMP_H
+#define BOOTLOADER_SMP_H
+
+#include <stdint.h>
+
+/**
+ * The maximum number of cores the bootloader will use, including the boot
+ * core. Each secondary core gets a SMP_STACK_SIZE stack, reserved by
+ * bootloader.lds (keep them in sync).
+ */
+#define SMP_MAX_CPUS          ( 8U )
+#define SMP_STACK_SIZE        ( 0x4000U )
+
+#define SMP_ERR_INVALID_CPU   ( -1L )
+#define SMP_ERR_BUSY          ( -2L )
+#define SMP_ERR_TIMEOUT       ( -3L )
+
+/**
+ * A function run on a secondary core by smp_call().
+ */
+typedef int64_t (*smp_fn_t)(uint64_t arg);
+
+/**
+ * A lock shared by the cores (see smp_lock()). Zero-initialized is unlocked.
+ */
+struct smp_lock_t {
+    volatile uint64_t choosing[SMP_MAX_CPUS];
+    volatile uint64_t ticket[SMP_MAX_CPUS];
+};
+
+/**
+ * Brings up the secondary cores described by the platform device tree using
+ * PSCI CPU_ON. Cores that don't use PSCI, or refuse CPU_ON, are skipped. If a
+ * core doesn't come online in time, no further cores are started: it may
+ * still come up later, under the index it was given. The boot core is always
+ * CPU 0.
+ *
+ * @param fdt The platform device tree, or NULL to run on the boot core only.
+ * @return The number of cores online, including the boot core.
+ */
+uint64_t smp_init(const void *fdt);
+
+/**
+ * @return The number of cores online, including the boot core.
+ */
+uint64_t smp_num_cpus(void);
+
+/**
+ * @return The index of the calling core (0 for the boot core).
+ */
+uint64_t smp_this_cpu(void);
+
+/**
+ * Asynchronously runs fn(arg) on a secondary core. Completion is checked with
+ * smp_poll() or smp_wait(). Only the boot core may post calls.
+ *
+ * @param cpu The secondary core to run on (1 to smp_num_cpus() - 1).
+ * @param fn The function to run.
+ * @param arg The argument passed to fn.
+ * @return 0 on success, SMP_ERR_INVALID_CPU if the core isn't online, or
+ *      SMP_ERR_BUSY if it's still running a previous call.
+ */
+int64_t smp_call(uint64_t cpu, smp_fn_t fn, uint64_t arg);
+
+/**
+ * Checks whether a secondary core has finished its last call.
+ *
+ * @param cpu The secondary core.
+ * @param ret Out argument. Receives the call's return value, if finished.
+ * @return 1 if the core is idle, 0 if it's still running.
+ */
+int smp_poll(uint64_t cpu, int64_t *ret);
+
+/**
+ * Waits for a secondary core to finish its last call.
+ *
+ * @param cpu The secondary core.
+ * @return The call's return value.
+ */
+int64_t smp_wait(uint64_t cpu);
+
+/**
+ * Sleeps until any secondary core finishes a call (or another event occurs).
+ */
+void smp_wait_event(void);
+
+/**
+ * Takes a lock, waiting for it if another core holds it. This is Lamport's
+ * bakery algorithm, which only needs ordered loads and stores: with the MMU
+ * off, exclusive accesses can't be relied on. Not reentrant.
+ */
+void smp_lock(struct smp_lock_t *lock);
+
+/**
+ * Releases a lock taken by smp_lock().
+ */
+void smp_unlock(struct smp_lock_t *lock);
+
+/**
+ * Powers off every secondary core with PSCI CPU_OFF, after letting it finish
+ * its current call, so that they can be brought up again by the next stage
+ * (e.g. an operating system). Afterwards, only the boot core is online.
+ */
+void smp_shutdown(void);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef BOOTLOADER_STAGE2_H
+#define BOOTLOADER_STAGE2_H
+
+#include <stdint.h>
+#include "boot.h"
+
+#define STAGE2_MAX_RANGES          ( 64U )
+
+#define STAGE2_POOL_PAGES          ( 64U )
+
+#define STAGE2_ERR_TOO_MANY        ( -1L )
+#define STAGE2_ERR_NO_MEMORY       ( -2L )
+#define STAGE2_ERR_OVERLAP         ( -3L )
+
+/**
+ * How a range of the guest's (identity mapped) address space is mapped.
+ */
+#define STAGE2_UNMAPPED            ( 0U )
+#define STAGE2_NORMAL              ( 1U )
+#define STAGE2_DEVICE              ( 2U )
+
+/**
+ * Mapping granularity statistics, per translation level (1: 1 GiB blocks,
+ * 2: 2 MiB blocks, 3: 4 KiB pages).
+ */
+struct stage2_stats_t {
+    uint64_t leaves[4];
+    uint64_t contiguous[4];
+    uint64_t tables;
+};
+
+/**
+ * Builds the guest's stage-2 identity map from the platform device tree:
+ * the whole physical address space is mapped as device memory, DRAM as
+ * normal memory, and /reserved-memory marked no-map, memory reserved for
+ * the VMM (see linux_reserve_memory()) and the translation tables
+ * themselves are left unmapped. The bootloader and its heap stay mapped, as
+ * the bootloader carries on at EL1 under these tables.
+ *
+ * @param fdt The platform device tree.
+ * @param stats Out argument. Receives the mapping granularity statistics.
+ * @return The value to program into VTTBR_EL2 (VMID 0), or a negative
+ *      STAGE2_ERR_* code.
+ */
+int64_t stage2_build(const void *fdt, struct stage2_stats_t *stats);
+
+/**
+ * @return The VTCR_EL2 value for the tables built by stage2_build(), sized
+ *      for the physical address range the core implements.
+ */
+uint64_t stage2_vtcr(void);
+
+boot_ret_t init_stage2();
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef BOOTLOADER_TIMER_H
+#define BOOTLOADER_TIMER_H
+
+#include <stdint.h>
+#include "regs.h"
+
+/**
+ * Returns the current value of the generic timer's physical count.
+ */
+inline static uint64_t timer_ticks(void)
+{
+    uint64_t val;
+
+    // Keep the read from being speculated ahead of the code being timed
+    asm volatile ("isb" ::: "memory");
+    READ_SYSREG_64(cntpct_el0, val);
+    return val;
+}
+
+/**
+ * Returns the generic timer's frequency, in ticks per second.
+ */
+inline static uint64_t timer_frequency(void)
+{
+    uint64_t val;
+    READ_SYSREG_64(cntfrq_el0, val);
+    return val;
+}
+
+/**
+ * Converts a number of timer ticks to microseconds.
+ */
+inline static uint64_t timer_ticks_to_us(uint64_t ticks)
+{
+    uint64_t freq = timer_frequency();
+    return freq ? (ticks / freq) * 1000000 + ((ticks % freq) * 1000000) / freq : 0;
+}
+
+#endif
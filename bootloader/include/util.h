@@ -5,4 +5,8 @@
 // stack and all general-purpose registers.
 void _switch_to_el1(void);
 
+// Jump to a Linux kernel Image, passing it the given device tree. Never
+// returns.
+void _launch_linux(void *kernel, void *dtb);
+
 #endif
@@ -0,0 +1,29 @@
+#ifndef BOOTLOADER_VIRTIO_BLK_H
+#define BOOTLOADER_VIRTIO_BLK_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+/**
+ * virtio block devices on the virtio-mmio transport (legacy or version 1),
+ * e.g. QEMU's "-device virtio-blk-device". The device is polled, with
+ * interrupts suppressed: a read is split into requests of up to
+ * VIRTIO_BLK_REQUEST_SIZE, each a chain of one descriptor per segment of
+ * the destination (plus the request's header and status), and up to
+ * VIRTIO_BLK_MAX_INFLIGHT of them are queued at once.
+ */
+
+#define VIRTIO_BLK_REQUEST_SIZE    ( 0x400000UL )
+#define VIRTIO_BLK_MAX_INFLIGHT    ( 8U )
+#define VIRTIO_BLK_MAX_SEGMENTS    ( 16U )
+
+/**
+ * Binds the first virtio-mmio node in the device tree with a block device
+ * behind it.
+ *
+ * @param fdt The platform device tree.
+ * @return The device, or NULL if there isn't one (or it couldn't be set up).
+ */
+struct blockdev_t *virtio_blk_probe(const void *fdt);
+
+#endif
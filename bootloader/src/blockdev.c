@@ -0,0 +1,53 @@
+#include "blockdev.h"
+#include "microlib.h"
+
+static uint8_t g_blockdev_bounce[BLOCKDEV_MAX_BLOCK_SIZE] __attribute__((aligned(64)));
+
+/**
+ * Reads part of one block, through the bounce buffer.
+ */
+static int64_t read_partial(struct blockdev_t *dev, uint64_t lba, uint64_t skip,
+    void *buf, uint64_t len)
+{
+    int64_t ret;
+
+    ret = dev->read(dev, lba, g_blockdev_bounce, 1);
+    if(ret != 0)
+        return ret;
+
+    memcpy(buf, g_blockdev_bounce + skip, len);
+    return 0;
+}
+
+int64_t blockdev_read_bytes(struct blockdev_t *dev, uint64_t offset, void *buf, uint64_t len)
+{
+    uint64_t bs = dev->block_size, lba = offset / bs, skip = offset % bs, n;
+    uint8_t *dst = buf;
+    int64_t ret;
+
+    if(bs > BLOCKDEV_MAX_BLOCK_SIZE)
+        return BLOCKDEV_ERR_IO;
+    if(offset + len < offset || (offset + len + bs - 1) / bs > dev->nr_blocks)
+        return BLOCKDEV_ERR_RANGE;
+
+    if(skip && len) {
+        n = min(len, bs - skip);
+        if((ret = read_partial(dev, lba++, skip, dst, n)) != 0)
+            return ret;
+
+        dst += n;
+        len -= n;
+    }
+
+    n = len / bs;
+    if(n) {
+        if((ret = dev->read(dev, lba, dst, n)) != 0)
+            return ret;
+
+        lba += n;
+        dst += n * bs;
+        len -= n * bs;
+    }
+
+    return len ? read_partial(dev, lba, 0, dst, len) : 0;
+}
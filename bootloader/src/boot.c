@@ -23,84 +23,307 @@
 
 #include <bfelf_loader.h>
 #include "boot.h"
+#include "microlib.h"
+#include "smp.h"
+#include "timer.h"
 
-static boot_fn_t _prestart_fns[NR_START_FNS] = {0};
-static boot_fn_t _start_fn;
-static boot_fn_t _poststart_fns[NR_START_FNS] = {0};
+#define BOOT_STAGE_WAITING    ( 0U )
+#define BOOT_STAGE_RUNNING    ( 1U )
+#define BOOT_STAGE_DONE       ( 2U )
+#define BOOT_STAGE_SKIPPED    ( 3U )
+#define BOOT_STAGE_FAILED     ( 4U )
+
+// The stage table, collected and sorted by phase and priority by bootloader.lds
+extern const struct boot_stage_t bootloader_boot_stages_start[];
+extern const struct boot_stage_t bootloader_boot_stages_end[];
+
+#define for_each_boot_stage(stage) \
+    for (stage = bootloader_boot_stages_start; stage < bootloader_boot_stages_end; ++stage)
 
 struct platform_info_t boot_platform_info;
 
-static boot_ret_t inline
-run_function_list(boot_fn_t fnlist[])
+// The generic timer's count when boot_start() was called
+static uint64_t g_boot_start_ticks;
+
+static const struct boot_stage_t *
+find_stage(const char *name)
 {
-    uint64_t i;
-    for (i = 0U; i < NR_START_FNS; ++i) {
-        if (fnlist[i]) {
-            boot_ret_t ret = fnlist[i]();
-            if (ret == BOOT_INTERRUPT_STAGE) {
-                return BOOT_CONTINUE;
-            }
-            else if (ret == BOOT_ABORT) {
-                return ret;
-            }
+    const struct boot_stage_t *stage;
+    for_each_boot_stage(stage) {
+        if (strcmp(stage->name, name) == 0) {
+            return stage;
+        }
+    }
+    return NULL;
+}
 
-            if (ret != BOOT_CONTINUE) {
+/**
+ * Checks that there's exactly one start stage, and that every dependency
+ * exists and doesn't belong to a later phase (which could never complete in
+ * time). Also resets the stages' scheduler state.
+ */
+static boot_ret_t
+check_stages(void)
+{
+    const struct boot_stage_t *stage;
+    uint64_t j, nr_start = 0U;
+
+    for_each_boot_stage(stage) {
+        stage->state->state = BOOT_STAGE_WAITING;
+        stage->state->ticks = 0U;
+        if (stage->phase == BOOT_PHASE_START) {
+            nr_start++;
+        }
+
+        for (j = 0U; j < BOOT_STAGE_MAX_DEPS && stage->deps[j]; ++j) {
+            const struct boot_stage_t *dep = find_stage(stage->deps[j]);
+            if (!dep) {
+                BOOTLOADER_ERROR("boot stage %s depends on unknown stage %s",
+                    stage->name, stage->deps[j]);
+                return BOOT_NOT_FOUND;
+            }
+            if (dep->phase > stage->phase) {
+                BOOTLOADER_ERROR("boot stage %s depends on later stage %s",
+                    stage->name, stage->deps[j]);
                 return BOOT_ABORT;
             }
         }
-        else {
-            break;
-        }
+    }
+
+    if (nr_start != 1U) {
+        BOOTLOADER_ERROR("expected exactly one start stage, found %d", nr_start);
+        return BOOT_ABORT;
     }
     return BOOT_CONTINUE;
 }
 
-boot_ret_t
-boot_add_prestart_fn(boot_fn_t fn)
+static int
+stage_ready(const struct boot_stage_t *stage)
+{
+    uint64_t i;
+    for (i = 0U; i < BOOT_STAGE_MAX_DEPS && stage->deps[i]; ++i) {
+        uint64_t state = find_stage(stage->deps[i])->state->state;
+        if (state == BOOT_STAGE_WAITING || state == BOOT_STAGE_RUNNING) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs a stage's function, measuring it when PMU counters are enabled.
+ */
+static boot_ret_t
+call_stage(const struct boot_stage_t *stage)
+{
+    uint64_t start = timer_ticks();
+    boot_ret_t ret;
+#ifdef BOOTLOADER_PMU
+    struct pmu_sample_t sample;
+
+    pmu_read(&sample);
+    ret = stage->fn();
+    pmu_accumulate(&stage->state->pmu, &sample);
+#else
+    ret = stage->fn();
+#endif
+
+    stage->state->ticks = timer_ticks() - start;
+    return ret;
+}
+
+static int64_t
+run_stage_on_secondary(uint64_t arg)
+{
+    return call_stage((const struct boot_stage_t *)arg);
+}
+
+/**
+ * Records a stage's result. Returns the phase's result so far: the stage
+ * can interrupt the phase (BOOT_INTERRUPT_STAGE) or abort the boot.
+ */
+static boot_ret_t
+finish_stage(const struct boot_stage_t *stage, boot_ret_t ret, boot_ret_t phase_ret)
 {
-    static uint64_t nr_added = 0U;
-    if (nr_added == NR_START_FNS) {
-        return BOOT_FAIL;
+    stage->state->ret = ret;
+    stage->state->state = BOOT_STAGE_DONE;
+
+    if (ret == BOOT_CONTINUE) {
+        return phase_ret;
+    }
+    if (ret == BOOT_INTERRUPT_STAGE) {
+        return phase_ret == BOOT_CONTINUE ? BOOT_INTERRUPT_STAGE : phase_ret;
     }
 
-    _prestart_fns[nr_added++] = fn;
-    return BOOT_SUCCESS;
+    BOOTLOADER_ERROR("boot stage %s failed (%d)", stage->name, ret);
+    stage->state->state = BOOT_STAGE_FAILED;
+    return BOOT_ABORT;
 }
 
-boot_ret_t
-boot_set_start_fn(boot_fn_t fn)
+static uint64_t
+idle_cpu(const struct boot_stage_t *running[])
 {
-    _start_fn = fn;
-    return BOOT_SUCCESS;
+    uint64_t cpu;
+    for (cpu = 1U; cpu < smp_num_cpus(); ++cpu) {
+        if (!running[cpu]) {
+            return cpu;
+        }
+    }
+    return 0U;
 }
 
-boot_ret_t
-boot_add_poststart_fn(boot_fn_t fn)
+/**
+ * Runs every stage of a phase. Ready stages are handed to idle secondary
+ * cores; stages pinned to the boot core, or that find no idle core, run on
+ * the boot core itself.
+ */
+static boot_ret_t
+run_phase(uint64_t phase)
 {
-    static uint64_t nr_added = 0U;
-    if (nr_added == NR_START_FNS) {
-        return BOOT_FAIL;
+    const struct boot_stage_t *running[SMP_MAX_CPUS] = {0};
+    const struct boot_stage_t *stage;
+    uint64_t cpu, remaining = 0U, active = 0U;
+    boot_ret_t ret = BOOT_CONTINUE;
+
+    for_each_boot_stage(stage) {
+        if (stage->phase == phase) {
+            remaining++;
+        }
+    }
+
+    while (remaining) {
+        const struct boot_stage_t *local = NULL;
+        int progress = false;
+        int64_t stage_ret;
+
+        // Collect stages that finished on a secondary core
+        for (cpu = 1U; cpu < smp_num_cpus(); ++cpu) {
+            if (running[cpu] && smp_poll(cpu, &stage_ret)) {
+                ret = finish_stage(running[cpu], stage_ret, ret);
+                running[cpu] = NULL;
+                remaining--;
+                active--;
+                progress = true;
+            }
+        }
+
+        for_each_boot_stage(stage) {
+            if (stage->phase != phase || stage->state->state != BOOT_STAGE_WAITING) {
+                continue;
+            }
+
+            // Once a stage interrupts the phase or fails, nothing else starts
+            if (ret != BOOT_CONTINUE) {
+                stage->state->state = BOOT_STAGE_SKIPPED;
+                remaining--;
+                continue;
+            }
+
+            if (!stage_ready(stage)) {
+                continue;
+            }
+
+            // Nothing else may be in flight, or start, while it runs
+            if (stage->flags & BOOT_STAGE_ALL_CPUS) {
+                if (active || local) {
+                    continue;
+                }
+                local = stage;
+                break;
+            }
+
+            cpu = (stage->flags & BOOT_STAGE_BOOT_CPU) ? 0U : idle_cpu(running);
+            if (cpu && smp_call(cpu, run_stage_on_secondary, (uint64_t)stage) == 0) {
+                BOOTLOADER_SUBINFO("boot stage %s: cpu %d", stage->name, cpu);
+                stage->state->state = BOOT_STAGE_RUNNING;
+                stage->state->cpu = cpu;
+                running[cpu] = stage;
+                active++;
+                progress = true;
+            }
+            else if (!local) {
+                local = stage;
+            }
+        }
+
+        if (local) {
+            BOOTLOADER_SUBINFO("boot stage %s: cpu 0", local->name);
+            local->state->state = BOOT_STAGE_RUNNING;
+            local->state->cpu = 0U;
+            ret = finish_stage(local, call_stage(local), ret);
+            remaining--;
+            continue;
+        }
+
+        if (!progress && remaining) {
+            if (!active) {
+                BOOTLOADER_ERROR("boot stages have circular dependencies");
+                return BOOT_ABORT;
+            }
+            smp_wait_event();
+        }
     }
 
-    _poststart_fns[nr_added++] = fn;
-    return BOOT_SUCCESS;
+    return ret == BOOT_INTERRUPT_STAGE ? BOOT_CONTINUE : ret;
 }
 
 boot_ret_t
 boot_start()
 {
-    boot_ret_t ret = BOOT_CONTINUE;
-    ret = run_function_list(_prestart_fns);
+    uint64_t phase;
+    boot_ret_t ret;
+
+    g_boot_start_ticks = timer_ticks();
+
+    ret = check_stages();
     if (ret != BOOT_CONTINUE) {
         return ret;
     }
-    ret = _start_fn();
-    if (ret != BOOT_CONTINUE) {
-        return ret;
+
+    for (phase = 0U; phase < NR_BOOT_PHASES; ++phase) {
+        ret = run_phase(phase);
+        if (ret != BOOT_CONTINUE) {
+            break;
+        }
     }
-    ret = run_function_list(_poststart_fns);
-    if (ret != BOOT_CONTINUE) {
-        return ret;
+
+    boot_report_timing();
+    boot_report_pmu();
+    return ret;
+}
+
+void
+boot_report_timing()
+{
+    const struct boot_stage_t *stage;
+    uint64_t now = timer_ticks();
+
+    BOOTLOADER_INFO("Boot stage timing:");
+    for_each_boot_stage(stage) {
+        if (stage->state->state == BOOT_STAGE_DONE || stage->state->state == BOOT_STAGE_FAILED) {
+            BOOTLOADER_SUBINFO("timing: %s %lu us", stage->name,
+                timer_ticks_to_us(stage->state->ticks));
+        }
     }
-    return BOOT_CONTINUE;
+
+    BOOTLOADER_SUBINFO("timing: entry %lu us", timer_ticks_to_us(g_boot_start_ticks));
+    BOOTLOADER_SUBINFO("timing: total %lu us", timer_ticks_to_us(now - g_boot_start_ticks));
+}
+
+void
+boot_report_pmu()
+{
+#ifdef BOOTLOADER_PMU
+    const struct boot_stage_t *stage;
+
+    BOOTLOADER_INFO("PMU counts by boot stage:");
+    for_each_boot_stage(stage) {
+        if (stage->state->pmu.calls) {
+            pmu_print(stage->name, &stage->state->pmu);
+        }
+    }
+
+    BOOTLOADER_INFO("PMU counts by region:");
+    pmu_report_regions();
+#endif
 }
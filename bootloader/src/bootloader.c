@@ -1,8 +1,18 @@
 #include <microlib.h>
 #include "bootloader.h"
 #include "bootloader_common.h"
+#include "diskboot.h"
+#include "download.h"
+#include "launch_vmm.h"
+#include "pmu.h"
+#include "profile.h"
 #include "regs.h"
+#include "timer.h"
 #include "util.h"
+#include <bfdriverinterface.h>
+#include <libfdt.h>
+
+const void *g_boot_image = 0;
 
 boot_ret_t print_banner()
 {
@@ -53,15 +63,6 @@ boot_ret_t verify_environment()
     return BOOT_CONTINUE;
 }
 
-boot_ret_t init_el2()
-{
-    // Enable 64-bit execution for EL1
-    uint64_t val = 0x80000000;
-    WRITE_SYSREG_64(hcr_el2, val);
-
-    return BOOT_CONTINUE;
-}
-
 boot_ret_t init_platform_info()
 {
     BOOTLOADER_INFO("Initializing platform info");
@@ -74,13 +75,14 @@ boot_ret_t init_bootloader()
     print_banner();
     verify_environment();
 
-    init_el2();
-
     return BOOT_CONTINUE;
 }
 
 boot_ret_t switch_to_el1()
 {
+    // Samples are taken at EL2 only, and our vectors don't apply at EL1
+    profile_stop();
+
     BOOTLOADER_INFO("Switching to EL1...");
 
     uint32_t el = get_current_el();
@@ -101,26 +103,209 @@ boot_ret_t switch_to_el1()
     return BOOT_CONTINUE;
 }
 
-// #include <bfelf_loader.h>
-boot_ret_t launch_bareflank()
+// Poststart stages run in EL1, so leaving EL2 comes first (after anything
+// that configures EL2 for the guest, at 00)
+BOOT_POSTSTART_STAGE(01, "el1", switch_to_el1, BOOT_STAGE_BOOT_CPU);
+
+/**
+ * Gives optional boot image sources (ENABLE_SERIAL_DOWNLOAD, then
+ * ENABLE_DISK_BOOT) the chance to replace the image the previous stage
+ * passed us, before anything is planned or placed from it.
+ */
+boot_ret_t select_boot_image()
+{
+    const void *image = NULL;
+
+#ifdef ENABLE_SERIAL_DOWNLOAD
+    image = download_boot_image(g_boot_image);
+#endif
+
+#ifdef ENABLE_DISK_BOOT
+    if (!image) {
+        image = disk_boot_image(g_boot_image);
+    }
+#endif
+
+    if (image) {
+        g_boot_image = image;
+    }
+
+    return BOOT_CONTINUE;
+}
+
+// Sources may use the console and the secondary cores, and have them to
+// themselves
+BOOT_PRESTART_STAGE(20, "image", select_boot_image, BOOT_STAGE_ALL_CPUS, "console");
+
+boot_ret_t place_vmm()
 {
     BOOTLOADER_INFO("Launching Bareflank VMM...");
-    // const char * target_vmm_start = 0xf00d; // Lookup in image tree
-    // const char * target_vmm_end = 0xbeef; // Lookup in image tree
-    // uint64_t target_vmm_size = (uint64_t)(target_vmm_end - target_vmm_start);
-    //
-    // int64_t ret = common_add_module(target_vmm_start, target_vmm_size);
-    // if (ret < 0) {
-    //     BOOTLOADER_INFO("common_add_module returned %a", ec_to_str(ret));
-    //     goto fail;
-    // }
-    //
-    // ret = common_load_vmm();
-    // if (ret < 0) {
-    //     BOOTLOADER_INFO("common_load_vmm returned %a", ec_to_str(ret));
-    //     goto fail;
-    // }
-    //
+
+    if (load_vmm_component(g_boot_image, "/images/vmm") != SUCCESS) {
+        BOOTLOADER_ERROR("Failed to place Bareflank VMM");
+        return BOOT_FAIL;
+    }
+
+    return BOOT_CONTINUE;
+}
+
+// Placing the VMM only touches memory, so it may run on any core
+BOOT_PRESTART_STAGE(50, "vmm-place", place_vmm, 0, "plan");
+
+#if defined(VMM_CALL_BENCHMARK_ITERATIONS) && VMM_CALL_BENCHMARK_ITERATIONS > 0
+/**
+ * Measures the round trip cost of a VMM call, using a request that only
+ * reads state (fetching the debug ring).
+ */
+static void benchmark_vmm_calls()
+{
+    struct debug_ring_resources_t *drr = 0;
+    uint64_t i, start, ticks;
+
+    start = timer_ticks();
+    for (i = 0; i < VMM_CALL_BENCHMARK_ITERATIONS; i++) {
+        common_dump_vmm(&drr, 0);
+    }
+    ticks = timer_ticks() - start;
+
+    BOOTLOADER_INFO("VMM call benchmark: %lu calls in %lu us", i, timer_ticks_to_us(ticks));
+    BOOTLOADER_SUBINFO("%lu calls per second",
+        ticks ? (i * timer_frequency()) / ticks : 0);
+}
+#endif
+
+#ifdef ENABLE_VMM_RELOAD
+#define CNTHCTL_EL2_EVNTEN      ( 1UL << 2 )
+#define CNTHCTL_EL2_EVNTI_SHIFT ( 4 )
+
+// While waiting for reload requests, wake from wfe every 2^16 counter ticks
+// (about a millisecond at 62.5 MHz): a debugger writing the mailbox can't
+// send an event
+#define VMM_RELOAD_EVENT_STREAM ( CNTHCTL_EL2_EVNTEN | (15UL << CNTHCTL_EL2_EVNTI_SHIFT) )
+
+struct vmm_reload_mailbox_t g_vmm_reload = {0};
+
+/**
+ * Replaces the VMM with a new one, without a reboot: the current VMM is
+ * stopped (if it was started) and unloaded, returning its memory to the
+ * allocator, then the new one is loaded. This leaves the VMM just as booting
+ * does, so nothing starts it here. The time spent in each phase is reported.
+ *
+ * @param image A FIT image containing /images/vmm, or a VMM ELF executable
+ * @param size The size of an ELF executable (unused for FIT images)
+ * @return BF_SUCCESS, or the error of the phase that failed
+ */
+int64_t reload_vmm(const void *image, uint64_t size)
+{
+    const char *phases[] = { "stop", "unload", "load" };
+    uint64_t ticks[3] = {0};
+    uint64_t start, total = 0;
+    int64_t ret = BF_SUCCESS;
+    int phase, failed = 0;
+
+    BOOTLOADER_INFO("Reloading Bareflank VMM from 0x%08lx...", image);
+
+    for (phase = 0; phase < 3 && ret == BF_SUCCESS; phase++) {
+        start = timer_ticks();
+
+        switch (phase) {
+            case 0:
+                if (common_vmm_status() != VMM_UNLOADED) {
+                    ret = common_stop_vmm();
+                }
+                break;
+            case 1:
+                ret = common_unload_vmm();
+                break;
+            case 2:
+                if (fdt_check_header(image) == 0) {
+                    ret = load_vmm_component(image, "/images/vmm");
+                }
+                else {
+                    ret = common_add_module(image, size);
+                }
+                if (ret == BF_SUCCESS) {
+                    ret = common_load_vmm();
+                }
+                break;
+        }
+
+        ticks[phase] = timer_ticks() - start;
+        total += ticks[phase];
+        failed = phase;
+    }
+
+    for (phase = 0; phase < 3; phase++) {
+        BOOTLOADER_SUBINFO("%s: %lu us", phases[phase], timer_ticks_to_us(ticks[phase]));
+    }
+    BOOTLOADER_SUBINFO("total: %lu us", timer_ticks_to_us(total));
+
+    if (ret != BF_SUCCESS) {
+        BOOTLOADER_ERROR("VMM reload failed during %s (%ld)", phases[failed], ret);
+    }
+
+    return ret;
+}
+
+/**
+ * Services VMM reload requests posted to g_vmm_reload until told to continue
+ * booting.
+ */
+static void wait_for_vmm_reloads()
+{
+    uint64_t cnthctl;
+
+    BOOTLOADER_INFO("Waiting for VMM reload requests at 0x%08lx", &g_vmm_reload);
+
+    READ_SYSREG_64(cnthctl_el2, cnthctl);
+    WRITE_SYSREG_64(cnthctl_el2, cnthctl | VMM_RELOAD_EVENT_STREAM);
+    asm volatile ("isb" ::: "memory");
+
+    while (1) {
+        uint64_t request = g_vmm_reload.request;
+
+        if (request == VMM_RELOAD_CONTINUE) {
+            break;
+        }
+
+        if (request == VMM_RELOAD_IMAGE) {
+            g_vmm_reload.status = reload_vmm((const void *)g_vmm_reload.image, g_vmm_reload.size);
+            g_vmm_reload.request = VMM_RELOAD_NONE;
+            continue;
+        }
+
+        asm volatile ("wfe" ::: "memory");
+    }
+
+    g_vmm_reload.request = VMM_RELOAD_NONE;
+
+    WRITE_SYSREG_64(cnthctl_el2, cnthctl);
+    asm volatile ("isb" ::: "memory");
+}
+#endif
+
+PMU_REGION(g_pmu_load_vmm, "common_load_vmm");
+
+boot_ret_t start_vmm()
+{
+    int64_t ret = 0;
+
+    PMU_BEGIN(g_pmu_load_vmm);
+    ret = common_load_vmm();
+    PMU_END(g_pmu_load_vmm);
+    if (ret < 0) {
+        BOOTLOADER_ERROR("common_load_vmm returned %d", ret);
+        goto fail;
+    }
+
+#if defined(VMM_CALL_BENCHMARK_ITERATIONS) && VMM_CALL_BENCHMARK_ITERATIONS > 0
+    benchmark_vmm_calls();
+#endif
+
+#ifdef ENABLE_VMM_RELOAD
+    wait_for_vmm_reloads();
+#endif
+
     // uint64_t cpus = platform_num_cpus();
     // if (cpus == 0) {
     //     BOOTLOADER_ERROR("No CPUs found!");
@@ -140,6 +325,8 @@ boot_ret_t launch_bareflank()
     return BOOT_CONTINUE;
 
 fail:
-    BOOTLOADER_ERROR("Failed to launch Bareflank VMM (ELF loader not yet implemented)");
+    BOOTLOADER_ERROR("Failed to launch Bareflank VMM");
     return BOOT_FAIL;
 }
+
+BOOT_START_STAGE("vmm-start", start_vmm, BOOT_STAGE_BOOT_CPU, "vmm-place");
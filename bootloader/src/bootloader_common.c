@@ -17,15 +17,17 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
-#include <common.h>
+#include <bootloader_common.h>
 
-// #include <bftypes.h>
-// #include <bfdebug.h>
-// #include <bfmemory.h>
-// #include <bfplatform.h>
-// #include <bfconstants.h>
-// #include <bfthreadcontext.h>
-// #include <bfdriverinterface.h>
+#include <bftypes.h>
+#include <bfdebug.h>
+#include <bfmemory.h>
+#include <bfplatform.h>
+#include <bfconstants.h>
+#include <bfthreadcontext.h>
+#include <bfdriverinterface.h>
+
+#include "smp.h"
 
 /* -------------------------------------------------------------------------- */
 /* Global                                                                     */
@@ -41,45 +43,101 @@ struct bfelf_loader_t g_loader;
 int64_t g_num_cpus_started = 0;
 int64_t g_vmm_status = VMM_UNLOADED;
 
-void *g_tls = 0;
-void *g_stack = 0;
+int64_t g_prelinked = 0;
+struct bfvmm_prelink_t g_prelink;
+
+/*
+ * Per-CPU VMM memory. Every CPU gets a CPU_SLOT_SIZE slot of one
+ * STACK_SIZE aligned region, laid out as:
+ *
+ *   slot + 0                          TLS (page aligned)
+ *   slot + THREAD_LOCAL_STORAGE_SIZE  guard, filled with STACK_GUARD_PATTERN
+ *   slot + STACK_SIZE                 stack (grows down from the slot's end)
+ *
+ * so no two CPUs share a cache line (or page), a stack overflow runs into
+ * its own guard rather than another CPU's data, and the whole region can be
+ * given to the VMM as a single range.
+ */
+#define CPU_SLOT_SIZE (STACK_SIZE * 2)
+#define STACK_GUARD_PATTERN 0xBADC0FFEE0DDF00DULL
+
+_Static_assert(THREAD_LOCAL_STORAGE_SIZE < STACK_SIZE, "TLS must leave room for a stack guard");
+
+void *g_cpu_mem = 0;
+uint64_t g_cpu_mem_size = 0;
 
-uint64_t g_tls_size = 0;
-uint64_t g_stack_size = 0;
-uint64_t g_stack_top = 0;
+uint64_t g_cpu_region = 0;
+uint64_t g_cpu_region_size = 0;
+
+/*
+ * Everything private_call_vmm() needs for a CPU that doesn't change between
+ * calls, computed once by private_setup_cpu_contexts().
+ */
+struct private_cpu_context_t {
+    uint64_t cpuid;
+    uint64_t *tlsptr;
+    struct thread_context_t *tc;
+    void *stack;
+};
+
+struct private_cpu_context_t g_cpu_contexts[SMP_MAX_CPUS];
 
 /* -------------------------------------------------------------------------- */
 /* Helpers                                                                    */
 /* -------------------------------------------------------------------------- */
 
 int64_t
-private_setup_stack(void)
+private_setup_cpu_memory(void)
 {
-    g_stack_size = STACK_SIZE * 2;
+    uint64_t cpuid = 0;
+    uint64_t num_cpus = (uint64_t)platform_num_cpus();
+
+    if (num_cpus == 0 || num_cpus > SMP_MAX_CPUS) {
+        return BF_ERROR_INVALID_ARG;
+    }
+
+    // Allocations aren't guaranteed to be aligned, so leave room to align up
+    g_cpu_region_size = CPU_SLOT_SIZE * num_cpus;
+    g_cpu_mem_size = g_cpu_region_size + STACK_SIZE;
 
-    g_stack = platform_alloc_rw(g_stack_size);
-    if (g_stack == 0) {
+    g_cpu_mem = platform_alloc_rw(g_cpu_mem_size);
+    if (g_cpu_mem == 0) {
         return BF_ERROR_OUT_OF_MEMORY;
     }
 
-    g_stack_top = (uint64_t)g_stack + g_stack_size;
-    g_stack_top = (g_stack_top & ~(STACK_SIZE - 1)) - 1;
+    g_cpu_region = ((uint64_t)g_cpu_mem + STACK_SIZE - 1) & ~(STACK_SIZE - 1);
+    platform_memset((void *)g_cpu_region, 0, g_cpu_region_size);
+
+    for (cpuid = 0; cpuid < num_cpus; cpuid++) {
+        uint64_t *guard = (uint64_t *)(g_cpu_region + cpuid * CPU_SLOT_SIZE + THREAD_LOCAL_STORAGE_SIZE);
+        uint64_t *guard_end = (uint64_t *)(g_cpu_region + cpuid * CPU_SLOT_SIZE + STACK_SIZE);
+
+        for (; guard < guard_end; guard++) {
+            *guard = STACK_GUARD_PATTERN;
+        }
+    }
 
-    platform_memset(g_stack, 0, g_stack_size);
     return BF_SUCCESS;
 }
 
 int64_t
-private_setup_tls(void)
+private_check_stack_guards(void)
 {
-    g_tls_size = THREAD_LOCAL_STORAGE_SIZE * (uint64_t)platform_num_cpus();
+    uint64_t cpuid = 0;
+    uint64_t num_cpus = g_cpu_region_size / CPU_SLOT_SIZE;
 
-    g_tls = platform_alloc_rw(g_tls_size);
-    if (g_tls == 0) {
-        return BF_ERROR_OUT_OF_MEMORY;
+    for (cpuid = 0; cpuid < num_cpus; cpuid++) {
+        uint64_t *guard = (uint64_t *)(g_cpu_region + cpuid * CPU_SLOT_SIZE + THREAD_LOCAL_STORAGE_SIZE);
+        uint64_t *guard_end = (uint64_t *)(g_cpu_region + cpuid * CPU_SLOT_SIZE + STACK_SIZE);
+
+        for (; guard < guard_end; guard++) {
+            if (*guard != STACK_GUARD_PATTERN) {
+                BFALERT("VMM stack overflow on cpu %d\n", (int)cpuid);
+                return BF_ERROR_VMM_CORRUPTED;
+            }
+        }
     }
 
-    platform_memset(g_tls, 0, g_tls_size);
     return BF_SUCCESS;
 }
 
@@ -90,28 +148,61 @@ private_setup_info(void)
 }
 
 int64_t
-private_call_vmm(uintptr_t request, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3)
+private_setup_cpu_contexts(void)
 {
-    int64_t ret = 0;
     int64_t cpuid = 0;
-    int64_t ignored_ret = 0;
-    struct thread_context_t *tc = (struct thread_context_t *)(g_stack_top - sizeof(struct thread_context_t));
+    int64_t num_cpus = platform_num_cpus();
+
+    if (num_cpus > SMP_MAX_CPUS) {
+        return BF_ERROR_INVALID_ARG;
+    }
+
+    for (cpuid = 0; cpuid < num_cpus; cpuid++) {
+        struct private_cpu_context_t *ctx = &g_cpu_contexts[cpuid];
+        uint64_t slot = g_cpu_region + (uint64_t)cpuid * CPU_SLOT_SIZE;
+        uint64_t stack_top = slot + CPU_SLOT_SIZE - 1;
+
+        ctx->cpuid = (uint64_t)cpuid;
+        ctx->tlsptr = (uint64_t *)slot;
+        ctx->tc = (struct thread_context_t *)(stack_top - sizeof(struct thread_context_t));
+        ctx->stack = (void *)(stack_top - sizeof(struct thread_context_t) - 1);
 
-    ignored_ret = bfelf_set_integer_args(&g_info, request, arg1, arg2, arg3);
-    bfignored(ignored_ret);
+        // Every CPU has its own stack, so its thread context never changes
+        ctx->tc->cpuid = ctx->cpuid;
+        ctx->tc->tlsptr = ctx->tlsptr;
+    }
 
-    cpuid = platform_get_current_cpu_num();
+    return BF_SUCCESS;
+}
 
-    tc->cpuid = (uint64_t)cpuid;
-    tc->tlsptr = (uint64_t *)((uint64_t)g_tls + (THREAD_LOCAL_STORAGE_SIZE * (uint64_t)cpuid));
+/*
+ * The bootloader is the only thing running, and never migrates or preempts
+ * itself, so a call only has to store its arguments. They're stored
+ * directly, skipping bfelf_set_integer_args() and the clear after the call:
+ * every call overwrites all four.
+ */
+static inline int64_t
+private_call_vmm_on(struct private_cpu_context_t *ctx,
+    uintptr_t request, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3)
+{
+    g_info.request = request;
+    g_info.arg1 = arg1;
+    g_info.arg2 = arg2;
+    g_info.arg3 = arg3;
 
-    ret = _start_func((void *)(g_stack_top - sizeof(struct thread_context_t) - 1), &g_info);
+    return _start_func(ctx->stack, &g_info);
+}
 
-    ignored_ret = bfelf_set_integer_args(&g_info, 0, 0, 0, 0);
-    bfignored(ignored_ret);
+int64_t
+private_call_vmm(uintptr_t request, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3)
+{
+    return private_call_vmm_on(&g_cpu_contexts[0], request, arg1, arg2, arg3);
+}
 
-    platform_restore_preemption();
-    return ret;
+int64_t
+private_call_vmm_cpu(uint64_t cpuid, uintptr_t request, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3)
+{
+    return private_call_vmm_on(&g_cpu_contexts[cpuid], request, arg1, arg2, arg3);
 }
 
 int64_t
@@ -171,12 +262,68 @@ private_add_md_to_memory_manager(struct bfelf_binary_t *module)
 }
 
 int64_t
-private_add_tss_mdl(void)
+private_add_prelinked_md_to_memory_manager(struct bfelf_binary_t *module)
+{
+    uint64_t s = 0;
+
+    for (s = 0; s < g_prelink.num_segments; s++) {
+
+        int64_t ret = 0;
+
+        uint64_t exec_s = 0;
+        uint64_t exec_e = 0;
+        const struct bfvmm_prelink_segment_t *seg = &g_prelink.segments[s];
+
+        exec_s = (uint64_t)module->exec + seg->offset;
+        exec_e = (uint64_t)module->exec + seg->offset + seg->memsz;
+        exec_s &= ~(BAREFLANK_PAGE_SIZE - 1);
+        exec_e &= ~(BAREFLANK_PAGE_SIZE - 1);
+
+        for (; exec_s <= exec_e; exec_s += BAREFLANK_PAGE_SIZE) {
+            if ((seg->flags & BFVMM_PRELINK_PF_X) != 0) {
+                ret = private_add_raw_md_to_memory_manager(exec_s, MEMORY_TYPE_R | MEMORY_TYPE_E);
+            }
+            else {
+                ret = private_add_raw_md_to_memory_manager(exec_s, MEMORY_TYPE_R | MEMORY_TYPE_W);
+            }
+
+            if (ret != MEMORY_MANAGER_SUCCESS) {
+                return ret;
+            }
+        }
+    }
+
+    return BF_SUCCESS;
+}
+
+int64_t
+private_load_prelinked(void)
+{
+    struct section_info_t *info = &g_info.info[0];
+
+    // The image was relocated on the build host, so everything bfelf_load()
+    // would have computed is already known.
+    info->init_addr = (void *)g_prelink.init;
+    info->fini_addr = (void *)g_prelink.fini;
+    info->init_array_addr = (void *)g_prelink.init_array;
+    info->init_array_size = g_prelink.init_array_size;
+    info->fini_array_addr = (void *)g_prelink.fini_array;
+    info->fini_array_size = g_prelink.fini_array_size;
+    info->eh_frame_addr = (void *)g_prelink.eh_frame;
+    info->eh_frame_size = g_prelink.eh_frame_size;
+    g_info.info_num = 1;
+
+    _start_func = (_start_t)g_prelink.entry;
+    return BF_SUCCESS;
+}
+
+int64_t
+private_add_cpu_memory_mdl(void)
 {
     uint64_t i = 0;
 
-    for (i = 0; i < g_tls_size; i += BAREFLANK_PAGE_SIZE) {
-        int64_t ret = private_add_raw_md_to_memory_manager((uint64_t)g_tls + i, MEMORY_TYPE_R | MEMORY_TYPE_W);
+    for (i = 0; i < g_cpu_region_size; i += BAREFLANK_PAGE_SIZE) {
+        int64_t ret = private_add_raw_md_to_memory_manager(g_cpu_region + i, MEMORY_TYPE_R | MEMORY_TYPE_W);
         if (ret != BF_SUCCESS) {
             return ret;
         }
@@ -191,7 +338,15 @@ private_add_modules_mdl(void)
     int64_t i = 0;
 
     for (i = 0; i < g_num_modules; i++) {
-        int64_t ret = private_add_md_to_memory_manager(&g_modules[i]);
+        int64_t ret = 0;
+
+        if (g_prelinked) {
+            ret = private_add_prelinked_md_to_memory_manager(&g_modules[i]);
+        }
+        else {
+            ret = private_add_md_to_memory_manager(&g_modules[i]);
+        }
+
         if (ret != BF_SUCCESS) {
             return ret;
         }
@@ -217,13 +372,16 @@ common_reset(void)
 
     platform_unload_info(&g_info.platform_info);
 
-    for (i = 0; i < g_num_modules; i++) {
+    // A prelinked image lives at its fixed load address, and was never
+    // allocated by us
+    for (i = 0; i < g_num_modules && !g_prelinked; i++) {
         if (g_modules[i].exec != 0) {
             platform_free_rwe(g_modules[i].exec, g_modules[i].exec_size);
         }
     }
 
     platform_memset(&g_modules, 0, sizeof(g_modules));
+    platform_memset(&g_prelink, 0, sizeof(g_prelink));
     platform_memset(&g_loader, 0, sizeof(struct bfelf_loader_t));
     platform_memset(&g_info, 0, sizeof(struct crt_info_t));
     platform_memset(&g_loader, 0, sizeof(struct bfelf_loader_t));
@@ -231,20 +389,20 @@ common_reset(void)
     _start_func = 0;
 
     g_num_modules = 0;
+    g_prelinked = 0;
     g_num_cpus_started = 0;
     g_vmm_status = VMM_UNLOADED;
 
-    if (g_tls != 0) {
-        platform_free_rw(g_tls, g_tls_size);
+    if (g_cpu_mem != 0) {
+        platform_free_rw(g_cpu_mem, g_cpu_mem_size);
     }
 
-    if (g_stack != 0) {
-        platform_free_rw(g_stack, g_stack_size);
-    }
+    g_cpu_mem = 0;
+    g_cpu_mem_size = 0;
+    g_cpu_region = 0;
+    g_cpu_region_size = 0;
 
-    g_tls = 0;
-    g_stack = 0;
-    g_stack_top = 0;
+    platform_memset(&g_cpu_contexts, 0, sizeof(g_cpu_contexts));
 }
 
 void
@@ -308,6 +466,45 @@ common_add_module(const char *file, uint64_t fsize)
     return BF_SUCCESS;
 }
 
+int64_t
+common_add_prelinked_module(char *exec, uint64_t exec_size,
+    const struct bfvmm_prelink_t *prelink)
+{
+    if (exec == 0 || exec_size == 0 || prelink == 0) {
+        return BF_ERROR_INVALID_ARG;
+    }
+
+    if ((uint64_t)exec != prelink->base) {
+        return BF_ERROR_INVALID_ARG;
+    }
+
+    switch (common_vmm_status()) {
+        case VMM_CORRUPT:
+            return BF_ERROR_VMM_CORRUPTED;
+        case VMM_LOADED:
+            return BF_ERROR_VMM_INVALID_STATE;
+        case VMM_RUNNING:
+            return BF_ERROR_VMM_INVALID_STATE;
+        default:
+            break;
+    }
+
+    if (g_num_modules != 0) {
+        return BF_ERROR_MAX_MODULES_REACHED;
+    }
+
+    g_modules[0].file = exec;
+    g_modules[0].file_size = exec_size;
+    g_modules[0].exec = exec;
+    g_modules[0].exec_size = exec_size;
+
+    platform_memcpy(&g_prelink, prelink, sizeof(g_prelink));
+
+    g_prelinked = 1;
+    g_num_modules = 1;
+    return BF_SUCCESS;
+}
+
 int64_t
 common_load_vmm(void)
 {
@@ -329,12 +526,12 @@ common_load_vmm(void)
         return BF_ERROR_NO_MODULES_ADDED;
     }
 
-    ret = private_setup_stack();
+    ret = private_setup_cpu_memory();
     if (ret != BF_SUCCESS) {
         goto failure;
     }
 
-    ret = private_setup_tls();
+    ret = private_setup_cpu_contexts();
     if (ret != BF_SUCCESS) {
         goto failure;
     }
@@ -344,7 +541,13 @@ common_load_vmm(void)
         goto failure;
     }
 
-    ret = bfelf_load(g_modules, (uint64_t)g_num_modules, (void **)&_start_func, &g_info, &g_loader);
+    if (g_prelinked) {
+        ret = private_load_prelinked();
+    }
+    else {
+        ret = bfelf_load(g_modules, (uint64_t)g_num_modules, (void **)&_start_func, &g_info, &g_loader);
+    }
+
     if (ret != BF_SUCCESS) {
         goto failure;
     }
@@ -359,7 +562,12 @@ common_load_vmm(void)
         goto failure;
     }
 
-    ret = private_add_tss_mdl();
+    ret = private_add_cpu_memory_mdl();
+    if (ret != BF_SUCCESS) {
+        goto failure;
+    }
+
+    ret = private_check_stack_guards();
     if (ret != BF_SUCCESS) {
         goto failure;
     }
@@ -396,6 +604,11 @@ common_unload_vmm(void)
         goto corrupted;
     }
 
+    ret = private_check_stack_guards();
+    if (ret != BF_SUCCESS) {
+        goto corrupted;
+    }
+
 unloaded:
 
     common_reset();
@@ -435,7 +648,7 @@ common_start_vmm(void)
             goto failure;
         }
 
-        ret = private_call_vmm(BF_REQUEST_VMM_INIT, (uint64_t)cpuid, 0, 0);
+        ret = private_call_vmm_cpu((uint64_t)cpuid, BF_REQUEST_VMM_INIT, (uint64_t)cpuid, 0, 0);
         if (ret != BF_SUCCESS) {
             goto failure;
         }
@@ -483,7 +696,7 @@ common_stop_vmm(void)
             goto corrupted;
         }
 
-        ret = private_call_vmm(BF_REQUEST_VMM_FINI, (uint64_t)cpuid, 0, 0);
+        ret = private_call_vmm_cpu((uint64_t)cpuid, BF_REQUEST_VMM_FINI, (uint64_t)cpuid, 0, 0);
         if (ret != BFELF_SUCCESS) {
             goto corrupted;
         }
@@ -32,6 +32,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "pmu.h"
 
 /**
  * Reads the CTRL_EL0 register.
@@ -79,6 +80,8 @@ void __invalidate_cache_line(const void * addr)
 }
 
 
+PMU_REGION(g_pmu_invalidate, "__invalidate_cache_region");
+
 /**
  * Invalides any cache lines that store data relevant to a given regsion.
  */
@@ -87,10 +90,12 @@ void __invalidate_cache_region(const void * addr, size_t length)
     size_t bytes_per_line = __dcache_line_bytes();
     const void * end_addr = addr + length;
 
+    PMU_BEGIN(g_pmu_invalidate);
     while(addr <= end_addr) {
         __invalidate_cache_line(addr);
         addr += bytes_per_line;
     }
+    PMU_END(g_pmu_invalidate);
 }
 
 
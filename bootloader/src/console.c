@@ -0,0 +1,255 @@
+#include "console.h"
+#include "bootloader.h"
+#include "launch_vmm.h"
+#include "memmap.h"
+#include "microlib.h"
+#include <libfdt.h>
+
+#ifndef EARLY_CONSOLE_BASE
+#define EARLY_CONSOLE_BASE         ( 0x70006000UL )
+#endif
+
+#ifndef EARLY_CONSOLE_REG_SHIFT
+#define EARLY_CONSOLE_REG_SHIFT    ( 2U )
+#endif
+
+static const struct console_driver_t *const g_console_drivers[] = {
+    &g_uart_8250, &g_uart_pl011,
+};
+
+// The console in use: the early console until the device tree's is bound
+#if defined(CONSOLE_EARLY_NONE)
+static struct console_t g_console = { NULL };
+#elif defined(CONSOLE_EARLY_PL011)
+static struct console_t g_console = {
+    &g_uart_pl011, (volatile uint8_t *)EARLY_CONSOLE_BASE, 0, 4, 0, 0, 0
+};
+#else
+static struct console_t g_console = {
+    &g_uart_8250, (volatile uint8_t *)EARLY_CONSOLE_BASE, EARLY_CONSOLE_REG_SHIFT, 1, 0, 0, 0
+};
+#endif
+
+void console_write(const char *buf, uint64_t len)
+{
+    const struct console_driver_t *driver = g_console.driver;
+    uint64_t start = 0, i;
+
+    if(!driver)
+        return;
+
+    for(i = 0; i < len; ++i) {
+        if(buf[i] != '\n')
+            continue;
+
+        driver->write(&g_console, buf + start, i - start);
+        driver->write(&g_console, "\r\n", 2);
+        start = i + 1;
+    }
+
+    driver->write(&g_console, buf + start, len - start);
+}
+
+uint64_t console_read(char *buf, uint64_t len)
+{
+    if(!g_console.driver)
+        return 0;
+
+    return g_console.driver->read(&g_console, buf, len);
+}
+
+/**
+ * Parses the baud rate at the start of a console's options (e.g. "115200n8").
+ */
+static uint64_t parse_baud(const char *options, const char *end)
+{
+    uint64_t baud = 0;
+
+    while(options < end && *options >= '0' && *options <= '9')
+        baud = baud * 10 + (uint64_t)(*options++ - '0');
+
+    return baud;
+}
+
+/**
+ * Finds the node /chosen/stdout-path names (a path or an alias, optionally
+ * followed by ':' and options), and the baud rate in its options.
+ */
+static int find_stdout(const void *fdt, uint64_t *baud)
+{
+    const char *path, *options;
+    int chosen, len;
+
+    chosen = fdt_path_offset(fdt, "/chosen");
+    if(chosen < 0)
+        return chosen;
+
+    path = fdt_getprop(fdt, chosen, "stdout-path", &len);
+    if(!path)
+        path = fdt_getprop(fdt, chosen, "linux,stdout-path", &len);
+    if(!path || len < 1)
+        return -FDT_ERR_NOTFOUND;
+
+    options = strchr(path, ':');
+    if(!options)
+        return fdt_path_offset(fdt, path);
+
+    *baud = parse_baud(options + 1, path + len);
+    return fdt_path_offset_namelen(fdt, path, options - path);
+}
+
+/**
+ * Returns the baud rate of the last console= kernel argument that has one
+ * (which is the one Linux makes /dev/console), or 0.
+ */
+static uint64_t find_bootargs_baud(const void *fdt)
+{
+    const char *bootargs, *arg, *end, *comma;
+    uint64_t baud = 0;
+    int chosen, len;
+
+    chosen = fdt_path_offset(fdt, "/chosen");
+    if(chosen < 0)
+        return 0;
+
+    bootargs = fdt_getprop(fdt, chosen, "bootargs", &len);
+    if(!bootargs || len < 1)
+        return 0;
+
+    for(arg = bootargs; arg < bootargs + len && *arg; arg = end) {
+        while(*arg == ' ')
+            ++arg;
+
+        for(end = arg; *end && *end != ' '; ++end)
+            ;
+
+        if(end - arg <= 8 || memcmp(arg, "console=", 8) != 0)
+            continue;
+
+        for(comma = arg + 8; comma < end && *comma != ','; ++comma)
+            ;
+
+        if(comma < end && parse_baud(comma + 1, end))
+            baud = parse_baud(comma + 1, end);
+    }
+
+    return baud;
+}
+
+static uint64_t read_u32(const void *fdt, int node, const char *name, uint64_t def)
+{
+    const fdt32_t *prop;
+    int len;
+
+    prop = fdt_getprop(fdt, node, name, &len);
+    return prop && len >= (int)sizeof(*prop) ? fdt32_to_cpu(*prop) : def;
+}
+
+/**
+ * Returns a UART's input clock in Hz: its clock-frequency, or that of the
+ * fixed-clock its first clock refers to. 0 if neither says.
+ */
+static uint64_t read_clock(const void *fdt, int node)
+{
+    const fdt32_t *clocks;
+    int len, clock;
+
+    if(read_u32(fdt, node, "clock-frequency", 0))
+        return read_u32(fdt, node, "clock-frequency", 0);
+
+    clocks = fdt_getprop(fdt, node, "clocks", &len);
+    if(!clocks || len < (int)sizeof(*clocks))
+        return 0;
+
+    clock = fdt_node_offset_by_phandle(fdt, fdt32_to_cpu(clocks[0]));
+    if(clock < 0 || fdt_node_check_compatible(fdt, clock, "fixed-clock") != 0)
+        return 0;
+
+    return read_u32(fdt, clock, "clock-frequency", 0);
+}
+
+static const struct console_driver_t *find_driver(const void *fdt, int node)
+{
+    const char *const *compatible;
+    uint64_t i;
+
+    for(i = 0; i < sizeof(g_console_drivers) / sizeof(g_console_drivers[0]); ++i) {
+        for(compatible = g_console_drivers[i]->compatible; *compatible; ++compatible) {
+            if(fdt_node_check_compatible(fdt, node, *compatible) == 0)
+                return g_console_drivers[i];
+        }
+    }
+
+    return NULL;
+}
+
+int64_t console_init(const void *fdt)
+{
+    struct console_t console;
+    struct memmap_range_t reg;
+    uint64_t baud = 0;
+    int64_t ret;
+    int node;
+
+    node = find_stdout(fdt, &baud);
+    if(node < 0 || memmap_node_reg(fdt, node, &reg, 1) != 1)
+        return CONSOLE_ERR_NO_STDOUT;
+
+    if(!baud)
+        baud = find_bootargs_baud(fdt);
+
+    console.driver = find_driver(fdt, node);
+    if(!console.driver)
+        return CONSOLE_ERR_UNSUPPORTED;
+
+    console.base = (volatile uint8_t *)reg.start;
+    console.reg_shift = read_u32(fdt, node, "reg-shift", 0);
+    console.reg_io_width = read_u32(fdt, node, "reg-io-width", 1);
+    console.clock = read_clock(fdt, node);
+    console.baud = 0;
+    console.fifo_size = 0;
+
+    // If the baud rate can't be set, carry on at whatever it was
+    ret = console.driver->setup(&console, baud);
+    if(ret == CONSOLE_ERR_BAUD)
+        console.driver->setup(&console, 0);
+
+    g_console = console;
+    return ret;
+}
+
+/**
+ * Moves from the early console to the one the device tree describes. The
+ * boot carries on with the early console if that fails.
+ */
+boot_ret_t init_console()
+{
+    const void *fdt;
+    int64_t ret;
+
+    fdt = find_platform_device_tree(g_boot_image);
+    if(!fdt) {
+        BOOTLOADER_ERROR("no platform device tree to find the console in");
+        return BOOT_CONTINUE;
+    }
+
+    ret = console_init(fdt);
+    if(ret == CONSOLE_ERR_NO_STDOUT || ret == CONSOLE_ERR_UNSUPPORTED) {
+        BOOTLOADER_ERROR("couldn't bind /chosen/stdout-path (%d), keeping the early console", ret);
+        return BOOT_CONTINUE;
+    }
+
+    if(ret == CONSOLE_ERR_BAUD)
+        BOOTLOADER_ERROR("couldn't set the console's baud rate, leaving it as it was");
+
+    if(g_console.baud)
+        BOOTLOADER_INFO("Console: %s at 0x%lx, %lu baud", g_console.driver->name,
+            (uint64_t)g_console.base, g_console.baud);
+    else
+        BOOTLOADER_INFO("Console: %s at 0x%lx", g_console.driver->name,
+            (uint64_t)g_console.base);
+
+    return BOOT_CONTINUE;
+}
+
+BOOT_PRESTART_STAGE(00, "console", init_console, BOOT_STAGE_BOOT_CPU);
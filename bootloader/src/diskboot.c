@@ -0,0 +1,365 @@
+#include "diskboot.h"
+#include "blockdev.h"
+#include "bootloader.h"
+#include "cache.h"
+#include "fat.h"
+#include "launch_vmm.h"
+#include "linux.h"
+#include "microlib.h"
+#include "plan.h"
+#include "prelink.h"
+#include "timer.h"
+#include "virtio_blk.h"
+#include <bfplatform.h>
+#include <libfdt.h>
+
+#ifndef DISK_BOOT_OFFSET
+#define DISK_BOOT_OFFSET           ( 0UL )
+#endif
+
+// The FIT's path, if the partition holds a FAT32 file system
+#ifndef DISK_BOOT_FILE
+#define DISK_BOOT_FILE             "bootloader.fit"
+#endif
+
+// Room for the FIT's tree, and the component data read into it
+#ifndef DISK_FIT_SIZE
+#define DISK_FIT_SIZE              ( 0x40000UL )
+#endif
+
+// Enough of a tree to read its header
+#define DISK_FIT_HEADER            ( 64UL )
+
+#define DISK_PAGE_SIZE             ( 0x1000UL )
+#define DISK_KERNEL_HEADER         ( 64UL )
+
+// A master boot record's partition table
+#define DISK_MBR_SIZE              ( 512U )
+#define DISK_MBR_PARTITIONS        ( 446U )
+#define DISK_MBR_ENTRY_SIZE        ( 16U )
+#define DISK_MBR_NR_ENTRIES        ( 4U )
+#define DISK_MBR_ENTRY_TYPE        ( 4U )
+#define DISK_MBR_ENTRY_LBA         ( 8U )
+#define DISK_MBR_SIGNATURE         ( 510U )
+#define DISK_MBR_TYPE_FAT32        ( 0x0BU )
+#define DISK_MBR_TYPE_FAT32_LBA    ( 0x0CU )
+
+/**
+ * Where the FIT is: on a raw partition, or in a file on a FAT32 one.
+ */
+struct disk_image_t {
+    struct blockdev_t *dev;
+    uint64_t offset;
+
+    struct fat_fs_t fs;
+    struct fat_file_t file;
+    int in_file;
+};
+
+static struct disk_image_t g_disk;
+
+// The FIT position each planned component's data is at
+static uint64_t g_disk_positions[PLAN_MAX_COMPONENTS];
+
+// The FIT is reserved by the plan, so it can't live in the heap (the heap
+// is itself a component of the plan)
+static uint8_t g_disk_fit[DISK_FIT_SIZE] __attribute__((aligned(8)));
+
+/**
+ * Reads len bytes from position pos of the FIT.
+ *
+ * @return 0 on success, or a negative BLOCKDEV_ERR_* or FAT_ERR_* code.
+ */
+static int64_t disk_read(uint64_t pos, void *buf, uint64_t len)
+{
+    if(g_disk.in_file)
+        return fat_read(&g_disk.file, pos, buf, len);
+
+    return blockdev_read_bytes(g_disk.dev, g_disk.offset + pos, buf, len);
+}
+
+/**
+ * Reads a component from the disk to its destination (a plan_read_t).
+ *
+ * @return The number of bytes read, or a negative error code.
+ */
+static int64_t disk_read_component(const struct plan_component_t *c, void *dst)
+{
+    const uint64_t *position = c->source;
+    uint64_t start, us;
+    int64_t ret;
+
+    // Stale lines a previous stage left in the cache would otherwise be
+    // written back over what the device writes
+    __invalidate_cache_region(dst, c->size);
+
+    start = timer_ticks();
+    ret = disk_read(*position, dst, c->size);
+    us = timer_ticks_to_us(timer_ticks() - start);
+
+    if(ret != 0) {
+        BOOTLOADER_ERROR("couldn't read %s from %s (%d)", c->name, g_disk.dev->name, ret);
+        return ret;
+    }
+
+    BOOTLOADER_SUBINFO("%s: %lu KiB in %lu ms", c->name, c->size >> 10, us / 1000);
+    return c->size;
+}
+
+/**
+ * Finds a component's external data: at data-position from the start of
+ * the FIT, or data-offset from the end of its tree.
+ *
+ * @return 0 on success, or -1 if the component's data is in the tree.
+ */
+static int external_data(const void *fit, int node, uint64_t tree_size,
+    uint64_t *position, uint64_t *size)
+{
+    const uint32_t *cell;
+    int len;
+
+    cell = fdt_getprop(fit, node, "data-size", &len);
+    if(!cell || len != sizeof(uint32_t))
+        return -1;
+
+    *size = fdt32_to_cpu(*cell);
+
+    cell = fdt_getprop(fit, node, "data-position", &len);
+    if(cell && len == sizeof(uint32_t)) {
+        *position = fdt32_to_cpu(*cell);
+        return 0;
+    }
+
+    cell = fdt_getprop(fit, node, "data-offset", &len);
+    if(!cell || len != sizeof(uint32_t))
+        return -1;
+
+    *position = ((tree_size + 3) & ~3UL) + fdt32_to_cpu(*cell);
+    return 0;
+}
+
+/**
+ * Describes a component read from the disk to the planner, which picks its
+ * destination. Only the kernel's header is read now.
+ */
+static int64_t plan_disk_component(const void *fit, int node, uint64_t position,
+    uint64_t size, struct plan_component_t *c, uint64_t n)
+{
+    struct bfvmm_prelink_t prelink;
+    struct linux_image_t header;
+    uint8_t raw[DISK_KERNEL_HEADER];
+    const uint32_t *cell;
+    int len;
+
+    if(n >= PLAN_MAX_COMPONENTS)
+        return PLAN_ERR_TOO_MANY;
+
+    g_disk_positions[n] = position;
+
+    memset(c, 0, sizeof(*c));
+    c->name = fdt_get_name(fit, node, NULL);
+    c->image = fit;
+    c->node = node;
+    c->size = size;
+    c->memsz = size;
+    c->align = DISK_PAGE_SIZE;
+    c->read = disk_read_component;
+    c->source = &g_disk_positions[n];
+
+    cell = fdt_getprop(fit, node, "load", &len);
+    if(cell && len == sizeof(uint32_t))
+        c->hint = fdt32_to_cpu(*cell);
+
+    if(strcmp(c->name, "vmm") == 0) {
+        if(get_prelink_information(fit, node, &prelink) == SUCCESS) {
+            c->flags |= PLAN_FIXED;
+            c->hint = prelink.base;
+            c->memsz = max(c->memsz, prelink.memsz);
+        }
+    }
+    else if(strcmp(c->name, "kernel") == 0) {
+        if(disk_read(position, raw, sizeof(raw)) != 0 ||
+           linux_read_image_header(raw, size, &header) != 0) {
+            BOOTLOADER_ERROR("kernel is not a little-endian arm64 Image");
+            return PLAN_ERR_NO_MEMORY;
+        }
+
+        c->align = LINUX_IMAGE_ALIGN;
+        c->offset = header.text_offset;
+        c->memsz = max(c->memsz, header.image_size);
+    }
+
+    BOOTLOADER_SUBINFO("%s: %lu KiB at 0x%lx of the FIT", c->name, size >> 10, position);
+    return 0;
+}
+
+/**
+ * Reads a component the bootloader uses where it is into the tree, as if
+ * it had been built without external data.
+ */
+static int64_t read_into_tree(void *fit, int node, uint64_t position, uint64_t size)
+{
+    void *data;
+    int64_t ret;
+
+    data = platform_alloc_rw(size);
+    if(!data)
+        return PLAN_ERR_NO_MEMORY;
+
+    ret = disk_read(position, data, size);
+    if(ret == 0 && fdt_setprop(fit, node, "data", data, size) != 0) {
+        BOOTLOADER_ERROR("%s (%lu KiB) doesn't fit in the FIT (DISK_FIT_SIZE)",
+            fdt_get_name(fit, node, NULL), size >> 10);
+        ret = PLAN_ERR_NO_MEMORY;
+    }
+
+    platform_free_rw(data, size);
+    return ret;
+}
+
+/**
+ * Returns true if a component can be read straight to its destination.
+ */
+static int reads_directly(const void *fit, int node, const char *name)
+{
+    if(is_compressed(fit, node))
+        return 0;
+
+    return strcmp(name, "vmm") == 0 || strcmp(name, "kernel") == 0 ||
+        strcmp(name, "ramdisk") == 0;
+}
+
+static uint64_t mbr_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+/**
+ * Finds the FIT: DISK_BOOT_FILE on the FAT32 file system at
+ * DISK_BOOT_OFFSET, or on the first FAT32 partition of a partition table
+ * there, or else the raw partition at DISK_BOOT_OFFSET.
+ *
+ * @return 0 on success, or a negative FAT_ERR_* code if the file system
+ *      has no DISK_BOOT_FILE.
+ */
+static int64_t find_fit(struct blockdev_t *dev)
+{
+    uint8_t mbr[DISK_MBR_SIZE];
+    uint64_t offset = DISK_BOOT_OFFSET, i;
+    const uint8_t *entry;
+    int64_t ret;
+
+    g_disk.dev = dev;
+    g_disk.offset = DISK_BOOT_OFFSET;
+    g_disk.in_file = 0;
+
+    ret = fat_mount(&g_disk.fs, dev, offset);
+    if(ret == FAT_ERR_NOT_FAT && blockdev_read_bytes(dev, offset, mbr, sizeof(mbr)) == 0 &&
+       mbr[DISK_MBR_SIGNATURE] == 0x55 && mbr[DISK_MBR_SIGNATURE + 1] == 0xAA) {
+        for(i = 0; i < DISK_MBR_NR_ENTRIES && ret != 0; ++i) {
+            entry = mbr + DISK_MBR_PARTITIONS + i * DISK_MBR_ENTRY_SIZE;
+            if(entry[DISK_MBR_ENTRY_TYPE] != DISK_MBR_TYPE_FAT32 &&
+               entry[DISK_MBR_ENTRY_TYPE] != DISK_MBR_TYPE_FAT32_LBA)
+                continue;
+
+            offset = DISK_BOOT_OFFSET + mbr_le32(entry + DISK_MBR_ENTRY_LBA) * dev->block_size;
+            ret = fat_mount(&g_disk.fs, dev, offset);
+        }
+    }
+
+    if(ret != 0)
+        return 0;
+
+    ret = fat_open(&g_disk.fs, DISK_BOOT_FILE, &g_disk.file);
+    if(ret != 0) {
+        BOOTLOADER_ERROR("no %s on the FAT32 partition at 0x%lx (%d)", DISK_BOOT_FILE, offset, ret);
+        return ret;
+    }
+
+    BOOTLOADER_SUBINFO("%s: %lu KiB in %lu extents of the FAT32 partition at 0x%lx",
+        DISK_BOOT_FILE, g_disk.file.size >> 10, g_disk.file.nr_extents, offset);
+
+    g_disk.in_file = 1;
+    return 0;
+}
+
+const void *disk_boot_image(const void *image)
+{
+    struct plan_component_t planned[PLAN_MAX_COMPONENTS];
+    struct blockdev_t *dev;
+    void *fit = g_disk_fit;
+    uint64_t tree_size, position, size, i, n = 0;
+    const char *name;
+    const void *fdt;
+    int images, node;
+    int64_t ret = 0;
+
+    BOOTLOADER_INFO("Loading the boot image from disk");
+
+    fdt = find_platform_device_tree(image);
+    if(!fdt) {
+        BOOTLOADER_ERROR("no platform device tree to find the disk in");
+        return NULL;
+    }
+
+    dev = virtio_blk_probe(fdt);
+    if(!dev) {
+        BOOTLOADER_ERROR("no virtio block device to boot from");
+        return NULL;
+    }
+
+    if(find_fit(dev) != 0)
+        return NULL;
+
+    // Just the tree for now, with room to read components into
+    if(disk_read(0, fit, DISK_FIT_HEADER) != 0 ||
+       fdt_check_header(fit) != 0 || fdt_totalsize(fit) > DISK_FIT_SIZE ||
+       disk_read(0, fit, fdt_totalsize(fit)) != 0 ||
+       (images = fdt_path_offset(fit, "/images")) < 0) {
+        BOOTLOADER_ERROR("%s doesn't hold a FIT image",
+            g_disk.in_file ? DISK_BOOT_FILE : "the partition at DISK_BOOT_OFFSET");
+        return NULL;
+    }
+
+    tree_size = fdt_totalsize(fit);
+    if(fdt_open_into(fit, fit, DISK_FIT_SIZE) != 0)
+        return NULL;
+
+    // Growing a node only moves the ones after it, so the offsets recorded
+    // for earlier nodes stay valid; NOPs move nothing
+    fdt_for_each_subnode(node, fit, images) {
+        name = fdt_get_name(fit, node, NULL);
+        if(external_data(fit, node, tree_size, &position, &size) != 0)
+            continue;
+
+        if(strcmp(name, "bootloader") == 0) {
+            ret = 0;
+        }
+        else if(reads_directly(fit, node, name)) {
+            ret = plan_disk_component(fit, node, position, size, &planned[n], n);
+            ++n;
+        }
+        else {
+            ret = read_into_tree(fit, node, position, size);
+        }
+
+        if(ret != 0) {
+            BOOTLOADER_ERROR("couldn't load %s from %s (%d)", name, dev->name, ret);
+            return NULL;
+        }
+
+        // Components without data are left to whatever planned them
+        fdt_nop_property(fit, node, "data-size");
+        fdt_nop_property(fit, node, "data-position");
+        fdt_nop_property(fit, node, "data-offset");
+    }
+
+    fdt_pack(fit);
+
+    for(i = 0; i < n; ++i) {
+        if(plan_add(&planned[i]) != 0)
+            return NULL;
+    }
+
+    return fit;
+}
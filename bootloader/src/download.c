@@ -0,0 +1,544 @@
+#include "download.h"
+#include "bootloader.h"
+#include "cache.h"
+#include "console.h"
+#include "launch_vmm.h"
+#include "lz4.h"
+#include "memmap.h"
+#include "microlib.h"
+#include "smp.h"
+#include "timer.h"
+#include <bfplatform.h>
+#include <libfdt.h>
+
+#ifndef DOWNLOAD_ADDR
+#define DOWNLOAD_ADDR              ( 0x90000000UL )
+#endif
+
+// Seconds to wait for the sender before booting the image we were passed
+#ifndef DOWNLOAD_TIMEOUT
+#define DOWNLOAD_TIMEOUT           ( 10UL )
+#endif
+
+// A frame that stops arriving for this long is dropped (and asked for again)
+#define DOWNLOAD_FRAME_TIMEOUT_US  ( 200000UL )
+
+// How often we announce ourselves, and the shortest time between two naks
+// for the same block
+#define DOWNLOAD_RETRY_US          ( 1000000UL )
+
+// The secondary core blocks are decompressed on, if it's online
+#define DOWNLOAD_CPU               ( 1U )
+
+#define DOWNLOAD_STATE_HUNT        ( 0U )
+#define DOWNLOAD_STATE_HEADER      ( 1U )
+#define DOWNLOAD_STATE_PAYLOAD     ( 2U )
+
+#define DOWNLOAD_ERR               ( -1L )
+
+struct download_block_t {
+    uint64_t seq;
+    uint64_t flags;
+    uint64_t len;
+    uint64_t raw_len;
+    uint8_t *data;
+};
+
+/**
+ * The download. Blocks before received have arrived, and blocks before done
+ * have been decompressed into place; block n waits in blocks[n %
+ * DOWNLOAD_WINDOW] in between.
+ */
+struct download_t {
+    uint8_t *image;
+    uint64_t size;
+    uint64_t block_size;
+    uint64_t nr_blocks;
+    int started;
+    int ended;
+    int failed;
+
+    uint64_t received;
+    uint64_t done;
+    int busy;
+    struct download_block_t blocks[DOWNLOAD_WINDOW];
+
+    uint64_t nak_seq;
+    uint64_t nak_ticks;
+    uint64_t wire_bytes;
+
+    // The frame being parsed: pos counts header or payload bytes, and
+    // payload is where the payload goes (NULL to drop it)
+    uint64_t state;
+    uint64_t pos;
+    uint8_t header[DOWNLOAD_HEADER_SIZE];
+    uint8_t start[8];
+    uint8_t *payload;
+    uint32_t crc;
+};
+
+static struct download_t g_download;
+static uint32_t g_crc_table[256];
+
+extern char bootloader_start[];
+extern char bootloader_end[];
+
+static void crc_init(void)
+{
+    uint32_t crc, n, k;
+
+    for(n = 0; n < 256; ++n) {
+        for(crc = n, k = 0; k < 8; ++k)
+            crc = (crc & 1) ? 0xEDB88320U ^ (crc >> 1) : crc >> 1;
+
+        g_crc_table[n] = crc;
+    }
+}
+
+/**
+ * Continues a CRC-32 (as zlib computes it: start from 0xFFFFFFFF, and
+ * invert the result).
+ */
+static uint32_t crc_update(uint32_t crc, const uint8_t *buf, uint64_t len)
+{
+    while(len--)
+        crc = g_crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+static uint64_t read_le32(const uint8_t *field)
+{
+    return field[0] | (field[1] << 8) | (field[2] << 16) | ((uint64_t)field[3] << 24);
+}
+
+static uint64_t elapsed_us(uint64_t since)
+{
+    return timer_ticks_to_us(timer_ticks() - since);
+}
+
+/**
+ * Asks the sender to go back to block seq, unless we just did.
+ */
+static void nak(uint64_t seq)
+{
+    if(seq == g_download.nak_seq && elapsed_us(g_download.nak_ticks) < DOWNLOAD_RETRY_US)
+        return;
+
+    bootloader_printf("bfdl: nak %lu\n", seq);
+    g_download.nak_seq = seq;
+    g_download.nak_ticks = timer_ticks();
+}
+
+static void fail(const char *reason)
+{
+    bootloader_printf("bfdl: error %s\n", reason);
+    g_download.failed = true;
+}
+
+/**
+ * Decompresses (or copies) a block into place. Runs on DOWNLOAD_CPU when
+ * it's online, so the next blocks keep arriving meanwhile.
+ */
+static int64_t place_block(uint64_t arg)
+{
+    const struct download_block_t *block = (const struct download_block_t *)arg;
+    uint8_t *dst = g_download.image + block->seq * g_download.block_size;
+    long size;
+
+    if(block->flags & DOWNLOAD_FLAG_LZ4) {
+        size = lz4_decompress_block(block->data, block->len, dst, block->raw_len);
+    }
+    else {
+        memcpy(dst, block->data, block->len);
+        size = block->len;
+    }
+
+    return size == (long)block->raw_len ? 0 : DOWNLOAD_ERR;
+}
+
+/**
+ * Collects the block being placed, if it's finished, and starts on the next
+ * one that has arrived.
+ */
+static void place_blocks(void)
+{
+    int64_t ret;
+
+    if(g_download.busy) {
+        if(!smp_poll(DOWNLOAD_CPU, &ret))
+            return;
+
+        g_download.busy = false;
+        if(ret != 0) {
+            fail("corrupt LZ4 block");
+            return;
+        }
+
+        g_download.done++;
+        bootloader_printf("bfdl: ack %lu\n", g_download.done);
+    }
+
+    if(g_download.done == g_download.received)
+        return;
+
+    if(smp_call(DOWNLOAD_CPU, place_block,
+            (uint64_t)&g_download.blocks[g_download.done % DOWNLOAD_WINDOW]) == 0) {
+        g_download.busy = true;
+        return;
+    }
+
+    // Without a secondary core, blocks are placed as they arrive
+    if(place_block((uint64_t)&g_download.blocks[g_download.done % DOWNLOAD_WINDOW]) != 0) {
+        fail("corrupt LZ4 block");
+        return;
+    }
+
+    g_download.done++;
+    bootloader_printf("bfdl: ack %lu\n", g_download.done);
+}
+
+static void wait_for_blocks(void)
+{
+    if(g_download.busy)
+        smp_wait(DOWNLOAD_CPU);
+
+    g_download.busy = false;
+}
+
+static int overlaps(uint64_t a, uint64_t a_size, uint64_t b, uint64_t b_size)
+{
+    return a < b + b_size && b < a + a_size;
+}
+
+/**
+ * Returns how far the image we were passed extends: its tree, and for a FIT,
+ * the external data of every component.
+ */
+static uint64_t boot_image_size(const void *image)
+{
+    uint64_t end = fdt_totalsize(image);
+    const void *data;
+    int images, node, size;
+
+    images = fdt_path_offset(image, "/images");
+    if(images < 0)
+        return end;
+
+    fdt_for_each_subnode(node, image, images) {
+        if(get_component_data(image, node, &data, &size) == SUCCESS)
+            end = max(end, (uint64_t)data - (uint64_t)image + size);
+    }
+
+    return end;
+}
+
+/**
+ * Checks that the image fits in DRAM at DOWNLOAD_ADDR, clear of the
+ * bootloader and its heap, reserved memory, and the image we were passed
+ * (which is booted instead if the download fails).
+ */
+static int fits(const void *fdt, uint64_t size)
+{
+    struct memmap_range_t ranges[MEMMAP_MAX_RANGES];
+    uint64_t heap_start, heap_end, heap_used;
+    int i, nr_ranges;
+
+    platform_heap_region(&heap_start, &heap_end, &heap_used);
+    if(overlaps(DOWNLOAD_ADDR, size, (uint64_t)bootloader_start,
+            (uint64_t)(bootloader_end - bootloader_start)) ||
+       overlaps(DOWNLOAD_ADDR, size, heap_start, heap_end - heap_start) ||
+       overlaps(DOWNLOAD_ADDR, size, (uint64_t)g_boot_image,
+            boot_image_size(g_boot_image)))
+        return false;
+
+    if(!fdt)
+        return false;
+
+    nr_ranges = memmap_reserved(fdt, ranges, MEMMAP_MAX_RANGES, false);
+    for(i = 0; i < nr_ranges; ++i) {
+        if(overlaps(DOWNLOAD_ADDR, size, ranges[i].start,
+                ranges[i].end - ranges[i].start))
+            return false;
+    }
+
+    nr_ranges = memmap_banks(fdt, ranges, MEMMAP_MAX_RANGES);
+    for(i = 0; i < nr_ranges; ++i) {
+        if(ranges[i].start <= DOWNLOAD_ADDR && DOWNLOAD_ADDR + size <= ranges[i].end)
+            return true;
+    }
+
+    return false;
+}
+
+static void start(const void *fdt)
+{
+    uint64_t size = read_le32(g_download.start);
+    uint64_t block_size = read_le32(g_download.start + 4);
+
+    wait_for_blocks();
+
+    if(!size || !block_size || block_size > DOWNLOAD_MAX_BLOCK) {
+        fail("bad block size");
+        return;
+    }
+
+    if(!fits(fdt, size)) {
+        fail("image doesn't fit at DOWNLOAD_ADDR, or overlaps memory in use");
+        return;
+    }
+
+    g_download.image = (uint8_t *)DOWNLOAD_ADDR;
+    g_download.size = size;
+    g_download.block_size = block_size;
+    g_download.nr_blocks = (size + block_size - 1) / block_size;
+    g_download.started = true;
+    g_download.ended = false;
+    g_download.received = 0;
+    g_download.done = 0;
+    g_download.wire_bytes = 0;
+
+    // Stale lines a previous stage left in the cache would otherwise be
+    // written back over the image
+    __invalidate_cache_region(g_download.image, size);
+
+    bootloader_printf("bfdl: ack 0\n");
+}
+
+/**
+ * Works out where a frame's payload goes once its header has arrived.
+ */
+static void start_payload(void)
+{
+    uint64_t type = g_download.header[4];
+    uint64_t seq = read_le32(g_download.header + 8);
+    uint64_t len = read_le32(g_download.header + 12);
+
+    g_download.crc = crc_update(0xFFFFFFFFU, g_download.header, 20);
+    g_download.pos = 0;
+    g_download.payload = NULL;
+
+    // A corrupt length would have us swallow the frames after it
+    if(len > DOWNLOAD_MAX_BLOCK) {
+        g_download.state = DOWNLOAD_STATE_HUNT;
+        nak(g_download.received);
+        return;
+    }
+
+    if(type == DOWNLOAD_FRAME_START && len == sizeof(g_download.start))
+        g_download.payload = g_download.start;
+
+    if(type == DOWNLOAD_FRAME_DATA && g_download.started && len &&
+       seq == g_download.received && seq < g_download.done + DOWNLOAD_WINDOW)
+        g_download.payload = g_download.blocks[seq % DOWNLOAD_WINDOW].data;
+
+    g_download.state = DOWNLOAD_STATE_PAYLOAD;
+}
+
+static void end_frame(const void *fdt)
+{
+    struct download_block_t *block;
+    uint64_t type = g_download.header[4];
+    uint64_t seq = read_le32(g_download.header + 8);
+    uint64_t len = read_le32(g_download.header + 12);
+    uint64_t raw_len = read_le32(g_download.header + 16);
+    uint64_t expected;
+
+    g_download.state = DOWNLOAD_STATE_HUNT;
+    g_download.pos = 0;
+
+    if(!g_download.payload && len) {
+        // Blocks we already have are acknowledged again, in case the ack
+        // was lost; ones past a gap mean blocks went missing
+        if(type == DOWNLOAD_FRAME_DATA && seq < g_download.received)
+            bootloader_printf("bfdl: ack %lu\n", g_download.done);
+        else if(type == DOWNLOAD_FRAME_DATA && seq > g_download.received)
+            nak(g_download.received);
+        return;
+    }
+
+    if((g_download.crc ^ 0xFFFFFFFFU) != read_le32(g_download.header + 20)) {
+        nak(g_download.received);
+        return;
+    }
+
+    if(type == DOWNLOAD_FRAME_START) {
+        if(g_download.payload == g_download.start)
+            start(fdt);
+        return;
+    }
+
+    if(!g_download.started)
+        return;
+
+    if(type == DOWNLOAD_FRAME_END) {
+        if(seq != g_download.nr_blocks)
+            fail("END doesn't match the number of blocks");
+
+        g_download.ended = true;
+        return;
+    }
+
+    if(type != DOWNLOAD_FRAME_DATA)
+        return;
+
+    expected = min(g_download.block_size, g_download.size - seq * g_download.block_size);
+    if(seq >= g_download.nr_blocks || raw_len != expected ||
+       (!(g_download.header[5] & DOWNLOAD_FLAG_LZ4) && len != raw_len)) {
+        fail("bad block length");
+        return;
+    }
+
+    block = &g_download.blocks[seq % DOWNLOAD_WINDOW];
+    block->seq = seq;
+    block->flags = g_download.header[5];
+    block->len = len;
+    block->raw_len = raw_len;
+
+    g_download.received++;
+    g_download.wire_bytes += len;
+}
+
+/**
+ * Feeds received bytes to the frame parser, which hunts for the magic
+ * number to resynchronise after noise or a dropped byte.
+ */
+static void receive(const void *fdt, const uint8_t *buf, uint64_t len)
+{
+    uint64_t magic = DOWNLOAD_MAGIC;
+    uint8_t byte;
+
+    while(len-- && !g_download.failed) {
+        byte = *buf++;
+
+        switch(g_download.state) {
+            case DOWNLOAD_STATE_HUNT:
+                if(byte == ((magic >> (8 * g_download.pos)) & 0xFF))
+                    g_download.header[g_download.pos++] = byte;
+                else
+                    g_download.pos = byte == (magic & 0xFF) ? 1 : 0;
+
+                if(g_download.pos == 4)
+                    g_download.state = DOWNLOAD_STATE_HEADER;
+                break;
+
+            case DOWNLOAD_STATE_HEADER:
+                g_download.header[g_download.pos++] = byte;
+                if(g_download.pos == DOWNLOAD_HEADER_SIZE)
+                    start_payload();
+                break;
+
+            default:
+                if(g_download.payload) {
+                    g_download.payload[g_download.pos] = byte;
+                    g_download.crc = g_crc_table[(g_download.crc ^ byte) & 0xFF] ^
+                        (g_download.crc >> 8);
+                }
+                g_download.pos++;
+                break;
+        }
+
+        if(g_download.state == DOWNLOAD_STATE_PAYLOAD &&
+           g_download.pos == read_le32(g_download.header + 12))
+            end_frame(fdt);
+    }
+}
+
+/**
+ * Runs the protocol until the image is in place, the download fails, or
+ * nothing starts within DOWNLOAD_TIMEOUT seconds.
+ */
+static int64_t run(const void *fdt)
+{
+    uint64_t begin = timer_ticks(), last_byte = 0, last_ready = 0;
+    uint8_t buf[64];
+    uint64_t n;
+
+    while(!g_download.failed) {
+        n = console_read((char *)buf, sizeof(buf));
+        if(n) {
+            receive(fdt, buf, n);
+            last_byte = timer_ticks();
+        }
+        else if(g_download.state != DOWNLOAD_STATE_HUNT &&
+                elapsed_us(last_byte) > DOWNLOAD_FRAME_TIMEOUT_US) {
+            g_download.state = DOWNLOAD_STATE_HUNT;
+            g_download.pos = 0;
+            nak(g_download.received);
+        }
+        else if(g_download.started && elapsed_us(last_byte) > DOWNLOAD_TIMEOUT * 1000000UL) {
+            fail("timed out");
+            break;
+        }
+
+        place_blocks();
+
+        if(g_download.ended && g_download.done == g_download.nr_blocks) {
+            bootloader_printf("bfdl: done\n");
+            return 0;
+        }
+
+        if(!g_download.started && (!last_ready || elapsed_us(last_ready) > DOWNLOAD_RETRY_US)) {
+            if(elapsed_us(begin) > DOWNLOAD_TIMEOUT * 1000000UL)
+                return DOWNLOAD_ERR;
+
+            bootloader_printf("bfdl: ready %u %u\n", DOWNLOAD_WINDOW, DOWNLOAD_MAX_BLOCK);
+            last_ready = timer_ticks();
+        }
+    }
+
+    wait_for_blocks();
+    return DOWNLOAD_ERR;
+}
+
+const void *download_boot_image(const void *image)
+{
+    const void *fdt = find_platform_device_tree(image);
+    uint64_t begin, us, i;
+    uint8_t *slots;
+    int64_t ret;
+
+    if(!timer_frequency()) {
+        BOOTLOADER_ERROR("download: the generic timer's frequency isn't set");
+        return NULL;
+    }
+
+    slots = platform_alloc_rw(DOWNLOAD_WINDOW * DOWNLOAD_MAX_BLOCK);
+    if(!slots) {
+        BOOTLOADER_ERROR("download: couldn't allocate receive buffers");
+        return NULL;
+    }
+
+    BOOTLOADER_INFO("Waiting %lu s for scripts/tools/bfsend.py", DOWNLOAD_TIMEOUT);
+
+    memset(&g_download, 0, sizeof(g_download));
+    for(i = 0; i < DOWNLOAD_WINDOW; ++i)
+        g_download.blocks[i].data = slots + i * DOWNLOAD_MAX_BLOCK;
+
+    crc_init();
+
+    begin = timer_ticks();
+    ret = run(fdt);
+    us = timer_ticks_to_us(timer_ticks() - begin);
+
+    platform_free_rw(slots, DOWNLOAD_WINDOW * DOWNLOAD_MAX_BLOCK);
+
+    if(ret != 0) {
+        if(g_download.started)
+            BOOTLOADER_ERROR("download failed, booting the image we were passed");
+        else
+            BOOTLOADER_SUBINFO("nothing was sent, booting the image we were passed");
+        return NULL;
+    }
+
+    BOOTLOADER_SUBINFO("received %lu KiB (%lu KiB sent) in %lu ms", g_download.size >> 10,
+        g_download.wire_bytes >> 10, us / 1000);
+
+    if(ensure_image_is_accessible(g_download.image) != SUCCESS ||
+       fdt_path_offset(g_download.image, "/images") < 0) {
+        BOOTLOADER_ERROR("the downloaded image isn't a FIT image");
+        return NULL;
+    }
+
+    return g_download.image;
+}
@@ -0,0 +1,179 @@
+#include "el2.h"
+#include "microlib.h"
+#include "pmu.h"
+#include "regs.h"
+
+#define HCR_EL2_RW              ( 1UL << 31 )
+
+// RES1 bits, with FP/SIMD (TFP), SVE (TZ), trace (TTA) and CPACR (TCPAC)
+// accesses left untrapped
+#define CPTR_EL2_NO_TRAPS       ( 0x32FFUL )
+
+// EL1 and EL0 may use the physical counter (EL1PCTEN) and timer (EL1PCEN)
+#define CNTHCTL_EL2_NO_TRAPS    ( 0x3UL )
+
+// RES1 bits, MMU and data cache off, instruction cache on, little endian
+#define SCTLR_EL2_DEFAULT       ( 0x30C51830UL )
+
+#define PMCR_EL0_N_SHIFT        ( 11 )
+#define PMCR_EL0_N_MASK         ( 0x1FUL )
+
+#define EL2_ACCESSORS(reg)                                      \
+    static uint64_t el2_read_##reg(void)                        \
+    {                                                           \
+        uint64_t value;                                         \
+        READ_SYSREG_64(reg, value);                             \
+        return value;                                           \
+    }                                                           \
+    static void el2_write_##reg(uint64_t value)                 \
+    {                                                           \
+        WRITE_SYSREG_64(reg, value);                            \
+    }
+
+#define EL2_REG(reg, reg_value) \
+    { #reg, reg_value, NULL, el2_read_##reg, el2_write_##reg }
+#define EL2_REG_COMPUTED(reg, fn) \
+    { #reg, 0, fn, el2_read_##reg, el2_write_##reg }
+
+EL2_ACCESSORS(hcr_el2)
+EL2_ACCESSORS(cptr_el2)
+EL2_ACCESSORS(cnthctl_el2)
+EL2_ACCESSORS(cntvoff_el2)
+EL2_ACCESSORS(mdcr_el2)
+EL2_ACCESSORS(hstr_el2)
+EL2_ACCESSORS(vpidr_el2)
+EL2_ACCESSORS(vmpidr_el2)
+EL2_ACCESSORS(sctlr_el2)
+EL2_ACCESSORS(vbar_el2)
+
+// The EL2 exception vectors (see vectors.s)
+extern char _el2_vectors[];
+
+static uint64_t el2_vectors(void)
+{
+    return (uint64_t)_el2_vectors;
+}
+
+static uint64_t el2_midr(void)
+{
+    uint64_t value;
+    READ_SYSREG_64(midr_el1, value);
+    return value;
+}
+
+static uint64_t el2_mpidr(void)
+{
+    uint64_t value;
+    READ_SYSREG_64(mpidr_el1, value);
+    return value;
+}
+
+/**
+ * Hands every PMU counter to EL1 (HPMN = PMCR_EL0.N), with no PMU, debug
+ * or trace traps.
+ */
+static uint64_t el2_mdcr(void)
+{
+    uint64_t pmcr;
+    READ_SYSREG_64(pmcr_el0, pmcr);
+    return (pmcr >> PMCR_EL0_N_SHIFT) & PMCR_EL0_N_MASK;
+}
+
+/**
+ * Trap-minimal: nothing traps to EL2 other than what the VMM enables
+ * itself, and EL1 sees the real identification registers.
+ */
+static const struct el2_reg_t g_el2_minimal[] = {
+    EL2_REG(sctlr_el2, SCTLR_EL2_DEFAULT),
+    EL2_REG(hcr_el2, HCR_EL2_RW),
+    EL2_REG(cptr_el2, CPTR_EL2_NO_TRAPS),
+    EL2_REG(hstr_el2, 0),
+    EL2_REG(cnthctl_el2, CNTHCTL_EL2_NO_TRAPS),
+    EL2_REG(cntvoff_el2, 0),
+    EL2_REG_COMPUTED(mdcr_el2, el2_mdcr),
+    EL2_REG_COMPUTED(vpidr_el2, el2_midr),
+    EL2_REG_COMPUTED(vmpidr_el2, el2_mpidr),
+    EL2_REG_COMPUTED(vbar_el2, el2_vectors),
+};
+
+/**
+ * Firmware: only selects AArch64 for EL1 and installs our exception vectors,
+ * leaving everything else as the previous stage left it.
+ */
+static const struct el2_reg_t g_el2_firmware[] = {
+    EL2_REG(hcr_el2, HCR_EL2_RW),
+    EL2_REG_COMPUTED(vbar_el2, el2_vectors),
+};
+
+#define EL2_PROFILE_ENTRY(profile_name, table) \
+    { profile_name, table, sizeof(table) / sizeof(table[0]) }
+
+#if defined(EL2_PROFILE_FIRMWARE)
+static const struct el2_profile_t g_el2_profile =
+    EL2_PROFILE_ENTRY("firmware", g_el2_firmware);
+#else
+static const struct el2_profile_t g_el2_profile =
+    EL2_PROFILE_ENTRY("minimal", g_el2_minimal);
+#endif
+
+const struct el2_profile_t *el2_profile(void)
+{
+    return &g_el2_profile;
+}
+
+void el2_apply_profile(int verbose)
+{
+    const struct el2_reg_t *reg;
+    uint64_t i, old, value;
+
+    for(i = 0; i < g_el2_profile.nr_regs; ++i) {
+        reg = &g_el2_profile.regs[i];
+        value = reg->compute ? reg->compute() : reg->value;
+
+        old = reg->read();
+        reg->write(value);
+
+        if(verbose)
+            BOOTLOADER_SUBINFO("%s = 0x%lx (was 0x%lx)", reg->name, value, old);
+    }
+
+    asm volatile("isb" ::: "memory");
+}
+
+static const char *const g_el2_vector_names[] = {
+    "synchronous (SP_EL0)", "IRQ (SP_EL0)", "FIQ (SP_EL0)", "SError (SP_EL0)",
+    "synchronous", "IRQ", "FIQ", "SError",
+    "synchronous (from AArch64)", "IRQ (from AArch64)", "FIQ (from AArch64)",
+    "SError (from AArch64)",
+    "synchronous (from AArch32)", "IRQ (from AArch32)", "FIQ (from AArch32)",
+    "SError (from AArch32)",
+};
+
+void el2_unexpected_exception(uint64_t vector, uint64_t esr, uint64_t elr, uint64_t far)
+{
+    BOOTLOADER_ERROR("unexpected %s exception at EL2: ESR 0x%lx, ELR 0x%lx, FAR 0x%lx",
+        g_el2_vector_names[vector & 0xF], esr, elr, far);
+
+    while(1)
+        asm volatile("wfe");
+}
+
+/**
+ * Configures EL2 on the boot core from the selected profile (secondary
+ * cores apply it themselves as they come online, see smp.c), and starts the
+ * PMU counters if they're enabled.
+ */
+boot_ret_t init_el2()
+{
+    BOOTLOADER_INFO("Applying EL2 profile \"%s\"", g_el2_profile.name);
+    el2_apply_profile(true);
+
+#ifdef BOOTLOADER_PMU
+    pmu_init();
+#endif
+
+    return BOOT_CONTINUE;
+}
+
+// Runs first, so nothing drops to EL1 with the previous stage's settings
+BOOT_PRESTART_STAGE(00, "el2", init_el2, BOOT_STAGE_BOOT_CPU);
@@ -0,0 +1,430 @@
+#include "fat.h"
+#include "microlib.h"
+#include <bfplatform.h>
+
+// Boot sector (BIOS parameter block) fields
+#define FAT_BPB_BYTES_PER_SECTOR   ( 11U )
+#define FAT_BPB_SECTORS_PER_CLUS   ( 13U )
+#define FAT_BPB_RESERVED_SECTORS   ( 14U )
+#define FAT_BPB_NUM_FATS           ( 16U )
+#define FAT_BPB_ROOT_ENTRIES       ( 17U )
+#define FAT_BPB_TOTAL_SECTORS_16   ( 19U )
+#define FAT_BPB_FAT_SIZE_16        ( 22U )
+#define FAT_BPB_TOTAL_SECTORS_32   ( 32U )
+#define FAT_BPB_FAT_SIZE_32        ( 36U )
+#define FAT_BPB_ROOT_CLUSTER       ( 44U )
+#define FAT_BPB_SIGNATURE          ( 510U )
+
+#define FAT_BOOT_SECTOR_SIZE       ( 512U )
+#define FAT_BOOT_SIGNATURE         ( 0xAA55U )
+
+// Directory entry fields
+#define FAT_DIRENT_SIZE            ( 32U )
+#define FAT_DIRENT_EXT             ( 8U )
+#define FAT_DIRENT_ATTR            ( 11U )
+#define FAT_DIRENT_LFN_CHECKSUM    ( 13U )
+#define FAT_DIRENT_CLUSTER_HI      ( 20U )
+#define FAT_DIRENT_CLUSTER_LO      ( 26U )
+#define FAT_DIRENT_FILE_SIZE       ( 28U )
+
+#define FAT_DIRENT_END             ( 0x00U )
+#define FAT_DIRENT_E5              ( 0x05U )
+#define FAT_DIRENT_FREE            ( 0xE5U )
+
+#define FAT_ATTR_VOLUME_ID         ( 0x08U )
+#define FAT_ATTR_DIRECTORY         ( 0x10U )
+#define FAT_ATTR_LFN               ( 0x0FU )
+
+// Long names are stored 13 UCS-2 characters to an entry, last part first
+#define FAT_LFN_LAST               ( 0x40U )
+#define FAT_LFN_SEQ_MASK           ( 0x1FU )
+#define FAT_LFN_CHARS              ( 13U )
+#define FAT_LFN_MAX_ENTRIES        ( 20U )
+
+#define FAT_ENTRY_MASK             ( 0x0FFFFFFFU )
+#define FAT_ENTRY_END              ( 0x0FFFFFF8U )
+#define FAT_FIRST_CLUSTER          ( 2U )
+
+// Walk a directory's chain to its end, rather than to a file's size
+#define FAT_WHOLE_CHAIN            ( ~0UL )
+
+// The FAT is read this much at a time while chains are walked
+#define FAT_WINDOW_SIZE            ( 0x4000U )
+
+struct fat_dirent_t {
+    uint32_t cluster;
+    uint64_t size;
+    int directory;
+};
+
+/**
+ * The long name the entries before a short entry spell out, if they're
+ * intact.
+ */
+struct fat_lfn_t {
+    char name[FAT_LFN_MAX_ENTRIES * FAT_LFN_CHARS + 1];
+    uint8_t checksum;
+    uint64_t next_seq;
+    int valid;
+};
+
+static uint8_t g_fat_window[FAT_WINDOW_SIZE] __attribute__((aligned(64)));
+static const struct fat_fs_t *g_fat_window_fs;
+static uint64_t g_fat_window_start;
+
+// On-disk fields are little-endian and often unaligned, which the MMU being
+// off (so all memory being Device memory) doesn't allow
+static uint32_t le16(const uint8_t *p)
+{
+    return p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+    return le16(p) | (le16(p + 2) << 16);
+}
+
+static char fat_tolower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+int64_t fat_mount(struct fat_fs_t *fs, struct blockdev_t *dev, uint64_t offset)
+{
+    uint8_t bs[FAT_BOOT_SECTOR_SIZE];
+    uint64_t bps, spc, total;
+
+    if(blockdev_read_bytes(dev, offset, bs, sizeof(bs)) != 0)
+        return FAT_ERR_IO;
+
+    bps = le16(bs + FAT_BPB_BYTES_PER_SECTOR);
+    spc = bs[FAT_BPB_SECTORS_PER_CLUS];
+    total = le16(bs + FAT_BPB_TOTAL_SECTORS_16);
+    if(!total)
+        total = le32(bs + FAT_BPB_TOTAL_SECTORS_32);
+
+    // FAT12 and FAT16 have a fixed size root directory and 16 bit FAT sizes
+    if(le16(bs + FAT_BPB_SIGNATURE) != FAT_BOOT_SIGNATURE ||
+       bps < FAT_BOOT_SECTOR_SIZE || bps > BLOCKDEV_MAX_BLOCK_SIZE || (bps & (bps - 1)) ||
+       spc == 0 || (spc & (spc - 1)) ||
+       le16(bs + FAT_BPB_RESERVED_SECTORS) == 0 || bs[FAT_BPB_NUM_FATS] == 0 ||
+       le16(bs + FAT_BPB_ROOT_ENTRIES) != 0 || le16(bs + FAT_BPB_FAT_SIZE_16) != 0 ||
+       le32(bs + FAT_BPB_FAT_SIZE_32) == 0)
+        return FAT_ERR_NOT_FAT;
+
+    fs->dev = dev;
+    fs->fat_start = offset + le16(bs + FAT_BPB_RESERVED_SECTORS) * bps;
+    fs->fat_size = le32(bs + FAT_BPB_FAT_SIZE_32) * bps;
+    fs->data_start = fs->fat_start + bs[FAT_BPB_NUM_FATS] * fs->fat_size;
+    fs->cluster_size = spc * bps;
+    fs->root_cluster = le32(bs + FAT_BPB_ROOT_CLUSTER);
+
+    if(total * bps <= fs->data_start - offset)
+        return FAT_ERR_CORRUPT;
+
+    // Clusters past the end of either the partition or the FAT don't exist
+    fs->nr_clusters = (total * bps - (fs->data_start - offset)) / fs->cluster_size;
+    fs->nr_clusters = min(fs->nr_clusters, fs->fat_size / 4 - FAT_FIRST_CLUSTER);
+
+    if(fs->root_cluster < FAT_FIRST_CLUSTER ||
+       fs->root_cluster >= fs->nr_clusters + FAT_FIRST_CLUSTER)
+        return FAT_ERR_CORRUPT;
+
+    return 0;
+}
+
+/**
+ * Looks up the cluster after cluster in its chain, through a window of the
+ * FAT that's only moved when a chain leaves it.
+ */
+static int64_t fat_next(const struct fat_fs_t *fs, uint32_t cluster, uint32_t *next)
+{
+    uint64_t pos = (uint64_t)cluster * 4, start = pos - pos % FAT_WINDOW_SIZE;
+
+    if(g_fat_window_fs != fs || g_fat_window_start != start) {
+        g_fat_window_fs = NULL;
+        if(blockdev_read_bytes(fs->dev, fs->fat_start + start, g_fat_window,
+            min(FAT_WINDOW_SIZE, fs->fat_size - start)) != 0)
+            return FAT_ERR_IO;
+
+        g_fat_window_fs = fs;
+        g_fat_window_start = start;
+    }
+
+    *next = le32(g_fat_window + pos - start) & FAT_ENTRY_MASK;
+    return 0;
+}
+
+/**
+ * Walks a cluster chain until it ends, or covers size bytes, merging runs
+ * of adjacent clusters into extents.
+ */
+static int64_t resolve_chain(struct fat_fs_t *fs, uint32_t cluster, uint64_t size,
+    struct fat_file_t *file)
+{
+    struct fat_extent_t *extent = NULL;
+    uint64_t covered = 0, offset;
+    uint32_t next;
+
+    file->fs = fs;
+    file->nr_extents = 0;
+
+    while(covered < size) {
+        // A chain longer than the file system has clusters is a loop
+        if(cluster < FAT_FIRST_CLUSTER || cluster >= fs->nr_clusters + FAT_FIRST_CLUSTER ||
+           covered / fs->cluster_size >= fs->nr_clusters)
+            return FAT_ERR_CORRUPT;
+
+        offset = fs->data_start + (uint64_t)(cluster - FAT_FIRST_CLUSTER) * fs->cluster_size;
+        if(extent && extent->offset + extent->size == offset) {
+            extent->size += fs->cluster_size;
+        }
+        else {
+            if(file->nr_extents == FAT_MAX_EXTENTS)
+                return FAT_ERR_FRAGMENTED;
+
+            extent = &file->extents[file->nr_extents++];
+            extent->offset = offset;
+            extent->size = fs->cluster_size;
+        }
+
+        covered += fs->cluster_size;
+        if(covered >= size)
+            break;
+
+        if(fat_next(fs, cluster, &next) != 0)
+            return FAT_ERR_IO;
+        if(next >= FAT_ENTRY_END)
+            break;
+
+        cluster = next;
+    }
+
+    if(size != FAT_WHOLE_CHAIN && covered < size)
+        return FAT_ERR_CORRUPT;
+
+    file->size = min(size, covered);
+    return 0;
+}
+
+int64_t fat_read(const struct fat_file_t *file, uint64_t pos, void *buf, uint64_t len)
+{
+    const struct fat_extent_t *extent;
+    uint8_t *dst = buf;
+    uint64_t i, n;
+
+    if(pos + len < pos || pos + len > file->size)
+        return FAT_ERR_RANGE;
+
+    for(i = 0; i < file->nr_extents && len; ++i) {
+        extent = &file->extents[i];
+        if(pos >= extent->size) {
+            pos -= extent->size;
+            continue;
+        }
+
+        n = min(len, extent->size - pos);
+        if(blockdev_read_bytes(file->fs->dev, extent->offset + pos, dst, n) != 0)
+            return FAT_ERR_IO;
+
+        dst += n;
+        len -= n;
+        pos = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Adds a long name entry's part of the name, or forgets the name if the
+ * entry isn't the part expected next.
+ */
+static void add_lfn_entry(struct fat_lfn_t *lfn, const uint8_t *e)
+{
+    static const uint8_t chars[FAT_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    uint64_t seq = e[0] & FAT_LFN_SEQ_MASK, i, c;
+
+    if(e[0] & FAT_LFN_LAST) {
+        lfn->valid = seq > 0 && seq <= FAT_LFN_MAX_ENTRIES;
+        lfn->checksum = e[FAT_DIRENT_LFN_CHECKSUM];
+        lfn->next_seq = seq;
+        if(lfn->valid)
+            lfn->name[seq * FAT_LFN_CHARS] = '\0';
+    }
+
+    if(!lfn->valid || seq != lfn->next_seq || e[FAT_DIRENT_LFN_CHECKSUM] != lfn->checksum) {
+        lfn->valid = 0;
+        return;
+    }
+
+    // Characters past the terminator are padding; anything outside ASCII
+    // is kept as a character no path can match
+    for(i = 0; i < FAT_LFN_CHARS; ++i) {
+        c = le16(e + chars[i]);
+        lfn->name[(seq - 1) * FAT_LFN_CHARS + i] = c < 0x80 ? (char)c : '\x7f';
+        if(c == 0)
+            break;
+    }
+
+    lfn->next_seq = seq - 1;
+}
+
+static uint8_t short_name_checksum(const uint8_t *e)
+{
+    uint8_t sum = 0;
+    uint64_t i;
+
+    for(i = 0; i < FAT_DIRENT_ATTR; ++i)
+        sum = ((sum & 1) << 7) + (sum >> 1) + e[i];
+
+    return sum;
+}
+
+/**
+ * Formats an 8.3 entry's name as "NAME.EXT".
+ */
+static void short_name(const uint8_t *e, char *name)
+{
+    uint64_t i, n = 0;
+
+    for(i = 0; i < FAT_DIRENT_EXT && e[i] != ' '; ++i)
+        name[n++] = (i == 0 && e[i] == FAT_DIRENT_E5) ? (char)FAT_DIRENT_FREE : e[i];
+
+    if(e[FAT_DIRENT_EXT] != ' ') {
+        name[n++] = '.';
+        for(i = FAT_DIRENT_EXT; i < FAT_DIRENT_ATTR && e[i] != ' '; ++i)
+            name[n++] = e[i];
+    }
+
+    name[n] = '\0';
+}
+
+static int name_matches(const char *name, uint64_t len, const char *entry)
+{
+    uint64_t i;
+
+    for(i = 0; i < len; ++i) {
+        if(fat_tolower(name[i]) != fat_tolower(entry[i]))
+            return 0;
+    }
+
+    return entry[len] == '\0';
+}
+
+/**
+ * Looks for name in a block of directory entries, carrying long names
+ * over from the block before.
+ *
+ * @return 0 if found, FAT_ERR_NOT_FOUND at the end of the directory, or 1
+ *      if the directory goes on.
+ */
+static int64_t scan_entries(struct fat_fs_t *fs, const uint8_t *entries, uint64_t size,
+    struct fat_lfn_t *lfn, const char *name, uint64_t len, struct fat_dirent_t *found)
+{
+    char sfn[FAT_DIRENT_ATTR + 2];
+    const uint8_t *e;
+    uint64_t i;
+
+    for(i = 0; i < size; i += FAT_DIRENT_SIZE) {
+        e = entries + i;
+
+        if(e[0] == FAT_DIRENT_END)
+            return FAT_ERR_NOT_FOUND;
+        if(e[0] == FAT_DIRENT_FREE) {
+            lfn->valid = 0;
+            continue;
+        }
+        if(e[FAT_DIRENT_ATTR] == FAT_ATTR_LFN) {
+            add_lfn_entry(lfn, e);
+            continue;
+        }
+        if(e[FAT_DIRENT_ATTR] & FAT_ATTR_VOLUME_ID) {
+            lfn->valid = 0;
+            continue;
+        }
+
+        short_name(e, sfn);
+        if(!name_matches(name, len, sfn) &&
+           !(lfn->valid && lfn->next_seq == 0 && lfn->checksum == short_name_checksum(e) &&
+             name_matches(name, len, lfn->name))) {
+            lfn->valid = 0;
+            continue;
+        }
+
+        found->cluster = (le16(e + FAT_DIRENT_CLUSTER_HI) << 16) | le16(e + FAT_DIRENT_CLUSTER_LO);
+        found->size = le32(e + FAT_DIRENT_FILE_SIZE);
+        found->directory = !!(e[FAT_DIRENT_ATTR] & FAT_ATTR_DIRECTORY);
+
+        // ".." in a subdirectory of the root
+        if(found->directory && found->cluster == 0)
+            found->cluster = fs->root_cluster;
+
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Finds an entry of a directory, a cluster at a time.
+ */
+static int64_t find_entry(struct fat_fs_t *fs, uint32_t cluster, const char *name,
+    uint64_t len, struct fat_dirent_t *found)
+{
+    struct fat_file_t dir;
+    struct fat_lfn_t lfn;
+    uint64_t pos;
+    uint8_t *buf;
+    int64_t ret;
+
+    if((ret = resolve_chain(fs, cluster, FAT_WHOLE_CHAIN, &dir)) != 0)
+        return ret;
+
+    buf = platform_alloc_rw(fs->cluster_size);
+    if(!buf)
+        return FAT_ERR_IO;
+
+    lfn.valid = 0;
+    ret = 1;
+
+    for(pos = 0; pos < dir.size && ret == 1; pos += fs->cluster_size) {
+        if(fat_read(&dir, pos, buf, fs->cluster_size) != 0)
+            ret = FAT_ERR_IO;
+        else
+            ret = scan_entries(fs, buf, fs->cluster_size, &lfn, name, len, found);
+    }
+
+    platform_free_rw(buf, fs->cluster_size);
+    return ret == 1 ? FAT_ERR_NOT_FOUND : ret;
+}
+
+int64_t fat_open(struct fat_fs_t *fs, const char *path, struct fat_file_t *file)
+{
+    struct fat_dirent_t entry = { fs->root_cluster, 0, 1 };
+    const char *end;
+    int64_t ret;
+
+    while(*path) {
+        if(*path == '/') {
+            ++path;
+            continue;
+        }
+
+        if(!entry.directory)
+            return FAT_ERR_NOT_FOUND;
+
+        end = strchr(path, '/');
+        if(!end)
+            end = path + strlen(path);
+
+        if((ret = find_entry(fs, entry.cluster, path, end - path, &entry)) != 0)
+            return ret;
+
+        path = end;
+    }
+
+    if(entry.directory)
+        return FAT_ERR_NOT_FOUND;
+
+    return resolve_chain(fs, entry.cluster, entry.size, file);
+}
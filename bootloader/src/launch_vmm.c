@@ -1,8 +1,18 @@
 #include "launch_vmm.h"
+#include "bootloader.h"
+#include "bootloader_common.h"
 #include "cache.h"
+#include "linux.h"
+#include "lz4.h"
 #include "microlib.h"
+#include "plan.h"
+#include "pmu.h"
+#include "prelink.h"
 #include <libfdt.h>
 
+static int get_external_data(const void *image, int node,
+    const void **out_data_location, int *out_size);
+
 /**
  * Ensures that a valid FDT/image is accessible for the system, performing any
  * steps necessary to make the image accessible, and validating the device tree.
@@ -57,6 +67,78 @@ void load_device_tree(void * fdt)
     BOOTLOADER_PRINT("  flattened device tree size:            %d bytes", fdt_totalsize(fdt));
 }
 
+/**
+ * Returns the platform device tree: the image itself when the previous stage
+ * passed us a device tree, or the FIT's fdt component (used in place) when it
+ * passed us a FIT image.
+ *
+ * @return The device tree, or NULL if the FIT doesn't contain an uncompressed
+ *      device tree.
+ */
+const void *find_platform_device_tree(const void *image)
+{
+    const void *fdt;
+    int node, size;
+
+    if(fdt_path_offset(image, "/images") < 0)
+        return image;
+
+    node = fdt_path_offset(image, "/images/fdt");
+    if(node < 0 || is_compressed(image, node))
+        return NULL;
+
+    if(get_component_data(image, node, &fdt, &size) != SUCCESS)
+        return NULL;
+
+    if(fdt_check_header(fdt) != 0)
+        return NULL;
+
+    return fdt;
+}
+
+/**
+ * Reads a /chosen address property, which may be one or two cells.
+ */
+static uint64_t read_chosen_address(const void *fdt, int node, const char *name)
+{
+    const fdt32_t *prop;
+    int len;
+
+    prop = fdt_getprop(fdt, node, name, &len);
+    if(!prop)
+        return 0;
+
+    if(len == sizeof(uint64_t))
+        return ((uint64_t)fdt32_to_cpu(prop[0]) << 32) | fdt32_to_cpu(prop[1]);
+
+    return len == sizeof(uint32_t) ? fdt32_to_cpu(prop[0]) : 0;
+}
+
+const void *find_boot_image(const void *image)
+{
+    const void *fit;
+    int node;
+
+    if(fdt_path_offset(image, "/images") >= 0)
+        return image;
+
+    node = fdt_path_offset(image, "/chosen");
+    if(node < 0)
+        return image;
+
+    fit = (const void *)read_chosen_address(image, node, "linux,initrd-start");
+    if(!fit)
+        return image;
+
+    // An ordinary initrd isn't an error, so check quietly before validating
+    __invalidate_cache_line(fit);
+    if(fdt_check_header(fit) != 0 || ensure_image_is_accessible(fit) != SUCCESS ||
+       fdt_path_offset(fit, "/images") < 0)
+        return image;
+
+    return fit;
+}
+
 /**
  * Finds the chosen node in the Discharged FDT, which contains
  * e.g. the location of our final payload.
@@ -192,11 +274,67 @@ void * location_from_devicetree(uint32_t metalocation)
     return (void *)(uintptr_t)fdt32_to_cpu(metalocation);
 }
 
+/**
+ * Locates the data of a FIT component that is stored outside of the FIT's
+ * device tree (as produced by scripts/tools/bfmkfit.py), via either an
+ * absolute data-position or a data-offset from the end of the tree.
+ */
+static int get_external_data(const void *image, int node,
+    const void **out_data_location, int *out_size)
+{
+    const uint32_t *position, *offset, *size;
+    uintptr_t data_start;
+    int len;
+
+    size = fdt_getprop(image, node, "data-size", &len);
+    if(len != sizeof(uint32_t))
+        return -FDT_ERR_NOTFOUND;
+
+    position = fdt_getprop(image, node, "data-position", &len);
+    if(len == sizeof(uint32_t)) {
+        data_start = (uintptr_t)image + fdt32_to_cpu(*position);
+    }
+    else {
+        offset = fdt_getprop(image, node, "data-offset", &len);
+        if(len != sizeof(uint32_t))
+            return -FDT_ERR_NOTFOUND;
+
+        data_start = ((uintptr_t)image + fdt_totalsize(image) + 3) & ~3UL;
+        data_start += fdt32_to_cpu(*offset);
+    }
+
+    *out_data_location = (const void *)data_start;
+    *out_size = fdt32_to_cpu(*size);
+
+    // Only the tree itself was made accessible by ensure_image_is_accessible.
+    __invalidate_cache_region(*out_data_location, *out_size);
+    return SUCCESS;
+}
+
+/**
+ * Locates a FIT component's data, whether it's embedded in the tree or
+ * stored after it.
+ *
+ * @return SUCCESS, or an FDT error code.
+ */
+int get_component_data(const void *image, int node,
+    const void **out_data_location, int *out_size)
+{
+    const void *data = fdt_getprop(image, node, "data", out_size);
+    if(data) {
+        *out_data_location = data;
+        return SUCCESS;
+    }
+
+    return get_external_data(image, node, out_data_location, out_size);
+}
+
 int get_subcomponent_information(const void *image, const char *path,
     void **out_load_location, void const**out_data_location, int *out_size,
     int * node_offset)
 {
     const uint32_t const *load_information_location;
+    const struct plan_component_t *planned;
     const void *data_location;
     void *load_location;
 
@@ -212,7 +350,19 @@ int get_subcomponent_information(const void *image, const char *path,
         return node;
 
     // Locate the node that specifies where we should load this image from.
-    data_location = fdt_getprop(image, node, "data", &size);
+    // Components read from outside the image (see plan_component_t.read)
+    // only have data once the plan has placed them.
+    if(get_component_data(image, node, &data_location, &size) != SUCCESS) {
+        planned = plan_find(image, node);
+        if(planned && planned->read && planned->placed) {
+            data_location = (const void *)planned->dst;
+            size = planned->placed;
+        }
+        else {
+            size = -FDT_ERR_NOTFOUND;
+        }
+    }
+
     if(size <= 0) {
         BOOTLOADER_ERROR("ERROR: Couldn't find the data to load! (%d)", size);
         return size;
@@ -222,17 +372,19 @@ int get_subcomponent_information(const void *image, const char *path,
     BOOTLOADER_PRINT("  loading image from:                    0x%08x", data_location);
     BOOTLOADER_PRINT("  loading a total of:                    %d bytes", size);
 
-    // Locate the FIT node that specifies where we should load this image component to.
+    // Locate the FIT node that specifies where we should load this image
+    // component to. Components without one are placed by the planner.
     load_information_location = fdt_getprop(image, node, "load", &load_information_size);
     if(load_information_size <= 0) {
-        BOOTLOADER_ERROR("Couldn't determine where to load to! (%d)", load_information_size);
-        return load_information_size;
+        BOOTLOADER_PRINT("  image has no load address");
+        load_location = NULL;
+    }
+    else {
+        // Retrieve the load location.
+        load_location = location_from_devicetree(*load_information_location);
+        BOOTLOADER_PRINT("  loading image to location:             0x%08x", load_location);
+        BOOTLOADER_PRINT("  image will end at address:             0x%08x", load_location + size);
     }
-
-    // Retrieve the load location.
-    load_location = location_from_devicetree(*load_information_location);
-    BOOTLOADER_PRINT("  loading image to location:             0x%08x", load_location);
-    BOOTLOADER_PRINT("  image will end at address:             0x%08x", load_location + size);
 
     // Set our out arguments, and return success.
     *out_load_location = load_location;
@@ -247,29 +399,90 @@ int get_subcomponent_information(const void *image, const char *path,
     return SUCCESS;
 }
 
+/**
+ * Returns true if a FIT component's data is compressed.
+ */
+int is_compressed(const void *image, int node)
+{
+    const char *compression = fdt_getprop(image, node, "compression", NULL);
+    return compression && strcmp(compression, "none") != 0;
+}
+
+/**
+ * Copies, or decompresses, a component's data to its load location.
+ *
+ * @return The number of bytes placed at the load location, or a negative
+ *      FDT error code.
+ */
+int place_component(const void *image, int node, void *load_location,
+    const void *data_location, int size)
+{
+    const char *compression = fdt_getprop(image, node, "compression", NULL);
+    long unpacked_size;
+
+    if(!load_location) {
+        BOOTLOADER_ERROR("Couldn't determine where to load to!");
+        return -FDT_ERR_NOTFOUND;
+    }
+
+    if(!is_compressed(image, node)) {
+
+        // We're not using the cache, but Depthcharge was before us.
+        // To ensure that our next stage sees the proper memory, we'll have to
+        // make sure that there are no data cache entries for the regions we're
+        // about to touch. As there's no way to invalidate without cleaning via
+        // virtual address (i.e. all of the evicted cache lines will be written
+        // back), it's important that this runs before memmove.
+        __invalidate_cache_region(load_location, size);
+
+        // Trivial load: copy the gathered information to its final location.
+        memmove(load_location, data_location, size);
+        return size;
+    }
+
+    if(strcmp(compression, "lz4") != 0) {
+        BOOTLOADER_ERROR("Unsupported compression: %s", compression);
+        return -FDT_ERR_BADVALUE;
+    }
+
+    unpacked_size = lz4_frame_content_size(data_location, size);
+    if(unpacked_size < 0) {
+        BOOTLOADER_ERROR("Invalid LZ4 frame header (%d)", unpacked_size);
+        return -FDT_ERR_BADVALUE;
+    }
+
+    BOOTLOADER_PRINT("  decompressing (lz4) to:                %d bytes", unpacked_size);
+
+    __invalidate_cache_region(load_location, unpacked_size);
+    unpacked_size = lz4_decompress_frame(data_location, size, load_location, unpacked_size);
+    if(unpacked_size < 0) {
+        BOOTLOADER_ERROR("Failed to decompress image (%d)", unpacked_size);
+        return -FDT_ERR_BADVALUE;
+    }
+
+    return unpacked_size;
+}
+
+PMU_REGION(g_pmu_load_component, "load_image_component");
+
 void * load_image_component(const void *image, const char *path, int *out_size)
 {
     const void *data_location;
     void *load_location;
-    int size, rc;
+    int size, rc, node;
 
     // Get the information that describe where our information is located...
     rc = get_subcomponent_information(image, path, &load_location,
-        &data_location, &size, NULL);
+        &data_location, &size, &node);
 
     if(rc != SUCCESS)
         return NULL;
 
-    // We're not using the cache, but Depthcharge was before us.
-    // To ensure that our next stage sees the proper memory, we'll have to
-    // make sure that there are no data cache entries for the regions we're
-    // about to touch. As there's no way to invalidate without cleaning via
-    // virtual address (i.e. all of the evicted cache lines will be written
-    // back), it's important that this runs before memmove.
-    __invalidate_cache_region(load_location, size);
-
-    // Trivial load: copy the gathered information to its final location.
-    memmove(load_location, data_location, size);
+    PMU_BEGIN(g_pmu_load_component);
+    size = place_component(image, node, load_location, data_location, size);
+    PMU_END(g_pmu_load_component);
+    if(size < 0)
+        return NULL;
 
     // ... and update our size out argument, if provided.
     if(out_size)
@@ -293,3 +506,155 @@ void * load_image_component_verbosely(const void * image,
     return component;
 }
 
+
+/**
+ * Reads a 64-bit value stored as a pair of FDT cells. FDT properties are only
+ * guaranteed to be 4-byte aligned, so the cells are read individually.
+ */
+static uint64_t _from_fdt64_cells(const uint32_t *cells)
+{
+    uint64_t high = fdt32_to_cpu(cells[0]);
+    uint64_t low  = fdt32_to_cpu(cells[1]);
+
+    return (high << 32ULL) | low;
+}
+
+/**
+ * Reads the prelink information that scripts/tools/bfprelink.py recorded in
+ * a VMM image node.
+ *
+ * @param image The FIT image containing the VMM.
+ * @param node The offset of the VMM's image node.
+ * @param prelink Out argument. Receives the prelink information.
+ * @return SUCCESS, -FDT_ERR_NOTFOUND if the VMM was not prelinked, or another
+ *      FDT error code if the prelink information is malformed.
+ */
+int get_prelink_information(const void *image, int node,
+    struct bfvmm_prelink_t *prelink)
+{
+    const uint32_t *cells;
+    uint64_t *fields = (uint64_t *)prelink;
+    int size, i;
+
+    cells = fdt_getprop(image, node, "bareflank,prelink", &size);
+    if (!cells)
+        return -FDT_ERR_NOTFOUND;
+
+    if (size != BFVMM_PRELINK_NUM_FIELDS * sizeof(uint64_t)) {
+        BOOTLOADER_ERROR("Malformed bareflank,prelink property (%d bytes)", size);
+        return -FDT_ERR_BADVALUE;
+    }
+
+    memset(prelink, 0, sizeof(*prelink));
+    for (i = 0; i < BFVMM_PRELINK_NUM_FIELDS; ++i)
+        fields[i] = _from_fdt64_cells(&cells[i * 2]);
+
+    cells = fdt_getprop(image, node, "bareflank,prelink-segments", &size);
+    if (!cells || size % (3 * sizeof(uint64_t)) != 0 ||
+        size / (3 * sizeof(uint64_t)) > BFVMM_PRELINK_MAX_SEGMENTS) {
+        BOOTLOADER_ERROR("Malformed bareflank,prelink-segments property (%d)", size);
+        return -FDT_ERR_BADVALUE;
+    }
+
+    prelink->num_segments = size / (3 * sizeof(uint64_t));
+    for (i = 0; i < prelink->num_segments; ++i) {
+        prelink->segments[i].offset = _from_fdt64_cells(&cells[i * 6]);
+        prelink->segments[i].memsz  = _from_fdt64_cells(&cells[i * 6 + 2]);
+        prelink->segments[i].flags  = _from_fdt64_cells(&cells[i * 6 + 4]);
+    }
+
+    return SUCCESS;
+}
+
+int load_vmm_component(const void *image, const char *path)
+{
+    const struct plan_component_t *planned;
+    struct bfvmm_prelink_t prelink;
+    const void *data_location;
+    void *load_location;
+    int size, node, rc;
+    int64_t ret;
+
+    BOOTLOADER_PRINT("\nLoading Bareflank VMM image...");
+
+    rc = get_subcomponent_information(image, path, &load_location,
+        &data_location, &size, &node);
+    if(rc != SUCCESS)
+        return rc;
+
+    // If the boot image was planned, the VMM is already at its destination,
+    // decompressed (images passed in for a reload aren't).
+    planned = plan_find(image, node);
+    if(planned) {
+        data_location = (const void *)planned->dst;
+        size = planned->placed;
+    }
+
+    rc = get_prelink_information(image, node, &prelink);
+
+    // If the VMM wasn't prelinked, hand the ELF file to the ELF loader as-is;
+    // it will be relocated into freshly allocated memory by common_load_vmm.
+    if(rc == -FDT_ERR_NOTFOUND) {
+        BOOTLOADER_PRINT("  image is an ELF file, relocating at load time");
+
+        if(!planned && is_compressed(image, node)) {
+            size = place_component(image, node, load_location, data_location, size);
+            if(size < 0)
+                return size;
+
+            data_location = load_location;
+        }
+
+        ret = common_add_module(data_location, size);
+        if(ret != BF_SUCCESS) {
+            BOOTLOADER_ERROR("common_add_module failed: %d", ret);
+            return -FDT_ERR_BADVALUE;
+        }
+
+        return SUCCESS;
+    }
+
+    if(rc != SUCCESS)
+        return rc;
+
+    if(planned)
+        load_location = (void *)planned->dst;
+
+    if(prelink.base != (uintptr_t)load_location) {
+        BOOTLOADER_ERROR("VMM was prelinked for 0x%08lx, not 0x%08x",
+            prelink.base, load_location);
+        return -FDT_ERR_BADVALUE;
+    }
+
+    BOOTLOADER_PRINT("  image was prelinked, entry point:      0x%08lx", prelink.entry);
+
+    // Prelinked images are used as-is: only move the image if the FIT didn't
+    // already place it at its load address.
+    if(data_location != load_location) {
+        size = place_component(image, node, load_location, data_location, size);
+        if(size < 0)
+            return size;
+    }
+
+    if(prelink.memsz < size) {
+        BOOTLOADER_ERROR("Prelinked VMM is larger than its memory footprint");
+        return -FDT_ERR_BADVALUE;
+    }
+
+    // The raw image stops at the end of the last initialized segment.
+    __invalidate_cache_region(load_location + size, prelink.memsz - size);
+    memset(load_location + size, 0, prelink.memsz - size);
+
+    ret = common_add_prelinked_module(load_location, prelink.memsz, &prelink);
+    if(ret != BF_SUCCESS) {
+        BOOTLOADER_ERROR("common_add_prelinked_module failed: %d", ret);
+        return -FDT_ERR_BADVALUE;
+    }
+
+    // Unlike ELF images, prelinked images live outside of the heap, so the
+    // next stage has to be told about them separately.
+    if(linux_reserve_memory((uintptr_t)load_location, prelink.memsz) != 0)
+        BOOTLOADER_ERROR("couldn't reserve the VMM's memory for Linux");
+
+    return SUCCESS;
+}
@@ -0,0 +1,413 @@
+#include "linux.h"
+#include "bootloader.h"
+#include "launch_vmm.h"
+#include "microlib.h"
+#include "plan.h"
+#include "smp.h"
+#include "util.h"
+#include <bfplatform.h>
+#include <libfdt.h>
+
+#define LINUX_IMAGE_MAGIC            ( 0x644d5241UL )  // "ARM\x64"
+#define LINUX_IMAGE_HEADER_SIZE      ( 64UL )
+
+// Kernels older than 3.17 leave image_size zero, and always use this offset
+#define LINUX_LEGACY_TEXT_OFFSET     ( 0x80000UL )
+
+// Room for the memory reservations (and /chosen properties) we add
+#define LINUX_FDT_SLACK              ( 0x1000U )
+
+struct linux_region_t {
+    uint64_t addr;
+    uint64_t size;
+};
+
+struct linux_property_t {
+    const char *name;
+    const void *value;
+    int len;
+};
+
+struct linux_boot_t {
+    uint64_t kernel;
+    uint64_t kernel_size;
+    uint64_t initrd_start;
+    uint64_t initrd_end;
+    void *fdt;
+
+    uint64_t nr_reserved;
+    struct linux_region_t reserved[LINUX_MAX_RESERVATIONS];
+
+    uint64_t nr_chosen;
+    struct linux_property_t chosen[LINUX_MAX_CHOSEN];
+};
+
+static struct linux_boot_t g_linux;
+
+// Stages on any core may reserve memory or add /chosen properties (e.g.
+// vmm-place, which can run alongside kernel-place), so both lists are only
+// updated under this lock
+static struct smp_lock_t g_linux_lock;
+
+extern char bootloader_start[];
+extern char bootloader_end[];
+
+int64_t linux_reserve_memory(uint64_t addr, uint64_t size)
+{
+    int64_t ret = 0;
+    uint64_t i;
+
+    smp_lock(&g_linux_lock);
+
+    // Reloading the VMM reserves the same memory again
+    for(i = 0; i < g_linux.nr_reserved; ++i) {
+        if(g_linux.reserved[i].addr == addr && g_linux.reserved[i].size == size)
+            goto done;
+    }
+
+    if(g_linux.nr_reserved == LINUX_MAX_RESERVATIONS) {
+        ret = LINUX_ERR_NO_SPACE;
+        goto done;
+    }
+
+    g_linux.reserved[g_linux.nr_reserved].addr = addr;
+    g_linux.reserved[g_linux.nr_reserved].size = size;
+    g_linux.nr_reserved++;
+
+done:
+    smp_unlock(&g_linux_lock);
+    return ret;
+}
+
+int64_t linux_set_chosen(const char *name, const void *value, int len)
+{
+    int64_t ret = 0;
+    uint64_t i;
+
+    smp_lock(&g_linux_lock);
+
+    for(i = 0; i < g_linux.nr_chosen; ++i) {
+        if(strcmp(g_linux.chosen[i].name, name) == 0)
+            break;
+    }
+
+    if(i == LINUX_MAX_CHOSEN) {
+        ret = LINUX_ERR_NO_SPACE;
+        goto done;
+    }
+
+    g_linux.chosen[i].name = name;
+    g_linux.chosen[i].value = value;
+    g_linux.chosen[i].len = len;
+    if(i == g_linux.nr_chosen)
+        g_linux.nr_chosen++;
+
+done:
+    smp_unlock(&g_linux_lock);
+    return ret;
+}
+
+int linux_reserved_region(uint64_t index, uint64_t *addr, uint64_t *size)
+{
+    if(index >= g_linux.nr_reserved)
+        return -1;
+
+    *addr = g_linux.reserved[index].addr;
+    *size = g_linux.reserved[index].size;
+    return 0;
+}
+
+/**
+ * Reads a little-endian field from the Image header. Images don't have to be
+ * 8-byte aligned in the FIT, and unaligned accesses fault with the MMU off,
+ * so this goes byte by byte.
+ */
+static uint64_t read_le(const uint8_t *field, unsigned int bytes)
+{
+    uint64_t value = 0;
+
+    while(bytes--)
+        value = (value << 8) | field[bytes];
+
+    return value;
+}
+
+int linux_read_image_header(const void *image, uint64_t size,
+    struct linux_image_t *header)
+{
+    const uint8_t *raw = image;
+
+    if(size < LINUX_IMAGE_HEADER_SIZE || read_le(raw + 56, 4) != LINUX_IMAGE_MAGIC)
+        return -1;
+
+    header->text_offset = read_le(raw + 8, 8);
+    header->image_size = read_le(raw + 16, 8);
+    header->flags = read_le(raw + 24, 8);
+
+    if(header->flags & LINUX_FLAG_BIG_ENDIAN)
+        return -1;
+
+    if(header->image_size == 0) {
+        BOOTLOADER_SUBINFO("warning: kernel doesn't report its size, assuming no BSS");
+        header->text_offset = LINUX_LEGACY_TEXT_OFFSET;
+        header->image_size = size;
+    }
+
+    return 0;
+}
+
+int linux_read_component_header(const void *image, int node,
+    const void *data, uint64_t size, struct linux_image_t *header)
+{
+    const uint32_t *cells;
+    int len;
+
+    if(!is_compressed(image, node))
+        return linux_read_image_header(data, size, header);
+
+    cells = fdt_getprop(image, node, "bareflank,image-header", &len);
+    if(!cells || len != 6 * sizeof(uint32_t))
+        return -1;
+
+    header->text_offset = ((uint64_t)fdt32_to_cpu(cells[0]) << 32) | fdt32_to_cpu(cells[1]);
+    header->image_size = ((uint64_t)fdt32_to_cpu(cells[2]) << 32) | fdt32_to_cpu(cells[3]);
+    header->flags = ((uint64_t)fdt32_to_cpu(cells[4]) << 32) | fdt32_to_cpu(cells[5]);
+
+    return 0;
+}
+
+/**
+ * Finds where the plan put a FIT component.
+ */
+static const struct plan_component_t *find_planned(const char *path)
+{
+    const struct plan_component_t *c;
+    int node;
+
+    node = fdt_path_offset(g_boot_image, path);
+    if(node < 0)
+        return NULL;
+
+    c = plan_find(g_boot_image, node);
+    if(!c)
+        BOOTLOADER_ERROR("%s wasn't placed by the planner", path);
+
+    return c;
+}
+
+boot_ret_t place_linux()
+{
+    const struct plan_component_t *c;
+    struct linux_image_t header;
+
+    if(fdt_path_offset(g_boot_image, "/images/kernel") < 0) {
+        BOOTLOADER_SUBINFO("no Linux kernel in the boot image");
+        return BOOT_CONTINUE;
+    }
+
+    BOOTLOADER_INFO("Placing Linux kernel");
+
+    c = find_planned("/images/kernel");
+    if(!c)
+        return BOOT_FAIL;
+
+    if(linux_read_image_header((const void *)c->dst, c->placed, &header) != 0) {
+        BOOTLOADER_ERROR("kernel is not a little-endian arm64 Image");
+        return BOOT_FAIL;
+    }
+
+    BOOTLOADER_SUBINFO("text_offset 0x%x, image_size 0x%x, flags 0x%x",
+        header.text_offset, header.image_size, header.flags);
+
+    if(header.image_size < c->placed) {
+        BOOTLOADER_ERROR("kernel is larger than its reported image_size");
+        return BOOT_FAIL;
+    }
+
+    // The plan already put the kernel at a 2 MiB aligned base (plus
+    // text_offset) with image_size bytes to spare, running it in place if
+    // bfmkfit packed it that way.
+    BOOTLOADER_SUBINFO("kernel at 0x%08x", c->dst);
+
+    g_linux.kernel = c->dst;
+    g_linux.kernel_size = header.image_size;
+
+    return BOOT_CONTINUE;
+}
+
+BOOT_PRESTART_STAGE(60, "kernel-place", place_linux, 0, "plan");
+
+boot_ret_t place_initrd()
+{
+    const struct plan_component_t *c;
+
+    if(!g_linux.kernel || fdt_path_offset(g_boot_image, "/images/ramdisk") < 0)
+        return BOOT_CONTINUE;
+
+    BOOTLOADER_INFO("Placing initrd");
+
+    // Initrds tend to be the largest thing we boot, so the plan leaves them
+    // in the FIT unless they're compressed or in the way of something else
+    c = find_planned("/images/ramdisk");
+    if(!c)
+        return BOOT_FAIL;
+
+    BOOTLOADER_SUBINFO("initrd at 0x%08x - 0x%08x", c->dst, c->dst + c->placed);
+
+    g_linux.initrd_start = c->dst;
+    g_linux.initrd_end = c->dst + c->placed;
+
+    return BOOT_CONTINUE;
+}
+
+BOOT_PRESTART_STAGE(61, "initrd-place", place_initrd, 0, "kernel-place");
+
+/**
+ * Points Linux at the initrd through /chosen, and adds the properties passed
+ * to linux_set_chosen().
+ */
+static int set_chosen_properties(void *fdt)
+{
+    int chosen, rc;
+    uint64_t i;
+
+    if(!g_linux.initrd_start && !g_linux.nr_chosen)
+        return 0;
+
+    chosen = fdt_path_offset(fdt, "/chosen");
+    if(chosen == -FDT_ERR_NOTFOUND)
+        chosen = fdt_add_subnode(fdt, 0, "chosen");
+    if(chosen < 0)
+        return chosen;
+
+    for(i = 0; i < g_linux.nr_chosen; ++i) {
+        rc = fdt_setprop(fdt, chosen, g_linux.chosen[i].name, g_linux.chosen[i].value,
+            g_linux.chosen[i].len);
+        if(rc != 0)
+            return rc;
+    }
+
+    if(!g_linux.initrd_start)
+        return 0;
+
+    rc = fdt_setprop_u64(fdt, chosen, "linux,initrd-start", g_linux.initrd_start);
+    if(rc != 0)
+        return rc;
+
+    return fdt_setprop_u64(fdt, chosen, "linux,initrd-end", g_linux.initrd_end);
+}
+
+/**
+ * Makes a writable copy of the platform device tree with room to grow, and
+ * applies every change Linux needs in a single pass: one fdt_open_into and
+ * fdt_pack, rather than resizing the tree for each edit.
+ */
+boot_ret_t fixup_linux_device_tree()
+{
+    uint64_t heap_start, heap_end, heap_used, i;
+    const void *fdt;
+    void *buffer;
+    int size, rc;
+
+    if(!g_linux.kernel)
+        return BOOT_CONTINUE;
+
+    BOOTLOADER_INFO("Preparing the device tree for Linux");
+
+    fdt = find_platform_device_tree(g_boot_image);
+    if(!fdt) {
+        BOOTLOADER_ERROR("no platform device tree to pass to Linux");
+        return BOOT_FAIL;
+    }
+
+    size = fdt_totalsize(fdt) + LINUX_FDT_SLACK;
+    for(i = 0; i < g_linux.nr_chosen; ++i)
+        size += g_linux.chosen[i].len;
+
+    buffer = platform_alloc_rw(size);
+    if(!buffer) {
+        BOOTLOADER_ERROR("couldn't allocate %d bytes for the device tree", size);
+        return BOOT_FAIL;
+    }
+
+    rc = fdt_open_into(fdt, buffer, size);
+    if(rc != 0)
+        goto fail;
+
+    // The bootloader and everything it allocated (the VMM, per-core memory,
+    // stage-2 tables and this device tree) stay resident after handing off.
+    // Unlike the regions in g_linux.reserved, they stay mapped for the guest.
+    platform_heap_region(&heap_start, &heap_end, &heap_used);
+    BOOTLOADER_SUBINFO("reserving 0x%08lx - 0x%08lx (heap)", heap_start, heap_used);
+    rc = fdt_add_mem_rsv(buffer, heap_start, heap_used - heap_start);
+    if(rc != 0)
+        goto fail;
+
+    BOOTLOADER_SUBINFO("reserving 0x%08lx - 0x%08lx (bootloader)",
+        (uint64_t)bootloader_start, (uint64_t)bootloader_end);
+    rc = fdt_add_mem_rsv(buffer, (uint64_t)bootloader_start,
+        (uint64_t)(bootloader_end - bootloader_start));
+    if(rc != 0)
+        goto fail;
+
+    for(i = 0; i < g_linux.nr_reserved; ++i) {
+        BOOTLOADER_SUBINFO("reserving 0x%08lx - 0x%08lx", g_linux.reserved[i].addr,
+            g_linux.reserved[i].addr + g_linux.reserved[i].size);
+
+        rc = fdt_add_mem_rsv(buffer, g_linux.reserved[i].addr, g_linux.reserved[i].size);
+        if(rc != 0)
+            goto fail;
+    }
+
+    rc = set_chosen_properties(buffer);
+    if(rc != 0)
+        goto fail;
+
+    rc = fdt_pack(buffer);
+    if(rc != 0)
+        goto fail;
+
+    g_linux.fdt = buffer;
+    return BOOT_CONTINUE;
+
+fail:
+    BOOTLOADER_ERROR("couldn't update the device tree for Linux (%d)", rc);
+    return BOOT_FAIL;
+}
+
+// As a poststart stage, runs after the VMM has been loaded (the start phase),
+// so its memory has been reserved. It also has to wait for anything else
+// that allocates from the heap, which it reserves: the stage-2 tables.
+#ifdef ENABLE_STAGE2
+BOOT_POSTSTART_STAGE(50, "linux-dt", fixup_linux_device_tree, 0, "stage2");
+#else
+BOOT_POSTSTART_STAGE(50, "linux-dt", fixup_linux_device_tree, 0);
+#endif
+
+boot_ret_t launch_linux()
+{
+    if(!g_linux.kernel)
+        return BOOT_CONTINUE;
+
+    // This stage doesn't return, so report what's been measured now
+    boot_report_timing();
+    boot_report_pmu();
+
+    // Linux brings the secondary cores up itself, using PSCI
+    smp_shutdown();
+
+    BOOTLOADER_INFO("Launching Linux...");
+    BOOTLOADER_SUBINFO("kernel at 0x%08x, device tree at 0x%08x",
+        g_linux.kernel, g_linux.fdt);
+
+    // The kernel was written through the data side, so make sure no stale
+    // instructions are fetched from its memory.
+    asm volatile("dsb sy\n ic iallu\n dsb sy\n isb" ::: "memory");
+
+    _launch_linux((void *)g_linux.kernel, g_linux.fdt);
+
+    return BOOT_FAIL;
+}
+
+BOOT_POSTSTART_STAGE(99, "linux", launch_linux, BOOT_STAGE_BOOT_CPU,
+    "kernel-place", "initrd-place", "linux-dt");
@@ -0,0 +1,252 @@
+/*
+ * Bareflank Hypervisor
+ * Copyright (C) 2018 Assured Information Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <microlib.h>
+#include "lz4.h"
+
+#define LZ4_FRAME_MAGIC             0x184D2204U
+
+#define LZ4_FLG_VERSION_MASK        0xC0U
+#define LZ4_FLG_VERSION             0x40U
+#define LZ4_FLG_BLOCK_CHECKSUM      ( 1U << 4 )
+#define LZ4_FLG_CONTENT_SIZE        ( 1U << 3 )
+#define LZ4_FLG_CONTENT_CHECKSUM    ( 1U << 2 )
+#define LZ4_FLG_DICT_ID             ( 1U << 0 )
+
+#define LZ4_BLOCK_UNCOMPRESSED      0x80000000U
+
+#define LZ4_MIN_MATCH               ( 4U )
+
+/**
+ * Reads a little endian 32-bit value. The MMU is off while we run, so all
+ * accesses are treated as device accesses and must be naturally aligned;
+ * compressed streams have no alignment, so we read them a byte at a time.
+ */
+static uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Reads an LZ4 variable length field continuation (a run of 255 bytes
+ * terminated by a byte less than 255), adding it to length.
+ */
+static int read_length(const uint8_t **ip, const uint8_t *ip_end, size_t *length)
+{
+    uint8_t b;
+
+    do {
+        if(*ip >= ip_end)
+            return LZ4_ERR_CORRUPT;
+
+        b = *(*ip)++;
+        *length += b;
+    } while(b == 255);
+
+    return SUCCESS;
+}
+
+/**
+ * Decompresses a single block to op. Matches may reference any data
+ * previously written since out_start, which allows linked blocks.
+ *
+ * @return The new output position, or NULL if the block is corrupt.
+ */
+static uint8_t * decompress_block(const uint8_t *ip, size_t src_len,
+    uint8_t *out_start, uint8_t *op, uint8_t *op_end)
+{
+    const uint8_t *ip_end = ip + src_len;
+
+    while(ip < ip_end) {
+        const uint8_t *match;
+        uint8_t token = *ip++;
+        size_t length = token >> 4;
+        size_t offset;
+
+        // Literals...
+        if(length == 15 && read_length(&ip, ip_end, &length) != SUCCESS)
+            return NULL;
+
+        if(length > (size_t)(ip_end - ip) || length > (size_t)(op_end - op))
+            return NULL;
+
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        // ... the last sequence of a block is made of literals only.
+        if(ip == ip_end)
+            break;
+
+        // Match
+        if(ip_end - ip < 2)
+            return NULL;
+
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        if(offset == 0 || offset > (size_t)(op - out_start))
+            return NULL;
+
+        length = token & 0xF;
+        if(length == 15 && read_length(&ip, ip_end, &length) != SUCCESS)
+            return NULL;
+
+        length += LZ4_MIN_MATCH;
+        if(length > (size_t)(op_end - op))
+            return NULL;
+
+        // Matches may overlap their own output, so copy forwards bytewise.
+        match = op - offset;
+        while(length--)
+            *op++ = *match++;
+    }
+
+    return op;
+}
+
+long lz4_decompress_block(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+    uint8_t *out = dst;
+    uint8_t *op = decompress_block(src, src_len, out, out, out + dst_len);
+
+    if(!op)
+        return LZ4_ERR_CORRUPT;
+
+    return op - out;
+}
+
+/**
+ * Parses an LZ4 frame header.
+ *
+ * @param flags Out argument. Receives the frame's FLG byte.
+ * @param content_size Out argument. Receives the content size, or -1 if the
+ *      frame doesn't record it.
+ * @return The size of the header, or a negative LZ4_ERR_* code.
+ */
+static long parse_frame_header(const uint8_t *src, size_t src_len,
+    uint8_t *flags, long *content_size)
+{
+    size_t header_len = 7;
+
+    if(src_len < header_len || read_le32(src) != LZ4_FRAME_MAGIC)
+        return LZ4_ERR_CORRUPT;
+
+    *flags = src[4];
+    if((*flags & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION)
+        return LZ4_ERR_UNSUPPORTED;
+
+    if(*flags & LZ4_FLG_DICT_ID)
+        return LZ4_ERR_UNSUPPORTED;
+
+    *content_size = -1;
+    if(*flags & LZ4_FLG_CONTENT_SIZE) {
+        header_len += 8;
+        if(src_len < header_len)
+            return LZ4_ERR_CORRUPT;
+
+        // Sizes beyond 4 GiB are far larger than anything we load.
+        if(read_le32(src + 10) != 0)
+            return LZ4_ERR_UNSUPPORTED;
+
+        *content_size = read_le32(src + 6);
+    }
+
+    return header_len;
+}
+
+long lz4_frame_content_size(const void *src, size_t src_len)
+{
+    uint8_t flags;
+    long content_size;
+    long rc = parse_frame_header(src, src_len, &flags, &content_size);
+
+    if(rc < 0)
+        return rc;
+
+    if(content_size < 0)
+        return LZ4_ERR_NOSIZE;
+
+    return content_size;
+}
+
+long lz4_decompress_frame(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = ip + src_len;
+    uint8_t *out = dst;
+    uint8_t *op = out;
+    uint8_t *op_end = out + dst_len;
+
+    uint8_t flags;
+    long content_size;
+    long rc = parse_frame_header(ip, src_len, &flags, &content_size);
+
+    if(rc < 0)
+        return rc;
+
+    if(content_size > (long)dst_len)
+        return LZ4_ERR_NOSPACE;
+
+    ip += rc;
+    while(true) {
+        uint32_t block_size;
+
+        if(ip_end - ip < 4)
+            return LZ4_ERR_CORRUPT;
+
+        block_size = read_le32(ip);
+        ip += 4;
+
+        // End mark
+        if(block_size == 0)
+            break;
+
+        if((block_size & ~LZ4_BLOCK_UNCOMPRESSED) > (size_t)(ip_end - ip))
+            return LZ4_ERR_CORRUPT;
+
+        if(block_size & LZ4_BLOCK_UNCOMPRESSED) {
+            block_size &= ~LZ4_BLOCK_UNCOMPRESSED;
+            if(block_size > (size_t)(op_end - op))
+                return LZ4_ERR_NOSPACE;
+
+            memcpy(op, ip, block_size);
+            op += block_size;
+        }
+        else {
+            op = decompress_block(ip, block_size, out, op, op_end);
+            if(!op)
+                return LZ4_ERR_CORRUPT;
+        }
+
+        ip += block_size;
+        if(flags & LZ4_FLG_BLOCK_CHECKSUM)
+            ip += 4;
+    }
+
+    if(content_size >= 0 && op - out != content_size)
+        return LZ4_ERR_CORRUPT;
+
+    return op - out;
+}
@@ -1,17 +1,51 @@
 #include <microlib.h>
 #include "bootloader.h"
+#include "launch_vmm.h"
+#include "semihost.h"
+#include "smp.h"
+
+extern char bootloader_start[];
 
 void bootloader_main(void * fdt)
 {
-    bfignored(fdt);
+    const void *image;
+
+    g_boot_image = fdt;
     init_bootloader();
 
     BOOTLOADER_INFO("Hello from EL2");
 
-    switch_to_el1();
+    if (g_relocated_from) {
+        BOOTLOADER_SUBINFO("moved from 0x%08x to 0x%08x", g_relocated_from, bootloader_start);
+    }
+
+    if (ensure_image_is_accessible(g_boot_image) != SUCCESS) {
+        panic();
+    }
+
+    image = find_boot_image(g_boot_image);
+    if (image != g_boot_image) {
+        g_boot_image = image;
+        BOOTLOADER_SUBINFO("booting from the FIT image passed as an initrd, at 0x%lx",
+            (uint64_t)g_boot_image);
+    }
+
+#ifdef ENABLE_SEMIHOSTING
+    image = semihost_boot_image(g_boot_image);
+    if (!image) {
+        panic();
+    }
+
+    g_boot_image = image;
+#endif
+
+    smp_init(find_platform_device_tree(g_boot_image));
+
+    if (boot_start() != BOOT_CONTINUE) {
+        panic();
+    }
 
     BOOTLOADER_INFO("Hello from EL1");
 
     panic();
 }
-
@@ -0,0 +1,519 @@
+#include "membench.h"
+#include "bootloader.h"
+#include "cache.h"
+#include "launch_vmm.h"
+#include "linux.h"
+#include "memmap.h"
+#include "microlib.h"
+#include "plan.h"
+#include "regs.h"
+#include "smp.h"
+#include "timer.h"
+#include <bfplatform.h>
+
+#define MEMBENCH_PAGE_SIZE         ( 0x1000UL )
+#define MEMBENCH_BLOCK_SIZE        ( 0x200000UL )
+#define MEMBENCH_GB                ( 0x40000000UL )
+#define MEMBENCH_TABLE_ENTRIES     ( 512UL )
+
+// Bytes between the nodes the latency test chases (a cache line or more)
+#define MEMBENCH_NODE_STRIDE       ( 64UL )
+
+// Each bandwidth figure is the best of this many runs, as in STREAM
+#define MEMBENCH_RUNS              ( 3U )
+
+// The temporary map covers the first 512 GiB with a single level 1 table,
+// plus a level 2 table for each GiB a bank or the arrays start or end in
+#define MEMBENCH_VA_BITS           ( 39U )
+#define MEMBENCH_POOL_PAGES        ( 1U + 2U * MEMBENCH_MAX_BANKS + 2U )
+
+// MAIR_EL2 attributes: 0 Device-nGnRnE (as with the MMU off), 1 Normal
+// non-cacheable, 2 Normal write-back
+#define MAIR_EL2_VALUE             ( (0x00UL << 0) | (0x44UL << 8) | (0xFFUL << 16) )
+
+#define DESC_BLOCK                 ( 0x1UL )
+#define DESC_TABLE                 ( 0x3UL )
+#define DESC_ATTR_DEVICE           ( 0UL << 2 )
+#define DESC_ATTR_NONCACHEABLE     ( 1UL << 2 )
+#define DESC_ATTR_WRITEBACK        ( 2UL << 2 )
+#define DESC_SH_INNER              ( 0x3UL << 8 )
+#define DESC_AF                    ( 1UL << 10 )
+#define DESC_XN                    ( 1UL << 54 )
+
+#define TCR_EL2_RES1               ( (1UL << 31) | (1UL << 23) )
+#define TCR_EL2_T0SZ(bits)         ( 64UL - (bits) )
+#define TCR_EL2_SH0_INNER          ( 0x3UL << 12 )
+#define TCR_EL2_PS(parange)        ( (uint64_t)(parange) << 16 )
+#define TCR_EL2_PS_40BIT           ( 2UL )
+
+#define SCTLR_EL2_M                ( 1UL << 0 )
+#define SCTLR_EL2_C                ( 1UL << 2 )
+
+#define ID_AA64MMFR0_PARANGE_MASK  ( 0xFUL )
+
+static const char *const g_kernel_names[MEMBENCH_NR_KERNELS] = { "copy", "scale", "add" };
+
+// Arrays each kernel reads and writes, for working out bandwidth
+static const uint64_t g_kernel_arrays[MEMBENCH_NR_KERNELS] = { 2, 2, 3 };
+
+/**
+ * A slice of a kernel, run by one core.
+ */
+struct membench_job_t {
+    uint64_t kernel;
+    uint64_t *a;
+    const uint64_t *b;
+    const uint64_t *c;
+    uint64_t words;
+};
+
+struct membench_t {
+    uint64_t nr_banks;
+    struct memmap_range_t banks[MEMBENCH_MAX_BANKS];
+
+    // The arrays under test: [buffer, buffer + buffer_size)
+    uint64_t buffer;
+    uint64_t buffer_size;
+
+    uint64_t *pool;
+    uint64_t pool_used;
+
+    struct membench_job_t jobs[SMP_MAX_CPUS];
+
+    uint64_t nr_results;
+    struct membench_result_t results[MEMBENCH_MAX_RESULTS];
+};
+
+static struct membench_t g_membench;
+
+// Where the latency test leaves the last node it reached, so the chase
+// can't be optimised away
+static volatile uint64_t g_membench_sink;
+
+// The /chosen property results are recorded in, as a string list
+static char g_membench_chosen[MEMBENCH_MAX_RESULTS * 128];
+
+static uint64_t align_up(uint64_t addr, uint64_t align)
+{
+    return (addr + align - 1) & ~(align - 1);
+}
+
+static int overlaps(uint64_t start, uint64_t end, uint64_t addr, uint64_t size)
+{
+    return start < addr + size && addr < end;
+}
+
+/**
+ * Returns the attributes of a block: the arrays under test are cacheable,
+ * the rest of DRAM non-cacheable (so the bootloader's own data is coherent
+ * with cores whose caches are off, whichever mode they're in) and
+ * everything else device memory.
+ */
+static uint64_t block_attributes(uint64_t addr, uint64_t size)
+{
+    uint64_t i;
+
+    if(overlaps(g_membench.buffer, g_membench.buffer + g_membench.buffer_size, addr, size))
+        return DESC_ATTR_WRITEBACK | DESC_SH_INNER | DESC_AF;
+
+    for(i = 0; i < g_membench.nr_banks; ++i) {
+        if(overlaps(g_membench.banks[i].start, g_membench.banks[i].end, addr, size))
+            return DESC_ATTR_NONCACHEABLE | DESC_SH_INNER | DESC_AF;
+    }
+
+    return DESC_ATTR_DEVICE | DESC_AF | DESC_XN;
+}
+
+/**
+ * Returns whether a bank or the arrays start or end inside a 1 GiB block, so
+ * it needs splitting into 2 MiB blocks.
+ */
+static int needs_splitting(uint64_t addr)
+{
+    uint64_t i, end = addr + MEMBENCH_GB;
+
+    if((g_membench.buffer > addr && g_membench.buffer < end) ||
+       (g_membench.buffer + g_membench.buffer_size > addr &&
+        g_membench.buffer + g_membench.buffer_size < end))
+        return 1;
+
+    for(i = 0; i < g_membench.nr_banks; ++i) {
+        if((g_membench.banks[i].start > addr && g_membench.banks[i].start < end) ||
+           (g_membench.banks[i].end > addr && g_membench.banks[i].end < end))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Builds the EL2 stage-1 identity map the cached runs use, for the arrays
+ * currently under test.
+ *
+ * @return The level 1 table, or NULL if the pool ran out.
+ */
+static uint64_t *build_map(void)
+{
+    uint64_t *root, *table, addr, i, j;
+
+    memset(g_membench.pool, 0, MEMBENCH_POOL_PAGES * MEMBENCH_PAGE_SIZE);
+    root = g_membench.pool;
+    g_membench.pool_used = 1;
+
+    for(i = 0; i < MEMBENCH_TABLE_ENTRIES; ++i) {
+        addr = i * MEMBENCH_GB;
+
+        if(!needs_splitting(addr)) {
+            root[i] = addr | block_attributes(addr, MEMBENCH_GB) | DESC_BLOCK;
+            continue;
+        }
+
+        if(g_membench.pool_used == MEMBENCH_POOL_PAGES)
+            return NULL;
+
+        table = g_membench.pool + g_membench.pool_used * MEMBENCH_TABLE_ENTRIES;
+        g_membench.pool_used++;
+
+        for(j = 0; j < MEMBENCH_TABLE_ENTRIES; ++j) {
+            table[j] = (addr + j * MEMBENCH_BLOCK_SIZE) |
+                block_attributes(addr + j * MEMBENCH_BLOCK_SIZE, MEMBENCH_BLOCK_SIZE) |
+                DESC_BLOCK;
+        }
+
+        root[i] = (uint64_t)table | DESC_TABLE;
+    }
+
+    return root;
+}
+
+/**
+ * Turns on the calling core's MMU and data cache, with the map from
+ * build_map().
+ */
+static int64_t caches_on(uint64_t root)
+{
+    uint64_t mmfr0, sctlr;
+
+    READ_SYSREG_64(id_aa64mmfr0_el1, mmfr0);
+
+    WRITE_SYSREG_64(mair_el2, MAIR_EL2_VALUE);
+    WRITE_SYSREG_64(tcr_el2, TCR_EL2_RES1 | TCR_EL2_T0SZ(MEMBENCH_VA_BITS) |
+        TCR_EL2_SH0_INNER | TCR_EL2_PS(min(mmfr0 & ID_AA64MMFR0_PARANGE_MASK, TCR_EL2_PS_40BIT)));
+    WRITE_SYSREG_64(ttbr0_el2, root);
+    asm volatile("isb\n"
+                 "tlbi alle2\n"
+                 "dsb ish\n"
+                 "isb" ::: "memory");
+
+    READ_SYSREG_64(sctlr_el2, sctlr);
+    WRITE_SYSREG_64(sctlr_el2, sctlr | SCTLR_EL2_M | SCTLR_EL2_C);
+    asm volatile("isb" ::: "memory");
+
+    return 0;
+}
+
+/**
+ * Turns the calling core's MMU and data cache back off.
+ */
+static int64_t caches_off(uint64_t unused)
+{
+    uint64_t sctlr;
+
+    (void)unused;
+
+    READ_SYSREG_64(sctlr_el2, sctlr);
+    WRITE_SYSREG_64(sctlr_el2, sctlr & ~(SCTLR_EL2_M | SCTLR_EL2_C));
+    asm volatile("isb\n"
+                 "tlbi alle2\n"
+                 "dsb ish\n"
+                 "isb" ::: "memory");
+
+    return 0;
+}
+
+/**
+ * Runs fn(arg) on every core, and waits for all of them.
+ */
+static void on_all_cpus(smp_fn_t fn, uint64_t arg)
+{
+    uint64_t cpu;
+
+    for(cpu = 1; cpu < smp_num_cpus(); ++cpu)
+        smp_call(cpu, fn, arg);
+
+    fn(arg);
+
+    for(cpu = 1; cpu < smp_num_cpus(); ++cpu)
+        smp_wait(cpu);
+}
+
+static int64_t run_job(uint64_t arg)
+{
+    const struct membench_job_t *job = (const struct membench_job_t *)arg;
+    uint64_t i;
+
+    switch(job->kernel) {
+        case MEMBENCH_COPY:
+            memcpy(job->a, job->b, job->words * sizeof(uint64_t));
+            break;
+
+        case MEMBENCH_SCALE:
+            for(i = 0; i < job->words; ++i)
+                job->a[i] = 3 * job->b[i];
+            break;
+
+        case MEMBENCH_ADD:
+            for(i = 0; i < job->words; ++i)
+                job->a[i] = job->b[i] + job->c[i];
+            break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Times a kernel split between the first cpus cores, each streaming through
+ * its own slice of the arrays.
+ *
+ * @return The bandwidth, in MB/s.
+ */
+static uint64_t time_kernel(uint64_t kernel, uint64_t cpus)
+{
+    uint64_t *a = (uint64_t *)g_membench.buffer;
+    uint64_t words = MEMBENCH_SIZE / sizeof(uint64_t);
+    uint64_t slice = words / cpus, cpu, run, start, ticks, best = 0;
+
+    for(cpu = 0; cpu < cpus; ++cpu) {
+        g_membench.jobs[cpu].kernel = kernel;
+        g_membench.jobs[cpu].a = a + cpu * slice;
+        g_membench.jobs[cpu].b = a + words + cpu * slice;
+        g_membench.jobs[cpu].c = a + 2 * words + cpu * slice;
+        g_membench.jobs[cpu].words = slice;
+    }
+
+    for(run = 0; run < MEMBENCH_RUNS; ++run) {
+        start = timer_ticks();
+
+        for(cpu = 1; cpu < cpus; ++cpu)
+            smp_call(cpu, run_job, (uint64_t)&g_membench.jobs[cpu]);
+
+        run_job((uint64_t)&g_membench.jobs[0]);
+
+        for(cpu = 1; cpu < cpus; ++cpu)
+            smp_wait(cpu);
+
+        ticks = timer_ticks() - start;
+        if(!best || ticks < best)
+            best = ticks;
+    }
+
+    if(!best)
+        return 0;
+
+    return (slice * cpus * sizeof(uint64_t) * g_kernel_arrays[kernel] * timer_frequency()) /
+        best / 1000000;
+}
+
+/**
+ * Times a chase through a random cycle of nodes spread over the first
+ * array, so each load depends on the one before.
+ *
+ * @return The average latency of a load, in ns.
+ */
+static uint64_t time_latency(void)
+{
+    uint8_t *base = (uint8_t *)g_membench.buffer;
+    uint64_t *order = (uint64_t *)(g_membench.buffer + 2 * MEMBENCH_SIZE);
+    uint64_t nodes = MEMBENCH_SIZE / MEMBENCH_NODE_STRIDE;
+    uint64_t seed = 0x2545F4914F6CDD1DUL, node, i, j, tmp, start, ticks;
+
+    // Sattolo's algorithm: a random permutation that's a single cycle, so
+    // the chase visits every node
+    for(i = 0; i < nodes; ++i)
+        order[i] = i;
+
+    for(i = nodes - 1; i > 0; --i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        j = seed % i;
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    for(i = 0; i < nodes; ++i)
+        *(uint64_t *)(base + i * MEMBENCH_NODE_STRIDE) = (uint64_t)(base + order[i] * MEMBENCH_NODE_STRIDE);
+
+    node = (uint64_t)base;
+    start = timer_ticks();
+    for(i = 0; i < MEMBENCH_LOADS; ++i)
+        node = *(const uint64_t *)node;
+    ticks = timer_ticks() - start;
+
+    g_membench_sink = node;
+    return (ticks * 1000000000UL) / (timer_frequency() * MEMBENCH_LOADS);
+}
+
+/**
+ * Measures the arrays under test from one core, then from every core.
+ */
+static void bench(uint64_t bank, uint64_t cached)
+{
+    struct membench_result_t *result;
+    uint64_t latency, cpus, k;
+
+    latency = time_latency();
+
+    for(cpus = 1; cpus <= smp_num_cpus(); cpus = (cpus == 1 ? smp_num_cpus() : cpus + 1)) {
+        if(g_membench.nr_results == MEMBENCH_MAX_RESULTS)
+            return;
+
+        result = &g_membench.results[g_membench.nr_results++];
+        result->bank = bank;
+        result->cached = cached;
+        result->cpus = cpus;
+        result->latency_ns = latency;
+
+        for(k = 0; k < MEMBENCH_NR_KERNELS; ++k)
+            result->mbps[k] = time_kernel(k, cpus);
+
+        if(cpus == smp_num_cpus())
+            break;
+    }
+}
+
+/**
+ * Runs the cached measurements, with every core's MMU and data cache on.
+ */
+static void bench_cached(uint64_t bank)
+{
+    uint64_t *root;
+
+    root = build_map();
+    if(!root) {
+        BOOTLOADER_ERROR("membench: too many banks to map bank %lu", bank);
+        return;
+    }
+
+    on_all_cpus(caches_on, (uint64_t)root);
+
+    bench(bank, 1);
+
+    on_all_cpus(caches_off, 0);
+
+    // Nothing may be left dirty in the caches over memory Linux is about to
+    // be handed
+    __invalidate_cache_region((const void *)g_membench.buffer, g_membench.buffer_size);
+    asm volatile("dsb sy" ::: "memory");
+}
+
+static void print_results(void)
+{
+    const struct membench_result_t *result;
+    uint64_t i;
+
+    BOOTLOADER_INFO("Memory benchmark (%lu bytes per array, best of %lu runs):",
+        MEMBENCH_SIZE, (uint64_t)MEMBENCH_RUNS);
+    BOOTLOADER_SUBINFO("bank  base                caches  cpus  %10s  %10s  %10s  latency",
+        g_kernel_names[MEMBENCH_COPY], g_kernel_names[MEMBENCH_SCALE],
+        g_kernel_names[MEMBENCH_ADD]);
+
+    for(i = 0; i < g_membench.nr_results; ++i) {
+        result = &g_membench.results[i];
+        BOOTLOADER_SUBINFO("%4lu  0x%016lx  %6s  %4lu  %5lu MB/s  %5lu MB/s  %5lu MB/s  %4lu ns",
+            result->bank, g_membench.banks[result->bank].start,
+            result->cached ? "on" : "off", result->cpus,
+            result->mbps[MEMBENCH_COPY], result->mbps[MEMBENCH_SCALE],
+            result->mbps[MEMBENCH_ADD], result->latency_ns);
+    }
+}
+
+/**
+ * Records the results in /chosen, one string per row, for the OS to pick
+ * up.
+ */
+static void publish_results(void)
+{
+    const struct membench_result_t *result;
+    uint64_t i;
+    int len = 0;
+
+    for(i = 0; i < g_membench.nr_results; ++i) {
+        result = &g_membench.results[i];
+        len += bootloader_sprintf(g_membench_chosen + len,
+            "bank=0x%lx caches=%s cpus=%lu copy=%lu scale=%lu add=%lu latency=%lu",
+            g_membench.banks[result->bank].start, result->cached ? "on" : "off",
+            result->cpus, result->mbps[MEMBENCH_COPY], result->mbps[MEMBENCH_SCALE],
+            result->mbps[MEMBENCH_ADD], result->latency_ns) + 1;
+    }
+
+    if(len && linux_set_chosen("bareflank,membench", g_membench_chosen, len) != 0)
+        BOOTLOADER_ERROR("membench: couldn't record the results in /chosen");
+}
+
+/**
+ * Measures the bandwidth and latency of each DRAM bank, in memory the plan
+ * left free, with the caches off and on, and from one core and all of them.
+ * The caches are only ever on for the arrays under test, and only while
+ * this stage runs (the bootloader otherwise runs with the MMU off). The
+ * benchmark is optional, so the boot carries on whatever happens.
+ */
+boot_ret_t run_membench()
+{
+    const void *fdt;
+    uint64_t i, size, pool;
+
+    fdt = find_platform_device_tree(g_boot_image);
+    if(!fdt) {
+        BOOTLOADER_ERROR("membench: no platform device tree to find DRAM in");
+        return BOOT_CONTINUE;
+    }
+
+    if(!timer_frequency()) {
+        BOOTLOADER_ERROR("membench: the generic timer's frequency isn't set");
+        return BOOT_CONTINUE;
+    }
+
+    g_membench.nr_banks = memmap_banks(fdt, g_membench.banks, MEMBENCH_MAX_BANKS);
+
+    pool = (uint64_t)platform_alloc_rw((MEMBENCH_POOL_PAGES + 1) * MEMBENCH_PAGE_SIZE);
+    if(!pool) {
+        BOOTLOADER_ERROR("membench: couldn't allocate translation tables");
+        return BOOT_CONTINUE;
+    }
+
+    g_membench.pool = (uint64_t *)align_up(pool, MEMBENCH_PAGE_SIZE);
+
+    // Whole 2 MiB blocks, so the arrays can be mapped cacheable on their own
+    size = align_up(3 * MEMBENCH_SIZE, MEMBENCH_BLOCK_SIZE);
+
+    for(i = 0; i < g_membench.nr_banks; ++i) {
+        if(plan_find_free(g_membench.banks[i].start, g_membench.banks[i].end, size,
+                MEMBENCH_BLOCK_SIZE, &g_membench.buffer) != 0) {
+            BOOTLOADER_SUBINFO("membench: no free memory to test in bank %lu", i);
+            continue;
+        }
+
+        g_membench.buffer_size = size;
+
+        bench(i, 0);
+
+        if(g_membench.banks[i].end <= (1UL << MEMBENCH_VA_BITS))
+            bench_cached(i);
+    }
+
+    print_results();
+    publish_results();
+
+    return BOOT_CONTINUE;
+}
+
+#ifdef ENABLE_MEMBENCH
+BOOT_PRESTART_STAGE(70, "membench", run_membench, BOOT_STAGE_ALL_CPUS,
+    "vmm-place", "initrd-place");
+#endif
@@ -0,0 +1,100 @@
+#include "memmap.h"
+#include "microlib.h"
+#include <libfdt.h>
+
+static uint64_t read_cells(const uint32_t **cells, int count)
+{
+    uint64_t value = 0;
+
+    while(count--)
+        value = (value << 32) | fdt32_to_cpu(*(*cells)++);
+
+    return value;
+}
+
+/**
+ * Reads a node's reg property into ranges, using its parent's cell sizes.
+ */
+static int read_reg(const void *fdt, int node, int address_cells, int size_cells,
+    struct memmap_range_t *ranges, int max)
+{
+    int len, entry_size = (address_cells + size_cells) * sizeof(uint32_t);
+    const uint32_t *reg;
+    uint64_t start;
+    int n = 0;
+
+    reg = fdt_getprop(fdt, node, "reg", &len);
+    if(!reg || entry_size == 0)
+        return 0;
+
+    for(; len >= entry_size && n < max; len -= entry_size) {
+        start = read_cells(&reg, address_cells);
+        ranges[n].start = start;
+        ranges[n].end = start + read_cells(&reg, size_cells);
+        n++;
+    }
+
+    return n;
+}
+
+int memmap_node_reg(const void *fdt, int node, struct memmap_range_t *ranges, int max)
+{
+    int parent = fdt_parent_offset(fdt, node);
+
+    if(parent < 0)
+        return 0;
+
+    return read_reg(fdt, node, fdt_address_cells(fdt, parent),
+        fdt_size_cells(fdt, parent), ranges, max);
+}
+
+int memmap_banks(const void *fdt, struct memmap_range_t *banks, int max)
+{
+    int address_cells, size_cells, node, n = 0;
+    const char *type;
+
+    address_cells = fdt_address_cells(fdt, 0);
+    size_cells = fdt_size_cells(fdt, 0);
+
+    fdt_for_each_subnode(node, fdt, 0) {
+        type = fdt_getprop(fdt, node, "device_type", NULL);
+        if(!type || strcmp(type, "memory") != 0)
+            continue;
+
+        n += read_reg(fdt, node, address_cells, size_cells, banks + n, max - n);
+    }
+
+    return n;
+}
+
+int memmap_reserved(const void *fdt, struct memmap_range_t *ranges, int max,
+    int no_map_only)
+{
+    int address_cells, size_cells, node, child, i, n = 0;
+    uint64_t addr, size;
+
+    for(i = 0; !no_map_only && i < fdt_num_mem_rsv(fdt) && n < max; ++i) {
+        if(fdt_get_mem_rsv(fdt, i, &addr, &size) != 0)
+            continue;
+
+        ranges[n].start = addr;
+        ranges[n].end = addr + size;
+        n++;
+    }
+
+    node = fdt_path_offset(fdt, "/reserved-memory");
+    if(node < 0)
+        return n;
+
+    address_cells = fdt_address_cells(fdt, node);
+    size_cells = fdt_size_cells(fdt, node);
+
+    fdt_for_each_subnode(child, fdt, node) {
+        if(no_map_only && !fdt_getprop(fdt, child, "no-map", NULL))
+            continue;
+
+        n += read_reg(fdt, child, address_cells, size_cells, ranges + n, max - n);
+    }
+
+    return n;
+}
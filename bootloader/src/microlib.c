@@ -26,6 +26,7 @@
  */
 
 #include <microlib.h>
+#include <console.h>
 
 /**
  * Quick (and not particularly performant) implementation of the standard
@@ -45,36 +46,24 @@ void * memcpy(void * dest, const void * src, size_t n)
 }
 
 /**
- * Prints a single character (synchronously) via serial.
+ * Prints a single character (synchronously) via the console.
  *
  * @param c The character to be printed
  */
 void putc(char c, void *stream)
 {
-    // If we're about to send a newline, prefix it with a carriage return.
-    // This makes our putc behave like a normal console putc.
-    if(c == '\n')
-        putc('\r', stream);
-
-    asm volatile(
-          "mov x0, %0\n\t"
-          "bl  _putc\n\t"
-          :: "r" (c) : "x0", "x1", "x2", "x30"
-    );
+    (void)stream;
+    console_write(&c, 1);
 }
 
 /**
- * Prints a string (synchronously) via serial.
+ * Prints a string (synchronously) via the console.
  *
  * @param s The string to be printed; must be null terminated.
  */
 int puts(const char * s)
 {
-    while(*s) {
-        putc(*s, stdin);
-        ++s;
-    }
-
+    console_write(s, strlen(s));
     return 0;
 }
 
@@ -109,3 +98,114 @@ void * memset(void *b, int c, size_t len)
 
     return b;
 }
+
+/**
+ * Copies a block of memory, handling overlapping source and destination
+ * regions correctly.
+ */
+void * memmove(void *dst0, const void *src0, register size_t length)
+{
+    const char * src_byte = src0;
+    char * dest_byte = dst0;
+
+    if(dest_byte == src_byte || length == 0)
+        return dst0;
+
+    // If the destination lies after the source, copy backwards so we never
+    // overwrite source bytes that haven't been copied yet.
+    if(dest_byte > src_byte && dest_byte < src_byte + length) {
+        while(length--)
+            dest_byte[length] = src_byte[length];
+
+        return dst0;
+    }
+
+    return memcpy(dst0, src0, length);
+}
+
+/**
+ * Compares two blocks of memory.
+ */
+int memcmp(const void *s1, const void *s2, size_t n)
+{
+    const unsigned char * a = s1;
+    const unsigned char * b = s2;
+
+    size_t i = 0;
+
+    for(i = 0; i < n; ++i)
+        if(a[i] != b[i])
+            return a[i] - b[i];
+
+    return 0;
+}
+
+/**
+ * Finds the first occurrence of a byte value in a block of memory.
+ */
+void * memchr(const void *s, int c, size_t n)
+{
+    const unsigned char * p = s;
+
+    size_t i = 0;
+
+    for(i = 0; i < n; ++i)
+        if(p[i] == (unsigned char)c)
+            return (void *)&p[i];
+
+    return NULL;
+}
+
+/**
+ * Determines the length of a string.
+ */
+size_t strlen(const char *s)
+{
+    size_t n = 0;
+
+    while(s[n])
+        ++n;
+
+    return n;
+}
+
+/**
+ * Finds the first occurrence of a character in a string.
+ */
+char * strchr(const char *s, int c)
+{
+    do {
+        if(*s == (char)c)
+            return (char *)s;
+    } while(*s++);
+
+    return NULL;
+}
+
+/**
+ * Finds the last occurrence of a character in a string.
+ */
+char * strrchr(const char *s, int c)
+{
+    const char * last = NULL;
+
+    do {
+        if(*s == (char)c)
+            last = s;
+    } while(*s++);
+
+    return (char *)last;
+}
+
+/**
+ * Compares two strings.
+ */
+int strcmp(const char *s1, const char *s2)
+{
+    while(*s1 && *s1 == *s2) {
+        ++s1;
+        ++s2;
+    }
+
+    return (unsigned char)*s1 - (unsigned char)*s2;
+}
@@ -0,0 +1,586 @@
+#include "plan.h"
+#include "bootloader.h"
+#include "launch_vmm.h"
+#include "linux.h"
+#include "lz4.h"
+#include "memmap.h"
+#include "microlib.h"
+#include <libfdt.h>
+
+#define PLAN_PAGE_SIZE        ( 0x1000UL )
+
+struct plan_range_t {
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * The plan. free holds the memory that's still available for destinations,
+ * sorted by address; reserved holds memory nothing may be copied over.
+ */
+struct plan_t {
+    uint64_t nr_components;
+    struct plan_component_t components[PLAN_MAX_COMPONENTS];
+    uint64_t order[PLAN_MAX_COMPONENTS];
+
+    uint64_t nr_free;
+    struct plan_range_t free[PLAN_MAX_RANGES];
+
+    uint64_t nr_reserved;
+    struct plan_range_t reserved[PLAN_MAX_RANGES];
+};
+
+static struct plan_t g_plan;
+
+extern char bootloader_start[];
+extern char bootloader_end[];
+
+static int overlaps(uint64_t a, uint64_t a_size, uint64_t b, uint64_t b_size)
+{
+    return a < b + b_size && b < a + a_size;
+}
+
+/**
+ * Returns the first address at or above addr that's offset bytes past an
+ * align boundary.
+ */
+static uint64_t align_up_offset(uint64_t addr, uint64_t align, uint64_t offset)
+{
+    if(addr <= offset)
+        return offset;
+
+    return ((addr - offset + align - 1) & ~(align - 1)) + offset;
+}
+
+int64_t plan_reserve(uint64_t addr, uint64_t size)
+{
+    if(g_plan.nr_reserved == PLAN_MAX_RANGES)
+        return PLAN_ERR_TOO_MANY;
+
+    g_plan.reserved[g_plan.nr_reserved].start = addr;
+    g_plan.reserved[g_plan.nr_reserved].end = addr + size;
+    g_plan.nr_reserved++;
+
+    return 0;
+}
+
+int64_t plan_add(const struct plan_component_t *component)
+{
+    if(g_plan.nr_components == PLAN_MAX_COMPONENTS)
+        return PLAN_ERR_TOO_MANY;
+
+    g_plan.components[g_plan.nr_components++] = *component;
+    return 0;
+}
+
+/**
+ * Adds a range to the free list, keeping it sorted by address.
+ */
+static int64_t free_insert(uint64_t start, uint64_t end)
+{
+    uint64_t i;
+
+    if(start >= end)
+        return 0;
+
+    if(g_plan.nr_free == PLAN_MAX_RANGES)
+        return PLAN_ERR_TOO_MANY;
+
+    for(i = g_plan.nr_free; i > 0 && g_plan.free[i - 1].start > start; --i)
+        g_plan.free[i] = g_plan.free[i - 1];
+
+    g_plan.free[i].start = start;
+    g_plan.free[i].end = end;
+    g_plan.nr_free++;
+
+    return 0;
+}
+
+/**
+ * Removes [start, end) from the free list, splitting ranges as needed.
+ */
+static int64_t free_remove(uint64_t start, uint64_t end)
+{
+    struct plan_range_t range;
+    uint64_t i = 0;
+    int64_t ret;
+
+    while(i < g_plan.nr_free) {
+        range = g_plan.free[i];
+        if(range.end <= start || end <= range.start) {
+            ++i;
+            continue;
+        }
+
+        memmove(&g_plan.free[i], &g_plan.free[i + 1],
+            (g_plan.nr_free - i - 1) * sizeof(struct plan_range_t));
+        g_plan.nr_free--;
+
+        if((ret = free_insert(range.start, min(range.end, start))) != 0)
+            return ret;
+        if((ret = free_insert(max(range.start, end), range.end)) != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+static int free_contains(uint64_t start, uint64_t size)
+{
+    uint64_t i;
+
+    for(i = 0; i < g_plan.nr_free; ++i) {
+        if(g_plan.free[i].start <= start && start + size <= g_plan.free[i].end)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Builds the free list from the device tree's memory map: every /memory
+ * node's banks, minus the memory reservation block, /reserved-memory and
+ * everything passed to plan_reserve().
+ */
+static int64_t read_memory_map(const void *fdt)
+{
+    struct memmap_range_t ranges[MEMMAP_MAX_RANGES];
+    int n, nr_ranges;
+    uint64_t i;
+    int64_t ret;
+
+    nr_ranges = memmap_banks(fdt, ranges, MEMMAP_MAX_RANGES);
+    for(n = 0; n < nr_ranges; ++n) {
+        if((ret = free_insert(ranges[n].start, ranges[n].end)) != 0)
+            return ret;
+    }
+
+    if(g_plan.nr_free == 0)
+        return PLAN_ERR_NO_MAP;
+
+    nr_ranges = memmap_reserved(fdt, ranges, MEMMAP_MAX_RANGES, false);
+    for(n = 0; n < nr_ranges; ++n) {
+        if((ret = free_remove(ranges[n].start, ranges[n].end)) != 0)
+            return ret;
+    }
+
+    for(i = 0; i < g_plan.nr_reserved; ++i) {
+        if((ret = free_remove(g_plan.reserved[i].start, g_plan.reserved[i].end)) != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+static int needs_copy(const struct plan_component_t *c)
+{
+    return c->src && c->dst != c->src;
+}
+
+/**
+ * Returns true if placing c writes to its destination.
+ */
+static int writes(const struct plan_component_t *c)
+{
+    return c->read || needs_copy(c);
+}
+
+/**
+ * Returns the end of the first piece of data in [start, start + c->memsz)
+ * that c's destination should avoid, or 0 if there's none: its own data if
+ * it's compressed (decompression can't run in place) and, if avoid_data is
+ * set, the data of every other component that still has to be copied.
+ */
+static uint64_t find_conflict(const struct plan_component_t *c, uint64_t start,
+    int avoid_data)
+{
+    const struct plan_component_t *other;
+    uint64_t i;
+
+    if((c->flags & PLAN_COMPRESSED) && overlaps(start, c->memsz, c->src, c->size))
+        return c->src + c->size;
+
+    if(!avoid_data)
+        return 0;
+
+    for(i = 0; i < g_plan.nr_components; ++i) {
+        other = &g_plan.components[i];
+        if(other == c || !other->src)
+            continue;
+
+        // Components that stay in place were already removed from the
+        // free list
+        if(overlaps(start, c->memsz, other->src, other->size))
+            return other->src + other->size;
+    }
+
+    return 0;
+}
+
+static int fits(const struct plan_component_t *c, uint64_t dst, int avoid_data)
+{
+    if(dst % c->align != c->offset % c->align)
+        return false;
+
+    return free_contains(dst, c->memsz) && !find_conflict(c, dst, avoid_data);
+}
+
+/**
+ * Finds the lowest suitable free address for a component.
+ */
+static int first_fit(const struct plan_component_t *c, int avoid_data, uint64_t *dst)
+{
+    uint64_t i, candidate, conflict;
+
+    for(i = 0; i < g_plan.nr_free; ++i) {
+        candidate = align_up_offset(g_plan.free[i].start, c->align, c->offset);
+
+        while(candidate + c->memsz <= g_plan.free[i].end) {
+            conflict = find_conflict(c, candidate, avoid_data);
+            if(!conflict) {
+                *dst = candidate;
+                return true;
+            }
+
+            candidate = align_up_offset(conflict, c->align, c->offset);
+        }
+    }
+
+    return false;
+}
+
+static int64_t claim(struct plan_component_t *c, uint64_t dst)
+{
+    c->dst = dst;
+    return free_remove(dst, dst + c->memsz);
+}
+
+/**
+ * Picks a destination for a component without a fixed one: its hint, then
+ * the lowest free address, first avoiding other components' data (so their
+ * copies don't have to be ordered) and then not.
+ */
+static int place(struct plan_component_t *c)
+{
+    uint64_t dst;
+    int avoid_data;
+
+    for(avoid_data = true; avoid_data >= false; --avoid_data) {
+        if(c->hint && fits(c, c->hint, avoid_data))
+            return claim(c, c->hint) == 0;
+
+        if(first_fit(c, avoid_data, &dst))
+            return claim(c, dst) == 0;
+    }
+
+    return false;
+}
+
+/**
+ * Orders the copies: a component whose destination overlaps another
+ * component's data has to be copied (or read) after it (Kahn's algorithm).
+ * Components that aren't copied go first.
+ */
+static int64_t order_copies(void)
+{
+    uint64_t n = g_plan.nr_components;
+    uint64_t i, j, nr_ordered = 0;
+    int done[PLAN_MAX_COMPONENTS] = {0};
+    int ready;
+
+    while(nr_ordered < n) {
+        for(i = 0; i < n; ++i) {
+            struct plan_component_t *c = &g_plan.components[i];
+            if(done[i])
+                continue;
+
+            ready = true;
+            for(j = 0; j < n && ready; ++j) {
+                struct plan_component_t *other = &g_plan.components[j];
+                if(j == i || done[j] || !writes(c) || !needs_copy(other))
+                    continue;
+
+                if(overlaps(c->dst, c->memsz, other->src, other->size))
+                    ready = false;
+            }
+
+            if(ready)
+                break;
+        }
+
+        if(i == n)
+            return PLAN_ERR_CYCLE;
+
+        done[i] = true;
+        g_plan.order[nr_ordered++] = i;
+    }
+
+    return 0;
+}
+
+int64_t plan_compute(const void *fdt)
+{
+    struct plan_component_t *c, *sorted[PLAN_MAX_COMPONENTS];
+    uint64_t i, j, nr_sorted = 0;
+    int64_t ret;
+
+    if((ret = read_memory_map(fdt)) != 0)
+        return ret;
+
+    // Fixed components first: there's only one place they can go
+    for(i = 0; i < g_plan.nr_components; ++i) {
+        c = &g_plan.components[i];
+        if(!(c->flags & PLAN_FIXED))
+            continue;
+
+        if(!fits(c, c->hint, false) || claim(c, c->hint) != 0) {
+            BOOTLOADER_ERROR("%s doesn't fit at 0x%08x", c->name, c->hint);
+            return PLAN_ERR_NO_MEMORY;
+        }
+    }
+
+    // Then everything that can stay where it is, so it's never copied
+    for(i = 0; i < g_plan.nr_components; ++i) {
+        c = &g_plan.components[i];
+        if(c->flags & PLAN_FIXED)
+            continue;
+
+        if((c->flags & PLAN_IN_PLACE) && fits(c, c->src, true)) {
+            if(claim(c, c->src) != 0)
+                return PLAN_ERR_TOO_MANY;
+            continue;
+        }
+
+        sorted[nr_sorted++] = c;
+    }
+
+    // Then the rest, largest first
+    for(i = 1; i < nr_sorted; ++i) {
+        for(j = i; j > 0 && sorted[j - 1]->memsz < sorted[j]->memsz; --j) {
+            c = sorted[j];
+            sorted[j] = sorted[j - 1];
+            sorted[j - 1] = c;
+        }
+    }
+
+    for(i = 0; i < nr_sorted; ++i) {
+        if(!place(sorted[i])) {
+            BOOTLOADER_ERROR("no room for %s (0x%x bytes)", sorted[i]->name, sorted[i]->memsz);
+            return PLAN_ERR_NO_MEMORY;
+        }
+    }
+
+    return order_copies();
+}
+
+int64_t plan_execute(void)
+{
+    struct plan_component_t *c;
+    int64_t ret;
+    int size;
+    uint64_t i;
+
+    for(i = 0; i < g_plan.nr_components; ++i) {
+        c = &g_plan.components[g_plan.order[i]];
+
+        if(c->read) {
+            BOOTLOADER_SUBINFO("%s: 0x%08x - 0x%08x (read)", c->name,
+                c->dst, c->dst + c->memsz);
+
+            ret = c->read(c, (void *)c->dst);
+            if(ret < 0)
+                return PLAN_ERR_COPY;
+
+            c->placed = ret;
+            continue;
+        }
+
+        if(!needs_copy(c)) {
+            BOOTLOADER_SUBINFO("%s: 0x%08x - 0x%08x (in place)", c->name,
+                c->dst, c->dst + c->memsz);
+            c->placed = c->size;
+            continue;
+        }
+
+        BOOTLOADER_SUBINFO("%s: 0x%08x - 0x%08x (from 0x%08x)", c->name,
+            c->dst, c->dst + c->memsz, c->src);
+
+        size = place_component(c->image, c->node, (void *)c->dst,
+            (const void *)c->src, c->size);
+        if(size < 0)
+            return PLAN_ERR_COPY;
+
+        c->placed = size;
+    }
+
+    return 0;
+}
+
+const struct plan_component_t *plan_find(const void *image, int node)
+{
+    uint64_t i;
+
+    for(i = 0; i < g_plan.nr_components; ++i) {
+        if(g_plan.components[i].image == image && g_plan.components[i].node == node)
+            return &g_plan.components[i];
+    }
+
+    return NULL;
+}
+
+int64_t plan_find_free(uint64_t start, uint64_t end, uint64_t size, uint64_t align,
+    uint64_t *addr)
+{
+    uint64_t i, candidate;
+
+    for(i = 0; i < g_plan.nr_free; ++i) {
+        candidate = align_up_offset(max(g_plan.free[i].start, start), align, 0);
+        if(candidate + size <= min(g_plan.free[i].end, end)) {
+            *addr = candidate;
+            return 0;
+        }
+    }
+
+    return PLAN_ERR_NO_MEMORY;
+}
+
+/**
+ * Describes a FIT component to the planner. Components the bootloader uses
+ * where they are (the platform device tree, plain VMM ELF files) or doesn't
+ * use at all are reserved instead, so nothing is copied over them.
+ */
+static int64_t plan_fit_component(const void *image, int node)
+{
+    struct plan_component_t c = {0};
+    struct bfvmm_prelink_t prelink;
+    struct linux_image_t header;
+    const uint32_t *cell;
+    const void *data;
+    int size, len;
+    long unpacked;
+
+    if(get_component_data(image, node, &data, &size) != SUCCESS)
+        return 0;
+
+    c.name = fdt_get_name(image, node, NULL);
+    c.image = image;
+    c.node = node;
+    c.src = (uint64_t)data;
+    c.size = size;
+    c.memsz = size;
+    c.align = PLAN_PAGE_SIZE;
+
+    cell = fdt_getprop(image, node, "load", &len);
+    if(cell && len == sizeof(uint32_t))
+        c.hint = fdt32_to_cpu(*cell);
+
+    if(is_compressed(image, node)) {
+        unpacked = lz4_frame_content_size(data, size);
+        if(unpacked < 0)
+            return PLAN_ERR_NO_MEMORY;
+
+        c.flags |= PLAN_COMPRESSED;
+        c.memsz = unpacked;
+    }
+    else {
+        c.flags |= PLAN_IN_PLACE;
+    }
+
+    if(strcmp(c.name, "vmm") == 0) {
+        if(get_prelink_information(image, node, &prelink) == SUCCESS) {
+            c.flags = (c.flags & ~PLAN_IN_PLACE) | PLAN_FIXED;
+            c.hint = prelink.base;
+            c.memsz = max(c.memsz, prelink.memsz);
+        }
+        else if(!(c.flags & PLAN_COMPRESSED)) {
+            return plan_reserve(c.src, c.size);
+        }
+    }
+    else if(strcmp(c.name, "kernel") == 0) {
+        if(linux_read_component_header(image, node, data, size, &header) != 0) {
+            BOOTLOADER_ERROR("kernel is not a little-endian arm64 Image");
+            return PLAN_ERR_NO_MEMORY;
+        }
+
+        c.align = LINUX_IMAGE_ALIGN;
+        c.offset = header.text_offset;
+        c.memsz = max(c.memsz, header.image_size);
+
+        // Unless it says otherwise, the kernel can't use memory below itself
+        if(!(header.flags & LINUX_FLAG_ANY_PLACEMENT))
+            c.flags &= ~PLAN_IN_PLACE;
+    }
+    else if(strcmp(c.name, "ramdisk") != 0) {
+        if(strcmp(c.name, "bootloader") == 0)
+            return 0;
+
+        return plan_reserve(c.src, c.size);
+    }
+
+    return plan_add(&c);
+}
+
+/**
+ * Plans where every component of the boot image (and the bootloader heap)
+ * goes, then places them. Components without data in the image are planned
+ * by whatever reads them, which adds them before this stage runs (e.g.
+ * semihost_boot_image() or disk_boot_image()).
+ */
+boot_ret_t plan_boot_image()
+{
+    const void *image = g_boot_image;
+    struct plan_component_t heap = {0};
+    const struct plan_component_t *c;
+    uint64_t heap_start, heap_end, heap_used;
+    const void *fdt;
+    int images, node;
+    int64_t ret;
+
+    images = fdt_path_offset(image, "/images");
+    if(images < 0)
+        return BOOT_CONTINUE;
+
+    BOOTLOADER_INFO("Planning boot image placement");
+
+    fdt = find_platform_device_tree(image);
+    if(!fdt) {
+        BOOTLOADER_ERROR("no platform device tree to read the memory map from");
+        return BOOT_FAIL;
+    }
+
+    if((ret = plan_reserve((uint64_t)bootloader_start, (uint64_t)(bootloader_end - bootloader_start))) != 0 ||
+       (ret = plan_reserve((uint64_t)image, fdt_totalsize(image))) != 0)
+        goto fail;
+
+    fdt_for_each_subnode(node, image, images) {
+        if((ret = plan_fit_component(image, node)) != 0)
+            goto fail;
+    }
+
+    // The heap is placed like any other component, if it's still unused
+    platform_heap_region(&heap_start, &heap_end, &heap_used);
+    heap.name = "heap";
+    heap.memsz = heap_end - heap_start;
+    heap.align = PLAN_PAGE_SIZE;
+    heap.hint = heap_start;
+    heap.flags = heap_used == heap_start ? 0 : PLAN_FIXED;
+    if((ret = plan_add(&heap)) != 0)
+        goto fail;
+
+    if((ret = plan_compute(fdt)) != 0 || (ret = plan_execute()) != 0)
+        goto fail;
+
+    c = &g_plan.components[g_plan.nr_components - 1];
+    if(c->dst != heap_start)
+        platform_move_heap(c->dst, c->dst + c->memsz);
+
+    return BOOT_CONTINUE;
+
+fail:
+    BOOTLOADER_ERROR("couldn't plan the boot image's placement (%ld)", ret);
+    return BOOT_FAIL;
+}
+
+// Everything that places a component works from the plan, which works from
+// the boot image the "image" stage settled on
+BOOT_PRESTART_STAGE(40, "plan", plan_boot_image, 0, "image");
@@ -22,17 +22,146 @@
  */
 
 #include "microlib.h"
+#include "smp.h"
 #include <bfplatform.h>
 
-char * g_next_addr = (char *)0x8C000000; // TODO: Calculate from linker script
+/*
+ * VMM heap. Memory is handed out first-fit from a free list of previously
+ * freed blocks, falling back to bumping g_next_addr. Freed blocks are kept
+ * sorted by address and merged with their neighbours (and given back to the
+ * bump region when they end at g_next_addr), so unloading and reloading the
+ * VMM reuses the same memory instead of leaking its whole footprint.
+ *
+ * Each free block stores its own list node, so allocations are rounded up
+ * to HEAP_GRANULE bytes (which also keeps them cache line aligned).
+ *
+ * HEAP_START is only the default: the placement planner (plan.c) moves the
+ * heap to wherever it fits in the platform's memory map before the first
+ * allocation.
+ *
+ * Boot stages allocate from several cores at once, so the heap is only
+ * touched under g_heap_lock.
+ */
+#define HEAP_START   ( 0x8C000000UL )
+#define HEAP_SIZE    ( 0x4000000UL )
+#define HEAP_GRANULE ( 64UL )
 
-void *platform_alloc(uint64_t len)
+struct heap_block_t {
+    uint64_t size;
+    struct heap_block_t *next;
+};
+
+uint64_t g_heap_start = HEAP_START;
+uint64_t g_heap_end = HEAP_START + HEAP_SIZE;
+char * g_next_addr = (char *)HEAP_START;
+struct heap_block_t *g_free_list = 0;
+
+static struct smp_lock_t g_heap_lock;
+
+static uint64_t heap_round(uint64_t len)
+{
+    return (len + HEAP_GRANULE - 1) & ~(HEAP_GRANULE - 1);
+}
+
+static void *heap_alloc(uint64_t len)
 {
+    struct heap_block_t **link = &g_free_list;
     char * next_addr = g_next_addr;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    len = heap_round(len);
+
+    for (; *link; link = &(*link)->next) {
+        struct heap_block_t *block = *link;
+
+        if (block->size < len) {
+            continue;
+        }
+
+        // Hand out the front of the block, and keep the rest on the list
+        if (block->size == len) {
+            *link = block->next;
+        }
+        else {
+            struct heap_block_t *rest = (struct heap_block_t *)((char *)block + len);
+            rest->size = block->size - len;
+            rest->next = block->next;
+            *link = rest;
+        }
+
+        return block;
+    }
+
+    if (len > g_heap_end - (uint64_t)g_next_addr) {
+        BOOTLOADER_ERROR("platform_alloc: out of memory (%d bytes)", len);
+        return 0;
+    }
+
     g_next_addr += len;
     return (void *)next_addr;
 }
 
+static void heap_free(const void *addr, uint64_t len)
+{
+    struct heap_block_t **link = &g_free_list;
+    struct heap_block_t *block = (struct heap_block_t *)addr;
+    struct heap_block_t *prev = 0;
+
+    if (addr == 0 || len == 0) {
+        return;
+    }
+
+    block->size = heap_round(len);
+
+    // Keep the list sorted by address, so neighbours can be merged
+    while (*link && *link < block) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+
+    block->next = *link;
+    *link = block;
+
+    if (block->next && (char *)block + block->size == (char *)block->next) {
+        block->size += block->next->size;
+        block->next = block->next->next;
+    }
+
+    if (prev && (char *)prev + prev->size == (char *)block) {
+        prev->size += block->size;
+        prev->next = block->next;
+    }
+
+    // Give the last free block back to the bump region if it borders it
+    for (link = &g_free_list; *link && (*link)->next; link = &(*link)->next);
+
+    if (*link && (char *)*link + (*link)->size == g_next_addr) {
+        g_next_addr = (char *)*link;
+        *link = 0;
+    }
+}
+
+void *platform_alloc(uint64_t len)
+{
+    void *mem;
+
+    smp_lock(&g_heap_lock);
+    mem = heap_alloc(len);
+    smp_unlock(&g_heap_lock);
+
+    return mem;
+}
+
+void platform_free(const void *addr, uint64_t len)
+{
+    smp_lock(&g_heap_lock);
+    heap_free(addr, len);
+    smp_unlock(&g_heap_lock);
+}
+
 void *platform_alloc_rw(uint64_t len)
 {
     void * mem = platform_alloc(len);
@@ -46,12 +175,33 @@ void *platform_alloc_rwe(uint64_t len)
 
 void platform_free_rw(const void *addr, uint64_t len)
 {
-    return;
+    platform_free(addr, len);
 }
 
 void platform_free_rwe(const void *addr, uint64_t len)
 {
-    return;
+    platform_free(addr, len);
+}
+
+void platform_heap_region(uint64_t *start, uint64_t *end, uint64_t *used_end)
+{
+    *start = g_heap_start;
+    *end = g_heap_end;
+    *used_end = (uint64_t)g_next_addr;
+}
+
+int platform_move_heap(uint64_t start, uint64_t end)
+{
+    // Memory has already been handed out from the old location
+    if ((uint64_t)g_next_addr != g_heap_start || g_free_list) {
+        return -1;
+    }
+
+    g_heap_start = start;
+    g_heap_end = end;
+    g_next_addr = (char *)start;
+
+    return 0;
 }
 
 void *platform_virt_to_phys(void *virt)
@@ -84,12 +234,13 @@ void platform_stop(void)
 /**
  * Get Number of CPUs
  *
- * @return returns the total number of CPUs available to the driver.
+ * @return returns the total number of CPUs available to the driver (the cores
+ *      smp_init() brought online).
  */
 int64_t
 platform_num_cpus(void)
 {
-    return 1;
+    return (int64_t)smp_num_cpus();
 }
 
 /**
@@ -114,7 +265,7 @@ platform_restore_affinity(int64_t affinity)
 
 int64_t platform_get_current_cpu_num(void)
 {
-    return 0;
+    return (int64_t)smp_this_cpu();
 }
 
 void platform_restore_preemption(void)
@@ -145,7 +296,7 @@ int printf(const char *format, ...)
 }
 
 int64_t
-private_call_vmm(uintptr_t request, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3);
+private_call_vmm_cpu(uint64_t cpuid, uintptr_t request, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3);
 
 int64_t
 platform_start_core(void)
@@ -158,7 +309,7 @@ platform_start_core(void)
         return ret;
     }
 
-    ret = private_call_vmm(BF_REQUEST_VMM_INIT, (uint64_t)cpuid, 0, 0);
+    ret = private_call_vmm_cpu((uint64_t)cpuid, BF_REQUEST_VMM_INIT, (uint64_t)cpuid, 0, 0);
     if (ret != BF_SUCCESS) {
         return ret;
     }
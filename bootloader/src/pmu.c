@@ -0,0 +1,161 @@
+#include "pmu.h"
+#include "microlib.h"
+#include "regs.h"
+
+#define PMCR_EL0_E              ( 1UL << 0 )
+#define PMCR_EL0_P              ( 1UL << 1 )
+#define PMCR_EL0_C              ( 1UL << 2 )
+#define PMCR_EL0_LC             ( 1UL << 6 )
+#define PMCR_EL0_N_SHIFT        ( 11 )
+#define PMCR_EL0_N_MASK         ( 0x1FUL )
+
+#define MDCR_EL2_HPMN_MASK      ( 0x1FUL )
+
+#define PMCNTENSET_EL0_C        ( 1UL << 31 )
+
+// Count at EL1 and EL2, but not EL0 (U and NSU set, NSH set)
+#define PMU_FILTER              ( (1UL << 30) | (1UL << 28) | (1UL << 27) )
+
+#define PMU_EVENT_L1D_REFILL    ( 0x03UL )
+#define PMU_EVENT_L1D_TLB_REFILL ( 0x05UL )
+#define PMU_EVENT_INST_RETIRED  ( 0x08UL )
+#define PMU_EVENT_L2D_REFILL    ( 0x17UL )
+#define PMU_EVENT_BUS_ACCESS    ( 0x19UL )
+
+// The events programmed into event counters 0 onwards
+static const uint64_t g_pmu_events[PMU_NR_COUNTERS - 1] = {
+    PMU_EVENT_INST_RETIRED,
+    PMU_EVENT_L1D_REFILL,
+    PMU_EVENT_L2D_REFILL,
+    PMU_EVENT_L1D_TLB_REFILL,
+    PMU_EVENT_BUS_ACCESS,
+};
+
+// Event counters in use: every core is assumed to have the same PMU
+static uint64_t g_pmu_nr_events = 0;
+
+// The region table, collected by bootloader.lds
+extern const struct pmu_region_t bootloader_pmu_regions_start[];
+extern const struct pmu_region_t bootloader_pmu_regions_end[];
+
+void pmu_init(void)
+{
+    uint64_t pmcr, mdcr, nr, i;
+
+    READ_SYSREG_64(pmcr_el0, pmcr);
+    READ_SYSREG_64(mdcr_el2, mdcr);
+
+    // Counters from MDCR_EL2.HPMN up are reserved for EL2, and can't be
+    // read once we've dropped to EL1
+    nr = min((pmcr >> PMCR_EL0_N_SHIFT) & PMCR_EL0_N_MASK, mdcr & MDCR_EL2_HPMN_MASK);
+    nr = min(nr, PMU_NR_COUNTERS - 1);
+
+#ifdef BOOTLOADER_PROFILE
+    // The last counter is the profiler's (see profile.c)
+    nr = min(nr, ((pmcr >> PMCR_EL0_N_SHIFT) & PMCR_EL0_N_MASK) - 1);
+#endif
+
+    for(i = 0; i < nr; ++i) {
+        WRITE_SYSREG_64(pmselr_el0, i);
+        asm volatile("isb" ::: "memory");
+        WRITE_SYSREG_64(pmxevtyper_el0, g_pmu_events[i] | PMU_FILTER);
+    }
+
+    WRITE_SYSREG_64(pmccfiltr_el0, PMU_FILTER);
+    WRITE_SYSREG_64(pmcntenset_el0, PMCNTENSET_EL0_C | ((1UL << nr) - 1));
+    WRITE_SYSREG_64(pmcr_el0, PMCR_EL0_E | PMCR_EL0_P | PMCR_EL0_C | PMCR_EL0_LC);
+    asm volatile("isb" ::: "memory");
+
+    g_pmu_nr_events = nr;
+}
+
+void pmu_read(struct pmu_sample_t *sample)
+{
+    uint64_t i;
+
+    for(i = g_pmu_nr_events + 1; i < PMU_NR_COUNTERS; ++i)
+        sample->counts[i] = 0;
+
+    // Keep the reads from being speculated ahead of the code being measured
+    asm volatile("isb" ::: "memory");
+
+    switch(g_pmu_nr_events) {
+        case 5:
+            READ_SYSREG_64(pmevcntr4_el0, sample->counts[5]);
+            // fallthrough
+        case 4:
+            READ_SYSREG_64(pmevcntr3_el0, sample->counts[4]);
+            // fallthrough
+        case 3:
+            READ_SYSREG_64(pmevcntr2_el0, sample->counts[3]);
+            // fallthrough
+        case 2:
+            READ_SYSREG_64(pmevcntr1_el0, sample->counts[2]);
+            // fallthrough
+        case 1:
+            READ_SYSREG_64(pmevcntr0_el0, sample->counts[1]);
+            // fallthrough
+        default:
+            break;
+    }
+
+    READ_SYSREG_64(pmccntr_el0, sample->counts[PMU_CYCLES]);
+}
+
+void pmu_accumulate(struct pmu_totals_t *totals, const struct pmu_sample_t *start)
+{
+    struct pmu_sample_t now;
+    uint64_t i;
+
+    pmu_read(&now);
+
+    // The cycle counter is 64 bits wide (PMCR_EL0.LC), the event counters 32
+    totals->counts[PMU_CYCLES] += now.counts[PMU_CYCLES] - start->counts[PMU_CYCLES];
+    for(i = PMU_CYCLES + 1; i < PMU_NR_COUNTERS; ++i)
+        totals->counts[i] += (uint32_t)(now.counts[i] - start->counts[i]);
+
+    totals->calls++;
+}
+
+/**
+ * Returns events per thousand instructions.
+ */
+static uint64_t per_kilo_inst(const struct pmu_totals_t *totals, uint64_t counter)
+{
+    uint64_t inst = totals->counts[PMU_INST_RETIRED];
+    return inst ? (totals->counts[counter] * 1000) / inst : 0;
+}
+
+void pmu_print(const char *name, const struct pmu_totals_t *totals)
+{
+    uint64_t cycles = totals->counts[PMU_CYCLES];
+    uint64_t ipc = cycles ? (totals->counts[PMU_INST_RETIRED] * 100) / cycles : 0;
+
+    BOOTLOADER_SUBINFO("%s: %lu call(s), %lu cycles, %lu instructions, IPC %lu.%02lu",
+        name, totals->calls, cycles, totals->counts[PMU_INST_RETIRED],
+        ipc / 100, ipc % 100);
+    BOOTLOADER_SUBINFO("%s: per 1000 instructions: %lu L1D refills, "
+        "%lu L2D refills, %lu TLB refills, %lu bus accesses", name,
+        per_kilo_inst(totals, PMU_L1D_REFILL), per_kilo_inst(totals, PMU_L2D_REFILL),
+        per_kilo_inst(totals, PMU_TLB_REFILL), per_kilo_inst(totals, PMU_BUS_ACCESS));
+}
+
+void pmu_report_regions(void)
+{
+    const struct pmu_region_t *region;
+    struct pmu_totals_t sum;
+    uint64_t cpu, i;
+
+    for(region = bootloader_pmu_regions_start; region < bootloader_pmu_regions_end; ++region) {
+        memset(&sum, 0, sizeof(sum));
+
+        for(cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+            sum.calls += region->totals[cpu].calls;
+            for(i = 0; i < PMU_NR_COUNTERS; ++i)
+                sum.counts[i] += region->totals[cpu].counts[i];
+        }
+
+        if(sum.calls)
+            pmu_print(region->name, &sum);
+    }
+}
@@ -35,6 +35,8 @@ This code is based on a file that contains the following:
 #include <stddef.h>
 #include <stdarg.h>
 #include <microlib.h>
+#include <console.h>
+#include <smp.h>
 
 #define ZEROPAD     (1<<0)  /* Pad with zero */
 #define SIGN        (1<<1)  /* Unsigned/signed long */
@@ -573,23 +575,37 @@ repeat:
   return str - buf;
 }
 
+int bootloader_sprintf(char *buf, const char *fmt, ...)
+{
+  va_list args;
+  int n;
+
+  va_start(args, fmt);
+  n = ee_vsprintf(buf, fmt, args);
+  va_end(args);
+
+  return n;
+}
+
+// Stages print from several cores at once
+static struct smp_lock_t g_printf_lock;
+
 int bootloader_printf(const char *fmt, ...)
 {
-  char buf[1024], *p;
+  char buf[1024];
 
   va_list args;
-  int n=0;
+  int n;
 
   va_start(args, fmt);
-  ee_vsprintf(buf, fmt, args);
+  n = ee_vsprintf(buf, fmt, args);
   va_end(args);
-  p=buf;
 
-  while (*p) {
-    putc(*p, stdin);
-    n++;
-    p++;
-  }
+  // Hand the whole line to the console at once, so it can fill the FIFO,
+  // and so lines from different cores aren't interleaved
+  smp_lock(&g_printf_lock);
+  console_write(buf, n);
+  smp_unlock(&g_printf_lock);
 
   return n;
 }
@@ -0,0 +1,328 @@
+#include "profile.h"
+#include "bootloader.h"
+#include "launch_vmm.h"
+#include "memmap.h"
+#include "microlib.h"
+#include "regs.h"
+#include <libfdt.h>
+
+#define GICD_CTLR                  ( 0x000U )
+#define GICD_ISENABLER(irq)        ( 0x100U + ((irq) / 32) * 4 )
+#define GICD_ICENABLER(irq)        ( 0x180U + ((irq) / 32) * 4 )
+#define GICD_IPRIORITYR(irq)       ( 0x400U + (irq) )
+#define GICD_ITARGETSR(irq)        ( 0x800U + (irq) )
+
+#define GICC_CTLR                  ( 0x00U )
+#define GICC_PMR                   ( 0x04U )
+#define GICC_IAR                   ( 0x0CU )
+#define GICC_EOIR                  ( 0x10U )
+
+// Enables group 0 and group 1 (only group 1 is visible from non-secure
+// state, where the group 0 bit is ignored)
+#define GIC_CTLR_ENABLE            ( 0x3U )
+#define GIC_PRIORITY               ( 0xA0U )
+#define GIC_PRIORITY_MASK          ( 0xF0U )
+#define GIC_IRQ_MASK               ( 0x3FFU )
+#define GIC_SPURIOUS               ( 1023U )
+
+// Device tree interrupt specifiers: <type number flags>
+#define GIC_PPI                    ( 1U )
+#define GIC_SPI_BASE               ( 32U )
+#define GIC_PPI_BASE               ( 16U )
+
+#define PMCR_EL0_E                 ( 1UL << 0 )
+#define PMCR_EL0_N_SHIFT           ( 11 )
+#define PMCR_EL0_N_MASK            ( 0x1FUL )
+#define MDCR_EL2_HPMN_MASK         ( 0x1FUL )
+#define MDCR_EL2_HPME              ( 1UL << 7 )
+
+// Physical IRQs are taken to EL2 (otherwise they target EL1, and are never
+// taken while we run at EL2)
+#define HCR_EL2_IMO                ( 1UL << 4 )
+
+#define PMU_EVENT_CPU_CYCLES       ( 0x11UL )
+#define PMU_FILTER_EL2_ONLY        ( (1UL << 31) | (1UL << 30) | (1UL << 28) | (1UL << 27) )
+
+// Distinct PCs the profiler can count, as a power of two
+#define PROFILE_PC_BITS            ( 12U )
+
+static const char *const g_gic_compatible[] = {
+    "arm,gic-400", "arm,cortex-a15-gic", "arm,cortex-a9-gic",
+};
+
+static const char *const g_pmu_compatible[] = {
+    "arm,armv8-pmuv3", "arm,cortex-a57-pmu", "arm,cortex-a53-pmu",
+};
+
+struct profile_pc_t {
+    uint64_t pc;
+    uint64_t count;
+};
+
+struct profile_t {
+    volatile uint8_t *gicd;
+    volatile uint8_t *gicc;
+    uint32_t irq;
+    uint64_t counter;
+
+    uint64_t samples;
+    uint64_t dropped;
+    struct profile_pc_t pcs[1U << PROFILE_PC_BITS];
+};
+
+static struct profile_t g_profile;
+
+extern char bootloader_start[];
+
+static uint32_t gic_read(volatile uint8_t *base, uint32_t reg)
+{
+    return *(volatile uint32_t *)(base + reg);
+}
+
+static void gic_write(volatile uint8_t *base, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(base + reg) = value;
+}
+
+static int find_compatible(const void *fdt, const char *const *compatible, uint64_t n)
+{
+    uint64_t i;
+    int node;
+
+    for(i = 0; i < n; ++i) {
+        node = fdt_node_offset_by_compatible(fdt, -1, compatible[i]);
+        if(node >= 0)
+            return node;
+    }
+
+    return -1;
+}
+
+/**
+ * Finds the GICv2 distributor and CPU interface.
+ */
+static int64_t find_gic(const void *fdt)
+{
+    struct memmap_range_t reg[2];
+    int node;
+
+    node = find_compatible(fdt, g_gic_compatible,
+        sizeof(g_gic_compatible) / sizeof(g_gic_compatible[0]));
+    if(node < 0 || memmap_node_reg(fdt, node, reg, 2) != 2)
+        return PROFILE_ERR_NO_GIC;
+
+    g_profile.gicd = (volatile uint8_t *)reg[0].start;
+    g_profile.gicc = (volatile uint8_t *)reg[1].start;
+    return 0;
+}
+
+/**
+ * Finds the boot core's PMU interrupt: a PPI, or the first of a list of
+ * per-core SPIs.
+ */
+static int64_t find_pmu_irq(const void *fdt)
+{
+    const uint32_t *interrupts;
+    int node, len;
+
+    node = find_compatible(fdt, g_pmu_compatible,
+        sizeof(g_pmu_compatible) / sizeof(g_pmu_compatible[0]));
+    if(node < 0)
+        return PROFILE_ERR_NO_PMU;
+
+    interrupts = fdt_getprop(fdt, node, "interrupts", &len);
+    if(!interrupts || len < 3 * (int)sizeof(uint32_t))
+        return PROFILE_ERR_NO_PMU;
+
+    g_profile.irq = fdt32_to_cpu(interrupts[1]) +
+        (fdt32_to_cpu(interrupts[0]) == GIC_PPI ? GIC_PPI_BASE : GIC_SPI_BASE);
+    return 0;
+}
+
+static void reload_counter(void)
+{
+    WRITE_SYSREG_64(pmselr_el0, g_profile.counter);
+    asm volatile("isb" ::: "memory");
+    WRITE_SYSREG_64(pmxevcntr_el0, 0x100000000UL - PROFILE_PERIOD);
+}
+
+/**
+ * Claims the last event counter (which pmu.c leaves alone when profiling)
+ * to count EL2 cycles, interrupting when it overflows.
+ */
+static int64_t start_counter(void)
+{
+    uint64_t pmcr, mdcr;
+
+    READ_SYSREG_64(pmcr_el0, pmcr);
+    if(((pmcr >> PMCR_EL0_N_SHIFT) & PMCR_EL0_N_MASK) == 0)
+        return PROFILE_ERR_NO_COUNTER;
+
+    g_profile.counter = ((pmcr >> PMCR_EL0_N_SHIFT) & PMCR_EL0_N_MASK) - 1;
+
+    // Counters from HPMN up are only enabled by MDCR_EL2.HPME
+    READ_SYSREG_64(mdcr_el2, mdcr);
+    if(g_profile.counter >= (mdcr & MDCR_EL2_HPMN_MASK))
+        WRITE_SYSREG_64(mdcr_el2, mdcr | MDCR_EL2_HPME);
+
+    WRITE_SYSREG_64(pmselr_el0, g_profile.counter);
+    asm volatile("isb" ::: "memory");
+    WRITE_SYSREG_64(pmxevtyper_el0, PMU_EVENT_CPU_CYCLES | PMU_FILTER_EL2_ONLY);
+    reload_counter();
+
+    WRITE_SYSREG_64(pmovsclr_el0, 1UL << g_profile.counter);
+    WRITE_SYSREG_64(pmintenset_el1, 1UL << g_profile.counter);
+    WRITE_SYSREG_64(pmcntenset_el0, 1UL << g_profile.counter);
+    WRITE_SYSREG_64(pmcr_el0, pmcr | PMCR_EL0_E);
+    asm volatile("isb" ::: "memory");
+
+    return 0;
+}
+
+static void enable_irq(void)
+{
+    uint32_t irq = g_profile.irq;
+    volatile uint8_t *gicd = g_profile.gicd;
+
+    gicd[GICD_IPRIORITYR(irq)] = GIC_PRIORITY;
+
+    // Reading any of the first eight target registers returns our own
+    // CPU interface's bit
+    if(irq >= GIC_SPI_BASE)
+        gicd[GICD_ITARGETSR(irq)] = gicd[GICD_ITARGETSR(0)];
+
+    gic_write(gicd, GICD_ISENABLER(irq), 1U << (irq % 32));
+    gic_write(gicd, GICD_CTLR, gic_read(gicd, GICD_CTLR) | GIC_CTLR_ENABLE);
+
+    gic_write(g_profile.gicc, GICC_PMR, GIC_PRIORITY_MASK);
+    gic_write(g_profile.gicc, GICC_CTLR,
+        gic_read(g_profile.gicc, GICC_CTLR) | GIC_CTLR_ENABLE);
+}
+
+int64_t profile_start(const void *fdt)
+{
+    uint64_t hcr;
+    int64_t ret;
+
+    if((ret = find_gic(fdt)) == 0 && (ret = find_pmu_irq(fdt)) == 0)
+        ret = start_counter();
+
+    if(ret != 0) {
+        g_profile.gicd = NULL;
+        g_profile.gicc = NULL;
+        return ret;
+    }
+
+    enable_irq();
+
+    READ_SYSREG_64(hcr_el2, hcr);
+    WRITE_SYSREG_64(hcr_el2, hcr | HCR_EL2_IMO);
+    asm volatile("isb\n"
+                 "msr daifclr, #2" ::: "memory");
+
+    return 0;
+}
+
+/**
+ * Counts a sample, in an open addressed table of PCs.
+ */
+static void record(uint64_t pc)
+{
+    uint64_t i, n, mask = (1U << PROFILE_PC_BITS) - 1;
+
+    g_profile.samples++;
+
+    i = ((pc >> 2) * 0x9E3779B97F4A7C15UL) >> (64 - PROFILE_PC_BITS);
+    for(n = 0; n <= mask; ++n, i = (i + 1) & mask) {
+        if(g_profile.pcs[i].pc == pc) {
+            g_profile.pcs[i].count++;
+            return;
+        }
+
+        if(!g_profile.pcs[i].pc) {
+            g_profile.pcs[i].pc = pc;
+            g_profile.pcs[i].count = 1;
+            return;
+        }
+    }
+
+    g_profile.dropped++;
+}
+
+void el2_irq(uint64_t pc)
+{
+    uint32_t iar, irq;
+
+    if(!g_profile.gicc)
+        return;
+
+    iar = gic_read(g_profile.gicc, GICC_IAR);
+    irq = iar & GIC_IRQ_MASK;
+    if(irq == GIC_SPURIOUS)
+        return;
+
+    if(irq == g_profile.irq) {
+        record(pc);
+        WRITE_SYSREG_64(pmovsclr_el0, 1UL << g_profile.counter);
+        reload_counter();
+    }
+
+    gic_write(g_profile.gicc, GICC_EOIR, iar);
+}
+
+void profile_stop(void)
+{
+    uint64_t i, hcr;
+
+    if(!g_profile.gicd)
+        return;
+
+    // IRQs go back to EL1 before we drop to it
+    asm volatile("msr daifset, #2" ::: "memory");
+    READ_SYSREG_64(hcr_el2, hcr);
+    WRITE_SYSREG_64(hcr_el2, hcr & ~HCR_EL2_IMO);
+    asm volatile("isb" ::: "memory");
+    WRITE_SYSREG_64(pmintenclr_el1, 1UL << g_profile.counter);
+    WRITE_SYSREG_64(pmcntenclr_el0, 1UL << g_profile.counter);
+    gic_write(g_profile.gicd, GICD_ICENABLER(g_profile.irq), 1U << (g_profile.irq % 32));
+    g_profile.gicd = NULL;
+
+    BOOTLOADER_INFO("profile: base 0x%lx, %lu samples every %lu cycles, %lu dropped",
+        (uint64_t)bootloader_start, g_profile.samples, (uint64_t)PROFILE_PERIOD,
+        g_profile.dropped);
+
+    for(i = 0; i < (1U << PROFILE_PC_BITS); ++i) {
+        if(g_profile.pcs[i].count)
+            BOOTLOADER_SUBINFO("profile: 0x%lx %lu", g_profile.pcs[i].pc, g_profile.pcs[i].count);
+    }
+}
+
+/**
+ * Samples the boot core from here until it leaves EL2 (see switch_to_el1).
+ * Stages that run on secondary cores aren't sampled. Profiling is optional,
+ * so the boot carries on if it can't be started.
+ */
+boot_ret_t init_profile()
+{
+    const void *fdt;
+    int64_t ret;
+
+    fdt = find_platform_device_tree(g_boot_image);
+    if(!fdt) {
+        BOOTLOADER_ERROR("no platform device tree to find the GIC and PMU in");
+        return BOOT_CONTINUE;
+    }
+
+    ret = profile_start(fdt);
+    if(ret != 0) {
+        BOOTLOADER_ERROR("couldn't start the profiler (%d)", ret);
+        return BOOT_CONTINUE;
+    }
+
+    BOOTLOADER_INFO("Profiling: IRQ %d every %d cycles", g_profile.irq, PROFILE_PERIOD);
+    return BOOT_CONTINUE;
+}
+
+#ifdef BOOTLOADER_PROFILE
+BOOT_PRESTART_STAGE(01, "profile", init_profile, BOOT_STAGE_BOOT_CPU, "el2");
+#endif
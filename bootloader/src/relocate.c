@@ -0,0 +1,164 @@
+#include "bootloader.h"
+#include "cache.h"
+#include "launch_vmm.h"
+#include "memmap.h"
+#include "microlib.h"
+#include <libfdt.h>
+
+#define RELOCATE_ALIGN        ( 0x1000UL )
+
+// FIT load addresses and data positions are single cells, so stay below 4 GiB
+#define RELOCATE_LIMIT        ( 0x100000000UL )
+
+// Where we were loaded, if we moved (see start.s). Kept out of BSS, which
+// is cleared again once we've moved.
+uint64_t g_relocated_from __attribute__((section(".data"))) = 0;
+
+extern char bootloader_start[];
+extern char bootloader_end[];
+
+#ifdef BOOTLOADER_SELF_RELOCATE
+static int overlaps(uint64_t a, uint64_t a_size, uint64_t b, uint64_t b_size)
+{
+    return a < b + b_size && b < a + a_size;
+}
+
+/**
+ * Returns the end of the boot image, including the external data of every
+ * FIT component.
+ */
+static uint64_t boot_image_end(const void *image)
+{
+    uint64_t end = (uint64_t)image + fdt_totalsize(image);
+    const void *data;
+    int images, node, size;
+
+    images = fdt_path_offset(image, "/images");
+    if(images < 0)
+        return end;
+
+    fdt_for_each_subnode(node, image, images) {
+        if(get_component_data(image, node, &data, &size) == SUCCESS)
+            end = max(end, (uint64_t)data + size);
+    }
+
+    return end;
+}
+
+/**
+ * Returns the start of the first region [addr, addr + size) can't be moved
+ * over (our current copy, the image we were passed, the FIT it points to as
+ * its initrd, or reserved memory), or 0 if it's free.
+ */
+static uint64_t find_conflict(const void *fdt, const void *image, const void *fit,
+    uint64_t addr, uint64_t size)
+{
+    uint64_t current = (uint64_t)bootloader_start;
+    struct memmap_range_t reserved[MEMMAP_MAX_RANGES];
+    int n, nr_reserved;
+
+    if(overlaps(addr, size, current, (uint64_t)(bootloader_end - bootloader_start)))
+        return current;
+
+    if(overlaps(addr, size, (uint64_t)image, boot_image_end(image) - (uint64_t)image))
+        return (uint64_t)image;
+
+    if(overlaps(addr, size, (uint64_t)fit, boot_image_end(fit) - (uint64_t)fit))
+        return (uint64_t)fit;
+
+    nr_reserved = memmap_reserved(fdt, reserved, MEMMAP_MAX_RANGES, false);
+    for(n = 0; n < nr_reserved; ++n) {
+        if(overlaps(addr, size, reserved[n].start,
+                    reserved[n].end - reserved[n].start))
+            return reserved[n].start;
+    }
+
+    return 0;
+}
+
+/**
+ * Finds the highest free spot for the bootloader in a DRAM bank.
+ */
+static uint64_t highest_free(const void *fdt, const void *image, const void *fit,
+    uint64_t bank_start, uint64_t bank_end, uint64_t size)
+{
+    uint64_t target, conflict;
+
+    bank_end = min(bank_end, RELOCATE_LIMIT);
+    if(bank_end < bank_start + size)
+        return 0;
+
+    target = (bank_end - size) & ~(RELOCATE_ALIGN - 1);
+    while(target >= bank_start) {
+        conflict = find_conflict(fdt, image, fit, target, size);
+        if(!conflict)
+            return target;
+
+        if(conflict < bank_start + size)
+            return 0;
+
+        target = (conflict - size) & ~(RELOCATE_ALIGN - 1);
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * Decides where the bootloader should move itself to, at startup (called by
+ * start.s before any other C code, with a stack and BSS at the address we
+ * were loaded at, so this mustn't print anything).
+ *
+ * Previous stages tend to load us at the base of DRAM, right where the VMM
+ * and the kernel would like to go. Position independent builds move to the
+ * top of the DRAM bank they were loaded into instead, below anything the
+ * device tree reserves and clear of the boot image, leaving low memory for
+ * payloads that can then be placed without copying.
+ *
+ * @param image The flattened device tree or FIT image we were passed.
+ * @return The address to move to, or 0 to stay where we are.
+ */
+uint64_t bootloader_relocation_target(const void *image)
+{
+#ifdef BOOTLOADER_SELF_RELOCATE
+    uint64_t current = (uint64_t)bootloader_start;
+    uint64_t size = (uint64_t)(bootloader_end - bootloader_start);
+    struct memmap_range_t banks[MEMMAP_MAX_RANGES];
+    const void *fdt, *fit;
+    uint64_t target;
+    int n, nr_banks;
+
+    // As ensure_image_is_accessible(), without reporting a bad header
+    __invalidate_cache_line(image);
+    if(fdt_check_header(image) != 0)
+        return 0;
+
+    __invalidate_cache_region(image, fdt_totalsize(image));
+
+    // The FIT we'll boot may have been passed as the initrd (its header is
+    // checked before anything that could report it)
+    fit = find_boot_image(image);
+
+    fdt = find_platform_device_tree(fit);
+    if(!fdt)
+        return 0;
+
+    nr_banks = memmap_banks(fdt, banks, MEMMAP_MAX_RANGES);
+    for(n = 0; n < nr_banks; ++n) {
+        if(current < banks[n].start || current >= banks[n].end)
+            continue;
+
+        // Only ever move up: we're already as high as we can get
+        target = highest_free(fdt, image, fit, banks[n].start, banks[n].end, size);
+        if(target <= current)
+            return 0;
+
+        g_relocated_from = current;
+        return target;
+    }
+#else
+    (void)image;
+#endif
+
+    return 0;
+}
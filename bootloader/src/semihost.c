@@ -0,0 +1,270 @@
+#include "semihost.h"
+#include "bootloader.h"
+#include "cache.h"
+#include "launch_vmm.h"
+#include "linux.h"
+#include "microlib.h"
+#include "timer.h"
+#include <bfplatform.h>
+#include <libfdt.h>
+
+#define SEMIHOST_SYS_OPEN          ( 0x01UL )
+#define SEMIHOST_SYS_CLOSE         ( 0x02UL )
+#define SEMIHOST_SYS_READ          ( 0x06UL )
+#define SEMIHOST_SYS_FLEN          ( 0x0CUL )
+
+// fopen() mode "rb"
+#define SEMIHOST_OPEN_RB           ( 1UL )
+
+#define SEMIHOST_PAGE_SIZE         ( 0x1000UL )
+#define SEMIHOST_KERNEL_HEADER     ( 64UL )
+
+// Room for the FIT the payloads are described by, most of which is the
+// platform device tree
+#ifndef SEMIHOST_FIT_SIZE
+#define SEMIHOST_FIT_SIZE          ( 0x40000UL )
+#endif
+
+static uint64_t semihost_call(uint64_t op, const uint64_t *args)
+{
+    register uint64_t x0 __asm__("x0") = op;
+    register uint64_t x1 __asm__("x1") = (uint64_t)args;
+
+    asm volatile("hlt #0xf000" : "+r" (x0) : "r" (x1) : "memory");
+    return x0;
+}
+
+int64_t semihost_open(const char *path)
+{
+    uint64_t args[3] = { (uint64_t)path, SEMIHOST_OPEN_RB, strlen(path) };
+    return (int64_t)semihost_call(SEMIHOST_SYS_OPEN, args);
+}
+
+int64_t semihost_length(int64_t handle)
+{
+    uint64_t args[1] = { (uint64_t)handle };
+    return (int64_t)semihost_call(SEMIHOST_SYS_FLEN, args);
+}
+
+int64_t semihost_read(int64_t handle, void *buf, uint64_t len)
+{
+    uint64_t args[3], done = 0, left;
+
+    // SYS_READ returns the number of bytes it didn't read: all of them at
+    // the end of the file, and possibly some before it
+    while(done < len) {
+        args[0] = (uint64_t)handle;
+        args[1] = (uint64_t)buf + done;
+        args[2] = len - done;
+
+        left = semihost_call(SEMIHOST_SYS_READ, args);
+        if(left > len - done)
+            return SEMIHOST_ERR;
+        if(left == len - done)
+            break;
+
+        done = len - left;
+    }
+
+    return done;
+}
+
+void semihost_close(int64_t handle)
+{
+    uint64_t args[1] = { (uint64_t)handle };
+    semihost_call(SEMIHOST_SYS_CLOSE, args);
+}
+
+int64_t semihost_read_component(const struct plan_component_t *c, void *dst)
+{
+    uint64_t start, us;
+    int64_t handle, size;
+
+    handle = semihost_open(c->source);
+    if(handle < 0) {
+        BOOTLOADER_ERROR("couldn't open %s on the host", c->source);
+        return SEMIHOST_ERR;
+    }
+
+    // As with copies, stale lines a previous stage left in the cache would
+    // otherwise be written back over what the host writes
+    __invalidate_cache_region(dst, c->size);
+
+    start = timer_ticks();
+    size = semihost_read(handle, dst, c->size);
+    us = timer_ticks_to_us(timer_ticks() - start);
+    semihost_close(handle);
+
+    if(size != (int64_t)c->size) {
+        BOOTLOADER_ERROR("read %ld of %lu bytes of %s", size, c->size, c->source);
+        return SEMIHOST_ERR;
+    }
+
+    BOOTLOADER_SUBINFO("%s: %lu KiB in %lu ms", c->source, size >> 10, us / 1000);
+    return size;
+}
+
+#ifdef ENABLE_SEMIHOSTING
+
+/**
+ * The payloads read from the host, by FIT component name. Empty paths are
+ * skipped.
+ */
+static const struct {
+    const char *name;
+    const char *path;
+} g_semihost_files[] = {
+    { "vmm", SEMIHOSTING_VMM },
+    { "kernel", SEMIHOSTING_KERNEL },
+    { "ramdisk", SEMIHOSTING_INITRD },
+};
+
+// The FIT is reserved by the plan, so it can't live in the heap (the heap
+// is itself a component of the plan)
+static uint8_t g_semihost_fit[SEMIHOST_FIT_SIZE] __attribute__((aligned(8)));
+
+/**
+ * Reads the platform device tree from the host, into the heap, and returns
+ * its size in size. The caller frees it.
+ */
+static void *read_device_tree(const char *path, int64_t *size)
+{
+    int64_t handle;
+    void *fdt;
+
+    handle = semihost_open(path);
+    if(handle < 0) {
+        BOOTLOADER_ERROR("couldn't open %s on the host", path);
+        return NULL;
+    }
+
+    *size = semihost_length(handle);
+    fdt = *size > 0 ? platform_alloc_rw(*size) : NULL;
+
+    if(fdt && (semihost_read(handle, fdt, *size) != *size ||
+               fdt_check_header(fdt) != 0 || fdt_totalsize(fdt) > (uint64_t)*size)) {
+        platform_free_rw(fdt, *size);
+        fdt = NULL;
+    }
+
+    semihost_close(handle);
+
+    if(!fdt)
+        BOOTLOADER_ERROR("%s isn't a device tree blob", path);
+
+    return fdt;
+}
+
+/**
+ * Describes a host file to the planner, which picks its destination. Only
+ * the kernel's header is read now; the rest is read straight to where the
+ * plan puts it.
+ */
+static int64_t plan_host_file(const void *fit, int node, const char *name,
+    const char *path)
+{
+    struct plan_component_t c = {0};
+    struct linux_image_t header;
+    uint8_t raw[SEMIHOST_KERNEL_HEADER];
+    int64_t handle, size;
+
+    handle = semihost_open(path);
+    if(handle < 0) {
+        BOOTLOADER_ERROR("couldn't open %s on the host", path);
+        return SEMIHOST_ERR;
+    }
+
+    size = semihost_length(handle);
+    if(size > 0 && strcmp(name, "kernel") == 0) {
+        if(semihost_read(handle, raw, sizeof(raw)) != sizeof(raw) ||
+           linux_read_image_header(raw, size, &header) != 0) {
+            BOOTLOADER_ERROR("%s is not a little-endian arm64 Image", path);
+            semihost_close(handle);
+            return SEMIHOST_ERR;
+        }
+    }
+
+    semihost_close(handle);
+
+    if(size <= 0) {
+        BOOTLOADER_ERROR("couldn't read %s on the host", path);
+        return SEMIHOST_ERR;
+    }
+
+    c.name = name;
+    c.image = fit;
+    c.node = node;
+    c.size = size;
+    c.memsz = size;
+    c.align = SEMIHOST_PAGE_SIZE;
+    c.read = semihost_read_component;
+    c.source = path;
+
+    if(strcmp(name, "kernel") == 0) {
+        c.align = LINUX_IMAGE_ALIGN;
+        c.offset = header.text_offset;
+        c.memsz = max(c.memsz, header.image_size);
+    }
+
+    BOOTLOADER_SUBINFO("%s: %s (%lu bytes)", name, path, size);
+    return plan_add(&c);
+}
+
+const void *semihost_boot_image(const void *image)
+{
+    void *fit = g_semihost_fit;
+    const void *fdt = NULL;
+    void *dtb = NULL;
+    int64_t dtb_size = 0;
+    int images, node, ret;
+    uint64_t i;
+
+    BOOTLOADER_INFO("Loading the boot image over semihosting");
+
+    if(SEMIHOSTING_FDT[0])
+        fdt = dtb = read_device_tree(SEMIHOSTING_FDT, &dtb_size);
+    if(!fdt)
+        fdt = find_platform_device_tree(image);
+    if(!fdt) {
+        BOOTLOADER_ERROR("no platform device tree to boot with");
+        return NULL;
+    }
+
+    // The nodes are all added before the plan records their offsets, as
+    // adding a node moves the ones after it
+    ret = fdt_create_empty_tree(fit, SEMIHOST_FIT_SIZE) != 0 ||
+          (images = fdt_add_subnode(fit, 0, "images")) < 0 ||
+          (node = fdt_add_subnode(fit, images, "fdt")) < 0 ||
+          fdt_setprop(fit, node, "data", fdt, fdt_totalsize(fdt)) != 0;
+
+    // The FIT holds its own copy now. Leaving the host's copy on the heap
+    // would make the planner treat the heap as fixed
+    if(dtb)
+        platform_free_rw(dtb, dtb_size);
+
+    if(ret) {
+        BOOTLOADER_ERROR("the device tree doesn't fit in the semihosting FIT");
+        return NULL;
+    }
+
+    for(i = 0; i < sizeof(g_semihost_files) / sizeof(g_semihost_files[0]); ++i) {
+        if(g_semihost_files[i].path[0] && fdt_add_subnode(fit, images, g_semihost_files[i].name) < 0)
+            return NULL;
+    }
+
+    fdt_pack(fit);
+    images = fdt_path_offset(fit, "/images");
+
+    for(i = 0; i < sizeof(g_semihost_files) / sizeof(g_semihost_files[0]); ++i) {
+        if(!g_semihost_files[i].path[0])
+            continue;
+
+        node = fdt_subnode_offset(fit, images, g_semihost_files[i].name);
+        if(plan_host_file(fit, node, g_semihost_files[i].name, g_semihost_files[i].path) != 0)
+            return NULL;
+    }
+
+    return fit;
+}
+
+#endif
@@ -0,0 +1,402 @@
+#include "smp.h"
+#include "el2.h"
+#include "microlib.h"
+#include "pmu.h"
+#include "regs.h"
+#include "timer.h"
+#include <libfdt.h>
+
+#define PSCI_CPU_OFF          ( 0x84000002UL )
+#define PSCI_CPU_ON_64        ( 0xC4000003UL )
+#define PSCI_AFFINITY_INFO_64 ( 0xC4000004UL )
+#define PSCI_SUCCESS          ( 0L )
+#define PSCI_ALREADY_ON       ( -4L )
+#define PSCI_AFFINITY_OFF     ( 1L )
+
+#define MPIDR_AFFINITY_MASK   ( 0xFF00FFFFFFUL )
+
+// How long to wait for a secondary core to report in after CPU_ON, or to
+// power off after CPU_OFF
+#define SMP_TIMEOUT_US        ( 100000UL )
+
+/**
+ * Per-core mailbox used to hand work to a secondary core.
+ *
+ * We run with the MMU off, so all of memory is Device memory and exclusive
+ * accesses can't be relied on. Instead, every field has a single writer:
+ * fn, arg and seq are only written by the boot core, online, ret and ack only
+ * by the secondary core. A call is pending while seq != ack. Writes are
+ * published with a dsb, followed by a sev to wake the other side from wfe.
+ */
+struct smp_mailbox_t {
+    volatile uint64_t fn;
+    volatile uint64_t arg;
+    volatile uint64_t seq;
+
+    volatile uint64_t online;
+    volatile int64_t ret;
+    volatile uint64_t ack;
+} __attribute__((aligned(64)));
+
+static struct smp_mailbox_t g_mailbox[SMP_MAX_CPUS];
+static uint64_t g_mpidr[SMP_MAX_CPUS];
+static uint64_t g_num_cpus = 1;
+
+// A core that timed out coming online (0 if none), see smp_init()
+static uint64_t g_late_cpu;
+
+// Secondary core entry point (start.s), x0 = the core's index
+extern void _secondary_start(void);
+
+static inline void smp_signal(void)
+{
+    asm volatile ("dsb sy\n sev" ::: "memory");
+}
+
+static inline void smp_sleep(void)
+{
+    asm volatile ("wfe" ::: "memory");
+}
+
+static inline void smp_barrier(void)
+{
+    asm volatile ("dsb sy" ::: "memory");
+}
+
+static int64_t psci_call(uint64_t fn, uint64_t arg1, uint64_t arg2, uint64_t arg3)
+{
+    register uint64_t x0 asm("x0") = fn;
+    register uint64_t x1 asm("x1") = arg1;
+    register uint64_t x2 asm("x2") = arg2;
+    register uint64_t x3 asm("x3") = arg3;
+
+    // PSCI is always provided by secure firmware via SMC: at EL2 it's the
+    // only conduit, and after switch_to_el1 SMCs still aren't trapped
+    asm volatile ("smc #0"
+        : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+        :
+        : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12", "x13",
+          "x14", "x15", "x16", "x17", "memory");
+
+    return (int64_t)x0;
+}
+
+/**
+ * Returns true if the device tree says secondary cores can be started with
+ * PSCI through an SMC, which is the only conduit available to us at EL2.
+ */
+static int psci_usable(const void *fdt)
+{
+    const char *method;
+    int node;
+
+    node = fdt_path_offset(fdt, "/psci");
+    if(node < 0)
+        return false;
+
+    method = fdt_getprop(fdt, node, "method", NULL);
+    if(!method || strcmp(method, "smc") != 0) {
+        BOOTLOADER_SUBINFO("PSCI conduit is not SMC, secondary cores unavailable");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Reads a CPU node's MPIDR from its reg property.
+ */
+static int cpu_mpidr(const void *fdt, int node, int address_cells, uint64_t *mpidr)
+{
+    const uint32_t *reg;
+    int len;
+
+    reg = fdt_getprop(fdt, node, "reg", &len);
+    if(!reg || len < address_cells * (int)sizeof(uint32_t))
+        return false;
+
+    if(address_cells == 2)
+        *mpidr = ((uint64_t)fdt32_to_cpu(reg[0]) << 32) | fdt32_to_cpu(reg[1]);
+    else
+        *mpidr = fdt32_to_cpu(reg[0]);
+
+    return true;
+}
+
+static uint64_t timeout_ticks(void)
+{
+    return timer_frequency() * SMP_TIMEOUT_US / 1000000;
+}
+
+static int64_t start_secondary(uint64_t cpu, uint64_t mpidr)
+{
+    struct smp_mailbox_t *mailbox = &g_mailbox[cpu];
+    uint64_t start;
+    int64_t ret;
+
+    ret = psci_call(PSCI_CPU_ON_64, mpidr, (uint64_t)&_secondary_start, cpu);
+    if(ret != PSCI_SUCCESS) {
+        BOOTLOADER_SUBINFO("cpu %d (mpidr 0x%lx): CPU_ON failed (%d)", cpu, mpidr, ret);
+        return SMP_ERR_INVALID_CPU;
+    }
+
+    start = timer_ticks();
+    while(!mailbox->online) {
+        if(timer_ticks() - start > timeout_ticks()) {
+            BOOTLOADER_SUBINFO("cpu %d (mpidr 0x%lx): timed out coming online", cpu, mpidr);
+            return SMP_ERR_TIMEOUT;
+        }
+    }
+
+    return 0;
+}
+
+uint64_t smp_init(const void *fdt)
+{
+    uint64_t self, mpidr;
+    int cpus, node, address_cells;
+    const char *type, *method;
+    int64_t ret;
+
+    BOOTLOADER_INFO("Starting secondary cores");
+
+    if(!fdt || !psci_usable(fdt))
+        goto done;
+
+    cpus = fdt_path_offset(fdt, "/cpus");
+    if(cpus < 0)
+        goto done;
+
+    address_cells = fdt_address_cells(fdt, cpus);
+    READ_SYSREG_64(mpidr_el1, self);
+    self &= MPIDR_AFFINITY_MASK;
+
+    fdt_for_each_subnode(node, fdt, cpus) {
+        if(g_num_cpus == SMP_MAX_CPUS)
+            break;
+
+        type = fdt_getprop(fdt, node, "device_type", NULL);
+        if(!type || strcmp(type, "cpu") != 0)
+            continue;
+
+        if(!cpu_mpidr(fdt, node, address_cells, &mpidr) || mpidr == self)
+            continue;
+
+        method = fdt_getprop(fdt, node, "enable-method", NULL);
+        if(!method || strcmp(method, "psci") != 0)
+            continue;
+
+        // Cores are numbered in the order they come online; the mailboxes
+        // are still zero from BSS clearing, so online can only be set by
+        // the core we just started.
+        ret = start_secondary(g_num_cpus, mpidr);
+        if(ret == 0) {
+            g_mpidr[g_num_cpus] = mpidr;
+            g_num_cpus++;
+        }
+
+        // A core that's slow to come online may still do so later, using
+        // this index's mailbox and stack, so none of them can be reused.
+        // It's kept to be powered off by smp_shutdown().
+        if(ret == SMP_ERR_TIMEOUT) {
+            g_mpidr[g_num_cpus] = mpidr;
+            g_late_cpu = g_num_cpus;
+            break;
+        }
+    }
+
+done:
+    BOOTLOADER_SUBINFO("%d core(s) online", g_num_cpus);
+    return g_num_cpus;
+}
+
+uint64_t smp_num_cpus(void)
+{
+    return g_num_cpus;
+}
+
+uint64_t smp_this_cpu(void)
+{
+    uint64_t mpidr, cpu;
+
+    READ_SYSREG_64(mpidr_el1, mpidr);
+    mpidr &= MPIDR_AFFINITY_MASK;
+
+    for(cpu = 1; cpu < g_num_cpus; ++cpu) {
+        if(g_mpidr[cpu] == mpidr)
+            return cpu;
+    }
+
+    return 0;
+}
+
+int64_t smp_call(uint64_t cpu, smp_fn_t fn, uint64_t arg)
+{
+    struct smp_mailbox_t *mailbox;
+
+    if(cpu == 0 || cpu >= g_num_cpus)
+        return SMP_ERR_INVALID_CPU;
+
+    mailbox = &g_mailbox[cpu];
+    if(mailbox->seq != mailbox->ack)
+        return SMP_ERR_BUSY;
+
+    mailbox->fn = (uint64_t)fn;
+    mailbox->arg = arg;
+    smp_barrier();
+
+    mailbox->seq = mailbox->seq + 1;
+    smp_signal();
+
+    return 0;
+}
+
+int smp_poll(uint64_t cpu, int64_t *ret)
+{
+    struct smp_mailbox_t *mailbox = &g_mailbox[cpu];
+
+    if(mailbox->seq != mailbox->ack)
+        return false;
+
+    if(ret)
+        *ret = mailbox->ret;
+
+    return true;
+}
+
+int64_t smp_wait(uint64_t cpu)
+{
+    int64_t ret = 0;
+
+    while(!smp_poll(cpu, &ret))
+        smp_sleep();
+
+    return ret;
+}
+
+void smp_wait_event(void)
+{
+    smp_sleep();
+}
+
+static int64_t smp_cpu_off(uint64_t arg)
+{
+    (void)arg;
+
+    // Only returns if PSCI refused
+    return psci_call(PSCI_CPU_OFF, 0, 0, 0);
+}
+
+void smp_shutdown(void)
+{
+    uint64_t cpu, start;
+    int64_t ret;
+
+    // A core that came online after smp_init() gave up on it is idling in
+    // smp_secondary_main() like the others
+    if(g_late_cpu && g_mailbox[g_late_cpu].online) {
+        g_num_cpus = g_late_cpu + 1;
+        g_late_cpu = 0;
+    }
+
+    if(g_num_cpus == 1)
+        return;
+
+    BOOTLOADER_INFO("Stopping secondary cores");
+
+    for(cpu = 1; cpu < g_num_cpus; ++cpu) {
+        smp_wait(cpu);
+        smp_call(cpu, smp_cpu_off, 0);
+    }
+
+    // CPU_OFF doesn't return on success, so completion is observed through
+    // AFFINITY_INFO rather than the mailbox
+    for(cpu = 1; cpu < g_num_cpus; ++cpu) {
+        start = timer_ticks();
+        do {
+            ret = psci_call(PSCI_AFFINITY_INFO_64, g_mpidr[cpu], 0, 0);
+        } while(ret != PSCI_AFFINITY_OFF && timer_ticks() - start <= timeout_ticks());
+
+        if(ret != PSCI_AFFINITY_OFF)
+            BOOTLOADER_SUBINFO("cpu %d (mpidr 0x%lx): still on (%d)", cpu, g_mpidr[cpu], ret);
+    }
+
+    g_num_cpus = 1;
+}
+
+void smp_lock(struct smp_lock_t *lock)
+{
+    uint64_t self = smp_this_cpu();
+    uint64_t cpu, ticket = 0;
+
+    // Take a ticket higher than any other core holds
+    lock->choosing[self] = 1;
+    smp_barrier();
+
+    for(cpu = 0; cpu < SMP_MAX_CPUS; ++cpu)
+        ticket = max(ticket, lock->ticket[cpu]);
+
+    lock->ticket[self] = ticket + 1;
+    smp_barrier();
+    lock->choosing[self] = 0;
+    smp_barrier();
+
+    // Then wait for every core with a lower ticket (or the same ticket and a
+    // lower index) to be done
+    for(cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+        if(cpu == self)
+            continue;
+
+        while(lock->choosing[cpu])
+            ;
+
+        while(lock->ticket[cpu] && (lock->ticket[cpu] < lock->ticket[self] ||
+              (lock->ticket[cpu] == lock->ticket[self] && cpu < self)))
+            smp_sleep();
+    }
+
+    smp_barrier();
+}
+
+void smp_unlock(struct smp_lock_t *lock)
+{
+    smp_barrier();
+    lock->ticket[smp_this_cpu()] = 0;
+    smp_signal();
+}
+
+/**
+ * Main loop of a secondary core (called from _secondary_start). Runs every
+ * call posted to the core's mailbox, and never returns.
+ */
+void smp_secondary_main(uint64_t cpu)
+{
+    struct smp_mailbox_t *mailbox = &g_mailbox[cpu];
+    uint64_t seq = 0;
+    int64_t ret;
+
+    // EL2 registers (and PMU counters) are per core
+    el2_apply_profile(false);
+#ifdef BOOTLOADER_PMU
+    pmu_init();
+#endif
+
+    mailbox->online = 1;
+    smp_signal();
+
+    while(1) {
+        while(mailbox->seq == seq)
+            smp_sleep();
+
+        seq = mailbox->seq;
+        smp_barrier();
+
+        ret = ((smp_fn_t)mailbox->fn)(mailbox->arg);
+
+        mailbox->ret = ret;
+        smp_barrier();
+
+        mailbox->ack = seq;
+        smp_signal();
+    }
+}
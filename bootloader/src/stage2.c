@@ -0,0 +1,432 @@
+#include "stage2.h"
+#include "bootloader.h"
+#include "launch_vmm.h"
+#include "linux.h"
+#include "memmap.h"
+#include "microlib.h"
+#include "regs.h"
+#include <bfplatform.h>
+#include <libfdt.h>
+
+#define STAGE2_PAGE_SIZE           ( 0x1000UL )
+#define STAGE2_TABLE_ENTRIES       ( 512UL )
+
+// The largest root table: 4096 concatenated level 1 entries, for 42 bit
+// addresses. The pool is aligned to it, so every table in the pool can be
+// aligned to its size.
+#define STAGE2_MAX_ROOT_SIZE       ( 0x8000UL )
+
+// Entries covered by the contiguous hint with a 4 KiB granule, at every level
+#define STAGE2_CONTIGUOUS_ENTRIES  ( 16UL )
+
+// Physical address sizes, indexed by ID_AA64MMFR0_EL1.PARange. 52 bit
+// addresses need a 64 KiB granule (or LPA2), so those cores are limited to 48.
+static const uint8_t g_pa_bits[] = { 32, 36, 40, 42, 44, 48 };
+#define STAGE2_MAX_PARANGE         ( sizeof(g_pa_bits) / sizeof(g_pa_bits[0]) - 1 )
+
+#define DESC_VALID                 ( 1UL << 0 )
+#define DESC_TABLE                 ( 1UL << 1 )  // or page, at level 3
+#define DESC_MEMATTR_DEVICE        ( 0x1UL << 2 )  // Device-nGnRE
+#define DESC_MEMATTR_NORMAL        ( 0xFUL << 2 )  // Normal, inner/outer write-back
+#define DESC_S2AP_RW               ( 0x3UL << 6 )
+#define DESC_SH_INNER              ( 0x3UL << 8 )
+#define DESC_AF                    ( 1UL << 10 )
+#define DESC_CONTIGUOUS            ( 1UL << 52 )
+#define DESC_XN                    ( 1UL << 54 )
+#define DESC_ADDR_MASK             ( 0x0000FFFFFFFFF000UL )
+
+#define DESC_NORMAL \
+    ( DESC_MEMATTR_NORMAL | DESC_S2AP_RW | DESC_SH_INNER | DESC_AF )
+#define DESC_DEVICE \
+    ( DESC_MEMATTR_DEVICE | DESC_S2AP_RW | DESC_AF | DESC_XN )
+
+#define VTCR_EL2_RES1              ( 1UL << 31 )
+#define VTCR_EL2_T0SZ(bits)        ( (64UL - (bits)) << 0 )
+#define VTCR_EL2_SL0_LEVEL1        ( 1UL << 6 )
+#define VTCR_EL2_SL0_LEVEL0        ( 2UL << 6 )
+#define VTCR_EL2_SH0_INNER         ( 3UL << 12 )
+#define VTCR_EL2_TG0_4K            ( 0UL << 14 )
+#define VTCR_EL2_PS(parange)       ( (uint64_t)(parange) << 16 )
+
+#define HCR_EL2_VM                 ( 1UL << 0 )
+
+#define ID_AA64MMFR0_PARANGE_MASK  ( 0xFUL )
+
+struct stage2_range_t {
+    uint64_t start;
+    uint64_t end;
+    uint64_t type;
+};
+
+/**
+ * The map being built: the ranges of the address space and how they're
+ * mapped, and the pool the translation tables come from.
+ */
+struct stage2_t {
+    uint64_t parange;
+    uint64_t pa_bits;
+    uint64_t root_level;
+    uint64_t root_entries;
+
+    uint64_t nr_ranges;
+    struct stage2_range_t ranges[STAGE2_MAX_RANGES];
+
+    uint8_t *pool;
+    uint64_t pool_used;
+    uint64_t *root;
+
+    struct stage2_stats_t stats;
+};
+
+static struct stage2_t g_stage2;
+
+static uint64_t page_down(uint64_t addr)
+{
+    return addr & ~(STAGE2_PAGE_SIZE - 1);
+}
+
+static uint64_t page_up(uint64_t addr)
+{
+    return (addr + STAGE2_PAGE_SIZE - 1) & ~(STAGE2_PAGE_SIZE - 1);
+}
+
+/**
+ * The shift of the address bits a table at the given level indexes.
+ */
+static uint64_t level_shift(uint64_t level)
+{
+    return 12 + 9 * (3 - level);
+}
+
+/**
+ * Picks the address size and starting level from ID_AA64MMFR0_EL1.PARange.
+ * Up to 42 bits start at level 1, with up to 16 concatenated root tables;
+ * anything larger starts at level 0.
+ */
+static void read_address_size(void)
+{
+    uint64_t mmfr0;
+
+    READ_SYSREG_64(id_aa64mmfr0_el1, mmfr0);
+
+    g_stage2.parange = min(mmfr0 & ID_AA64MMFR0_PARANGE_MASK, STAGE2_MAX_PARANGE);
+    g_stage2.pa_bits = g_pa_bits[g_stage2.parange];
+    g_stage2.root_level = g_stage2.pa_bits <= 42 ? 1 : 0;
+    g_stage2.root_entries =
+        1UL << (g_stage2.pa_bits - level_shift(g_stage2.root_level));
+}
+
+uint64_t stage2_vtcr(void)
+{
+    // The tables are written with the MMU (and so the data cache) off, so
+    // walks are non-cacheable rather than risk hitting stale lines
+    return VTCR_EL2_RES1 |
+        VTCR_EL2_T0SZ(g_stage2.pa_bits) |
+        (g_stage2.root_level == 1 ? VTCR_EL2_SL0_LEVEL1 : VTCR_EL2_SL0_LEVEL0) |
+        VTCR_EL2_SH0_INNER |
+        VTCR_EL2_TG0_4K |
+        VTCR_EL2_PS(g_stage2.parange);
+}
+
+/**
+ * Allocates zeroed table memory from the pool, aligned to its size (up to
+ * STAGE2_MAX_ROOT_SIZE).
+ */
+static uint64_t *table_alloc(uint64_t size)
+{
+    uint64_t offset = (g_stage2.pool_used + size - 1) & ~(size - 1);
+    uint64_t *table;
+
+    if(offset + size > STAGE2_POOL_PAGES * STAGE2_PAGE_SIZE)
+        return NULL;
+
+    table = (uint64_t *)(g_stage2.pool + offset);
+    memset(table, 0, size);
+
+    g_stage2.pool_used = offset + size;
+    g_stage2.stats.tables += size / STAGE2_PAGE_SIZE;
+
+    return table;
+}
+
+/**
+ * Sets [start, end) to the given type, replacing whatever it overlaps.
+ */
+static int64_t set_range(uint64_t start, uint64_t end, uint64_t type)
+{
+    struct stage2_range_t range;
+    uint64_t i = 0;
+
+    if(start >= end)
+        return 0;
+
+    while(i < g_stage2.nr_ranges) {
+        range = g_stage2.ranges[i];
+        if(range.end <= start || end <= range.start) {
+            ++i;
+            continue;
+        }
+
+        // Keep what's left on either side
+        if(range.start < start && end < range.end) {
+            if(g_stage2.nr_ranges == STAGE2_MAX_RANGES)
+                return STAGE2_ERR_TOO_MANY;
+
+            g_stage2.ranges[i].end = start;
+            g_stage2.ranges[g_stage2.nr_ranges].start = end;
+            g_stage2.ranges[g_stage2.nr_ranges].end = range.end;
+            g_stage2.ranges[g_stage2.nr_ranges].type = range.type;
+            g_stage2.nr_ranges++;
+        } else if(range.start < start) {
+            g_stage2.ranges[i].end = start;
+        } else if(end < range.end) {
+            g_stage2.ranges[i].start = end;
+        } else {
+            g_stage2.ranges[i] = g_stage2.ranges[--g_stage2.nr_ranges];
+            continue;
+        }
+
+        ++i;
+    }
+
+    if(type == STAGE2_UNMAPPED)
+        return 0;
+
+    if(g_stage2.nr_ranges == STAGE2_MAX_RANGES)
+        return STAGE2_ERR_TOO_MANY;
+
+    g_stage2.ranges[g_stage2.nr_ranges].start = start;
+    g_stage2.ranges[g_stage2.nr_ranges].end = end;
+    g_stage2.ranges[g_stage2.nr_ranges].type = type;
+    g_stage2.nr_ranges++;
+
+    return 0;
+}
+
+/**
+ * Identity maps [start, end) into a table covering base onwards, using the
+ * largest blocks alignment allows and descending only where it doesn't.
+ * Levels 1 and 2 map blocks (4 KiB granule level 0 entries can't).
+ */
+static int64_t map_range(uint64_t *table, uint64_t level, uint64_t base,
+    uint64_t start, uint64_t end, uint64_t attrs)
+{
+    uint64_t shift = level_shift(level), size = 1UL << shift;
+    uint64_t next, block, *entry, *sub;
+    int64_t ret;
+
+    while(start < end) {
+        block = start & ~(size - 1);
+        next = min(end, block + size);
+        entry = &table[(block - base) >> shift];
+
+        if(level > 0 && start == block && next == block + size) {
+            if(*entry & DESC_VALID)
+                return STAGE2_ERR_OVERLAP;
+
+            *entry = block | attrs | DESC_VALID | (level == 3 ? DESC_TABLE : 0);
+            g_stage2.stats.leaves[level]++;
+        } else {
+            if(!(*entry & DESC_VALID)) {
+                sub = table_alloc(STAGE2_PAGE_SIZE);
+                if(!sub)
+                    return STAGE2_ERR_NO_MEMORY;
+
+                *entry = (uint64_t)sub | DESC_TABLE | DESC_VALID;
+            } else if(!(*entry & DESC_TABLE)) {
+                return STAGE2_ERR_OVERLAP;
+            }
+
+            sub = (uint64_t *)(*entry & DESC_ADDR_MASK);
+            if((ret = map_range(sub, level + 1, block, start, next, attrs)) != 0)
+                return ret;
+        }
+
+        start = next;
+    }
+
+    return 0;
+}
+
+static int is_leaf(uint64_t desc, uint64_t level)
+{
+    if(!(desc & DESC_VALID))
+        return false;
+
+    return level == 3 ? (desc & DESC_TABLE) != 0 : !(desc & DESC_TABLE);
+}
+
+/**
+ * Sets the contiguous hint on every aligned run of 16 leaf entries that map
+ * adjacent memory with the same attributes, so the TLB can hold each run
+ * in a single entry.
+ */
+static void apply_contiguous(uint64_t *table, uint64_t level, uint64_t nr_entries)
+{
+    uint64_t size = 1UL << level_shift(level);
+    uint64_t i, j, first;
+
+    for(i = 0; i < nr_entries; ++i) {
+        if(level < 3 && (table[i] & DESC_VALID) && (table[i] & DESC_TABLE)) {
+            apply_contiguous((uint64_t *)(table[i] & DESC_ADDR_MASK), level + 1,
+                STAGE2_TABLE_ENTRIES);
+        }
+    }
+
+    if(level == 0)
+        return;
+
+    for(i = 0; i + STAGE2_CONTIGUOUS_ENTRIES <= nr_entries;
+            i += STAGE2_CONTIGUOUS_ENTRIES) {
+        first = table[i];
+        for(j = 0; j < STAGE2_CONTIGUOUS_ENTRIES; ++j) {
+            if(!is_leaf(table[i + j], level) ||
+               table[i + j] != first + j * size)
+                break;
+        }
+
+        if(j != STAGE2_CONTIGUOUS_ENTRIES)
+            continue;
+
+        for(j = 0; j < STAGE2_CONTIGUOUS_ENTRIES; ++j)
+            table[i + j] |= DESC_CONTIGUOUS;
+
+        g_stage2.stats.contiguous[level]++;
+    }
+}
+
+/**
+ * Lays out the guest's address space: device memory everywhere, DRAM over
+ * it, then the holes punched for memory the guest mustn't touch.
+ */
+static int64_t read_ranges(const void *fdt, uint64_t tables_start,
+    uint64_t tables_end)
+{
+    struct memmap_range_t ranges[MEMMAP_MAX_RANGES];
+    uint64_t addr, size, i;
+    int n, nr_ranges;
+    int64_t ret;
+
+    g_stage2.nr_ranges = 0;
+
+    if((ret = set_range(0, 1UL << g_stage2.pa_bits, STAGE2_DEVICE)) != 0)
+        return ret;
+
+    nr_ranges = memmap_banks(fdt, ranges, MEMMAP_MAX_RANGES);
+    for(n = 0; n < nr_ranges; ++n) {
+        ret = set_range(page_up(ranges[n].start), page_down(ranges[n].end),
+            STAGE2_NORMAL);
+        if(ret != 0)
+            return ret;
+    }
+
+    nr_ranges = memmap_reserved(fdt, ranges, MEMMAP_MAX_RANGES, true);
+    for(n = 0; n < nr_ranges; ++n) {
+        ret = set_range(page_down(ranges[n].start), page_up(ranges[n].end),
+            STAGE2_UNMAPPED);
+        if(ret != 0)
+            return ret;
+    }
+
+    for(i = 0; linux_reserved_region(i, &addr, &size) == 0; ++i) {
+        if((ret = set_range(page_down(addr), page_up(addr + size), STAGE2_UNMAPPED)) != 0)
+            return ret;
+    }
+
+    // The translation tables themselves
+    return set_range(page_down(tables_start), page_up(tables_end), STAGE2_UNMAPPED);
+}
+
+int64_t stage2_build(const void *fdt, struct stage2_stats_t *stats)
+{
+    uint64_t i, attrs, pool_size = STAGE2_POOL_PAGES * STAGE2_PAGE_SIZE;
+    uint8_t *pool;
+    int64_t ret;
+
+    memset(&g_stage2.stats, 0, sizeof(g_stage2.stats));
+    read_address_size();
+
+    // Allocations aren't guaranteed to be aligned
+    pool = platform_alloc_rw(pool_size + STAGE2_MAX_ROOT_SIZE);
+    if(!pool)
+        return STAGE2_ERR_NO_MEMORY;
+
+    g_stage2.pool = (uint8_t *)(((uint64_t)pool + STAGE2_MAX_ROOT_SIZE - 1) &
+        ~(STAGE2_MAX_ROOT_SIZE - 1));
+    g_stage2.pool_used = 0;
+
+    ret = read_ranges(fdt, (uint64_t)g_stage2.pool, (uint64_t)g_stage2.pool + pool_size);
+    if(ret != 0)
+        return ret;
+
+    g_stage2.root = table_alloc(max(g_stage2.root_entries * sizeof(uint64_t),
+        STAGE2_PAGE_SIZE));
+    if(!g_stage2.root)
+        return STAGE2_ERR_NO_MEMORY;
+
+    for(i = 0; i < g_stage2.nr_ranges; ++i) {
+        attrs = g_stage2.ranges[i].type == STAGE2_NORMAL ? DESC_NORMAL : DESC_DEVICE;
+
+        ret = map_range(g_stage2.root, g_stage2.root_level, 0,
+            g_stage2.ranges[i].start, g_stage2.ranges[i].end, attrs);
+        if(ret != 0)
+            return ret;
+    }
+
+    apply_contiguous(g_stage2.root, g_stage2.root_level, g_stage2.root_entries);
+
+    *stats = g_stage2.stats;
+    return (int64_t)g_stage2.root;
+}
+
+/**
+ * Builds the guest's stage-2 identity map and turns on stage-2 translation
+ * for the boot core. Runs after the VMM has been loaded, so its memory has
+ * been reserved, and before leaving EL2. Secondary cores are brought up by the
+ * guest through PSCI, and are the VMM's to configure.
+ */
+boot_ret_t init_stage2()
+{
+    struct stage2_stats_t stats;
+    const void *fdt;
+    uint64_t hcr;
+    int64_t vttbr;
+
+    fdt = find_platform_device_tree(g_boot_image);
+    if(!fdt) {
+        BOOTLOADER_ERROR("no platform device tree to read the memory map from");
+        return BOOT_FAIL;
+    }
+
+    vttbr = stage2_build(fdt, &stats);
+    if(vttbr < 0) {
+        BOOTLOADER_ERROR("couldn't build the stage-2 translation tables (%d)", vttbr);
+        return BOOT_FAIL;
+    }
+
+    BOOTLOADER_INFO("Stage-2 identity map (%d bit addresses, %d translation tables):",
+        g_stage2.pa_bits, stats.tables);
+    BOOTLOADER_SUBINFO("1G blocks: %d (%d contiguous runs)", stats.leaves[1],
+        stats.contiguous[1]);
+    BOOTLOADER_SUBINFO("2M blocks: %d (%d contiguous runs)", stats.leaves[2],
+        stats.contiguous[2]);
+    BOOTLOADER_SUBINFO("4K pages:  %d (%d contiguous runs)", stats.leaves[3],
+        stats.contiguous[3]);
+
+    WRITE_SYSREG_64(vtcr_el2, stage2_vtcr());
+    WRITE_SYSREG_64(vttbr_el2, vttbr);
+    asm volatile("isb\n"
+                 "tlbi vmalls12e1\n"
+                 "dsb sy\n"
+                 "isb" ::: "memory");
+
+    READ_SYSREG_64(hcr_el2, hcr);
+    WRITE_SYSREG_64(hcr_el2, hcr | HCR_EL2_VM);
+    asm volatile("isb" ::: "memory");
+
+    return BOOT_CONTINUE;
+}
+
+#ifdef ENABLE_STAGE2
+BOOT_POSTSTART_STAGE(00, "stage2", init_stage2, BOOT_STAGE_BOOT_CPU);
+#endif
@@ -7,8 +7,8 @@
 _header:
         b       _bootloader_start
         .long   0               // reserved
-        .quad   0               // Image load offset from start of RAM
-        .quad   0x2000000       // Image size to be processed, little endian (32MiB, default for Pixel C)
+        .quad   bootloader_text_offset  // Image load offset from a 2MiB aligned base
+        .quad   bootloader_image_size   // Effective image size, including BSS and stack
         .quad   0               // reserved
         .quad   0               // reserved
         .quad   0               // reserved
@@ -30,9 +30,11 @@ _header:
 .global _bootloader_start
 _bootloader_start:
     // Reminder: x0 needs to be preserved (needed by bootloader_main())
-    // Setup the bootloader's stack (used for execution in both EL2 and EL1)
+    // Setup the bootloader's stack (used for execution in both EL2 and EL1).
+    // Only PC-relative addressing is safe until we've been relocated.
     // stp     x0, x1
-    ldr     x1, =bootloader_stack_end
+    adrp    x1, bootloader_stack_end
+    add     x1, x1, :lo12:bootloader_stack_end
     mov     x2, sp
     mov     x3, lr
     mov     sp, x1
@@ -55,6 +57,19 @@ _bootloader_start:
     stp     x28, x29, [sp, #-16]!
     stp     x30, xzr, [sp, #-16]!
 
+    // Get C code running where we were loaded. x20-x23 were stashed above,
+    // so they're free to hold state across calls.
+    mov     x23, x0
+    bl      _prepare_image
+
+    // Then move out of the way of the payloads, if that's possible (see
+    // bootloader_relocation_target)
+    mov     x0, x23
+    bl      bootloader_relocation_target
+    cbz     x0, 1f
+    bl      _move_image
+1:  mov     x0, x23
+
     // Clean out the general purpose registers
     mov     x1, xzr
     mov     x2, xzr
@@ -111,3 +126,126 @@ _bootloader_start:
     mov     sp, x2
     mov     lr, x3
     ret
+
+/*
+ * Secondary core entry point, started by smp_init() through PSCI CPU_ON.
+ * The boot core has already relocated the image and cleared BSS.
+ *
+ * x0 = The core's index (1 to SMP_MAX_CPUS - 1), passed as the PSCI context
+ */
+.global _secondary_start
+_secondary_start:
+    // Each secondary core gets a 16 KiB (SMP_STACK_SIZE) stack, core n using
+    // the n-th slot of bootloader_secondary_stacks
+    adrp    x1, bootloader_secondary_stacks
+    add     x1, x1, :lo12:bootloader_secondary_stacks
+    add     x1, x1, x0, lsl #14
+    mov     sp, x1
+
+    bl      smp_secondary_main
+
+    // smp_secondary_main never returns; trap.
+1:  wfe
+    b       1b
+
+/*
+ * Make the image at the address we're running at ready for C code: apply
+ * its relocations, then clear its BSS (which isn't part of the binary).
+ *
+ * Clobbers x0-x6, x22
+ */
+_prepare_image:
+    mov     x22, lr
+
+    // Position independent builds are linked at address zero, so the address
+    // we're running at is also the offset to relocate by. Other builds have
+    // no dynamic relocations, and this does nothing.
+    adr     x1, _header
+    adrp    x2, bootloader_rela_start
+    add     x2, x2, :lo12:bootloader_rela_start
+    adrp    x3, bootloader_rela_end
+    add     x3, x3, :lo12:bootloader_rela_end
+    bl      _apply_relocations
+
+    adrp    x0, bootloader_bss_start
+    add     x0, x0, :lo12:bootloader_bss_start
+    adrp    x1, bootloader_bss_end
+    add     x1, x1, :lo12:bootloader_bss_end
+    bl      _zero_memory
+
+    ret     x22
+
+/*
+ * Move the image, and the stack in use, to a new address, then continue
+ * running there: returns to the caller's copy of the code at the new
+ * address, with the image relocated and its BSS cleared again.
+ *
+ * Relocations are recomputed from their addends, so reapplying them at the
+ * new address is safe even though they were already applied here. .data is
+ * copied as-is.
+ *
+ * x0 = The address to move to (page aligned, not overlapping this copy)
+ *
+ * Clobbers x0-x6, x20-x22
+ */
+_move_image:
+    adr     x1, _header
+    sub     x20, x0, x1
+
+    // Copy everything that's part of the binary
+    adrp    x2, bootloader_bss_start
+    add     x2, x2, :lo12:bootloader_bss_start
+1:  ldp     x3, x4, [x1], #16
+    stp     x3, x4, [x0], #16
+    cmp     x1, x2
+    b.lo    1b
+
+    // Copy the live part of the stack (what's been stashed for the previous
+    // stage), keeping it at the same offset from the new stack's end
+    mov     x1, sp
+    add     x0, x1, x20
+    adrp    x2, bootloader_stack_end
+    add     x2, x2, :lo12:bootloader_stack_end
+2:  cmp     x1, x2
+    b.hs    3f
+    ldp     x3, x4, [x1], #16
+    stp     x3, x4, [x0], #16
+    b       2b
+
+    // The new copy was written through the data side
+3:  dsb     sy
+    ic      iallu
+    dsb     sy
+    isb
+
+    add     sp, sp, x20
+    add     lr, lr, x20
+
+    // Finish in the new copy, which returns to the caller's new copy
+    adr     x21, _prepare_image
+    add     x21, x21, x20
+    br      x21
+
+/*
+ * Apply R_AARCH64_RELATIVE relocations to the image.
+ *
+ * x1 = Offset to relocate by (the image's runtime address minus its link
+ *      address)
+ * x2 = Start of the image's .rela.dyn entries
+ * x3 = End of the image's .rela.dyn entries
+ *
+ * The image is linked with -Bsymbolic, so all relocations of a position
+ * independent build are relative; any other type is skipped. Preserves x0.
+ * Clobbers x2, x4, x5, x6.
+ */
+_apply_relocations:
+1:  cmp     x2, x3
+    b.hs    2f
+    ldp     x4, x5, [x2], #16   // r_offset, r_info
+    ldr     x6, [x2], #8        // r_addend
+    cmp     w5, #1027           // R_AARCH64_RELATIVE
+    b.ne    1b
+    add     x6, x6, x1
+    str     x6, [x4, x1]
+    b       1b
+2:  ret
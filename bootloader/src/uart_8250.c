@@ -0,0 +1,143 @@
+#include "console.h"
+
+/**
+ * 8250/16550 compatible UARTs (including Tegra's).
+ */
+
+#define UART_8250_RBR              ( 0U )
+#define UART_8250_THR              ( 0U )
+#define UART_8250_DLL              ( 0U )
+#define UART_8250_DLM              ( 1U )
+#define UART_8250_FCR              ( 2U )
+#define UART_8250_LCR              ( 3U )
+#define UART_8250_LSR              ( 5U )
+
+#define UART_8250_FCR_ENABLE       ( 1U << 0 )
+#define UART_8250_FCR_CLEAR_RX     ( 1U << 1 )
+#define UART_8250_FCR_CLEAR_TX     ( 1U << 2 )
+#define UART_8250_LCR_8N1          ( 0x03U )
+#define UART_8250_LCR_DLAB         ( 1U << 7 )
+#define UART_8250_LSR_DR           ( 1U << 0 )
+#define UART_8250_LSR_THRE         ( 1U << 5 )
+#define UART_8250_LSR_TEMT         ( 1U << 6 )
+
+// Bytes written each time the transmit FIFO empties (a 16550A's depth)
+#define UART_8250_FIFO_SIZE        ( 16U )
+
+// Furthest the baud rate may be from the one asked for, in percent
+#define UART_8250_BAUD_TOLERANCE   ( 3U )
+
+static const char *const g_uart_8250_compatible[] = {
+    "ns16550a", "ns16550", "ns8250", "snps,dw-apb-uart", "nvidia,tegra20-uart", NULL,
+};
+
+static uint32_t uart_read(struct console_t *console, uint32_t reg)
+{
+    volatile uint8_t *addr = console->base + (reg << console->reg_shift);
+
+    if(console->reg_io_width == 4)
+        return *(volatile uint32_t *)addr;
+
+    return *addr;
+}
+
+static void uart_write(struct console_t *console, uint32_t reg, uint32_t value)
+{
+    volatile uint8_t *addr = console->base + (reg << console->reg_shift);
+
+    if(console->reg_io_width == 4)
+        *(volatile uint32_t *)addr = value;
+    else
+        *addr = (uint8_t)value;
+}
+
+/**
+ * Works out the divisor for a baud rate: from the input clock if it's known,
+ * else by scaling the divisor the previous stage programmed for
+ * CONSOLE_DEFAULT_BAUD.
+ *
+ * @return The divisor, or 0 if the baud rate can't be reached closely enough.
+ */
+static uint64_t baud_divisor(struct console_t *console, uint64_t baud)
+{
+    uint64_t clock = console->clock, divisor, actual;
+    uint32_t lcr;
+
+    if(!clock) {
+        lcr = uart_read(console, UART_8250_LCR);
+        uart_write(console, UART_8250_LCR, lcr | UART_8250_LCR_DLAB);
+        divisor = uart_read(console, UART_8250_DLL) | (uart_read(console, UART_8250_DLM) << 8);
+        uart_write(console, UART_8250_LCR, lcr);
+
+        clock = divisor * 16 * CONSOLE_DEFAULT_BAUD;
+    }
+
+    divisor = (clock + 8 * baud) / (16 * baud);
+    if(!divisor || divisor > 0xFFFF)
+        return 0;
+
+    actual = clock / (16 * divisor);
+    if((actual > baud ? actual - baud : baud - actual) * 100 > baud * UART_8250_BAUD_TOLERANCE)
+        return 0;
+
+    return divisor;
+}
+
+static int64_t uart_8250_setup(struct console_t *console, uint64_t baud)
+{
+    uint64_t divisor = 0;
+
+    if(baud) {
+        divisor = baud_divisor(console, baud);
+        if(!divisor)
+            return CONSOLE_ERR_BAUD;
+    }
+
+    // Let anything already queued go out at the old settings
+    while(!(uart_read(console, UART_8250_LSR) & UART_8250_LSR_TEMT))
+        ;
+
+    uart_write(console, UART_8250_FCR,
+        UART_8250_FCR_ENABLE | UART_8250_FCR_CLEAR_RX | UART_8250_FCR_CLEAR_TX);
+    console->fifo_size = UART_8250_FIFO_SIZE;
+
+    if(divisor) {
+        uart_write(console, UART_8250_LCR, UART_8250_LCR_8N1 | UART_8250_LCR_DLAB);
+        uart_write(console, UART_8250_DLL, divisor & 0xFF);
+        uart_write(console, UART_8250_DLM, (divisor >> 8) & 0xFF);
+        uart_write(console, UART_8250_LCR, UART_8250_LCR_8N1);
+        console->baud = baud;
+    }
+
+    return 0;
+}
+
+static void uart_8250_write(struct console_t *console, const char *buf, uint64_t len)
+{
+    uint64_t burst = console->fifo_size ? console->fifo_size : 1, i;
+
+    while(len) {
+        while(!(uart_read(console, UART_8250_LSR) & UART_8250_LSR_THRE))
+            ;
+
+        for(i = 0; i < burst && i < len; ++i)
+            uart_write(console, UART_8250_THR, (uint8_t)buf[i]);
+
+        buf += i;
+        len -= i;
+    }
+}
+
+static uint64_t uart_8250_read(struct console_t *console, char *buf, uint64_t len)
+{
+    uint64_t i;
+
+    for(i = 0; i < len && (uart_read(console, UART_8250_LSR) & UART_8250_LSR_DR); ++i)
+        buf[i] = (char)uart_read(console, UART_8250_RBR);
+
+    return i;
+}
+
+const struct console_driver_t g_uart_8250 = {
+    "8250", g_uart_8250_compatible, uart_8250_setup, uart_8250_write, uart_8250_read,
+};
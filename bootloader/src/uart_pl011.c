@@ -0,0 +1,132 @@
+#include "console.h"
+
+/**
+ * ARM PrimeCell PL011 UARTs (e.g. QEMU virt's).
+ */
+
+#define UART_PL011_DR              ( 0x000U )
+#define UART_PL011_FR              ( 0x018U )
+#define UART_PL011_IBRD            ( 0x024U )
+#define UART_PL011_FBRD            ( 0x028U )
+#define UART_PL011_LCR_H           ( 0x02CU )
+#define UART_PL011_CR              ( 0x030U )
+
+#define UART_PL011_FR_BUSY         ( 1U << 3 )
+#define UART_PL011_FR_RXFE         ( 1U << 4 )
+#define UART_PL011_FR_TXFF         ( 1U << 5 )
+#define UART_PL011_LCR_H_FEN       ( 1U << 4 )
+#define UART_PL011_LCR_H_WLEN_8    ( 3U << 5 )
+#define UART_PL011_CR_UARTEN       ( 1U << 0 )
+#define UART_PL011_CR_TXE          ( 1U << 8 )
+#define UART_PL011_CR_RXE          ( 1U << 9 )
+
+// The divisor has 6 fractional bits (IBRD.FBRD, in 64ths)
+#define UART_PL011_FBRD_BITS       ( 6U )
+#define UART_PL011_IBRD_MAX        ( 0xFFFFU )
+
+// PL011s have a 32 byte FIFO, though TXFF is checked before every byte
+#define UART_PL011_FIFO_SIZE       ( 32U )
+
+static const char *const g_uart_pl011_compatible[] = {
+    "arm,pl011", "arm,sbsa-uart", NULL,
+};
+
+static uint32_t uart_read(struct console_t *console, uint32_t reg)
+{
+    return *(volatile uint32_t *)(console->base + reg);
+}
+
+static void uart_write(struct console_t *console, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(console->base + reg) = value;
+}
+
+/**
+ * Works out the divisor (in 64ths) for a baud rate: from the input clock if
+ * it's known, else by scaling the divisor the previous stage programmed for
+ * CONSOLE_DEFAULT_BAUD.
+ *
+ * @return The divisor, or 0 if the baud rate is out of range.
+ */
+static uint64_t baud_divisor(struct console_t *console, uint64_t baud)
+{
+    uint64_t divisor;
+
+    // baud = clock / (16 * divisor), so divisor in 64ths = 4 * clock / baud
+    if(console->clock) {
+        divisor = (4 * console->clock + baud / 2) / baud;
+    }
+    else {
+        divisor = (uart_read(console, UART_PL011_IBRD) << UART_PL011_FBRD_BITS) |
+            uart_read(console, UART_PL011_FBRD);
+        divisor = (divisor * CONSOLE_DEFAULT_BAUD + baud / 2) / baud;
+    }
+
+    if((divisor >> UART_PL011_FBRD_BITS) == 0 ||
+       (divisor >> UART_PL011_FBRD_BITS) > UART_PL011_IBRD_MAX)
+        return 0;
+
+    return divisor;
+}
+
+static int64_t uart_pl011_setup(struct console_t *console, uint64_t baud)
+{
+    uint64_t divisor = 0;
+    uint32_t cr;
+
+    if(baud) {
+        divisor = baud_divisor(console, baud);
+        if(!divisor)
+            return CONSOLE_ERR_BAUD;
+    }
+
+    // Let anything already queued go out at the old settings, then disable
+    // the UART while it's reconfigured
+    while(uart_read(console, UART_PL011_FR) & UART_PL011_FR_BUSY)
+        ;
+
+    cr = uart_read(console, UART_PL011_CR);
+    uart_write(console, UART_PL011_CR, 0);
+
+    if(divisor) {
+        uart_write(console, UART_PL011_IBRD, divisor >> UART_PL011_FBRD_BITS);
+        uart_write(console, UART_PL011_FBRD, divisor & ((1U << UART_PL011_FBRD_BITS) - 1));
+        console->baud = baud;
+    }
+
+    // Writing LCR_H also latches the new divisor
+    uart_write(console, UART_PL011_LCR_H, UART_PL011_LCR_H_WLEN_8 | UART_PL011_LCR_H_FEN);
+    uart_write(console, UART_PL011_CR,
+        cr | UART_PL011_CR_UARTEN | UART_PL011_CR_TXE | UART_PL011_CR_RXE);
+
+    console->fifo_size = UART_PL011_FIFO_SIZE;
+    return 0;
+}
+
+static void uart_pl011_write(struct console_t *console, const char *buf, uint64_t len)
+{
+    uint64_t i;
+
+    for(i = 0; i < len; ++i) {
+        while(uart_read(console, UART_PL011_FR) & UART_PL011_FR_TXFF)
+            ;
+
+        uart_write(console, UART_PL011_DR, (uint8_t)buf[i]);
+    }
+}
+
+static uint64_t uart_pl011_read(struct console_t *console, char *buf, uint64_t len)
+{
+    uint64_t i;
+
+    // DR's upper bits flag framing and overrun errors: the byte is returned
+    // anyway, and left to the caller's checksums
+    for(i = 0; i < len && !(uart_read(console, UART_PL011_FR) & UART_PL011_FR_RXFE); ++i)
+        buf[i] = (char)uart_read(console, UART_PL011_DR);
+
+    return i;
+}
+
+const struct console_driver_t g_uart_pl011 = {
+    "pl011", g_uart_pl011_compatible, uart_pl011_setup, uart_pl011_write, uart_pl011_read,
+};
@@ -54,3 +54,33 @@ _launch_linux:
     // We shouldn't ever reach here; trap.
 1:  b       1b
 
+
+/*
+ * Zero a region of memory, 64 bytes at a time where possible.
+ *
+ * With the MMU off all data accesses are to Device memory, where DC ZVA and
+ * unaligned accesses fault, so this uses plain aligned stores.
+ *
+ * x0: Start of the region (16 byte aligned)
+ * x1: End of the region (16 byte aligned)
+ *
+ * Clobbers x0, x1, x2
+ */
+.global _zero_memory
+_zero_memory:
+    sub     x2, x1, x0
+1:  cmp     x2, #64
+    b.lo    2f
+    stp     xzr, xzr, [x0]
+    stp     xzr, xzr, [x0, #16]
+    stp     xzr, xzr, [x0, #32]
+    stp     xzr, xzr, [x0, #48]
+    add     x0, x0, #64
+    sub     x2, x2, #64
+    b       1b
+2:  cmp     x2, #16
+    b.lo    3f
+    stp     xzr, xzr, [x0], #16
+    sub     x2, x2, #16
+    b       2b
+3:  ret
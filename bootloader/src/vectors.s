@@ -0,0 +1,105 @@
+/**
+ * EL2 exception vectors.
+ *
+ * IRQs taken from EL2 itself are handed to el2_irq() (see profile.c), and
+ * return to where they interrupted. Anything else is unexpected: its type,
+ * ESR_EL2, ELR_EL2 and FAR_EL2 are handed to el2_unexpected_exception()
+ * (see el2.c), which doesn't return.
+ */
+
+.macro  push, xreg1, xreg2
+    stp     \xreg1, \xreg2, [sp, #-16]!
+.endm
+
+.macro  pop, xreg1, xreg2
+    ldp     \xreg1, \xreg2, [sp], #16
+.endm
+
+// Each vector is 128 bytes, so there's room to spill the type of an
+// unexpected exception before leaving it
+.macro  unexpected, type
+    .balign 0x80
+    mov     x0, #\type
+    b       _el2_unexpected
+.endm
+
+.text
+.balign 0x800
+.global _el2_vectors
+_el2_vectors:
+    // Current EL, SP_EL0 (unused: EL2 always runs on SP_EL2)
+    unexpected  0
+    unexpected  1
+    unexpected  2
+    unexpected  3
+
+    // Current EL, SP_EL2
+    unexpected  4
+    .balign 0x80
+    b       _el2_irq
+    unexpected  6
+    unexpected  7
+
+    // Lower EL, AArch64
+    unexpected  8
+    unexpected  9
+    unexpected  10
+    unexpected  11
+
+    // Lower EL, AArch32
+    unexpected  12
+    unexpected  13
+    unexpected  14
+    unexpected  15
+
+/*
+ * Saves the registers the C calling convention doesn't preserve, handles
+ * the IRQ and returns to the interrupted code.
+ */
+_el2_irq:
+    push    x0, x1
+    push    x2, x3
+    push    x4, x5
+    push    x6, x7
+    push    x8, x9
+    push    x10, x11
+    push    x12, x13
+    push    x14, x15
+    push    x16, x17
+    push    x18, x29
+    mrs     x0, elr_el2
+    mrs     x1, spsr_el2
+    push    x30, x0
+    push    x1, xzr
+
+    // x0 = the interrupted PC
+    bl      el2_irq
+
+    pop     x1, xzr
+    pop     x30, x0
+    msr     spsr_el2, x1
+    msr     elr_el2, x0
+    pop     x18, x29
+    pop     x16, x17
+    pop     x14, x15
+    pop     x12, x13
+    pop     x10, x11
+    pop     x8, x9
+    pop     x6, x7
+    pop     x4, x5
+    pop     x2, x3
+    pop     x0, x1
+    eret
+
+/*
+ * x0: The vector taken (0-15)
+ */
+_el2_unexpected:
+    mrs     x1, esr_el2
+    mrs     x2, elr_el2
+    mrs     x3, far_el2
+    bl      el2_unexpected_exception
+
+    // Not reached
+1:  wfe
+    b       1b
@@ -0,0 +1,481 @@
+#include "virtio_blk.h"
+#include "bootloader.h"
+#include "memmap.h"
+#include "microlib.h"
+#include "timer.h"
+#include <bfplatform.h>
+#include <libfdt.h>
+
+#define VIRTIO_MMIO_MAGIC_VALUE    ( 0x000U )
+#define VIRTIO_MMIO_VERSION        ( 0x004U )
+#define VIRTIO_MMIO_DEVICE_ID      ( 0x008U )
+#define VIRTIO_MMIO_DEV_FEATURES   ( 0x010U )
+#define VIRTIO_MMIO_DEV_FEAT_SEL   ( 0x014U )
+#define VIRTIO_MMIO_DRV_FEATURES   ( 0x020U )
+#define VIRTIO_MMIO_DRV_FEAT_SEL   ( 0x024U )
+#define VIRTIO_MMIO_GUEST_PAGE     ( 0x028U )
+#define VIRTIO_MMIO_QUEUE_SEL      ( 0x030U )
+#define VIRTIO_MMIO_QUEUE_NUM_MAX  ( 0x034U )
+#define VIRTIO_MMIO_QUEUE_NUM      ( 0x038U )
+#define VIRTIO_MMIO_QUEUE_ALIGN    ( 0x03CU )
+#define VIRTIO_MMIO_QUEUE_PFN      ( 0x040U )
+#define VIRTIO_MMIO_QUEUE_READY    ( 0x044U )
+#define VIRTIO_MMIO_QUEUE_NOTIFY   ( 0x050U )
+#define VIRTIO_MMIO_STATUS         ( 0x070U )
+#define VIRTIO_MMIO_QUEUE_DESC     ( 0x080U )
+#define VIRTIO_MMIO_QUEUE_AVAIL    ( 0x090U )
+#define VIRTIO_MMIO_QUEUE_USED     ( 0x0A0U )
+#define VIRTIO_MMIO_CONFIG         ( 0x100U )
+
+#define VIRTIO_MMIO_MAGIC          ( 0x74726976U )   // "virt"
+#define VIRTIO_MMIO_LEGACY         ( 1U )
+#define VIRTIO_ID_BLOCK            ( 2U )
+
+#define VIRTIO_STATUS_ACKNOWLEDGE  ( 1U << 0 )
+#define VIRTIO_STATUS_DRIVER       ( 1U << 1 )
+#define VIRTIO_STATUS_DRIVER_OK    ( 1U << 2 )
+#define VIRTIO_STATUS_FEATURES_OK  ( 1U << 3 )
+
+#define VIRTIO_BLK_F_SIZE_MAX      ( 1ULL << 1 )
+#define VIRTIO_BLK_F_SEG_MAX       ( 1ULL << 2 )
+#define VIRTIO_BLK_F_BLK_SIZE      ( 1ULL << 6 )
+#define VIRTIO_F_VERSION_1         ( 1ULL << 32 )
+
+// Offsets into struct virtio_blk_config
+#define VIRTIO_BLK_CFG_CAPACITY    ( 0x00U )
+#define VIRTIO_BLK_CFG_SIZE_MAX    ( 0x08U )
+#define VIRTIO_BLK_CFG_SEG_MAX     ( 0x0CU )
+#define VIRTIO_BLK_CFG_BLK_SIZE    ( 0x14U )
+
+#define VIRTIO_BLK_T_IN            ( 0U )
+#define VIRTIO_BLK_S_OK            ( 0U )
+#define VIRTIO_BLK_S_PENDING       ( 0xFFU )
+
+// Requests address 512 byte sectors, whatever the device's block size
+#define VIRTIO_BLK_SECTOR_SIZE     ( 512U )
+
+#define VIRTQ_DESC_F_NEXT          ( 1U )
+#define VIRTQ_DESC_F_WRITE         ( 2U )
+#define VIRTQ_AVAIL_F_NO_INTERRUPT ( 1U )
+
+// The legacy transport wants the used ring on its own page
+#define VIRTQ_SIZE                 ( 128U )
+#define VIRTQ_ALIGN                ( 0x1000UL )
+
+// A device that completes nothing for this long is reset and given up on
+#define VIRTIO_BLK_TIMEOUT_US      ( 5000000UL )
+
+struct virtq_desc_t {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_used_elem_t {
+    uint32_t id;
+    uint32_t len;
+};
+
+/**
+ * What the device reads (the header) and writes (the status) for each
+ * request, besides its data.
+ */
+struct virtio_blk_slot_t {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+    uint8_t status;
+} __attribute__((aligned(32)));
+
+struct virtio_blk_t {
+    volatile uint8_t *base;
+    uint64_t version;
+
+    // The queue: descriptors, then the available ring (flags, idx, ring)
+    // and the used ring (flags, idx, then virtq_used_elem_t entries)
+    uint64_t queue_size;
+    volatile struct virtq_desc_t *desc;
+    volatile uint16_t *avail;
+    volatile uint16_t *used;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+
+    // Request slot n owns descriptors [n * chain_len, (n + 1) * chain_len)
+    volatile struct virtio_blk_slot_t *slots;
+    uint64_t nr_slots;
+    uint64_t chain_len;
+    uint64_t busy;
+
+    uint64_t segment_size;
+    uint64_t request_size;
+    int failed;
+};
+
+static struct virtio_blk_t g_virtio_blk;
+static struct blockdev_t g_virtio_blk_dev;
+
+static uint32_t mmio_read(struct virtio_blk_t *vblk, uint32_t reg)
+{
+    return *(volatile uint32_t *)(vblk->base + reg);
+}
+
+static void mmio_write(struct virtio_blk_t *vblk, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(vblk->base + reg) = value;
+}
+
+static void mmio_write64(struct virtio_blk_t *vblk, uint32_t reg, uint64_t value)
+{
+    mmio_write(vblk, reg, (uint32_t)value);
+    mmio_write(vblk, reg + 4, (uint32_t)(value >> 32));
+}
+
+static uint64_t align_up(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline void virtq_barrier(void)
+{
+    asm volatile ("dsb sy" ::: "memory");
+}
+
+static volatile struct virtq_used_elem_t *used_ring(struct virtio_blk_t *vblk)
+{
+    return (volatile struct virtq_used_elem_t *)(vblk->used + 2);
+}
+
+/**
+ * Queues a read of len bytes (a multiple of the block size) from sector
+ * to dst on a free slot: one descriptor for the header, one for each
+ * segment of dst, and one for the status. The device isn't told until
+ * publish().
+ */
+static void submit(struct virtio_blk_t *vblk, uint64_t slot, uint64_t sector,
+    uint8_t *dst, uint64_t len)
+{
+    volatile struct virtio_blk_slot_t *s = &vblk->slots[slot];
+    uint64_t head = slot * vblk->chain_len, d = head, n;
+
+    s->type = VIRTIO_BLK_T_IN;
+    s->reserved = 0;
+    s->sector = sector;
+    s->status = VIRTIO_BLK_S_PENDING;
+
+    vblk->desc[d].addr = (uint64_t)s;
+    vblk->desc[d].len = 16;
+    vblk->desc[d].flags = VIRTQ_DESC_F_NEXT;
+    vblk->desc[d].next = d + 1;
+
+    for(++d; len; ++d, dst += n, len -= n) {
+        n = min(len, vblk->segment_size);
+        vblk->desc[d].addr = (uint64_t)dst;
+        vblk->desc[d].len = n;
+        vblk->desc[d].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
+        vblk->desc[d].next = d + 1;
+    }
+
+    vblk->desc[d].addr = (uint64_t)&s->status;
+    vblk->desc[d].len = 1;
+    vblk->desc[d].flags = VIRTQ_DESC_F_WRITE;
+    vblk->desc[d].next = 0;
+
+    vblk->avail[2 + vblk->avail_idx % vblk->queue_size] = head;
+    vblk->avail_idx++;
+    vblk->busy |= 1UL << slot;
+}
+
+/**
+ * Makes everything submit() queued visible to the device, and tells it.
+ */
+static void publish(struct virtio_blk_t *vblk)
+{
+    virtq_barrier();
+    vblk->avail[1] = vblk->avail_idx;
+    virtq_barrier();
+    mmio_write(vblk, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+}
+
+/**
+ * Frees the slots of every request the device has completed.
+ *
+ * @return The number of requests completed; ret is set to BLOCKDEV_ERR_IO
+ *      if any of them failed.
+ */
+static uint64_t reap(struct virtio_blk_t *vblk, int64_t *ret)
+{
+    uint64_t done = 0, slot;
+
+    while(vblk->used[1] != vblk->used_idx) {
+        virtq_barrier();
+
+        slot = used_ring(vblk)[vblk->used_idx % vblk->queue_size].id / vblk->chain_len;
+        vblk->used_idx++;
+
+        if(slot >= vblk->nr_slots || !(vblk->busy & (1UL << slot))) {
+            *ret = BLOCKDEV_ERR_IO;
+            continue;
+        }
+
+        if(vblk->slots[slot].status != VIRTIO_BLK_S_OK)
+            *ret = BLOCKDEV_ERR_IO;
+
+        vblk->busy &= ~(1UL << slot);
+        ++done;
+    }
+
+    return done;
+}
+
+static int64_t virtio_blk_read(struct blockdev_t *dev, uint64_t lba, void *buf, uint64_t count)
+{
+    struct virtio_blk_t *vblk = dev->priv;
+    uint64_t sector, left, n, slot, last, timeout;
+    uint8_t *dst = buf;
+    int64_t ret = 0;
+    int queued;
+
+    if(vblk->failed)
+        return BLOCKDEV_ERR_IO;
+    if(lba + count < lba || lba + count > dev->nr_blocks)
+        return BLOCKDEV_ERR_RANGE;
+
+    sector = lba * (dev->block_size / VIRTIO_BLK_SECTOR_SIZE);
+    left = count * dev->block_size;
+    timeout = (VIRTIO_BLK_TIMEOUT_US * timer_frequency()) / 1000000;
+    last = timer_ticks();
+
+    while(left || vblk->busy) {
+
+        // Keep every slot busy until a request fails; the ones already in
+        // flight still have to finish before their buffers are given back
+        queued = 0;
+        for(slot = 0; left && ret == 0 && slot < vblk->nr_slots; ++slot) {
+            if(vblk->busy & (1UL << slot))
+                continue;
+
+            n = min(left, vblk->request_size);
+            submit(vblk, slot, sector, dst, n);
+
+            sector += n / VIRTIO_BLK_SECTOR_SIZE;
+            dst += n;
+            left -= n;
+            queued = 1;
+        }
+
+        if(queued)
+            publish(vblk);
+        if(ret != 0)
+            left = 0;
+
+        if(reap(vblk, &ret)) {
+            last = timer_ticks();
+        }
+        else if(timer_ticks() - last > timeout) {
+            // Resetting the device stops it writing to our buffers
+            BOOTLOADER_ERROR("%s: no response, giving up on it", dev->name);
+            mmio_write(vblk, VIRTIO_MMIO_STATUS, 0);
+            vblk->failed = 1;
+            vblk->busy = 0;
+            return BLOCKDEV_ERR_TIMEOUT;
+        }
+    }
+
+    return ret;
+}
+
+static uint64_t read_features(struct virtio_blk_t *vblk)
+{
+    uint64_t features;
+
+    mmio_write(vblk, VIRTIO_MMIO_DEV_FEAT_SEL, 0);
+    features = mmio_read(vblk, VIRTIO_MMIO_DEV_FEATURES);
+
+    if(vblk->version != VIRTIO_MMIO_LEGACY) {
+        mmio_write(vblk, VIRTIO_MMIO_DEV_FEAT_SEL, 1);
+        features |= (uint64_t)mmio_read(vblk, VIRTIO_MMIO_DEV_FEATURES) << 32;
+    }
+
+    return features;
+}
+
+static void write_features(struct virtio_blk_t *vblk, uint64_t features)
+{
+    mmio_write(vblk, VIRTIO_MMIO_DRV_FEAT_SEL, 0);
+    mmio_write(vblk, VIRTIO_MMIO_DRV_FEATURES, (uint32_t)features);
+
+    if(vblk->version != VIRTIO_MMIO_LEGACY) {
+        mmio_write(vblk, VIRTIO_MMIO_DRV_FEAT_SEL, 1);
+        mmio_write(vblk, VIRTIO_MMIO_DRV_FEATURES, (uint32_t)(features >> 32));
+    }
+}
+
+/**
+ * Sizes requests from the limits the device negotiated: segments of at
+ * most size_max bytes, and at most seg_max of them per request.
+ */
+static void size_requests(struct virtio_blk_t *vblk, struct blockdev_t *dev,
+    uint64_t features)
+{
+    uint64_t size_max = 0, seg_max = 0, segments;
+
+    if(features & VIRTIO_BLK_F_SIZE_MAX)
+        size_max = mmio_read(vblk, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_SIZE_MAX);
+    if(features & VIRTIO_BLK_F_SEG_MAX)
+        seg_max = mmio_read(vblk, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+
+    vblk->segment_size = VIRTIO_BLK_REQUEST_SIZE;
+    if(size_max >= dev->block_size)
+        vblk->segment_size = min(size_max - size_max % dev->block_size, VIRTIO_BLK_REQUEST_SIZE);
+
+    segments = seg_max ? min(seg_max, VIRTIO_BLK_MAX_SEGMENTS) : VIRTIO_BLK_MAX_SEGMENTS;
+    vblk->request_size = min(segments * vblk->segment_size, VIRTIO_BLK_REQUEST_SIZE);
+    vblk->request_size -= vblk->request_size % dev->block_size;
+
+    segments = (vblk->request_size + vblk->segment_size - 1) / vblk->segment_size;
+    vblk->chain_len = segments + 2;
+}
+
+/**
+ * Allocates the queue and the request slots, and hands the queue to the
+ * device.
+ */
+static int64_t setup_queue(struct virtio_blk_t *vblk)
+{
+    uint64_t max, q, avail, used, slots, size;
+    uint8_t *mem;
+
+    mmio_write(vblk, VIRTIO_MMIO_QUEUE_SEL, 0);
+    max = mmio_read(vblk, VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if(max == 0)
+        return BLOCKDEV_ERR_IO;
+
+    q = min(max, VIRTQ_SIZE);
+    vblk->queue_size = q;
+    vblk->nr_slots = min(q / vblk->chain_len, VIRTIO_BLK_MAX_INFLIGHT);
+    if(vblk->nr_slots == 0)
+        return BLOCKDEV_ERR_IO;
+
+    avail = q * sizeof(struct virtq_desc_t);
+    used = align_up(avail + 2 * (3 + q), VIRTQ_ALIGN);
+    slots = align_up(used + 6 + q * sizeof(struct virtq_used_elem_t), 64);
+    size = slots + vblk->nr_slots * sizeof(struct virtio_blk_slot_t);
+
+    mem = platform_alloc_rw(size + VIRTQ_ALIGN);
+    if(!mem)
+        return BLOCKDEV_ERR_IO;
+
+    mem = (uint8_t *)align_up((uint64_t)mem, VIRTQ_ALIGN);
+    memset(mem, 0, size);
+
+    vblk->desc = (volatile struct virtq_desc_t *)mem;
+    vblk->avail = (volatile uint16_t *)(mem + avail);
+    vblk->used = (volatile uint16_t *)(mem + used);
+    vblk->slots = (volatile struct virtio_blk_slot_t *)(mem + slots);
+    vblk->avail[0] = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    mmio_write(vblk, VIRTIO_MMIO_QUEUE_NUM, q);
+
+    if(vblk->version == VIRTIO_MMIO_LEGACY) {
+        mmio_write(vblk, VIRTIO_MMIO_QUEUE_ALIGN, VIRTQ_ALIGN);
+        mmio_write(vblk, VIRTIO_MMIO_QUEUE_PFN, (uint64_t)mem / VIRTQ_ALIGN);
+    }
+    else {
+        mmio_write64(vblk, VIRTIO_MMIO_QUEUE_DESC, (uint64_t)vblk->desc);
+        mmio_write64(vblk, VIRTIO_MMIO_QUEUE_AVAIL, (uint64_t)vblk->avail);
+        mmio_write64(vblk, VIRTIO_MMIO_QUEUE_USED, (uint64_t)vblk->used);
+        mmio_write(vblk, VIRTIO_MMIO_QUEUE_READY, 1);
+    }
+
+    return 0;
+}
+
+/**
+ * Brings up the device (virtio 1.0, section 3.1) and reads its geometry.
+ */
+static int64_t virtio_blk_init(struct virtio_blk_t *vblk, struct blockdev_t *dev)
+{
+    uint64_t features, blk_size, capacity;
+    uint32_t status;
+
+    mmio_write(vblk, VIRTIO_MMIO_STATUS, 0);
+    status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    mmio_write(vblk, VIRTIO_MMIO_STATUS, status);
+
+    features = read_features(vblk) &
+        (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_F_VERSION_1);
+    if(vblk->version != VIRTIO_MMIO_LEGACY && !(features & VIRTIO_F_VERSION_1))
+        return BLOCKDEV_ERR_IO;
+
+    write_features(vblk, features);
+
+    if(vblk->version != VIRTIO_MMIO_LEGACY) {
+        status |= VIRTIO_STATUS_FEATURES_OK;
+        mmio_write(vblk, VIRTIO_MMIO_STATUS, status);
+        if(!(mmio_read(vblk, VIRTIO_MMIO_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+            return BLOCKDEV_ERR_IO;
+    }
+    else {
+        mmio_write(vblk, VIRTIO_MMIO_GUEST_PAGE, VIRTQ_ALIGN);
+    }
+
+    // Reads are in the device's own blocks, if it has a usable size
+    blk_size = VIRTIO_BLK_SECTOR_SIZE;
+    if(features & VIRTIO_BLK_F_BLK_SIZE) {
+        blk_size = mmio_read(vblk, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_BLK_SIZE);
+        if(blk_size < VIRTIO_BLK_SECTOR_SIZE || blk_size > BLOCKDEV_MAX_BLOCK_SIZE ||
+           (blk_size & (blk_size - 1)))
+            blk_size = VIRTIO_BLK_SECTOR_SIZE;
+    }
+
+    capacity = mmio_read(vblk, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY) |
+        ((uint64_t)mmio_read(vblk, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+
+    dev->name = "virtio-blk";
+    dev->block_size = blk_size;
+    dev->nr_blocks = capacity / (blk_size / VIRTIO_BLK_SECTOR_SIZE);
+    dev->read = virtio_blk_read;
+    dev->priv = vblk;
+
+    size_requests(vblk, dev, features);
+    if(setup_queue(vblk) != 0)
+        return BLOCKDEV_ERR_IO;
+
+    mmio_write(vblk, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+    return 0;
+}
+
+struct blockdev_t *virtio_blk_probe(const void *fdt)
+{
+    struct virtio_blk_t *vblk = &g_virtio_blk;
+    struct memmap_range_t reg;
+    int node;
+
+    for(node = fdt_node_offset_by_compatible(fdt, -1, "virtio,mmio"); node >= 0;
+        node = fdt_node_offset_by_compatible(fdt, node, "virtio,mmio")) {
+        if(memmap_node_reg(fdt, node, &reg, 1) != 1)
+            continue;
+
+        // Most transports (e.g. QEMU's 32) have nothing behind them
+        memset(vblk, 0, sizeof(*vblk));
+        vblk->base = (volatile uint8_t *)reg.start;
+        if(mmio_read(vblk, VIRTIO_MMIO_MAGIC_VALUE) != VIRTIO_MMIO_MAGIC ||
+           mmio_read(vblk, VIRTIO_MMIO_DEVICE_ID) != VIRTIO_ID_BLOCK)
+            continue;
+
+        vblk->version = mmio_read(vblk, VIRTIO_MMIO_VERSION);
+        if(virtio_blk_init(vblk, &g_virtio_blk_dev) != 0) {
+            BOOTLOADER_ERROR("couldn't set up the virtio-blk device at 0x%lx", reg.start);
+            mmio_write(vblk, VIRTIO_MMIO_STATUS, 0);
+            continue;
+        }
+
+        BOOTLOADER_SUBINFO("virtio-blk at 0x%lx: %lu MiB, %lu KiB requests, %lu in flight",
+            reg.start, (g_virtio_blk_dev.nr_blocks * g_virtio_blk_dev.block_size) >> 20,
+            vblk->request_size >> 10, vblk->nr_slots);
+        return &g_virtio_blk_dev;
+    }
+
+    return NULL;
+}
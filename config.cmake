@@ -17,7 +17,9 @@ set(FLASH_PATH boot)
 # Build configs
 # ------------------------------------------------------------------------------
 set(BUILD_TARGET_ARCH aarch64)
-set(CMAKE_BUILD_TYPE Debug)
+if(NOT CMAKE_BUILD_TYPE)
+    set(CMAKE_BUILD_TYPE Debug)     # -DCMAKE_BUILD_TYPE=Release for production
+endif()
 set(BUILD_SHARED_LIBS OFF)
 set(BUILD_STATIC_LIBS ON)
 set(ENABLE_BUILD_VMM ON)
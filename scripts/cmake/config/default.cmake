@@ -56,21 +56,296 @@ add_config(
     DESCRIPTION "Build the bareflank bootloader"
 )
 
+add_config(
+    CONFIG_NAME PLATFORM
+    CONFIG_TYPE STRING
+    DEFAULT_VAL jetson-tx1
+    DESCRIPTION "The board to build for, which sets the defaults of the platform specific configs (see scripts/cmake/config/platform)"
+    OPTIONS jetson-tx1 qemu-virt
+)
+
+include(${BOOTLOADER_SOURCE_CONFIG_DIR}/platform/${PLATFORM}.cmake)
+
 add_config(
     CONFIG_NAME BUILD_IMAGE_FORMAT
     CONFIG_TYPE STRING
-    DEFAULT_VAL bin
+    DEFAULT_VAL ${PLATFORM_IMAGE_FORMAT}
     DESCRIPTION "The target image format"
     OPTIONS bin fit shellcode
 )
 
+add_config(
+    CONFIG_NAME BOOTLOADER_LINK_ADDR
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ${PLATFORM_LINK_ADDR}
+    DESCRIPTION "The address the bootloader is linked at (ignored by the position independent shellcode format)"
+)
+
+add_config(
+    CONFIG_NAME EARLY_CONSOLE
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ${PLATFORM_EARLY_CONSOLE}
+    DESCRIPTION "UART used for output until /chosen/stdout-path has been read (see console.c)"
+    OPTIONS 8250 pl011 none
+)
+
+add_config(
+    CONFIG_NAME EARLY_CONSOLE_BASE
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ${PLATFORM_EARLY_CONSOLE_BASE}
+    DESCRIPTION "Physical address of the early console's registers"
+)
+
+add_config(
+    CONFIG_NAME EARLY_CONSOLE_REG_SHIFT
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ${PLATFORM_EARLY_CONSOLE_REG_SHIFT}
+    DESCRIPTION "log2 of the spacing between the early console's registers (8250 only)"
+)
+
+add_config(
+    CONFIG_NAME EL2_PROFILE
+    CONFIG_TYPE STRING
+    DEFAULT_VAL minimal
+    DESCRIPTION "EL2 register profile applied before handing off to EL1 (see el2.c)"
+    OPTIONS minimal firmware
+)
+
+add_config(
+    CONFIG_NAME ENABLE_SELF_RELOCATION
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL ON
+    DESCRIPTION "Move the bootloader to the top of its DRAM bank at startup (shellcode format only)"
+)
+
+add_config(
+    CONFIG_NAME ENABLE_STAGE2
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL OFF
+    DESCRIPTION "Build an identity mapped stage-2 translation table for the guest once the VMM has started"
+)
+
+add_config(
+    CONFIG_NAME ENABLE_VMM_PRELINK
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL ON
+    DESCRIPTION "Relocate the VMM for VMM_LOAD_ADDR at build time instead of at boot"
+)
+
+add_config(
+    CONFIG_NAME VMM_LOAD_ADDR
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ${PLATFORM_VMM_LOAD_ADDR}
+    DESCRIPTION "The physical address the VMM image is loaded at"
+)
+
+add_config(
+    CONFIG_NAME VMM_CALL_BENCHMARK_ITERATIONS
+    CONFIG_TYPE STRING
+    DEFAULT_VAL 0
+    DESCRIPTION "Number of VMM calls to time after the VMM is loaded (0 disables the benchmark)"
+)
+
+add_config(
+    CONFIG_NAME ENABLE_PMU_COUNTERS
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL OFF
+    DESCRIPTION "Count cycles, cache/TLB refills, instructions and bus accesses per boot stage and PMU region (see pmu.h)"
+)
+
+add_config(
+    CONFIG_NAME ENABLE_PROFILER
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL OFF
+    DESCRIPTION "Sample the boot core's PC at EL2 using PMU overflow interrupts (symbolise with scripts/tools/bfprofile.py)"
+)
+
+add_config(
+    CONFIG_NAME PROFILER_PERIOD
+    CONFIG_TYPE STRING
+    DEFAULT_VAL 100000
+    DESCRIPTION "Cycles between profiler samples"
+)
+
+add_config(
+    CONFIG_NAME ENABLE_MEMBENCH
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL OFF
+    DESCRIPTION "Measure DRAM bandwidth and latency at boot, in memory left free, and record the results in /chosen"
+)
+
+add_config(
+    CONFIG_NAME MEMBENCH_SIZE
+    CONFIG_TYPE STRING
+    DEFAULT_VAL 0x800000
+    DESCRIPTION "Bytes in each of the three arrays the memory benchmark streams through"
+)
+
+add_config(
+    CONFIG_NAME ENABLE_SERIAL_DOWNLOAD
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL OFF
+    DESCRIPTION "Wait at boot for scripts/tools/bfsend.py to send a FIT image over the console, and boot it instead"
+)
+
+add_config(
+    CONFIG_NAME SERIAL_DOWNLOAD_ADDR
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ${PLATFORM_SERIAL_DOWNLOAD_ADDR}
+    DESCRIPTION "Physical address a FIT image sent over the console is received at"
+)
+
+add_config(
+    CONFIG_NAME SERIAL_DOWNLOAD_TIMEOUT
+    CONFIG_TYPE STRING
+    DEFAULT_VAL 10
+    DESCRIPTION "Seconds to wait for bfsend.py before booting the image passed to the bootloader"
+)
+
+add_config(
+    CONFIG_NAME ENABLE_DISK_BOOT
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL OFF
+    DESCRIPTION "Load the FIT's components from a virtio block device (a raw or FAT32 partition), instead of from memory"
+)
+
+add_config(
+    CONFIG_NAME DISK_BOOT_OFFSET
+    CONFIG_TYPE STRING
+    DEFAULT_VAL 0
+    DESCRIPTION "Byte offset on the disk of the partition bootloader.fit is written to"
+)
+
+add_config(
+    CONFIG_NAME DISK_BOOT_FILE
+    CONFIG_TYPE STRING
+    DEFAULT_VAL /boot/bootloader.fit
+    DESCRIPTION "Path of bootloader.fit, if the partition (or the first of an MBR there) is FAT32, as 'make flash' leaves it"
+    SKIP_VALIDATION
+)
+
+add_config(
+    CONFIG_NAME ENABLE_SEMIHOSTING
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL OFF
+    DESCRIPTION "Read the VMM, kernel, initrd and device tree from host files over ARM semihosting, instead of from the FIT (needs a debugger or QEMU -semihosting; not with ENABLE_SERIAL_DOWNLOAD or ENABLE_DISK_BOOT)"
+)
+
+add_config(
+    CONFIG_NAME SEMIHOSTING_VMM
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ""
+    DESCRIPTION "Host path of the VMM ELF read over semihosting (bfvmm_static in the VMM prefix if empty)"
+    SKIP_VALIDATION
+)
+
+add_config(
+    CONFIG_NAME SEMIHOSTING_KERNEL
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ""
+    DESCRIPTION "Host path of the Linux Image read over semihosting (none if empty)"
+    SKIP_VALIDATION
+)
+
+add_config(
+    CONFIG_NAME SEMIHOSTING_INITRD
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ""
+    DESCRIPTION "Host path of the initrd read over semihosting (none if empty)"
+    SKIP_VALIDATION
+)
+
+add_config(
+    CONFIG_NAME SEMIHOSTING_FDT
+    CONFIG_TYPE STRING
+    DEFAULT_VAL ""
+    DESCRIPTION "Host path of the device tree blob read over semihosting (the one passed to the bootloader if empty)"
+    SKIP_VALIDATION
+)
+
+add_config(
+    CONFIG_NAME ENABLE_VMM_RELOAD
+    CONFIG_TYPE BOOL
+    DEFAULT_VAL OFF
+    DESCRIPTION "Wait for VMM reload requests (see g_vmm_reload) after loading the VMM"
+)
+
 add_config(
     CONFIG_NAME DEVICE_TREE_SOURCE
     CONFIG_TYPE FILE
-    DEFAULT_VAL ${BOOTLOADER_DEVICE_TREE_DIR}/jetson-tx1-with-kernel-commandline.dts
+    DEFAULT_VAL ${PLATFORM_DEVICE_TREE_SOURCE}
     DESCRIPTION "The device tree source file to be used with this bootloader"
 )
 
+add_config(
+    CONFIG_NAME FIT_KERNEL
+    CONFIG_TYPE FILE
+    DEFAULT_VAL ""
+    DESCRIPTION "Optional Linux kernel Image to include in bootloader.fit"
+    SKIP_VALIDATION
+)
+
+add_config(
+    CONFIG_NAME FIT_RAMDISK
+    CONFIG_TYPE FILE
+    DEFAULT_VAL ""
+    DESCRIPTION "Optional initrd to include in bootloader.fit"
+    SKIP_VALIDATION
+)
+
+add_config(
+    CONFIG_NAME FIT_DEFAULT_ALIGN
+    CONFIG_TYPE STRING
+    DEFAULT_VAL 4k
+    DESCRIPTION "Default alignment of component data in bootloader.fit"
+    OPTIONS 4k 2m
+)
+
+add_config(
+    CONFIG_NAME FIT_DEFAULT_COMPRESSION
+    CONFIG_TYPE STRING
+    DEFAULT_VAL none
+    DESCRIPTION "Default compression of components in bootloader.fit"
+    OPTIONS none lz4
+)
+
+add_config(
+    CONFIG_NAME FIT_DEFAULT_HASH
+    CONFIG_TYPE STRING
+    DEFAULT_VAL crc32
+    DESCRIPTION "Default hash algorithm of components in bootloader.fit (not checked by the bootloader)"
+    OPTIONS none crc32 sha1 sha256
+)
+
+add_config(
+    CONFIG_NAME QEMU_BIN
+    CONFIG_TYPE STRING
+    DEFAULT_VAL qemu-system-aarch64
+    DESCRIPTION "QEMU executable used by the qemu-benchmark target (PLATFORM qemu-virt)"
+)
+
+add_config(
+    CONFIG_NAME QEMU_ICOUNT_SHIFT
+    CONFIG_TYPE STRING
+    DEFAULT_VAL 0
+    DESCRIPTION "qemu-benchmark runs with -icount: each instruction takes 2^QEMU_ICOUNT_SHIFT ns of virtual time"
+)
+
+add_config(
+    CONFIG_NAME QEMU_BENCHMARK_TOLERANCE
+    CONFIG_TYPE STRING
+    DEFAULT_VAL 5
+    DESCRIPTION "Percentage a boot stage may be slower than its baseline before qemu-benchmark fails"
+)
+
+add_config(
+    CONFIG_NAME QEMU_BENCHMARK_BASELINE
+    CONFIG_TYPE FILE
+    DEFAULT_VAL ${BOOTLOADER_SOURCE_ROOT_DIR}/scripts/qemu/qemu-virt.baseline
+    DESCRIPTION "Per-stage boot timings qemu-benchmark compares against"
+    SKIP_VALIDATION
+)
+
 add_config(
     CONFIG_NAME FLASH_DEV
     CONFIG_TYPE FILE
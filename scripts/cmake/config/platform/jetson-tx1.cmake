@@ -0,0 +1,31 @@
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# ------------------------------------------------------------------------------
+# NVIDIA Jetson TX1 (the default platform)
+# ------------------------------------------------------------------------------
+
+# Defaults of the platform specific configs in default.cmake
+set(PLATFORM_IMAGE_FORMAT bin)
+set(PLATFORM_LINK_ADDR 0x80000000)
+set(PLATFORM_DEVICE_TREE_SOURCE ${BOOTLOADER_DEVICE_TREE_DIR}/jetson-tx1-with-kernel-commandline.dts)
+set(PLATFORM_EARLY_CONSOLE 8250)
+set(PLATFORM_EARLY_CONSOLE_BASE 0x70006000)
+set(PLATFORM_EARLY_CONSOLE_REG_SHIFT 2)
+set(PLATFORM_VMM_LOAD_ADDR 0x88000000)
+set(PLATFORM_SERIAL_DOWNLOAD_ADDR 0xA0000000)
@@ -0,0 +1,44 @@
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# ------------------------------------------------------------------------------
+# QEMU "virt" machine (see scripts/device_tree/qemu-virt.dts)
+# ------------------------------------------------------------------------------
+
+# RAM is 2 GiB from 0x40000000. QEMU's -kernel loads the bootloader at its
+# Linux header's text offset from the start of RAM (0x40080000), and -initrd
+# loads bootloader.fit 128 MiB in (0x48000000), leaving the top 1.5 GiB for
+# the VMM and the components the planner places. A FIT sent over the console
+# is received after the one -initrd loaded, which is booted if the download
+# fails, with 256 MiB of room below the VMM.
+set(PLATFORM_IMAGE_FORMAT fit)
+set(PLATFORM_LINK_ADDR 0x40080000)
+set(PLATFORM_DEVICE_TREE_SOURCE ${BOOTLOADER_DEVICE_TREE_DIR}/qemu-virt.dts)
+set(PLATFORM_EARLY_CONSOLE pl011)
+set(PLATFORM_EARLY_CONSOLE_BASE 0x09000000)
+set(PLATFORM_EARLY_CONSOLE_REG_SHIFT 0)
+set(PLATFORM_VMM_LOAD_ADDR 0x60000000)
+set(PLATFORM_SERIAL_DOWNLOAD_ADDR 0x50000000)
+
+# The machine qemu-virt.dts describes
+set(PLATFORM_QEMU_MACHINE
+    -machine virt,virtualization=on,gic-version=2
+    -cpu cortex-a57
+    -smp 4
+    -m 2G
+)
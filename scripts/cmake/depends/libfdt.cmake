@@ -22,10 +22,19 @@ if(ENABLE_BUILD_BOOTLOADER AND NOT WIN32)
         "-std=gnu99 "
     )
 
+    if(BUILD_IMAGE_FORMAT STREQUAL "shellcode")
+        string(APPEND LIBFDT_C_FLAGS "-fpie ")
+    endif()
+
+    # Release builds are linked into the bootloader with LTO and section
+    # garbage collection (see bootloader/src/CMakeLists.txt). The archive
+    # needs the LTO plugin's symbol index, so it's created with gcc-ar.
     if(${CMAKE_BUILD_TYPE} STREQUAL "Release")
-        string(CONCAT LIBFDT_C_FLAGS "-O3 ")
+        string(APPEND LIBFDT_C_FLAGS "-Os -ffunction-sections -fdata-sections -flto ")
+        set(LIBFDT_AR /usr/bin/aarch64-linux-gnu-gcc-ar)
     else()
-        string(CONCAT LIBFDT_C_FLAGS "-Os -g ")
+        string(APPEND LIBFDT_C_FLAGS "-Os -g ")
+        set(LIBFDT_AR /usr/bin/aarch64-linux-gnu-ar)
     endif()
 
     download_dependency(
@@ -42,6 +51,7 @@ if(ENABLE_BUILD_BOOTLOADER AND NOT WIN32)
             make -C ${LIBFDT_BUILD_DIR} libfdt
             NO_PYTHON=1
             CC=${LIBFDT_C_COMPILER}
+            AR=${LIBFDT_AR}
             CFLAGS=${LIBFDT_C_FLAGS}
         INSTALL_COMMAND
             COMMAND ${CMAKE_COMMAND} -E copy_if_different
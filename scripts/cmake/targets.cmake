@@ -1,8 +1,14 @@
 add_custom_target_category("Bareflank ARM Bootloader")
 
+# Disk boot builds read bootloader.fit from the same FAT32 partition
+set(FLASH_FILES ${VMM_PREFIX_PATH}/boot/bootloader.bin)
+if(ENABLE_DISK_BOOT AND BUILD_IMAGE_FORMAT STREQUAL "fit")
+    list(APPEND FLASH_FILES ${VMM_PREFIX_PATH}/boot/bootloader.fit)
+endif()
+
 add_custom_target(flash
     COMMAND mount ${FLASH_DEV} ${FLASH_MOUNT}
-    COMMAND cp ${VMM_PREFIX_PATH}/boot/bootloader.bin ${FLASH_MOUNT}/${FLASH_PATH}
+    COMMAND cp ${FLASH_FILES} ${FLASH_MOUNT}/${FLASH_PATH}
     COMMAND sync
     COMMAND umount ${FLASH_MOUNT}
     USES_TERMINAL
@@ -10,5 +16,56 @@ add_custom_target(flash
 
 add_custom_target_info(
     TARGET flash
-    COMMENT "Mount ${FLASH_DEV} to ${FLASH_MOUNT}, install bootloader.bin to ${FLASH_MOUNT}/${FLASH_PATH}"
+    COMMENT "Mount ${FLASH_DEV} to ${FLASH_MOUNT}, install bootloader.bin (and bootloader.fit) to ${FLASH_MOUNT}/${FLASH_PATH}"
 )
+
+if(PLATFORM STREQUAL "qemu-virt")
+    find_program(PYTHON_BIN python3)
+
+    # -icount makes the guest's timer count instructions rather than host
+    # time, so the same build reports the same stage timings on any machine
+    set(BFQEMU_ARGS
+        --qemu ${QEMU_BIN}
+        --baseline ${QEMU_BENCHMARK_BASELINE}
+        --tolerance ${QEMU_BENCHMARK_TOLERANCE}
+        --log ${CMAKE_BINARY_DIR}/qemu-benchmark.log
+        --
+        ${PLATFORM_QEMU_MACHINE}
+        -icount shift=${QEMU_ICOUNT_SHIFT},sleep=off
+        -kernel ${VMM_PREFIX_PATH}/boot/bootloader.bin
+        -nographic
+    )
+
+    # Semihosting builds read their payloads from the host instead of a FIT,
+    # and disk boot builds read the FIT from a virtio disk
+    if(ENABLE_SEMIHOSTING)
+        list(APPEND BFQEMU_ARGS -semihosting-config enable=on,target=native)
+    elseif(ENABLE_DISK_BOOT)
+        list(APPEND BFQEMU_ARGS
+            -drive if=none,format=raw,readonly=on,id=boot,file=${VMM_PREFIX_PATH}/boot/bootloader.fit
+            -device virtio-blk-device,drive=boot
+        )
+    else()
+        list(APPEND BFQEMU_ARGS -initrd ${VMM_PREFIX_PATH}/boot/bootloader.fit)
+    endif()
+
+    add_custom_target(qemu-benchmark
+        COMMAND ${PYTHON_BIN} ${BOOTLOADER_SOURCE_ROOT_DIR}/scripts/tools/bfqemu.py ${BFQEMU_ARGS}
+        USES_TERMINAL
+    )
+
+    add_custom_target_info(
+        TARGET qemu-benchmark
+        COMMENT "Boot in ${QEMU_BIN}, failing if a stage is over ${QEMU_BENCHMARK_TOLERANCE}% slower than its baseline"
+    )
+
+    add_custom_target(qemu-benchmark-baseline
+        COMMAND ${PYTHON_BIN} ${BOOTLOADER_SOURCE_ROOT_DIR}/scripts/tools/bfqemu.py --update ${BFQEMU_ARGS}
+        USES_TERMINAL
+    )
+
+    add_custom_target_info(
+        TARGET qemu-benchmark-baseline
+        COMMENT "Boot in ${QEMU_BIN}, writing the stage timings to ${QEMU_BENCHMARK_BASELINE}"
+    )
+endif()
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""
+Minimal LZ4 frame compressor.
+
+Produces standard LZ4 frames (readable by the lz4 command line tool) with
+independent blocks and the content size recorded in the frame header, which
+is what the bootloader's decompressor (bootloader/src/lz4.c) expects. Only
+the standard library is used so no extra host packages are needed.
+"""
+
+import struct
+
+LZ4_MAGIC = 0x184D2204
+
+MIN_MATCH = 4
+LAST_LITERALS = 5
+MF_LIMIT = 12
+MAX_OFFSET = 65535
+
+BLOCK_SIZE_ID = {64 << 10: 4, 256 << 10: 5, 1 << 20: 6, 4 << 20: 7}
+
+PRIME32_1 = 2654435761
+PRIME32_2 = 2246822519
+PRIME32_3 = 3266489917
+PRIME32_4 = 668265263
+PRIME32_5 = 374761393
+
+
+def _rotl32(x, r):
+    return ((x << r) | (x >> (32 - r))) & 0xffffffff
+
+
+def xxh32(data, seed=0):
+    """ xxHash32, used for the frame header checksum """
+
+    n = len(data)
+    i = 0
+    mask = 0xffffffff
+
+    if n >= 16:
+        v = [(seed + PRIME32_1 + PRIME32_2) & mask, (seed + PRIME32_2) & mask,
+             seed & mask, (seed - PRIME32_1) & mask]
+        while i + 16 <= n:
+            for j in range(4):
+                lane = struct.unpack_from('<I', data, i + j * 4)[0]
+                v[j] = (_rotl32((v[j] + lane * PRIME32_2) & mask, 13) * PRIME32_1) & mask
+            i += 16
+        h = (_rotl32(v[0], 1) + _rotl32(v[1], 7) + _rotl32(v[2], 12) + _rotl32(v[3], 18)) & mask
+    else:
+        h = (seed + PRIME32_5) & mask
+
+    h = (h + n) & mask
+
+    while i + 4 <= n:
+        lane = struct.unpack_from('<I', data, i)[0]
+        h = (_rotl32((h + lane * PRIME32_3) & mask, 17) * PRIME32_4) & mask
+        i += 4
+
+    while i < n:
+        h = (_rotl32((h + data[i] * PRIME32_5) & mask, 11) * PRIME32_1) & mask
+        i += 1
+
+    h ^= h >> 15
+    h = (h * PRIME32_2) & mask
+    h ^= h >> 13
+    h = (h * PRIME32_3) & mask
+    h ^= h >> 16
+    return h
+
+
+def _put_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def _put_sequence(out, literals, offset, match_len):
+    lit_len = len(literals)
+    token = min(lit_len, 15) << 4
+
+    if offset:
+        token |= min(match_len - MIN_MATCH, 15)
+
+    out.append(token)
+    if lit_len >= 15:
+        _put_length(out, lit_len - 15)
+    out += literals
+
+    if offset:
+        out += struct.pack('<H', offset)
+        if match_len - MIN_MATCH >= 15:
+            _put_length(out, match_len - MIN_MATCH - 15)
+
+
+def compress_block(src):
+    """ Greedy single-pass LZ4 block compression """
+
+    n = len(src)
+    out = bytearray()
+
+    anchor = 0
+    i = 0
+    misses = 0
+    table = {}
+
+    match_limit = n - LAST_LITERALS
+    start_limit = n - MF_LIMIT
+
+    while i < start_limit:
+        key = src[i:i + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = i
+
+        if candidate is None or i - candidate > MAX_OFFSET:
+            # Skip ahead faster through incompressible data
+            misses += 1
+            i += 1 + (misses >> 6)
+            continue
+
+        misses = 0
+        length = MIN_MATCH
+        while i + length + 64 <= match_limit and \
+                src[candidate + length:candidate + length + 64] == src[i + length:i + length + 64]:
+            length += 64
+        while i + length < match_limit and src[candidate + length] == src[i + length]:
+            length += 1
+
+        _put_sequence(out, src[anchor:i], i - candidate, length)
+
+        i += length
+        anchor = i
+
+    _put_sequence(out, src[anchor:], 0, 0)
+    return bytes(out)
+
+
+def compress(data, block_size=4 << 20):
+    """ Returns data as an LZ4 frame """
+
+    flg = (1 << 6) | (1 << 5) | (1 << 3)
+    bd = BLOCK_SIZE_ID[block_size] << 4
+    descriptor = struct.pack('<BBQ', flg, bd, len(data))
+
+    out = bytearray(struct.pack('<I', LZ4_MAGIC))
+    out += descriptor
+    out.append((xxh32(descriptor) >> 8) & 0xff)
+
+    for off in range(0, len(data), block_size):
+        raw = data[off:off + block_size]
+        block = compress_block(raw)
+
+        if len(block) >= len(raw):
+            out += struct.pack('<I', len(raw) | 0x80000000)
+            out += raw
+        else:
+            out += struct.pack('<I', len(block))
+            out += block
+
+    out += struct.pack('<I', 0)
+    return bytes(out)
@@ -0,0 +1,336 @@
+#!/usr/bin/env python3
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""
+Builds the bootloader's flattened image tree (bootloader.fit).
+
+Every component is stored as external data after the FIT's device tree
+blob, at an absolute "data-position" aligned to a 4 KiB or 2 MiB boundary.
+Components that are loaded to an address with the same alignment can then
+be used in place, or mapped with block descriptors, without being copied
+first. Each component can optionally be LZ4 compressed and hashed.
+
+Load addresses are optional: components without one are placed by the
+bootloader's placement planner, based on the platform's memory map.
+"""
+
+import argparse
+import hashlib
+import re
+import struct
+import sys
+import zlib
+
+import bflz4
+
+FDT_MAGIC = 0xd00dfeed
+FDT_BEGIN_NODE = 1
+FDT_END_NODE = 2
+FDT_PROP = 3
+FDT_END = 9
+
+ALIGNMENTS = {'4k': 0x1000, '2m': 0x200000}
+COMPRESSIONS = ['none', 'lz4']
+HASHES = ['none', 'crc32', 'sha1', 'sha256']
+
+# name: (FIT image type, os)
+COMPONENTS = {
+    'bootloader': ('kernel', 'linux'),
+    'vmm': ('kernel', 'linux'),
+    'fdt': ('flat_dt', None),
+    'kernel': ('kernel', 'linux'),
+    'ramdisk': ('ramdisk', 'linux'),
+}
+
+
+class FdtWriter(object):
+    """ Serializes a device tree blob (version 17) """
+
+    def __init__(self):
+        self.struct = bytearray()
+        self.strings = bytearray()
+        self.string_offsets = {}
+
+    def _pad(self):
+        while len(self.struct) % 4:
+            self.struct.append(0)
+
+    def begin_node(self, name):
+        self.struct += struct.pack('>I', FDT_BEGIN_NODE)
+        self.struct += name.encode('ascii') + b'\0'
+        self._pad()
+
+    def end_node(self):
+        self.struct += struct.pack('>I', FDT_END_NODE)
+
+    def prop(self, name, value):
+        if name not in self.string_offsets:
+            self.string_offsets[name] = len(self.strings)
+            self.strings += name.encode('ascii') + b'\0'
+
+        self.struct += struct.pack('>III', FDT_PROP, len(value), self.string_offsets[name])
+        self.struct += value
+        self._pad()
+
+    def prop_string(self, name, *values):
+        self.prop(name, b''.join(v.encode('ascii') + b'\0' for v in values))
+
+    def prop_u32(self, name, *values):
+        self.prop(name, b''.join(struct.pack('>I', v) for v in values))
+
+    def prop_u64(self, name, *values):
+        self.prop(name, b''.join(struct.pack('>Q', v) for v in values))
+
+    def finish(self):
+        body = self.struct + struct.pack('>I', FDT_END)
+
+        off_rsvmap = 40
+        off_struct = off_rsvmap + 16
+        off_strings = off_struct + len(body)
+        total = off_strings + len(self.strings)
+
+        header = struct.pack('>10I', FDT_MAGIC, total, off_struct, off_strings,
+                             off_rsvmap, 17, 16, 0, len(self.strings), len(body))
+
+        return header + bytes(16) + bytes(body) + bytes(self.strings)
+
+
+class Component(object):
+    def __init__(self, name, path):
+        self.name = name
+        self.path = path
+        self.load = None
+        self.entry = None
+        self.align = '4k'
+        self.compression = 'none'
+        self.hash = 'crc32'
+        self.properties = []
+        self.position = 0
+
+        with open(path, 'rb') as f:
+            self.raw = f.read()
+
+    def encode(self):
+        if self.compression == 'lz4':
+            self.data = bflz4.compress(self.raw)
+        else:
+            self.data = self.raw
+
+    def digest(self):
+        # Hash nodes cover the data as stored (i.e. compressed), which is
+        # what mkimage and U-Boot verify
+        if self.hash == 'crc32':
+            return struct.pack('>I', zlib.crc32(self.data) & 0xffffffff)
+        return hashlib.new(self.hash, self.data).digest()
+
+
+def parse_dtsi(path):
+    """
+    Reads the properties of a generated device tree fragment such as the one
+    written by bfprelink.py. Only 64-bit cell properties are supported.
+    """
+
+    properties = []
+    with open(path) as f:
+        text = re.sub(r'/\*.*?\*/', '', f.read(), flags=re.S)
+
+    for name, cells in re.findall(r'([\w,.-]+)\s*=\s*/bits/\s*64\s*<([^>]*)>\s*;', text):
+        properties.append((name, [int(c, 0) for c in cells.split()]))
+
+    return properties
+
+
+def arm64_image_header(raw):
+    """
+    Returns the text_offset, image_size and flags of an arm64 Linux Image,
+    so that the bootloader can plan where a compressed kernel goes before
+    decompressing it.
+    """
+
+    if len(raw) < 64 or raw[56:60] != b'ARM\x64':
+        sys.exit('bfmkfit: kernel is not an arm64 Image')
+
+    return struct.unpack_from('<QQQ', raw, 8)
+
+
+def align_up(value, align):
+    return (value + align - 1) & ~(align - 1)
+
+
+def build(components, description):
+    def tree():
+        fdt = FdtWriter()
+        fdt.begin_node('')
+        fdt.prop_string('description', description)
+        fdt.prop_u32('#address-cells', 1)
+
+        fdt.begin_node('images')
+        for c in components:
+            image_type, image_os = COMPONENTS[c.name]
+
+            fdt.begin_node(c.name)
+            fdt.prop_string('description', c.name)
+            fdt.prop_u32('data-position', c.position)
+            fdt.prop_u32('data-size', len(c.data))
+            fdt.prop_string('type', image_type)
+            fdt.prop_string('arch', 'arm64')
+            if image_os:
+                fdt.prop_string('os', image_os)
+            fdt.prop_string('compression', c.compression)
+            if c.compression != 'none':
+                fdt.prop_u32('bareflank,uncompressed-size', len(c.raw))
+            if c.name == 'kernel' and c.compression != 'none':
+                fdt.prop_u64('bareflank,image-header', *arm64_image_header(c.raw))
+            if c.load is not None:
+                fdt.prop_u32('load', c.load)
+            if c.entry is not None:
+                fdt.prop_u32('entry', c.entry)
+            for name, cells in c.properties:
+                fdt.prop_u64(name, *cells)
+
+            if c.hash != 'none':
+                fdt.begin_node('hash-1')
+                fdt.prop_string('algo', c.hash)
+                fdt.prop('value', c.digest())
+                fdt.end_node()
+
+            fdt.end_node()
+        fdt.end_node()
+
+        names = [c.name for c in components]
+        fdt.begin_node('configurations')
+        fdt.prop_string('default', 'conf-1')
+        fdt.begin_node('conf-1')
+        fdt.prop_string('description', description)
+        fdt.prop_string('kernel', 'bootloader')
+        if 'fdt' in names:
+            fdt.prop_string('fdt', 'fdt')
+        loadables = [n for n in names if n not in ('bootloader', 'fdt')]
+        if loadables:
+            fdt.prop_string('loadables', *loadables)
+        fdt.end_node()
+        fdt.end_node()
+
+        fdt.end_node()
+        return fdt.finish()
+
+    # Data positions are fixed width cells, so the size of the tree does not
+    # depend on their values: lay the data out after a first pass.
+    # An uncompressed kernel can only run in place if the memory after it is
+    # free for its BSS, so the next component starts after its image_size.
+    end = len(tree())
+    for c in components:
+        c.position = align_up(end, ALIGNMENTS[c.align])
+        end = c.position + len(c.data)
+        if c.name == 'kernel' and c.compression == 'none':
+            end = max(end, c.position + arm64_image_header(c.raw)[1])
+
+    blob = bytearray(tree())
+    for c in components:
+        blob += bytes(c.position - len(blob))
+        blob += c.data
+
+    return bytes(blob)
+
+
+def print_layout(output, components, size):
+    print('bfmkfit: %s (%d bytes)' % (output, size))
+    print('    %-12s %-12s %-12s %-12s %-6s %-6s %-8s %s' %
+          ('component', 'position', 'size', 'unpacked', 'align', 'comp', 'hash', 'load'))
+    for c in components:
+        load = '0x%08x' % c.load if c.load is not None else '-'
+        print('    %-12s 0x%08x   0x%08x   0x%08x   %-6s %-6s %-8s %s' %
+              (c.name, c.position, len(c.data), len(c.raw), c.align,
+               c.compression, c.hash, load))
+
+
+def component_option(value):
+    name, _, arg = value.partition('=')
+    if name not in COMPONENTS or not arg:
+        raise argparse.ArgumentTypeError('expected <component>=<value>, got "%s"' % value)
+    return name, arg
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split('\n')[0])
+    parser.add_argument('-o', '--output', required=True, help='FIT image to write')
+    parser.add_argument('--description', default='Bareflank Bootloader Flattened Image Tree')
+    for name in COMPONENTS:
+        parser.add_argument('--' + name, metavar='FILE', help='%s image' % name)
+    parser.add_argument('--load', action='append', default=[], type=component_option,
+                        metavar='COMPONENT=ADDR', help='load address of a component')
+    parser.add_argument('--entry', action='append', default=[], type=component_option,
+                        metavar='COMPONENT=ADDR', help='entry point of a component')
+    parser.add_argument('--align', action='append', default=[], type=component_option,
+                        metavar='COMPONENT={4k,2m}', help='data alignment of a component')
+    parser.add_argument('--compression', action='append', default=[], type=component_option,
+                        metavar='COMPONENT={none,lz4}', help='compression of a component')
+    parser.add_argument('--hash', action='append', default=[], type=component_option,
+                        metavar='COMPONENT={none,crc32,sha1,sha256}', help='hash of a component')
+    parser.add_argument('--properties', action='append', default=[], type=component_option,
+                        metavar='COMPONENT=DTSI', help='extra properties (e.g. from bfprelink.py)')
+    args = parser.parse_args()
+
+    components = []
+    for name in COMPONENTS:
+        path = getattr(args, name)
+        if path:
+            components.append(Component(name, path))
+
+    if not components or components[0].name != 'bootloader':
+        sys.exit('bfmkfit: a bootloader image is required')
+
+    by_name = dict((c.name, c) for c in components)
+
+    def apply(options, attr, convert, choices=None):
+        for name, value in options:
+            if name not in by_name:
+                continue
+            value = convert(value)
+            if choices is not None and value not in choices:
+                sys.exit('bfmkfit: invalid %s for %s: %s' % (attr, name, value))
+            setattr(by_name[name], attr, value)
+
+    apply(args.load, 'load', lambda v: int(v, 0))
+    apply(args.entry, 'entry', lambda v: int(v, 0))
+    apply(args.align, 'align', str.lower, ALIGNMENTS)
+    apply(args.compression, 'compression', str.lower, COMPRESSIONS)
+    apply(args.hash, 'hash', str.lower, HASHES)
+
+    for name, path in args.properties:
+        if name in by_name:
+            by_name[name].properties += parse_dtsi(path)
+
+    for c in components:
+        c.encode()
+
+    blob = build(components, args.description)
+
+    with open(args.output, 'wb') as f:
+        f.write(blob)
+
+    print_layout(args.output, components, len(blob))
+
+
+if __name__ == '__main__':
+    main()
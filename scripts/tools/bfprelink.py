@@ -0,0 +1,296 @@
+#!/usr/bin/env python3
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""
+Prelinks a Bareflank VMM ELF executable for a fixed load address.
+
+All dynamic relocations are applied on the build host and the loadable
+segments are flattened into a raw image that can be placed directly at the
+load address. The handful of values the bootloader would otherwise have to
+compute at boot (entry point, init/fini hooks, .eh_frame and the segment
+permissions) are emitted as a device tree fragment that can be included in
+the VMM's FIT image node.
+"""
+
+import argparse
+import struct
+import sys
+
+ET_EXEC = 2
+ET_DYN = 3
+EM_AARCH64 = 183
+
+PT_LOAD = 1
+PT_DYNAMIC = 2
+
+SHT_RELA = 4
+SHF_ALLOC = 0x2
+
+DT_NULL = 0
+DT_INIT = 12
+DT_FINI = 13
+DT_INIT_ARRAY = 25
+DT_FINI_ARRAY = 26
+DT_INIT_ARRAYSZ = 27
+DT_FINI_ARRAYSZ = 28
+
+R_AARCH64_NONE = 0
+R_AARCH64_ABS64 = 257
+R_AARCH64_GLOB_DAT = 1025
+R_AARCH64_JUMP_SLOT = 1026
+R_AARCH64_RELATIVE = 1027
+
+STB_WEAK = 2
+SHN_UNDEF = 0
+
+PAGE_SIZE = 0x1000
+
+# Order of the values in the "bareflank,prelink" property. Keep in sync with
+# struct bfvmm_prelink_t in bootloader/include/prelink.h
+PRELINK_FIELDS = [
+    'base',
+    'entry',
+    'memsz',
+    'init',
+    'fini',
+    'init_array',
+    'init_array_size',
+    'fini_array',
+    'fini_array_size',
+    'eh_frame',
+    'eh_frame_size',
+]
+
+
+class PrelinkError(Exception):
+    pass
+
+
+class Elf(object):
+    def __init__(self, data):
+        if data[0:4] != b'\x7fELF':
+            raise PrelinkError('not an ELF file')
+        if data[4] != 2 or data[5] != 1:
+            raise PrelinkError('only little endian ELF64 is supported')
+
+        self.data = data
+        (self.type, self.machine, _, self.entry, self.phoff, self.shoff, _,
+         _, self.phentsize, self.phnum, self.shentsize, self.shnum,
+         self.shstrndx) = struct.unpack_from('<HHIQQQIHHHHHH', data, 16)
+
+        if self.machine != EM_AARCH64:
+            raise PrelinkError('not an aarch64 ELF file')
+        if self.type not in (ET_EXEC, ET_DYN):
+            raise PrelinkError('not an executable or PIE ELF file')
+
+        self.segments = []
+        for i in range(self.phnum):
+            self.segments.append(struct.unpack_from(
+                '<IIQQQQQQ', data, self.phoff + i * self.phentsize))
+
+        self.sections = []
+        for i in range(self.shnum):
+            self.sections.append(struct.unpack_from(
+                '<IIQQQQIIQQ', data, self.shoff + i * self.shentsize))
+
+    def string(self, offset):
+        end = self.data.index(b'\0', offset)
+        return self.data[offset:end].decode('ascii')
+
+    def section_name(self, section):
+        strtab = self.sections[self.shstrndx]
+        return self.string(strtab[4] + section[0])
+
+    def section(self, name):
+        for s in self.sections:
+            if self.section_name(s) == name:
+                return s
+        return None
+
+    def load_segments(self):
+        return [p for p in self.segments if p[0] == PT_LOAD]
+
+    def dynamic(self):
+        entries = {}
+        for p in self.segments:
+            if p[0] != PT_DYNAMIC:
+                continue
+            for off in range(p[2], p[2] + p[5], 16):
+                tag, val = struct.unpack_from('<qQ', self.data, off)
+                if tag == DT_NULL:
+                    break
+                entries[tag] = val
+        return entries
+
+    def symbol(self, symtab, index):
+        off = symtab[4] + index * symtab[9]
+        name, info, _, shndx, value, _ = struct.unpack_from(
+            '<IBBHQQ', self.data, off)
+        strtab = self.sections[symtab[6]]
+        return self.string(strtab[4] + name), info >> 4, shndx, value
+
+    def relocations(self):
+        for s in self.sections:
+            if s[1] != SHT_RELA or not (s[2] & SHF_ALLOC):
+                continue
+            symtab = self.sections[s[6]] if s[6] else None
+            for off in range(s[4], s[4] + s[5], s[9]):
+                r_offset, r_info, r_addend = struct.unpack_from(
+                    '<QQq', self.data, off)
+                yield symtab, r_offset, r_info & 0xffffffff, r_info >> 32, r_addend
+
+
+def prelink(data, load_addr):
+    """
+    Returns a (image, info, segments) tuple for the ELF in data, relocated so
+    that it executes at load_addr.
+    """
+
+    elf = Elf(data)
+
+    loads = elf.load_segments()
+    if not loads:
+        raise PrelinkError('no loadable segments')
+
+    min_vaddr = min(p[3] for p in loads) & ~(PAGE_SIZE - 1)
+    max_vaddr = max(p[3] + p[6] for p in loads)
+    max_file = max(p[3] + p[5] for p in loads)
+
+    if elf.type == ET_EXEC:
+        if load_addr != min_vaddr:
+            raise PrelinkError(
+                'static executable is linked at 0x%x, not 0x%x' %
+                (min_vaddr, load_addr))
+        base = 0
+    else:
+        base = load_addr - min_vaddr
+
+    image = bytearray(max_file - min_vaddr)
+    for p in loads:
+        start = p[3] - min_vaddr
+        image[start:start + p[5]] = data[p[2]:p[2] + p[5]]
+
+    def put64(vaddr, value):
+        off = vaddr - min_vaddr
+        if off < 0 or off + 8 > len(image):
+            raise PrelinkError('relocation at 0x%x is outside the image' % vaddr)
+        struct.pack_into('<Q', image, off, value & 0xffffffffffffffff)
+
+    for symtab, r_offset, r_type, r_sym, r_addend in elf.relocations():
+        if r_type == R_AARCH64_NONE:
+            continue
+
+        if r_type == R_AARCH64_RELATIVE:
+            put64(r_offset, base + r_addend)
+            continue
+
+        if r_type not in (R_AARCH64_ABS64, R_AARCH64_GLOB_DAT, R_AARCH64_JUMP_SLOT):
+            raise PrelinkError('unsupported relocation type %d' % r_type)
+
+        name, bind, shndx, value = elf.symbol(symtab, r_sym)
+        if shndx == SHN_UNDEF:
+            if bind != STB_WEAK:
+                raise PrelinkError('undefined symbol: %s' % name)
+            put64(r_offset, 0)
+            continue
+
+        put64(r_offset, base + value + r_addend)
+
+    def section_range(name):
+        s = elf.section(name)
+        if s is None:
+            return 0, 0
+        return base + s[3], s[5]
+
+    dyn = elf.dynamic()
+
+    def dyn_addr(tag):
+        return base + dyn[tag] if tag in dyn else 0
+
+    info = dict.fromkeys(PRELINK_FIELDS, 0)
+    info['base'] = load_addr
+    info['entry'] = base + elf.entry
+    info['memsz'] = max_vaddr - min_vaddr
+    info['init'] = dyn_addr(DT_INIT)
+    info['fini'] = dyn_addr(DT_FINI)
+
+    if DT_INIT_ARRAY in dyn:
+        info['init_array'] = dyn_addr(DT_INIT_ARRAY)
+        info['init_array_size'] = dyn.get(DT_INIT_ARRAYSZ, 0)
+    else:
+        info['init_array'], info['init_array_size'] = section_range('.init_array')
+
+    if DT_FINI_ARRAY in dyn:
+        info['fini_array'] = dyn_addr(DT_FINI_ARRAY)
+        info['fini_array_size'] = dyn.get(DT_FINI_ARRAYSZ, 0)
+    else:
+        info['fini_array'], info['fini_array_size'] = section_range('.fini_array')
+
+    info['eh_frame'], info['eh_frame_size'] = section_range('.eh_frame')
+
+    segments = [(p[3] - min_vaddr, p[6], p[1]) for p in loads]
+    return bytes(image), info, segments
+
+
+def dtsi(info, segments, source):
+    cells = ' '.join('0x%x' % info[f] for f in PRELINK_FIELDS)
+    segs = ' '.join('0x%x 0x%x 0x%x' % s for s in segments)
+    return (
+        '/*\n'
+        ' * Generated by bfprelink.py from %s, do not edit.\n'
+        ' */\n'
+        'bareflank,prelink = /bits/ 64 <%s>;\n'
+        'bareflank,prelink-segments = /bits/ 64 <%s>;\n' % (source, cells, segs))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split('\n')[0])
+    parser.add_argument('elf', help='VMM ELF executable (e.g. bfvmm_static)')
+    parser.add_argument('--load-addr', required=True, type=lambda x: int(x, 0),
+                        help='physical address the image will be loaded at')
+    parser.add_argument('-o', '--output', required=True,
+                        help='prelinked raw image to write')
+    parser.add_argument('--dtsi', required=True,
+                        help='device tree fragment to write the prelink properties to')
+    args = parser.parse_args()
+
+    with open(args.elf, 'rb') as f:
+        data = f.read()
+
+    try:
+        image, info, segments = prelink(data, args.load_addr)
+    except PrelinkError as e:
+        sys.exit('bfprelink: %s: %s' % (args.elf, e))
+
+    with open(args.output, 'wb') as f:
+        f.write(image)
+
+    with open(args.dtsi, 'w') as f:
+        f.write(dtsi(info, segments, args.elf))
+
+    print('bfprelink: %s prelinked at 0x%x (entry 0x%x, %d bytes, %d bytes in memory)' %
+          (args.elf, info['base'], info['entry'], len(image), info['memsz']))
+
+
+if __name__ == '__main__':
+    main()
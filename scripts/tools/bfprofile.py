@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""
+Symbolises the bootloader's PC samples (ENABLE_PROFILER).
+
+Reads a console log containing the "profile:" lines printed when sampling
+stops, maps every sampled PC back to the function containing it in the
+bootloader ELF, and prints the hottest functions. Position independent
+builds run wherever they're loaded (or moved to), so PCs are rebased using
+the run-time address of bootloader_start printed with the samples.
+"""
+
+import argparse
+import bisect
+import re
+import subprocess
+import sys
+
+BASE_RE = re.compile(r'profile: base (0x[0-9a-fA-F]+), (\d+) samples')
+SAMPLE_RE = re.compile(r'profile: (0x[0-9a-fA-F]+) (\d+)\s*$')
+
+
+def read_log(f):
+    base = None
+    samples = {}
+
+    for line in f:
+        m = BASE_RE.search(line)
+        if m:
+            base = int(m.group(1), 16)
+            samples = {}
+            continue
+
+        m = SAMPLE_RE.search(line)
+        if m and base is not None:
+            pc = int(m.group(1), 16)
+            samples[pc] = samples.get(pc, 0) + int(m.group(2))
+
+    return base, samples
+
+
+def functions(nm, elf):
+    out = subprocess.check_output(
+        [nm, '--defined-only', '--numeric-sort', elf], universal_newlines=True)
+
+    addrs, names = [], []
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) != 3 or fields[1] not in 'tTwW':
+            continue
+        addrs.append(int(fields[0], 16))
+        names.append(fields[2])
+
+    return addrs, names
+
+
+def link_address(nm, elf, symbol):
+    out = subprocess.check_output([nm, '--defined-only', elf], universal_newlines=True)
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[2] == symbol:
+            return int(fields[0], 16)
+    return None
+
+
+def symbolise(samples, offset, addrs, names):
+    counts = {}
+
+    for pc, count in samples.items():
+        i = bisect.bisect_right(addrs, pc - offset) - 1
+        name = names[i] if i >= 0 else '[unknown 0x%x]' % pc
+        counts[name] = counts.get(name, 0) + count
+
+    return sorted(counts.items(), key=lambda c: c[1], reverse=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split('\n')[0])
+    parser.add_argument('elf', help='bootloader ELF executable (e.g. bootloader_static)')
+    parser.add_argument('log', nargs='?', help='console log (default: stdin)')
+    parser.add_argument('--nm', default='nm', help='nm executable for the target')
+    parser.add_argument('--top', type=int, default=30,
+                        help='number of functions to print (default: 30)')
+    args = parser.parse_args()
+
+    try:
+        if args.log:
+            with open(args.log, errors='replace') as f:
+                base, samples = read_log(f)
+        else:
+            base, samples = read_log(sys.stdin)
+
+        addrs, names = functions(args.nm, args.elf)
+        link_base = link_address(args.nm, args.elf, 'bootloader_start')
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit('bfprofile: %s' % e)
+
+    if base is None or not samples:
+        sys.exit('bfprofile: no profile samples found')
+    if link_base is None:
+        sys.exit('bfprofile: %s: no bootloader_start symbol' % args.elf)
+
+    hot = symbolise(samples, base - link_base, addrs, names)
+    total = sum(samples.values())
+
+    print('%8s %7s  %s' % ('samples', '%', 'function'))
+    for name, count in hot[:args.top]:
+        print('%8d %6.2f%%  %s' % (count, 100.0 * count / total, name))
+    if len(hot) > args.top:
+        print('%8s %7s  (%d more functions)' % ('...', '', len(hot) - args.top))
+
+
+if __name__ == '__main__':
+    main()
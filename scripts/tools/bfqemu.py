@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""
+Boots the bootloader in QEMU and checks its boot stage timings.
+
+Echoes the console, and once the bootloader prints its "timing:" lines (see
+boot_report_timing()), compares each stage's time against a baseline file,
+failing if any is more than the tolerance slower. A stage that's new, or
+missing from the boot, fails as well, as the baseline has to be regenerated
+(--update). Until a baseline has been measured, the boot still has to finish
+but the comparison is skipped. Run QEMU with -icount so the timings count
+guest instructions and don't depend on the host.
+"""
+
+import argparse
+import queue
+import re
+import subprocess
+import sys
+import threading
+import time
+
+TIMING_RE = re.compile(r'timing: (\S+) (\d+) us')
+
+# Differences smaller than this are never regressions, so stages that take a
+# few microseconds don't fail on a one instruction change
+MIN_REGRESSION_US = 10
+
+
+def read_baseline(path):
+    baseline = {}
+
+    try:
+        with open(path) as f:
+            for line in f:
+                fields = line.split('#', 1)[0].split()
+                if len(fields) == 2:
+                    baseline[fields[0]] = int(fields[1])
+    except FileNotFoundError:
+        pass
+
+    return baseline
+
+
+def write_baseline(path, timings):
+    with open(path, 'w') as f:
+        f.write('# Boot stage timings (in microseconds) under QEMU -icount, checked\n')
+        f.write('# by the qemu-benchmark target. Regenerate with qemu-benchmark-baseline.\n')
+        for stage, us in timings:
+            f.write('{} {}\n'.format(stage, us))
+
+
+def run_qemu(qemu, args, timeout, log):
+    """
+    Runs QEMU until the bootloader prints its total boot time, returning the
+    (stage, us) pairs it printed, in order.
+    """
+    proc = subprocess.Popen([qemu] + args, stdin=subprocess.DEVNULL,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    lines = queue.Queue()
+
+    def reader():
+        for line in proc.stdout:
+            lines.put(line.decode('utf-8', 'replace'))
+        lines.put(None)
+
+    threading.Thread(target=reader, daemon=True).start()
+
+    timings = []
+    deadline = time.monotonic() + timeout
+
+    try:
+        while True:
+            try:
+                line = lines.get(timeout=max(deadline - time.monotonic(), 0))
+            except queue.Empty:
+                sys.exit('error: no "timing: total" line within {} s'.format(timeout))
+
+            if line is None:
+                sys.exit('error: {} exited before the boot finished'.format(qemu))
+
+            sys.stdout.write(line)
+            if log:
+                log.write(line)
+
+            m = TIMING_RE.search(line)
+            if m:
+                timings.append((m.group(1), int(m.group(2))))
+                if m.group(1) == 'total':
+                    return timings
+    finally:
+        proc.kill()
+        proc.wait()
+
+
+def compare(baseline, timings, tolerance):
+    regressions = 0
+    measured = dict(timings)
+
+    print('\n{:<24} {:>10} {:>10} {:>8}'.format('stage', 'baseline', 'us', 'change'))
+    for stage, us in timings:
+        if stage not in baseline:
+            print('{:<24} {:>10} {:>10} {:>8}'.format(stage, '-', us, 'NEW'))
+            regressions += 1
+            continue
+
+        base = baseline[stage]
+        change = (us - base) * 100.0 / base if base else 0.0
+        slower = us - base > max(base * tolerance / 100.0, MIN_REGRESSION_US)
+        regressions += slower
+
+        print('{:<24} {:>10} {:>10} {:>+7.1f}%{}'.format(
+            stage, base, us, change, '  REGRESSION' if slower else ''))
+
+    for stage, base in baseline.items():
+        if stage not in measured:
+            print('{:<24} {:>10} {:>10} {:>8}'.format(stage, base, '-', 'MISSING'))
+            regressions += 1
+
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--qemu', default='qemu-system-aarch64')
+    parser.add_argument('--baseline', required=True, help='baseline timings file')
+    parser.add_argument('--tolerance', type=float, default=5,
+                        help='percentage a stage may be slower than its baseline')
+    parser.add_argument('--timeout', type=float, default=60,
+                        help='seconds to wait for the boot to finish')
+    parser.add_argument('--log', help='also write the console to this file')
+    parser.add_argument('--update', action='store_true',
+                        help='write the timings to the baseline instead of checking them')
+    parser.add_argument('args', nargs=argparse.REMAINDER, help='arguments for QEMU')
+    args = parser.parse_args()
+
+    qemu_args = args.args[1:] if args.args[:1] == ['--'] else args.args
+    log = open(args.log, 'w') if args.log else None
+
+    try:
+        timings = run_qemu(args.qemu, qemu_args, args.timeout, log)
+    finally:
+        if log:
+            log.close()
+
+    if args.update:
+        write_baseline(args.baseline, timings)
+        print('\nwrote {} timings to {}'.format(len(timings), args.baseline))
+        return 0
+
+    baseline = read_baseline(args.baseline)
+    if not baseline:
+        print('\n{} has no timings yet, skipping the comparison '
+              '(run qemu-benchmark-baseline and check it in)'.format(args.baseline))
+        return 0
+
+    regressions = compare(baseline, timings, args.tolerance)
+    if regressions:
+        print('\n{} stage(s) new, missing or more than {}% slower than the baseline'.format(
+            regressions, args.tolerance))
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""
+Sends a FIT image to the bootloader over its console (ENABLE_SERIAL_DOWNLOAD).
+
+The image is split into blocks, each LZ4 compressed if that makes it
+smaller, and sent with the windowed, CRC-32 checked protocol described in
+bootloader/include/download.h. The bootloader decompresses each block into
+place while the next ones arrive. Everything else the bootloader prints is
+echoed, so this can stay attached as the console (--follow).
+
+The console can be a serial device, or a TCP socket such as QEMU's
+"-serial tcp::4444,server=on,wait=off" chardev.
+"""
+
+import argparse
+import os
+import queue
+import re
+import socket
+import struct
+import sys
+import threading
+import time
+import zlib
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import bflz4
+
+MAGIC = 0x4C444642
+FRAME_START = 1
+FRAME_DATA = 2
+FRAME_END = 3
+FLAG_LZ4 = 1
+
+# How long to wait for an ack before resending everything unacknowledged
+ACK_TIMEOUT = 1.0
+MAX_RETRIES = 10
+
+MESSAGE_RE = re.compile(r'bfdl: (\w+) ?(.*)')
+
+
+def compress_block(raw):
+    """ Uses the lz4 package if it's installed, as bflz4 is pure Python """
+    try:
+        import lz4.block
+        return lz4.block.compress(raw, store_size=False)
+    except ImportError:
+        return bflz4.compress_block(raw)
+
+
+class SerialConsole:
+    def __init__(self, path, baud):
+        import termios
+        import tty
+
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+
+        attrs = termios.tcgetattr(self.fd)
+        speed = getattr(termios, 'B{}'.format(baud))
+        attrs[4] = attrs[5] = speed
+        termios.tcsetattr(self.fd, termios.TCSANOW, attrs)
+
+    def read(self):
+        return os.read(self.fd, 4096)
+
+    def write(self, data):
+        while data:
+            data = data[os.write(self.fd, data):]
+
+
+class SocketConsole:
+    def __init__(self, address):
+        host, port = address.rsplit(':', 1)
+        self.sock = socket.create_connection((host or 'localhost', int(port)))
+
+    def read(self):
+        return self.sock.recv(4096)
+
+    def write(self, data):
+        self.sock.sendall(data)
+
+
+def frame(kind, seq, payload, raw_len=0, flags=0):
+    header = struct.pack('<IBBHIII', MAGIC, kind, flags, 0, seq, len(payload), raw_len)
+    crc = zlib.crc32(header + payload) & 0xffffffff
+    return header + struct.pack('<I', crc) + payload
+
+
+def reader(console, messages):
+    """ Echoes the console, and queues the bootloader's bfdl: messages """
+    line = b''
+
+    while True:
+        data = console.read()
+        if not data:
+            messages.put(('closed', ''))
+            return
+
+        sys.stdout.write(data.decode('utf-8', 'replace'))
+        sys.stdout.flush()
+
+        line += data
+        *lines, line = line.split(b'\n')
+        for l in lines:
+            m = MESSAGE_RE.search(l.decode('utf-8', 'replace').strip())
+            if m:
+                messages.put((m.group(1), m.group(2)))
+
+
+def wait_for(messages, kinds, timeout):
+    deadline = time.monotonic() + timeout
+
+    while True:
+        try:
+            kind, arg = messages.get(timeout=max(deadline - time.monotonic(), 0))
+        except queue.Empty:
+            return None, None
+
+        if kind == 'error':
+            sys.exit('error: the bootloader gave up: {}'.format(arg))
+        if kind == 'closed':
+            sys.exit('error: the console was closed')
+        if kind in kinds:
+            return kind, arg
+
+
+def make_blocks(data, block_size):
+    blocks = []
+    packed = 0
+
+    for seq, off in enumerate(range(0, len(data), block_size)):
+        raw = data[off:off + block_size]
+        block = compress_block(raw)
+
+        if len(block) < len(raw):
+            blocks.append(frame(FRAME_DATA, seq, block, len(raw), FLAG_LZ4))
+        else:
+            blocks.append(frame(FRAME_DATA, seq, raw, len(raw)))
+        packed += len(blocks[-1])
+
+    return blocks, packed
+
+
+def send(console, messages, data, block_size):
+    kind, arg = wait_for(messages, ['ready'], 60)
+    if kind is None:
+        sys.exit('error: the bootloader never said it was ready')
+
+    window, max_len = (int(x) for x in arg.split())
+    block_size = min(block_size, max_len)
+
+    blocks, packed = make_blocks(data, block_size)
+    print('\nbfsend: {} bytes in {} blocks, {} bytes to send'.format(
+        len(data), len(blocks), packed), file=sys.stderr)
+
+    start = time.monotonic()
+
+    for retry in range(MAX_RETRIES):
+        console.write(frame(FRAME_START, 0, struct.pack('<II', len(data), block_size)))
+        kind, arg = wait_for(messages, ['ack'], ACK_TIMEOUT)
+        if kind == 'ack' and int(arg) == 0:
+            break
+    else:
+        sys.exit('error: the bootloader didn\'t accept the download')
+
+    # Go-back-N: keep up to window blocks unacknowledged, and resend from
+    # the first missing one on a nak, or when the acks stop
+    base = nxt = retries = 0
+    while base < len(blocks):
+        while nxt < len(blocks) and nxt < base + window:
+            console.write(blocks[nxt])
+            nxt += 1
+
+        kind, arg = wait_for(messages, ['ack', 'nak'], ACK_TIMEOUT)
+        if kind is None:
+            retries += 1
+            if retries == MAX_RETRIES:
+                sys.exit('error: no acks from the bootloader')
+            nxt = base
+        elif kind == 'ack':
+            if int(arg) > base:
+                base, retries = int(arg), 0
+                nxt = max(nxt, base)
+        elif int(arg) >= base:
+            nxt = int(arg)
+
+    for retry in range(MAX_RETRIES):
+        console.write(frame(FRAME_END, len(blocks), b''))
+        kind, arg = wait_for(messages, ['done'], ACK_TIMEOUT)
+        if kind == 'done':
+            break
+    else:
+        sys.exit('error: the bootloader didn\'t finish the download')
+
+    seconds = time.monotonic() - start
+    print('bfsend: sent in {:.1f} s ({:.0f} KiB/s of image)'.format(
+        seconds, len(data) / 1024 / seconds), file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('image', help='the FIT image to send (e.g. bootloader.fit)')
+    parser.add_argument('console', help='serial device, or host:port of a TCP console')
+    parser.add_argument('--baud', type=int, default=115200,
+                        help='baud rate of a serial device')
+    parser.add_argument('--block-size', type=int, default=0x10000,
+                        help='bytes of the image in each block')
+    parser.add_argument('--follow', action='store_true',
+                        help='keep echoing the console once the image is sent')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        data = f.read()
+
+    if os.path.exists(args.console):
+        console = SerialConsole(args.console, args.baud)
+    else:
+        console = SocketConsole(args.console)
+
+    messages = queue.Queue()
+    threading.Thread(target=reader, args=(console, messages), daemon=True).start()
+
+    send(console, messages, data, args.block_size)
+
+    if args.follow:
+        try:
+            while wait_for(messages, [], 3600)[0] is None:
+                pass
+        except KeyboardInterrupt:
+            pass
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# Bareflank Hypervisor
+# Copyright (C) 2018 Assured Information Security, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""
+Reports the per-symbol size of the bootloader.
+
+Symbols are listed largest first together with the section class they live
+in, followed by per-class totals. The full report is optionally written to a
+file, while only the largest symbols are printed, so it can run on every
+build.
+"""
+
+import argparse
+import subprocess
+import sys
+
+CLASSES = (
+    ('text', 'Tt'),
+    ('rodata', 'Rr'),
+    ('data', 'DdGg'),
+    ('bss', 'BbSsCc'),
+)
+
+
+def symbol_class(kind):
+    for name, kinds in CLASSES:
+        if kind in kinds:
+            return name
+    return 'other'
+
+
+def symbols(nm, elf):
+    out = subprocess.check_output(
+        [nm, '--print-size', '--size-sort', '--reverse-sort', '--radix=d', elf],
+        universal_newlines=True)
+
+    for line in out.splitlines():
+        fields = line.split(None, 3)
+        if len(fields) != 4:
+            continue
+        yield fields[3], int(fields[1]), symbol_class(fields[2])
+
+
+def report(syms, limit=None):
+    lines = []
+    totals = {}
+
+    for name, size, cls in syms:
+        totals[cls] = totals.get(cls, 0) + size
+
+    lines.append('%10s  %-7s %s' % ('bytes', 'class', 'symbol'))
+    for name, size, cls in syms[:limit]:
+        lines.append('%10d  %-7s %s' % (size, cls, name))
+    if limit is not None and len(syms) > limit:
+        lines.append('%10s  %-7s (%d more symbols)' % ('...', '', len(syms) - limit))
+
+    lines.append('')
+    for name in [c[0] for c in CLASSES] + ['other']:
+        if name in totals:
+            lines.append('%10d  %s' % (totals[name], name))
+    lines.append('%10d  total' % sum(totals.values()))
+
+    return '\n'.join(lines) + '\n'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split('\n')[0])
+    parser.add_argument('elf', help='bootloader ELF executable (e.g. bootloader_static)')
+    parser.add_argument('--nm', default='nm', help='nm executable for the target')
+    parser.add_argument('--top', type=int, default=20,
+                        help='number of symbols to print (default: 20)')
+    parser.add_argument('-o', '--output', help='file to write the full report to')
+    args = parser.parse_args()
+
+    try:
+        syms = list(symbols(args.nm, args.elf))
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit('bfsize: %s: %s' % (args.elf, e))
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(report(syms))
+
+    sys.stdout.write(report(syms, args.top))
+
+
+if __name__ == '__main__':
+    main()